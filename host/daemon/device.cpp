@@ -0,0 +1,191 @@
+/*
+ * device.cpp
+ * One OpenSTM head on a serial port: non-blocking reads and writes, stream parsing and its frame writer
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "device.h"
+
+Device::Device(const std::string &name, const std::string &path, const std::string &directory) :
+    name(name),
+    path(path),
+    fd(-1),
+    bytesRead(0),
+    linesRead(0),
+    frames(0),
+    framesIncomplete(0),
+    opens(0),
+    writer(directory + "/" + name),
+    discarding(false)
+{
+}
+
+Device::~Device() {
+    close("shutdown");
+}
+
+int Device::open() {
+    /*!
+     * \brief opens the port raw and non-blocking
+     * @return the fd, -1 if the port is not there
+     */
+
+    fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return -1;
+
+    // the Teensy's USB serial ignores the baud rate, a real UART does not
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B115200);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    partial.clear();
+    discarding = false;
+    opens += 1;
+
+    char message[64];
+    snprintf(message, sizeof(message), "opened %s", path.c_str());
+    writer.log(message);
+    return fd;
+}
+
+void Device::close(const char *reason) {
+    /*!
+     * \brief closes the port, and any frame it was sending
+     * @param reason for the log
+     */
+
+    if (fd < 0) return;
+    ::close(fd);
+    fd = -1;
+    output.clear();
+
+    closeFrame(reason);
+    parser.inFrame = false;
+
+    std::string message = "closed: ";
+    writer.log(message + reason);
+}
+
+int Device::onReadable() {
+    /*!
+     * \brief reads everything available and handles the complete lines
+     * @return 0, or -1 if the port closed
+     */
+
+    char buf[4096];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            return -1;
+        }
+        bytesRead += n;
+
+        for (ssize_t i = 0; i < n; i++) {
+            char c = buf[i];
+            if (c == '\r') continue;
+            if (c == '\n') {
+                if (!discarding) handleLine(partial);
+                partial.clear();
+                discarding = false;
+            }
+            else if (partial.size() < maxLineLength) partial += c;
+            else discarding = true;
+        }
+    }
+}
+
+int Device::onWritable() {
+    /*!
+     * \brief writes as much of the queued commands as the port takes
+     * @return 0, or -1 if the port closed
+     */
+
+    while (!output.empty()) {
+        ssize_t n = write(fd, output.data(), output.size());
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            return -1;
+        }
+        output.erase(0, n);
+    }
+    return 0;
+}
+
+void Device::send(const std::string &command) {
+    /*!
+     * \brief queues a command line for the head
+     */
+
+    output += command;
+    output += '\n';
+}
+
+bool Device::wantsWrite() {
+    return !output.empty();
+}
+
+void Device::handleLine(const std::string &line) {
+    linesRead += 1;
+
+    // a frame cut short by the next, its counts taken before the parser moves on
+    if (parser.inFrame && line.compare(0, 7, "#frame,") == 0) closeFrame("interrupted by a new frame");
+
+    int record = parser.feed(line);
+
+    if (record == StreamParser::RECORD_TEXT) {
+        writer.log(line);
+        text.push_back(line);
+        return;
+    }
+
+    if (record == StreamParser::RECORD_FRAME) {
+        char stamp[32];
+        time_t now = time(NULL);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+        char fileName[128];
+        snprintf(fileName, sizeof(fileName), "%s_%s_%04ld.txt", name.c_str(), stamp, frames);
+        frameName = fileName;
+        writer.beginFrame(frameName);
+    }
+
+    writer.writeFrame(line);
+
+    if (record == StreamParser::RECORD_END) closeFrame(NULL);
+}
+
+void Device::closeFrame(const char *reason) {
+    // reason is NULL for frames the head ended
+    if (frameName.empty()) return;
+
+    bool complete = reason == NULL && parser.rowsMissing == 0 && parser.rowsMalformed == 0;
+    char status[32];
+    snprintf(status, sizeof(status), "status=%d", parser.endStatus);
+    char summary[256];
+    snprintf(summary, sizeof(summary), "frame %s %dx%d channels=%d lines=%ld missing=%ld malformed=%ld %s",
+            frameName.c_str(), parser.width, parser.height, parser.channels, parser.linesReceived,
+            parser.rowsMissing, parser.rowsMalformed, reason == NULL ? status : reason);
+
+    // the frame file ends with the daemon's own record of what arrived
+    char record[128];
+    snprintf(record, sizeof(record), "#received,%ld,%ld,%ld", parser.linesReceived, parser.rowsMissing,
+            parser.rowsMalformed);
+    writer.writeFrame(record);
+    writer.endFrame(summary);
+    text.push_back(summary);
+
+    frames += 1;
+    if (!complete) framesIncomplete += 1;
+    frameName.clear();
+}
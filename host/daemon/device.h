@@ -0,0 +1,65 @@
+/*
+ * device.h
+ * One OpenSTM head on a serial port: non-blocking reads and writes, stream parsing and its frame writer
+ */
+
+#ifndef device_h
+#define device_h
+
+#include <string>
+#include <vector>
+
+#include "streamparser.h"
+#include "framewriter.h"
+
+/*
+ * The daemon's event loop calls onReadable() and onWritable() when the port is ready. Complete lines go through
+ * the StreamParser; frame records are queued for the FrameWriter as they arrive, text lines to the device log and
+ * to text for the loop to pass on to watching control clients. Commands are buffered and written as the port
+ * accepts them.
+ *
+ * A port that closes or errors, a head unplugged or reset, is closed here and reopened by the loop. A frame cut
+ * off that way is closed as incomplete.
+ */
+
+class Device
+{
+    public:
+        Device(const std::string &name, const std::string &path, const std::string &directory);
+        ~Device();
+
+        int open();
+        void close(const char *reason);
+        int onReadable();
+        int onWritable();
+        void send(const std::string &command);
+        bool wantsWrite();
+
+        std::string name;
+        std::string path;
+        int fd;
+
+        long bytesRead;
+        long linesRead;
+        long frames;       // frames closed, complete or not
+        long framesIncomplete;
+        long opens;
+
+        StreamParser parser;
+        FrameWriter writer;
+
+        std::vector<std::string> text; // text lines since the loop last took them
+
+    private:
+        static const size_t maxLineLength = 4096;
+
+        std::string partial; // line being assembled
+        std::string output;  // commands not yet written
+        bool discarding;     // dropping the rest of an overlong line
+        std::string frameName;
+
+        void handleLine(const std::string &line);
+        void closeFrame(const char *reason);
+};
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * framewriter.cpp
+ * Per-device disk writer: frames and the device log go through a queue to a thread of their own
+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "framewriter.h"
+
+FrameWriter::FrameWriter(const std::string &directory) :
+    queuedBytes(0),
+    framesWritten(0),
+    writeErrors(0),
+    directory(directory),
+    stopping(false),
+    frameFile(NULL),
+    logFile(NULL),
+    archiver(archive)
+{
+    mkdir(directory.c_str(), 0755);
+    thread = std::thread(&FrameWriter::run, this);
+}
+
+FrameWriter::~FrameWriter() {
+    /*!
+     * \brief writes out everything queued, then stops the thread
+     */
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_one();
+    thread.join();
+
+    if (frameFile != NULL) fclose(frameFile);
+    if (logFile != NULL) fclose(logFile);
+    if (archive.isOpen()) {
+        archiver.finish();
+        archive.close();
+    }
+}
+
+void FrameWriter::beginFrame(const std::string &name) {
+    /*!
+     * \brief starts a frame file, closing any frame left open
+     * @param name file name within the device directory
+     */
+
+    push(OP_BEGIN, name);
+}
+
+void FrameWriter::writeFrame(const std::string &line) {
+    push(OP_FRAME, line);
+}
+
+void FrameWriter::endFrame(const std::string &summary) {
+    /*!
+     * \brief closes the frame file, logging its summary
+     */
+
+    push(OP_END, summary);
+}
+
+void FrameWriter::log(const std::string &line) {
+    push(OP_LOG, line);
+}
+
+void FrameWriter::openArchive(const std::string &name) {
+    /*!
+     * \brief starts packing every frame into a delta encoded archive, closed with its index as the writer stops
+     * @param name file name within the device directory
+     */
+
+    push(OP_ARCHIVE, name);
+}
+
+void FrameWriter::push(int op, const std::string &text) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        items.push_back({op, text, time(NULL)});
+    }
+    queuedBytes += text.size();
+    ready.notify_one();
+}
+
+void FrameWriter::run() {
+    // takes the whole queue at a time, so the event loop is only ever locked out for a swap
+    std::deque<item_struct> batch;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard, [this] { return stopping || !items.empty(); });
+            if (items.empty() && stopping) return;
+            batch.swap(items);
+        }
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            apply(batch[i]);
+            queuedBytes -= batch[i].text.size();
+        }
+        batch.clear();
+
+        if (frameFile != NULL) fflush(frameFile);
+        if (logFile != NULL) fflush(logFile);
+    }
+}
+
+void FrameWriter::apply(const item_struct &item) {
+    if (item.op == OP_FRAME) {
+        if (archive.isOpen() && archiver.feed(item.text.data(), item.text.size()) != 0) writeErrors += 1;
+        if (frameFile == NULL) return;
+        if (fputs(item.text.c_str(), frameFile) < 0 || fputc('\n', frameFile) < 0) writeErrors += 1;
+        return;
+    }
+
+    if (item.op == OP_ARCHIVE) {
+        std::string path = directory + "/" + item.text;
+        if (archive.open(path.c_str(), ENCODE_DELTA) != 0) writeErrors += 1;
+        return;
+    }
+
+    if (item.op == OP_BEGIN) {
+        if (frameFile != NULL) fclose(frameFile);
+        std::string path = directory + "/" + item.text;
+        frameFile = fopen(path.c_str(), "w");
+        if (frameFile == NULL) writeErrors += 1;
+        return;
+    }
+
+    if (item.op == OP_END) {
+        if (frameFile != NULL) {
+            if (fclose(frameFile) != 0) writeErrors += 1;
+            frameFile = NULL;
+            framesWritten += 1;
+        }
+    }
+
+    // the log gets end of frame summaries and the text lines, timestamped
+    if (logFile == NULL) {
+        std::string path = directory + "/device.log";
+        logFile = fopen(path.c_str(), "a");
+        if (logFile == NULL) {
+            writeErrors += 1;
+            return;
+        }
+    }
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&item.when));
+    fprintf(logFile, "%s %s\n", stamp, item.text.c_str());
+}
@@ -0,0 +1,74 @@
+/*
+ * framewriter.h
+ * Per-device disk writer: frames and the device log go through a queue to a thread of their own
+ */
+
+#ifndef framewriter_h
+#define framewriter_h
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <time.h>
+
+#include "archive.h"
+
+/*
+ * The event loop only appends to the queue, so a slow or stalled disk never holds up reading the serial ports;
+ * the head would block on a full USB buffer and its control loop with it. Each frame goes to its own file in
+ * the device's directory, as the stream records the head sent, and a summary is appended to the device log.
+ * With an archive open the same records are packed into it as well, every frame of the session in one file.
+ */
+
+class FrameWriter
+{
+    public:
+        FrameWriter(const std::string &directory);
+        ~FrameWriter();
+
+        void beginFrame(const std::string &name);
+        void writeFrame(const std::string &line);
+        void endFrame(const std::string &summary);
+        void log(const std::string &line);
+        void openArchive(const std::string &name);
+
+        std::atomic<long> queuedBytes;
+        std::atomic<long> framesWritten;
+        std::atomic<long> writeErrors;
+
+    private:
+        enum Op {
+            OP_BEGIN,
+            OP_FRAME,
+            OP_END,
+            OP_LOG,
+            OP_ARCHIVE
+        };
+
+        struct item_struct {
+            int op;
+            std::string text;
+            time_t when; // queued, for the log
+        };
+
+        std::string directory;
+        std::deque<item_struct> items;
+        std::mutex lock;
+        std::condition_variable ready;
+        bool stopping;
+        std::thread thread;
+
+        FILE *frameFile;
+        FILE *logFile;
+        ArchiveWriter archive;
+        StreamArchiver archiver;
+
+        void push(int op, const std::string &text);
+        void run();
+        void apply(const item_struct &item);
+};
+
+#endif
@@ -0,0 +1,456 @@
+/*
+ * stmd.cpp
+ * Acquisition daemon for several OpenSTM heads: one epoll loop reads every serial port, frames are written to
+ * disk per device, and a local control socket sends commands and reports status.
+ *
+ * usage: stmd [-o directory] [-s socket] [-a] name=port [name=port ...]
+ *   -a  also pack each head's frames into one archive per session, see host/proc/archive.h
+ *
+ * Control socket, one command per line, replies end with a line starting "ok" or "err":
+ *   list                        one "device" line per head: port state, bytes, lines, frames, writer queue
+ *   send <name|all> <command>   send a firmware command line
+ *   watch <name|all>            pass on the heads' text lines (replies, job messages, frame summaries) as
+ *                               "<name> <line>", until unwatch
+ *   unwatch
+ *   add <name> <port>           start acquiring from another head
+ *   remove <name>
+ *   shutdown                    write out the queued frames and exit
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "device.h"
+
+class Daemon
+{
+    public:
+        Daemon(const std::string &directory, const std::string &socketPath);
+        ~Daemon();
+
+        int begin();
+        int addDevice(const std::string &name, const std::string &path);
+        int removeDevice(const std::string &name);
+        void run();
+
+        bool archive; // pack frames into an archive per device as well
+
+    private:
+        struct client_struct {
+            int fd;
+            std::string input;
+            std::string output;
+            std::string watching; // device name, "all", or empty
+        };
+
+        static const int maxEvents = 32;
+        static const size_t maxClientOutput = 1 << 20; // a client this far behind is dropped
+
+        std::string directory;
+        std::string socketPath;
+        int epollFd;
+        int listenFd;
+        int timerFd;
+        int signalFd;
+        bool stopping;
+
+        std::vector<Device*> devices;
+        std::vector<client_struct*> clients;
+
+        Device *findDevice(const std::string &name);
+        void watchFd(int fd, bool add, bool writable);
+
+        void reopenDevices();
+        void handleDevice(Device *device, uint32_t events);
+        void passOnText(Device *device);
+
+        void acceptClient();
+        void handleClient(client_struct *client, uint32_t events);
+        void dispatch(client_struct *client, const std::string &line);
+        void reply(client_struct *client, const std::string &line);
+        void dropClient(client_struct *client);
+};
+
+Daemon::Daemon(const std::string &directory, const std::string &socketPath) :
+    archive(false),
+    directory(directory),
+    socketPath(socketPath),
+    epollFd(-1),
+    listenFd(-1),
+    timerFd(-1),
+    signalFd(-1),
+    stopping(false)
+{
+}
+
+Daemon::~Daemon() {
+    // each device's writer drains its queue as it is destroyed
+    for (size_t i = 0; i < devices.size(); i++) delete devices[i];
+    for (size_t i = 0; i < clients.size(); i++) {
+        close(clients[i]->fd);
+        delete clients[i];
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+    if (timerFd >= 0) close(timerFd);
+    if (signalFd >= 0) close(signalFd);
+    if (epollFd >= 0) close(epollFd);
+}
+
+int Daemon::begin() {
+    /*!
+     * \brief sets up the event loop, the control socket, the reopen timer and the shutdown signals
+     * @return 0, -1 on failure with errno set
+     */
+
+    mkdir(directory.c_str(), 0755);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) return -1;
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) return -1;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    unlink(socketPath.c_str());
+    if (bind(listenFd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listenFd, 8) != 0) return -1;
+    watchFd(listenFd, true, false);
+
+    // unplugged heads are retried once a second
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec period = {{1, 0}, {1, 0}};
+    if (timerFd < 0 || timerfd_settime(timerFd, 0, &period, NULL) != 0) return -1;
+    watchFd(timerFd, true, false);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signalFd < 0) return -1;
+    watchFd(signalFd, true, false);
+
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+int Daemon::addDevice(const std::string &name, const std::string &path) {
+    /*!
+     * \brief starts acquiring from a head. The port need not exist yet
+     * @return 0, -1 if the name is taken
+     */
+
+    if (name.empty() || name == "all" || findDevice(name) != NULL) return -1;
+
+    Device *device = new Device(name, path, directory);
+    devices.push_back(device);
+    if (archive) {
+        char stamp[32];
+        time_t now = time(NULL);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+        device->writer.openArchive(name + "_" + stamp + ".stma");
+    }
+    if (device->open() >= 0) watchFd(device->fd, true, false);
+    return 0;
+}
+
+int Daemon::removeDevice(const std::string &name) {
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (devices[i]->name != name) continue;
+        delete devices[i]; // closing the fd drops it from the epoll set
+        devices.erase(devices.begin() + i);
+        return 0;
+    }
+    return -1;
+}
+
+void Daemon::run() {
+    /*!
+     * \brief runs the event loop until shutdown or a signal
+     */
+
+    struct epoll_event events[maxEvents];
+
+    while (!stopping) {
+        int n = epoll_wait(epollFd, events, maxEvents, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("stmd: epoll_wait");
+            return;
+        }
+
+        for (int i = 0; i < n && !stopping; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == listenFd) acceptClient();
+            else if (fd == timerFd) {
+                uint64_t expirations;
+                while (read(timerFd, &expirations, sizeof(expirations)) > 0) ;
+                reopenDevices();
+            }
+            else if (fd == signalFd) stopping = true;
+            else {
+                // devices and clients can go during the batch, so they are looked up by fd every time
+                Device *device = NULL;
+                for (size_t d = 0; d < devices.size() && device == NULL; d++) {
+                    if (devices[d]->fd == fd) device = devices[d];
+                }
+                if (device != NULL) {
+                    handleDevice(device, events[i].events);
+                    continue;
+                }
+                for (size_t c = 0; c < clients.size(); c++) {
+                    if (clients[c]->fd == fd) {
+                        handleClient(clients[c], events[i].events);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+Device *Daemon::findDevice(const std::string &name) {
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (devices[i]->name == name) return devices[i];
+    }
+    return NULL;
+}
+
+void Daemon::watchFd(int fd, bool add, bool writable) {
+    struct epoll_event event;
+    event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+    event.data.fd = fd;
+    epoll_ctl(epollFd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+}
+
+void Daemon::reopenDevices() {
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (devices[i]->fd >= 0 || devices[i]->open() < 0) continue;
+        watchFd(devices[i]->fd, true, devices[i]->wantsWrite());
+
+        std::string line = "opened " + devices[i]->path;
+        devices[i]->text.push_back(line);
+        passOnText(devices[i]);
+    }
+}
+
+void Daemon::handleDevice(Device *device, uint32_t events) {
+    // reading first, so whatever the head sent before hanging up is kept
+    int status = 0;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) status = device->onReadable();
+    if (status == 0 && (events & EPOLLOUT)) status = device->onWritable();
+    if (status == 0 && (events & (EPOLLHUP | EPOLLERR)) && !(events & EPOLLIN)) status = -1;
+
+    if (status != 0) {
+        device->close("port closed");
+        device->text.push_back("closed " + device->path);
+    }
+    else watchFd(device->fd, false, device->wantsWrite());
+
+    passOnText(device);
+}
+
+void Daemon::passOnText(Device *device) {
+    for (size_t t = 0; t < device->text.size(); t++) {
+        std::string line = device->name + " " + device->text[t];
+        for (size_t c = 0; c < clients.size(); c++) {
+            if (clients[c]->watching == "all" || clients[c]->watching == device->name) reply(clients[c], line);
+        }
+    }
+    device->text.clear();
+
+    // replies go out once the batch is done, dropping clients that fell too far behind
+    for (size_t c = 0; c < clients.size(); c++) {
+        if (clients[c]->output.size() > maxClientOutput) {
+            dropClient(clients[c]);
+            c -= 1;
+        }
+        else if (!clients[c]->output.empty()) watchFd(clients[c]->fd, false, true);
+    }
+}
+
+void Daemon::acceptClient() {
+    while (true) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        client_struct *client = new client_struct();
+        client->fd = fd;
+        clients.push_back(client);
+        watchFd(fd, true, false);
+    }
+}
+
+void Daemon::handleClient(client_struct *client, uint32_t events) {
+    if (events & EPOLLIN) {
+        char buf[1024];
+        while (true) {
+            ssize_t n = read(client->fd, buf, sizeof(buf));
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                dropClient(client);
+                return;
+            }
+            if (n < 0) break;
+            client->input.append(buf, n);
+        }
+
+        size_t end;
+        while ((end = client->input.find('\n')) != std::string::npos) {
+            std::string line = client->input.substr(0, end);
+            client->input.erase(0, end + 1);
+            if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+            if (!line.empty()) dispatch(client, line);
+            if (stopping) return;
+        }
+        if (client->input.size() > 4096) {
+            dropClient(client);
+            return;
+        }
+    }
+
+    while (!client->output.empty()) {
+        ssize_t n = write(client->fd, client->output.data(), client->output.size());
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            dropClient(client);
+            return;
+        }
+        client->output.erase(0, n);
+    }
+    watchFd(client->fd, false, !client->output.empty());
+}
+
+void Daemon::dispatch(client_struct *client, const std::string &line) {
+    /*!
+     * \brief runs one control command
+     */
+
+    size_t space = line.find(' ');
+    std::string cmd = line.substr(0, space);
+    std::string rest = space == std::string::npos ? "" : line.substr(space + 1);
+    space = rest.find(' ');
+    std::string arg = rest.substr(0, space);
+    std::string tail = space == std::string::npos ? "" : rest.substr(space + 1);
+
+    if (cmd == "list") {
+        for (size_t i = 0; i < devices.size(); i++) {
+            Device *d = devices[i];
+            char status[512];
+            snprintf(status, sizeof(status), "device %s %s %s bytes=%ld lines=%ld frames=%ld incomplete=%ld "
+                    "queued=%ld errors=%ld", d->name.c_str(), d->path.c_str(), d->fd >= 0 ? "open" : "closed",
+                    d->bytesRead, d->linesRead, d->frames, d->framesIncomplete, d->writer.queuedBytes.load(),
+                    d->writer.writeErrors.load());
+            reply(client, status);
+        }
+        reply(client, "ok");
+    }
+    else if (cmd == "send") {
+        int sent = 0;
+        for (size_t i = 0; i < devices.size(); i++) {
+            if ((arg != "all" && devices[i]->name != arg) || devices[i]->fd < 0) continue;
+            devices[i]->send(tail);
+            watchFd(devices[i]->fd, false, true);
+            sent += 1;
+        }
+        if (tail.empty()) reply(client, "err usage: send <name|all> <command>");
+        else if (sent == 0) reply(client, "err no open device " + arg);
+        else reply(client, "ok");
+    }
+    else if (cmd == "watch") {
+        if (arg != "all" && findDevice(arg) == NULL) reply(client, "err no device " + arg);
+        else {
+            client->watching = arg;
+            reply(client, "ok");
+        }
+    }
+    else if (cmd == "unwatch") {
+        client->watching.clear();
+        reply(client, "ok");
+    }
+    else if (cmd == "add") {
+        if (arg.empty() || tail.empty()) reply(client, "err usage: add <name> <port>");
+        else if (addDevice(arg, tail) != 0) reply(client, "err name taken " + arg);
+        else reply(client, "ok");
+    }
+    else if (cmd == "remove") {
+        if (removeDevice(arg) != 0) reply(client, "err no device " + arg);
+        else reply(client, "ok");
+    }
+    else if (cmd == "shutdown") {
+        reply(client, "ok");
+        // best effort, the loop ends before the socket is writable again
+        if (write(client->fd, client->output.data(), client->output.size()) > 0) client->output.clear();
+        stopping = true;
+    }
+    else reply(client, "err unknown command " + cmd);
+}
+
+void Daemon::reply(client_struct *client, const std::string &line) {
+    client->output += line;
+    client->output += '\n';
+}
+
+void Daemon::dropClient(client_struct *client) {
+    close(client->fd);
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (clients[i] == client) clients.erase(clients.begin() + i);
+    }
+    delete client;
+}
+
+int main(int argc, char **argv) {
+    std::string directory = "frames";
+    std::string socketPath = "/tmp/stmd.sock";
+    std::vector<std::string> specs;
+    bool archive = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) directory = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) socketPath = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0) archive = true;
+        else if (strchr(argv[i], '=') != NULL) specs.push_back(argv[i]);
+        else {
+            fprintf(stderr, "usage: stmd [-o directory] [-s socket] [-a] name=port [name=port ...]\n");
+            return 1;
+        }
+    }
+
+    Daemon daemon(directory, socketPath);
+    daemon.archive = archive;
+    if (daemon.begin() != 0) {
+        perror("stmd");
+        return 1;
+    }
+    for (size_t i = 0; i < specs.size(); i++) {
+        size_t equals = specs[i].find('=');
+        if (daemon.addDevice(specs[i].substr(0, equals), specs[i].substr(equals + 1)) != 0) {
+            fprintf(stderr, "stmd: duplicate device %s\n", specs[i].c_str());
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "stmd: %zu devices, frames in %s, control on %s\n", specs.size(), directory.c_str(),
+            socketPath.c_str());
+    daemon.run();
+    return 0;
+}
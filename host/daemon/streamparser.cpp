@@ -0,0 +1,149 @@
+/*
+ * streamparser.cpp
+ * Classifies the lines of a head's serial output against the scan stream format, checking frames for lost data
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "streamparser.h"
+#include "scanchannels.h"
+
+StreamParser::StreamParser() {
+    reset();
+}
+
+void StreamParser::reset() {
+    inFrame = false;
+    channels = 0;
+    width = 0;
+    height = 0;
+    step = 0;
+    lineIndex = -1;
+    endStatus = 0;
+    linesReceived = 0;
+    rowsMissing = 0;
+    rowsMalformed = 0;
+    frames = 0;
+    textLines = 0;
+    valuesPerRow = 0;
+    rowsInLine = 0;
+    shortfall = 0;
+    chunked = false;
+}
+
+int StreamParser::feed(const std::string &line) {
+    /*!
+     * \brief classifies one line, updating the frame state and its loss counts
+     * @param line serial line without its line ending
+     * @return the Record kind of the line
+     */
+
+    const char *s = line.c_str();
+
+    if (strncmp(s, "#frame,", 7) == 0) {
+        if (inFrame) closeLine();
+        inFrame = true;
+        channels = width = height = step = 0;
+        sscanf(s + 7, "%d,%d,%d,%d", &channels, &width, &height, &step);
+        valuesPerRow = 1 + channelCount(channels);
+        decoder.beginFrame(channels);
+        lineIndex = -1;
+        rowsInLine = 0;
+        linesReceived = 0;
+        rowsMissing = 0;
+        rowsMalformed = 0;
+        shortfall = 0;
+        chunked = false;
+        frames += 1;
+        return RECORD_FRAME;
+    }
+
+    if (!inFrame) {
+        textLines += 1;
+        return RECORD_TEXT;
+    }
+
+    if (strncmp(s, "step,", 5) == 0 && lineIndex < 0 && rowsInLine == 0) return RECORD_COLUMNS;
+
+    if (strncmp(s, "#line,", 6) == 0) {
+        openLine(atoi(s + 6));
+        return RECORD_LINE;
+    }
+
+    if (strncmp(s, "#zline,", 7) == 0) {
+        // a coded line stands for #line and its rows, all malformed if it does not decode
+        int index = -1;
+        int first = 0;
+        int rows = 0;
+        sscanf(s + 7, "%d,%d,%d", &index, &first, &rows);
+        openLine(index);
+        int decoded = decoder.decode(s + 7, s + line.size(), &index, pixels, values);
+        if (decoded < 0) {
+            if (rows < 0 || rows > width) rows = width;
+            rowsMalformed += rows;
+        }
+        else if (rowsInLine + rows > width) rowsMalformed += rowsInLine + rows - width;
+        rowsInLine += rows;
+        return RECORD_LINE;
+    }
+
+    if (strncmp(s, "#end,", 5) == 0) {
+        closeLine();
+        endStatus = atoi(s + 5);
+        // a failed or aborted frame ends early, a chunked one with a short chunk
+        if (endStatus == 0) {
+            if (!chunked) rowsMissing += shortfall;
+            if (lineIndex < height - 1) rowsMissing += (long) (height - 1 - lineIndex) * width;
+        }
+        shortfall = 0;
+        inFrame = false;
+        return RECORD_END;
+    }
+
+    if (s[0] == '#') {
+        // events are queued between whole lines, so the last line is complete
+        closeLine();
+        if (strncmp(s, "#overcurrent,", 13) == 0) shortfall = 0;
+        if (strncmp(s, "#spiral,", 8) == 0 || strncmp(s, "#lissajous,", 11) == 0 || strncmp(s, "#track,", 7) == 0) {
+            chunked = true;
+        }
+        return RECORD_EVENT;
+    }
+
+    if ((s[0] >= '0' && s[0] <= '9') || s[0] == '-') {
+        // data row: pixel index then the channels, all integers
+        int values = 1;
+        for (const char *c = s; *c != '\0'; c++) {
+            if (*c == ',') values += 1;
+            else if ((*c < '0' || *c > '9') && *c != '-') values = -1000;
+        }
+        if (values != valuesPerRow || rowsInLine >= width) rowsMalformed += 1;
+        rowsInLine += 1;
+        return RECORD_PIXEL;
+    }
+
+    // replies and job messages interleave with the stream
+    textLines += 1;
+    return RECORD_TEXT;
+}
+
+void StreamParser::openLine(int index) {
+    // lines skipped since the last are missing, as is the rest of the last if it stopped short unannounced
+    closeLine();
+    rowsMissing += shortfall;
+    shortfall = 0;
+
+    if (index > lineIndex + 1) rowsMissing += (long) (index - lineIndex - 1) * width;
+    lineIndex = index;
+    rowsInLine = 0;
+    linesReceived += 1;
+}
+
+void StreamParser::closeLine() {
+    // rows past width are counted malformed as they arrive
+    if (lineIndex < 0 || rowsInLine >= width) return;
+    shortfall = width - rowsInLine;
+    rowsInLine = width;
+}
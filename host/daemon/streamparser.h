@@ -0,0 +1,72 @@
+/*
+ * streamparser.h
+ * Classifies the lines of a head's serial output against the scan stream format, checking frames for lost data
+ */
+
+#ifndef streamparser_h
+#define streamparser_h
+
+#include <string>
+#include <vector>
+
+#include "linedecoder.h"
+
+/*
+ * Takes one line at a time, without its line ending. Records of the scan stream (see scanstream.h) belong to the
+ * open frame; anything else is text: command replies, job messages and the startup banner.
+ *
+ * Each frame is checked as it arrives. Lines must carry width rows of 1 + channelCount(channels) values and line
+ * indices must run 0 to height - 1 without skipping; retried lines repeat their index. A line may stop short only
+ * where the head says it did: the last line of a failed or aborted frame, the last chunk of a fast scan or track,
+ * or a spectroscopy curve cut off by an overcurrent event. Missing and malformed rows are counted, so a frame
+ * written to disk says whether it is complete. A #zline record is decoded to check it, and counts as a line of the
+ * rows it carries.
+ */
+
+class StreamParser
+{
+    public:
+        StreamParser();
+
+        enum Record {
+            RECORD_TEXT,
+            RECORD_FRAME,   // #frame header, opens a frame
+            RECORD_COLUMNS, // column header following #frame
+            RECORD_LINE,    // #line, or a #zline with its rows
+            RECORD_PIXEL,   // data row
+            RECORD_EVENT,   // any other #event
+            RECORD_END      // #end, closes the frame
+        };
+
+        int feed(const std::string &line);
+        void reset();
+
+        bool inFrame;
+        int channels;     // frame header fields
+        int width;
+        int height;
+        int step;
+        int lineIndex;    // line being received
+        int endStatus;    // #end status of the last frame
+
+        long linesReceived; // this frame
+        long rowsMissing;
+        long rowsMalformed;
+
+        long frames;      // since reset, complete or not
+        long textLines;
+
+    private:
+        int valuesPerRow;
+        int rowsInLine;   // rows of the line being received
+        long shortfall;   // rows the last closed line stopped short by, counted missing once the next record shows
+                          // it was not allowed
+        bool chunked;     // fast scan or track frame, whose last chunk is short
+        LineDecoder decoder;
+        std::vector<int> pixels, values;
+
+        void openLine(int index);
+        void closeLine();
+};
+
+#endif
@@ -0,0 +1,732 @@
+/*
+ * archive.cpp
+ * Binary scan archive: frames with their acquisition parameters, written as they stream in, read by mmap
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scanchannels.h"
+#include "archive.h"
+#include "crc32.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the archive is read and written in host byte order, which must be little-endian"
+#endif
+
+static const char fileMagic[8] = {'S', 'T', 'M', 'A', 'R', 'C', 'H', 0};
+static const char footerMagic[8] = {'S', 'T', 'M', 'A', 'I', 'D', 'X', 0};
+static const size_t fileHeaderSize = 24;
+static const size_t chunkHeaderSize = 16;
+static const size_t footerSize = 16;
+static const size_t frameHeaderSize = 44;
+static const size_t lineHeaderSize = 16;
+
+static size_t padded(size_t length) {
+    return (length + 7) & ~(size_t) 7;
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t value) {
+    out.insert(out.end(), (const uint8_t *) &value, (const uint8_t *) &value + 4);
+}
+
+static void put64(std::vector<uint8_t> &out, uint64_t value) {
+    out.insert(out.end(), (const uint8_t *) &value, (const uint8_t *) &value + 8);
+}
+
+static int32_t get32(const uint8_t *p) {
+    int32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static uint64_t get64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return value;
+}
+
+static void putVarint(std::vector<uint8_t> &out, int32_t delta) {
+    // zigzag, so small negative deltas are small too, then 7 bits a byte
+    uint32_t v = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+    while (v >= 0x80) {
+        out.push_back((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(v);
+}
+
+static const uint8_t *getVarint(const uint8_t *p, const uint8_t *end, int32_t *delta) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p >= end) return NULL;
+        uint8_t byte = *p++;
+        v |= (uint32_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *delta = (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+std::string ArchiveFrame::param(const char *key) const {
+    /*!
+     * \brief value of one acquisition parameter
+     * @return the value, empty if the frame's #params record did not have it
+     */
+
+    size_t keyLength = strlen(key);
+    size_t start = 0;
+    while (start < params.size()) {
+        size_t end = params.find(',', start);
+        if (end == std::string::npos) end = params.size();
+        if (end - start > keyLength && params.compare(start, keyLength, key) == 0 && params[start + keyLength] == '=') {
+            return params.substr(start + keyLength + 1, end - start - keyLength - 1);
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+ArchiveWriter::ArchiveWriter() :
+    bytesWritten(0),
+    rawBytes(0),
+    file(NULL),
+    encoding(ENCODE_RAW),
+    numColumns(0),
+    inFrame(false)
+{
+}
+
+ArchiveWriter::~ArchiveWriter() {
+    close();
+}
+
+int ArchiveWriter::open(const char *path, int encoding) {
+    /*!
+     * \brief creates the archive, replacing any file at path
+     * @param encoding ENCODE_RAW, or ENCODE_DELTA to compress the lines
+     * @return 0, -1 if the file could not be created
+     */
+
+    close();
+    file = fopen(path, "wb");
+    if (file == NULL) return -1;
+
+    this->encoding = encoding;
+    index.clear();
+    lines.clear();
+    inFrame = false;
+    bytesWritten = 0;
+    rawBytes = 0;
+
+    std::vector<uint8_t> header(fileMagic, fileMagic + 8);
+    put32(header, archiveVersion);
+    put32(header, 0);
+    put64(header, (uint64_t) time(NULL));
+    if (fwrite(header.data(), 1, header.size(), file) != header.size()) return -1;
+    bytesWritten = header.size();
+    return 0;
+}
+
+int ArchiveWriter::writeChunk(uint32_t type, const uint8_t *data, size_t length) {
+    // header, payload and zero padding to the next 8 byte boundary
+    uint32_t header[4] = {type, (uint32_t) length, index.empty() ? 0 : (uint32_t) index.size() - 1,
+                          crc32(data, length, 0)};
+    static const uint8_t zeros[8] = {0};
+    size_t padding = padded(length) - length;
+
+    bool failed = fwrite(header, 1, chunkHeaderSize, file) != chunkHeaderSize;
+    failed |= fwrite(data, 1, length, file) != length;
+    failed |= fwrite(zeros, 1, padding, file) != padding;
+    bytesWritten += chunkHeaderSize + length + padding;
+    return failed ? -1 : 0;
+}
+
+int ArchiveWriter::beginFrame(int channels, int width, int height, int step, const char *kind,
+        const std::string &params) {
+    /*!
+     * \brief starts a frame, ending the last one if it is still open
+     * @param kind "raster", "spiral", "lissajous", "track" or "spec"
+     * @param params the #params record's key=value list
+     * @return 0, -1 on a write error
+     */
+
+    if (file == NULL) return -1;
+    if (inFrame) endFrame(noEndStatus, -1, -1, -1);
+
+    index_struct entry = {(uint64_t) bytesWritten, 0, (uint32_t) lines.size(), 0};
+    index.push_back(entry);
+    numColumns = 1 + channelCount(channels);
+    inFrame = true;
+
+    payload.clear();
+    put32(payload, channels);
+    put32(payload, width);
+    put32(payload, height);
+    put32(payload, step);
+    char kindField[16] = {0};
+    strncpy(kindField, kind, sizeof(kindField) - 1);
+    payload.insert(payload.end(), kindField, kindField + 16);
+    put64(payload, (uint64_t) time(NULL));
+    put32(payload, params.size());
+    payload.insert(payload.end(), params.begin(), params.end());
+    return writeChunk(CHUNK_FRAME, payload.data(), payload.size());
+}
+
+int ArchiveWriter::writeLine(int lineIndex, const int *pixels, const int *values, int rows) {
+    /*!
+     * \brief appends one transmission of a line
+     * @param *pixels pixel index of each row
+     * @param *values the rows' channel values, row after row as streamed
+     * @return 0, -1 on a write error or outside a frame
+     */
+
+    if (file == NULL || !inFrame) return -1;
+
+    archive_line_struct line = {(uint64_t) bytesWritten, lineIndex, rows};
+    lines.push_back(line);
+    index.back().numLines += 1;
+
+    payload.clear();
+    put32(payload, lineIndex);
+    put32(payload, rows);
+    put32(payload, numColumns);
+    put32(payload, encoding);
+
+    int numChannels = numColumns - 1;
+    if (encoding == ENCODE_RAW) {
+        payload.reserve(lineHeaderSize + (size_t) rows * numColumns * 4);
+        payload.insert(payload.end(), (const uint8_t *) pixels, (const uint8_t *) (pixels + rows));
+        for (int c = 0; c < numChannels; c++) {
+            for (int r = 0; r < rows; r++) put32(payload, values[(size_t) r * numChannels + c]);
+        }
+    }
+    else {
+        int32_t previous = 0;
+        for (int r = 0; r < rows; r++) {
+            putVarint(payload, (int32_t) ((uint32_t) pixels[r] - (uint32_t) previous));
+            previous = pixels[r];
+        }
+        for (int c = 0; c < numChannels; c++) {
+            previous = 0;
+            for (int r = 0; r < rows; r++) {
+                int32_t v = values[(size_t) r * numChannels + c];
+                putVarint(payload, (int32_t) ((uint32_t) v - (uint32_t) previous));
+                previous = v;
+            }
+        }
+    }
+
+    rawBytes += chunkHeaderSize + lineHeaderSize + (long) rows * numColumns * 4;
+    return writeChunk(CHUNK_LINE, payload.data(), payload.size());
+}
+
+int ArchiveWriter::writeEvent(const char *name, int line, int value) {
+    /*!
+     * \brief appends a scan event, recenter, retry, pause ...
+     * @return 0, -1 on a write error or outside a frame
+     */
+
+    if (file == NULL || !inFrame) return -1;
+
+    payload.clear();
+    put32(payload, line);
+    put32(payload, value);
+    payload.insert(payload.end(), name, name + strlen(name) + 1);
+    return writeChunk(CHUNK_EVENT, payload.data(), payload.size());
+}
+
+int ArchiveWriter::endFrame(int status, int lines, int missing, int malformed) {
+    /*!
+     * \brief closes the frame, flushing it to disk
+     * @param status the #end status, noEndStatus if there was none
+     * @param lines, missing, malformed the capture's loss counts, -1 if not known
+     * @return 0, -1 on a write error or outside a frame
+     */
+
+    if (file == NULL || !inFrame) return -1;
+
+    index.back().endOffset = bytesWritten;
+    inFrame = false;
+
+    payload.clear();
+    put32(payload, status);
+    put32(payload, lines);
+    put32(payload, missing);
+    put32(payload, malformed);
+    int written = writeChunk(CHUNK_END, payload.data(), payload.size());
+    return flush() == 0 ? written : -1;
+}
+
+int ArchiveWriter::flush() {
+    if (file == NULL) return -1;
+    return fflush(file) == 0 ? 0 : -1;
+}
+
+int ArchiveWriter::close() {
+    /*!
+     * \brief ends any open frame, then writes the index and footer and closes the file
+     * @return 0, -1 on a write error
+     */
+
+    if (file == NULL) return 0;
+    if (inFrame) endFrame(noEndStatus, -1, -1, -1);
+
+    uint64_t indexOffset = bytesWritten;
+    payload.clear();
+    put32(payload, index.size());
+    put32(payload, lines.size());
+    for (size_t i = 0; i < index.size(); i++) {
+        put64(payload, index[i].offset);
+        put64(payload, index[i].endOffset);
+        put32(payload, index[i].firstLine);
+        put32(payload, index[i].numLines);
+    }
+    for (size_t i = 0; i < lines.size(); i++) {
+        put64(payload, lines[i].offset);
+        put32(payload, lines[i].lineIndex);
+        put32(payload, lines[i].rows);
+    }
+    int status = writeChunk(CHUNK_INDEX, payload.data(), payload.size());
+
+    std::vector<uint8_t> footer;
+    put64(footer, indexOffset);
+    footer.insert(footer.end(), footerMagic, footerMagic + 8);
+    if (fwrite(footer.data(), 1, footer.size(), file) != footer.size()) status = -1;
+    bytesWritten += footer.size();
+
+    if (fclose(file) != 0) status = -1;
+    file = NULL;
+    return status;
+}
+
+ArchiveReader::ArchiveReader() :
+    recovered(false),
+    map(NULL),
+    size(0)
+{
+}
+
+ArchiveReader::~ArchiveReader() {
+    close();
+}
+
+int ArchiveReader::open(const char *path) {
+    /*!
+     * \brief maps an archive and reads its index, or rebuilds it if the writer never closed the file
+     * @return the number of frames, -1 if the file is not a readable archive
+     */
+
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < fileHeaderSize) {
+        ::close(fd);
+        return -1;
+    }
+    size = info.st_size;
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        size = 0;
+        return -1;
+    }
+    map = (const uint8_t *) mapped;
+
+    if (memcmp(map, fileMagic, 8) != 0 || (uint32_t) get32(map + 8) > archiveVersion) {
+        close();
+        return -1;
+    }
+
+    recovered = false;
+    if (readIndex() != 0) {
+        rebuildIndex();
+        recovered = true;
+    }
+    for (size_t i = 0; i < frames.size(); i++) decodeFrame(frames[i]);
+    return frames.size();
+}
+
+void ArchiveReader::close() {
+    if (map != NULL) munmap((void *) map, size);
+    map = NULL;
+    size = 0;
+    frames.clear();
+}
+
+bool ArchiveReader::chunkAt(uint64_t offset, uint32_t *type, uint32_t *length, const uint8_t **payload) {
+    // a whole chunk with a good CRC at offset
+    if (offset < fileHeaderSize || offset + chunkHeaderSize > size || offset % 8 != 0) return false;
+    const uint8_t *header = map + offset;
+    *type = get32(header);
+    *length = get32(header + 4);
+    if (*length > size - offset - chunkHeaderSize) return false;
+    *payload = header + chunkHeaderSize;
+    return crc32(*payload, *length, 0) == (uint32_t) get32(header + 12);
+}
+
+int ArchiveReader::readIndex() {
+    // the index the footer points to. Returns 0, -1 if there is none to trust
+    if (size < fileHeaderSize + footerSize || memcmp(map + size - 8, footerMagic, 8) != 0) return -1;
+
+    uint32_t type, length;
+    const uint8_t *p;
+    if (!chunkAt(get64(map + size - footerSize), &type, &length, &p) || type != CHUNK_INDEX || length < 8) return -1;
+
+    uint32_t numFrames = get32(p);
+    uint32_t numLines = get32(p + 4);
+    if (length != 8 + (uint64_t) numFrames * 24 + (uint64_t) numLines * 16) return -1;
+
+    const uint8_t *lineEntries = p + 8 + (size_t) numFrames * 24;
+    frames.resize(numFrames);
+    for (uint32_t i = 0; i < numFrames; i++) {
+        const uint8_t *entry = p + 8 + (size_t) i * 24;
+        ArchiveFrame &frame = frames[i];
+        frame.offset = get64(entry);
+        frame.endOffset = get64(entry + 8);
+        uint32_t firstLine = get32(entry + 16);
+        uint32_t count = get32(entry + 20);
+        if ((uint64_t) firstLine + count > numLines) return -1;
+        frame.lines.resize(count);
+        for (uint32_t k = 0; k < count; k++) {
+            const uint8_t *line = lineEntries + (size_t) (firstLine + k) * 16;
+            frame.lines[k].offset = get64(line);
+            frame.lines[k].lineIndex = get32(line + 8);
+            frame.lines[k].rows = get32(line + 12);
+        }
+    }
+    return 0;
+}
+
+void ArchiveReader::rebuildIndex() {
+    // walks the chunks from the start, up to the first one cut off or damaged
+    frames.clear();
+    uint64_t offset = fileHeaderSize;
+    uint32_t type, length;
+    const uint8_t *p;
+    while (chunkAt(offset, &type, &length, &p)) {
+        if (type == CHUNK_INDEX) break;
+        // the CRC covers the payload only, and a type no writer uses is a damaged header; walking past it would
+        // put a frame's lines in the one before
+        if (type != CHUNK_FRAME && type != CHUNK_LINE && type != CHUNK_EVENT && type != CHUNK_END) break;
+        if (type == CHUNK_FRAME) {
+            frames.push_back(ArchiveFrame());
+            frames.back().offset = offset;
+        }
+        else if (!frames.empty() && type == CHUNK_LINE && length >= lineHeaderSize) {
+            archive_line_struct line = {offset, get32(p), get32(p + 4)};
+            frames.back().lines.push_back(line);
+        }
+        else if (!frames.empty() && type == CHUNK_END) frames.back().endOffset = offset;
+        offset += chunkHeaderSize + padded(length);
+    }
+}
+
+void ArchiveReader::decodeFrame(ArchiveFrame &frame) {
+    // fills in the header and end fields from their chunks
+    uint32_t type, length;
+    const uint8_t *p;
+    if (chunkAt(frame.offset, &type, &length, &p) && type == CHUNK_FRAME && length >= frameHeaderSize) {
+        frame.channels = get32(p);
+        frame.width = get32(p + 4);
+        frame.height = get32(p + 8);
+        frame.step = get32(p + 12);
+        frame.kind.assign((const char *) p + 16, strnlen((const char *) p + 16, 16));
+        frame.captureTime = get64(p + 32);
+        uint32_t paramsLength = get32(p + 40);
+        if (paramsLength <= length - frameHeaderSize) frame.params.assign((const char *) p + 44, paramsLength);
+    }
+    if (frame.endOffset != 0 && chunkAt(frame.endOffset, &type, &length, &p) && type == CHUNK_END && length >= 16) {
+        frame.endStatus = get32(p);
+        frame.linesReceived = get32(p + 4);
+        frame.rowsMissing = get32(p + 8);
+        frame.rowsMalformed = get32(p + 12);
+    }
+}
+
+int ArchiveReader::readLine(int frameIndex, int entry, std::vector<int> &pixels, std::vector<int> &values) {
+    /*!
+     * \brief decodes one line chunk of a frame
+     * @param entry the chunk's position in frame(frameIndex).lines
+     * @param pixels set to the rows' pixel indices
+     * @param values set to the rows' channel values, row after row as streamed
+     * @return the number of rows, -1 if the chunk is damaged
+     */
+
+    uint32_t type, length;
+    const uint8_t *p;
+    if (!chunkAt(frames[frameIndex].lines[entry].offset, &type, &length, &p) || type != CHUNK_LINE ||
+            length < lineHeaderSize) {
+        return -1;
+    }
+
+    int rows = get32(p + 4);
+    int numColumns = get32(p + 8);
+    int encoding = get32(p + 12);
+    int numChannels = numColumns - 1;
+    if (rows < 0 || numColumns < 1) return -1;
+    const uint8_t *data = p + lineHeaderSize;
+    const uint8_t *end = p + length;
+
+    pixels.resize(rows);
+    values.resize((size_t) rows * numChannels);
+    if (encoding == ENCODE_RAW) {
+        if ((size_t) (end - data) != (size_t) rows * numColumns * 4) return -1;
+        memcpy(pixels.data(), data, (size_t) rows * 4);
+        for (int c = 0; c < numChannels; c++) {
+            const uint8_t *column = data + (size_t) (c + 1) * rows * 4;
+            for (int r = 0; r < rows; r++) values[(size_t) r * numChannels + c] = get32(column + (size_t) r * 4);
+        }
+        return rows;
+    }
+    if (encoding != ENCODE_DELTA) return -1;
+
+    int32_t delta;
+    uint32_t previous = 0;
+    for (int r = 0; r < rows; r++) {
+        if ((data = getVarint(data, end, &delta)) == NULL) return -1;
+        previous += (uint32_t) delta;
+        pixels[r] = (int32_t) previous;
+    }
+    for (int c = 0; c < numChannels; c++) {
+        previous = 0;
+        for (int r = 0; r < rows; r++) {
+            if ((data = getVarint(data, end, &delta)) == NULL) return -1;
+            previous += (uint32_t) delta;
+            values[(size_t) r * numChannels + c] = (int32_t) previous;
+        }
+    }
+    return rows;
+}
+
+const int32_t *ArchiveReader::rawColumn(int frameIndex, int entry, int column) {
+    /*!
+     * \brief one column of a line chunk in place in the map, without copying or decoding
+     * @param column 0 for the pixel indices, 1 + the channel's offset for its values
+     * @return frame(frameIndex).lines[entry].rows values, NULL if the chunk is delta encoded or damaged
+     */
+
+    uint32_t type, length;
+    const uint8_t *p;
+    if (!chunkAt(frames[frameIndex].lines[entry].offset, &type, &length, &p) || type != CHUNK_LINE ||
+            length < lineHeaderSize || get32(p + 12) != ENCODE_RAW) {
+        return NULL;
+    }
+    int rows = get32(p + 4);
+    int numColumns = get32(p + 8);
+    if (column < 0 || column >= numColumns || length != lineHeaderSize + (size_t) rows * numColumns * 4) return NULL;
+    return (const int32_t *) (p + lineHeaderSize + (size_t) column * rows * 4);
+}
+
+int ArchiveReader::readFrame(int frameIndex, ScanFrame &out) {
+    /*!
+     * \brief decodes a whole frame, every line chunk in order
+     * @return the number of rows, -1 if a chunk is damaged
+     */
+
+    const ArchiveFrame &frame = frames[frameIndex];
+    out = ScanFrame();
+    out.channels = frame.channels;
+    out.width = frame.width;
+    out.height = frame.height;
+    out.step = frame.step;
+    out.endStatus = frame.endStatus;
+    out.kind = frame.kind;
+    out.params = frame.params;
+    out.numChannels = channelCount(frame.channels);
+
+    std::vector<int> pixels, values;
+    for (size_t k = 0; k < frame.lines.size(); k++) {
+        if (readLine(frameIndex, k, pixels, values) < 0) return -1;
+        out.pixels.insert(out.pixels.end(), pixels.begin(), pixels.end());
+        out.values.insert(out.values.end(), values.begin(), values.end());
+    }
+    return out.numRows();
+}
+
+std::vector<archive_event_struct> ArchiveReader::events(int frameIndex) {
+    /*!
+     * \brief the frame's events, walking its chunks
+     */
+
+    std::vector<archive_event_struct> found;
+    uint64_t end = frameIndex + 1 < (int) frames.size() ? frames[frameIndex + 1].offset : size;
+    uint64_t offset = frames[frameIndex].offset;
+    uint32_t type, length;
+    const uint8_t *p;
+    while (offset < end && chunkAt(offset, &type, &length, &p)) {
+        if (type == CHUNK_EVENT && length > 8) {
+            archive_event_struct event;
+            event.offset = offset;
+            event.line = get32(p);
+            event.value = get32(p + 4);
+            event.name.assign((const char *) p + 8, strnlen((const char *) p + 8, length - 8));
+            found.push_back(event);
+        }
+        if (type == CHUNK_END || type == CHUNK_INDEX) break;
+        offset += chunkHeaderSize + padded(length);
+    }
+    return found;
+}
+
+StreamArchiver::StreamArchiver(ArchiveWriter &writer) :
+    writer(writer),
+    inFrame(false),
+    headerWritten(false),
+    ended(false),
+    channels(0),
+    width(0),
+    height(0),
+    step(0),
+    numColumns(0),
+    endStatus(noEndStatus),
+    lineIndex(-1)
+{
+}
+
+int StreamArchiver::feed(const char *line, size_t length) {
+    /*!
+     * \brief takes one line of the stream, without its line ending
+     * @return 0, -1 on a write error
+     */
+
+    if (length > 0 && line[length - 1] == '\r') length--;
+    const char *end = line + length;
+    int fields[1 + numScanChannels];
+
+    if (length > 7 && memcmp(line, "#frame,", 7) == 0) {
+        int status = inFrame ? closeFrame(-1, -1, -1) : 0;
+        if (parseIntFields(line + 7, end, fields, 4) != 4) return status;
+        channels = fields[0];
+        width = fields[1];
+        height = fields[2];
+        step = fields[3];
+        numColumns = 1 + channelCount(channels);
+        inFrame = true;
+        headerWritten = false;
+        ended = false;
+        endStatus = noEndStatus;
+        kind = "raster";
+        params.clear();
+        lineIndex = -1;
+        decoder.beginFrame(channels);
+        return status;
+    }
+
+    if (!inFrame) return 0;
+
+    if (line[0] == '#') {
+        const char *name = line + 1;
+        const char *comma = (const char *) memchr(name, ',', end - name);
+        std::string event(name, comma ? comma : end);
+        int numFields = comma ? parseIntFields(comma + 1, end, fields, 3) : 0;
+
+        if (event == "params" && comma != NULL && !headerWritten) {
+            params.assign(comma + 1, end);
+            return 0;
+        }
+        if (event == "received" && numFields == 3) return closeFrame(fields[0], fields[1], fields[2]);
+        if (ended) return 0;
+
+        if (!headerWritten && (event == "spiral" || event == "lissajous" || event == "track" || event == "spec")) {
+            kind = event;
+        }
+        int status = writeHeader();
+        if (flushLine() != 0) status = -1;
+
+        if (event == "line" && numFields == 1) lineIndex = fields[0];
+        else if (event == "zline" && comma != NULL) {
+            // decoded whole and archived as its rows; a damaged one is left out, as a malformed row is
+            if (decoder.decode(comma + 1, end, &lineIndex, pixels, values) > 0 && flushLine() != 0) status = -1;
+            pixels.clear();
+            values.clear();
+            lineIndex = -1;
+        }
+        else if (event == "end" && numFields == 1) {
+            // kept open for the daemon's #received record that follows
+            endStatus = fields[0];
+            ended = true;
+        }
+        else if (numFields == 2 && writer.writeEvent(event.c_str(), fields[0], fields[1]) != 0) status = -1;
+        return status;
+    }
+
+    if (length > 5 && memcmp(line, "step,", 5) == 0) return 0;
+
+    // a data row; malformed ones, as the daemon counted them, are left out
+    if (ended || lineIndex < 0 || parseIntFields(line, end, fields, 1 + numScanChannels) != numColumns) return 0;
+    int status = writeHeader();
+    pixels.push_back(fields[0]);
+    values.insert(values.end(), fields + 1, fields + numColumns);
+    return status;
+}
+
+int StreamArchiver::finish() {
+    /*!
+     * \brief closes a frame left open at the end of the stream
+     * @return 0, -1 on a write error
+     */
+
+    return inFrame ? closeFrame(-1, -1, -1) : 0;
+}
+
+int StreamArchiver::writeHeader() {
+    if (headerWritten) return 0;
+    headerWritten = true;
+    return writer.beginFrame(channels, width, height, step, kind.c_str(), params);
+}
+
+int StreamArchiver::flushLine() {
+    if (pixels.empty()) return 0;
+    int status = writer.writeLine(lineIndex, pixels.data(), values.data(), pixels.size());
+    pixels.clear();
+    values.clear();
+    return status;
+}
+
+int StreamArchiver::closeFrame(int lines, int missing, int malformed) {
+    int status = writeHeader();
+    if (flushLine() != 0) status = -1;
+    if (writer.endFrame(endStatus, lines, missing, malformed) != 0) status = -1;
+    inFrame = false;
+    return status;
+}
+
+bool isArchive(const char *path) {
+    /*!
+     * \brief whether the file starts as an archive does
+     */
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+    char magic[8];
+    bool matches = fread(magic, 1, 8, file) == 8 && memcmp(magic, fileMagic, 8) == 0;
+    fclose(file);
+    return matches;
+}
+
+int readArchiveFrames(const char *path, std::vector<ScanFrame> &frames) {
+    /*!
+     * \brief decodes every frame of an archive
+     * @param frames the frames are appended here
+     * @return the number of frames appended, -1 if the archive could not be read
+     */
+
+    ArchiveReader reader;
+    if (reader.open(path) < 0) return -1;
+    for (int i = 0; i < reader.numFrames(); i++) {
+        frames.push_back(ScanFrame());
+        if (reader.readFrame(i, frames.back()) < 0) {
+            frames.pop_back();
+            return -1;
+        }
+    }
+    return reader.numFrames();
+}
@@ -0,0 +1,196 @@
+/*
+ * archive.h
+ * Binary scan archive: frames with their acquisition parameters, written as they stream in, read by mmap
+ */
+
+#ifndef archive_h
+#define archive_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "linedecoder.h"
+#include "scanframe.h"
+
+/*
+ * File layout, little-endian throughout, every chunk starting on an 8 byte boundary:
+ *
+ *   header   "STMARCH\0", u32 version, u32 flags, i64 creation time (Unix seconds)
+ *   chunks   u32 type, u32 payload length, u32 frame number, u32 CRC-32 of the payload, then the payload padded
+ *            with zeros to 8 bytes
+ *   footer   u64 offset of the index chunk, "STMAIDX\0"
+ *
+ *   CHUNK_FRAME  i32 channels, width, height, step, char kind[16], i64 capture time, u32 params length, then the
+ *                #params record's key=value list as text
+ *   CHUNK_LINE   i32 line index, rows, columns (1 + channels), encoding; then the rows, one column after another,
+ *                pixel indices first. ENCODE_RAW columns are i32 arrays, read in place from the map. ENCODE_DELTA
+ *                columns are zigzag varints of each value less the one before it in the column, lossless and
+ *                typically a quarter of the size
+ *   CHUNK_EVENT  i32 line, i32 value, the event name NUL terminated
+ *   CHUNK_END    i32 status (noEndStatus if the stream stopped before #end), i32 lines, missing rows, malformed
+ *                rows (-1 where no acquisition daemon counted them)
+ *   CHUNK_INDEX  u32 frames, u32 line chunks; per frame u64 FRAME and END chunk offsets (0 if none), u32 first
+ *                line chunk, u32 line chunks; per line chunk u64 offset, i32 line index, i32 rows
+ *
+ * A frame's chunks are contiguous, in the order the head sent them; a line sent again after a retry, or in parts
+ * around a pause, has a chunk per transmission. The writer appends chunks as the stream arrives and writes the
+ * index and footer on close. A capture that died before then leaves no footer, and the reader rebuilds the index
+ * by walking the chunks up to the last whole one.
+ */
+
+static const uint32_t archiveVersion = 1;
+
+enum ArchiveChunk {
+    CHUNK_FRAME = 0x4d415246, // "FRAM"
+    CHUNK_LINE = 0x454e494c,  // "LINE"
+    CHUNK_EVENT = 0x544e5645, // "EVNT"
+    CHUNK_END = 0x20444e45,   // "END "
+    CHUNK_INDEX = 0x58444e49  // "INDX"
+};
+
+enum ArchiveEncoding {
+    ENCODE_RAW,
+    ENCODE_DELTA
+};
+
+struct archive_line_struct {
+    uint64_t offset;
+    int lineIndex;
+    int rows;
+};
+
+struct archive_event_struct {
+    uint64_t offset; // of its chunk, placing it among the lines
+    std::string name;
+    int line;
+    int value;
+};
+
+// a frame as listed in the index, its header and end chunks decoded
+struct ArchiveFrame {
+    int channels = 0;
+    int width = 0;
+    int height = 0;
+    int step = 0;
+    std::string kind;
+    int64_t captureTime = 0;
+    std::string params;   // key=value,key=value...
+
+    int endStatus = noEndStatus;
+    int linesReceived = -1;
+    int rowsMissing = -1;
+    int rowsMalformed = -1;
+
+    uint64_t offset = 0;  // FRAME chunk
+    uint64_t endOffset = 0;
+    std::vector<archive_line_struct> lines;
+
+    std::string param(const char *key) const;
+};
+
+class ArchiveWriter
+{
+    public:
+        ArchiveWriter();
+        ~ArchiveWriter();
+
+        int open(const char *path, int encoding);
+        int beginFrame(int channels, int width, int height, int step, const char *kind, const std::string &params);
+        int writeLine(int lineIndex, const int *pixels, const int *values, int rows);
+        int writeEvent(const char *name, int line, int value);
+        int endFrame(int status, int lines, int missing, int malformed);
+        int flush();
+        int close();
+
+        bool isOpen() { return file != NULL; }
+        int frames() { return (int) index.size(); }
+        long bytesWritten;
+        long rawBytes;      // the lines as ENCODE_RAW would have taken
+
+    private:
+        struct index_struct {
+            uint64_t offset;
+            uint64_t endOffset;
+            uint32_t firstLine;
+            uint32_t numLines;
+        };
+
+        FILE *file;
+        int encoding;
+        int numColumns;     // of the open frame
+        bool inFrame;
+        std::vector<index_struct> index;
+        std::vector<archive_line_struct> lines;
+        std::vector<uint8_t> payload;
+
+        int writeChunk(uint32_t type, const uint8_t *data, size_t length);
+};
+
+class ArchiveReader
+{
+    public:
+        ArchiveReader();
+        ~ArchiveReader();
+
+        int open(const char *path);
+        void close();
+
+        int numFrames() { return (int) frames.size(); }
+        const ArchiveFrame &frame(int i) { return frames[i]; }
+        bool recovered;     // the index was rebuilt, the file has no footer
+
+        int readLine(int frameIndex, int entry, std::vector<int> &pixels, std::vector<int> &values);
+        const int32_t *rawColumn(int frameIndex, int entry, int column);
+        int readFrame(int frameIndex, ScanFrame &out);
+        std::vector<archive_event_struct> events(int frameIndex);
+
+    private:
+        const uint8_t *map;
+        size_t size;
+        std::vector<ArchiveFrame> frames;
+
+        bool chunkAt(uint64_t offset, uint32_t *type, uint32_t *length, const uint8_t **payload);
+        int readIndex();
+        void rebuildIndex();
+        void decodeFrame(ArchiveFrame &frame);
+};
+
+/*
+ * Packs scan stream text into an archive, a line at a time: a capture's serial lines, or a frame file saved by
+ * the acquisition daemon, whose #received record supplies the loss counts. #zline records are stored decoded, as
+ * the rows they carry. Text outside frames is skipped.
+ */
+
+class StreamArchiver
+{
+    public:
+        StreamArchiver(ArchiveWriter &writer);
+
+        int feed(const char *line, size_t length);
+        int finish();
+
+    private:
+        ArchiveWriter &writer;
+        bool inFrame;
+        bool headerWritten;
+        bool ended;         // #end seen, waiting for a #received
+        int channels, width, height, step, numColumns;
+        int endStatus;
+        std::string kind;
+        std::string params;
+        int lineIndex;
+        std::vector<int> pixels;
+        std::vector<int> values;
+        LineDecoder decoder;
+
+        int writeHeader();
+        int flushLine();
+        int closeFrame(int lines, int missing, int malformed);
+};
+
+bool isArchive(const char *path);
+int readArchiveFrames(const char *path, std::vector<ScanFrame> &frames);
+
+#endif
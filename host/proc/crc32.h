@@ -0,0 +1,35 @@
+/*
+ * crc32.h
+ * CRC-32 as PNG and zip use it, for the PNG writer and the archive's chunks
+ */
+
+#ifndef crc32_h
+#define crc32_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+inline std::vector<uint32_t> crcTable() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        table[n] = c;
+    }
+    return table;
+}
+
+/*!
+ * \brief CRC-32 of data, continuing from crc, 0 to start
+ */
+inline uint32_t crc32(const uint8_t *data, size_t length, uint32_t crc) {
+    // built once, safely, by whichever thread gets here first
+    static const std::vector<uint32_t> table = crcTable();
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * export.cpp
+ * Writes images as 16-bit grayscale PNG and as NumPy float arrays
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "crc32.h"
+#include "export.h"
+#include "kernels.h"
+
+void imageRange(const Image &image, float lowPercent, float highPercent, float *low, float *high) {
+    /*!
+     * \brief values at two percentiles of the image, from a sample of its pixels
+     * @param lowPercent percentile for low, 0 to 100
+     * @param highPercent percentile for high
+     */
+
+    if (image.data.empty()) {
+        *low = 0;
+        *high = 1;
+        return;
+    }
+
+    std::vector<float> sample;
+    size_t stride = std::max((size_t) 1, image.data.size() / 262144);
+    for (size_t i = 0; i < image.data.size(); i += stride) sample.push_back(image.data[i]);
+
+    size_t lowIndex = std::min(sample.size() - 1, (size_t) (lowPercent / 100 * sample.size()));
+    size_t highIndex = std::min(sample.size() - 1, (size_t) (highPercent / 100 * sample.size()));
+    std::nth_element(sample.begin(), sample.begin() + lowIndex, sample.end());
+    *low = sample[lowIndex];
+    std::nth_element(sample.begin(), sample.begin() + highIndex, sample.end());
+    *high = sample[highIndex];
+    if (*high <= *low) *high = *low + 1;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t length) {
+    uint32_t a = 1, b = 0;
+    while (length > 0) {
+        // the largest run before b can overflow
+        size_t run = std::min(length, (size_t) 5552);
+        for (size_t i = 0; i < run; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += run;
+        length -= run;
+    }
+    return (b << 16) | a;
+}
+
+static void putBigEndian(std::vector<uint8_t> &out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+static void putChunk(std::vector<uint8_t> &out, const char *type, const std::vector<uint8_t> &data) {
+    putBigEndian(out, data.size());
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    putBigEndian(out, crc32(&out[start], out.size() - start, 0));
+}
+
+int writePng16(const char *path, const Image &image, float low, float high) {
+    /*!
+     * \brief writes the image as a 16-bit grayscale PNG, low as black and high as white
+     * @return 0, -1 if the file could not be written
+     */
+
+    int width = image.width;
+    int height = image.height;
+    if (width <= 0 || height <= 0) return -1;
+
+    // scanlines: filter type 0, then big-endian samples
+    size_t lineBytes = 1 + (size_t) width * 2;
+    std::vector<uint8_t> raw(lineBytes * height);
+    std::vector<uint16_t> samples(width);
+    float scale = 65535 / (high - low);
+    for (int y = 0; y < height; y++) {
+        quantize16(image.row(y), width, low, scale, samples.data());
+        uint8_t *line = &raw[lineBytes * y];
+        line[0] = 0;
+        for (int x = 0; x < width; x++) {
+            line[1 + 2 * x] = samples[x] >> 8;
+            line[2 + 2 * x] = samples[x] & 0xff;
+        }
+    }
+
+    // zlib stream of stored deflate blocks
+    std::vector<uint8_t> zlib;
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+    size_t offset = 0;
+    do {
+        size_t length = std::min(raw.size() - offset, (size_t) 65535);
+        bool last = offset + length == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(length & 0xff);
+        zlib.push_back(length >> 8);
+        zlib.push_back(~length & 0xff);
+        zlib.push_back((~length >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+        offset += length;
+    } while (offset < raw.size());
+    putBigEndian(zlib, adler32(raw.data(), raw.size()));
+
+    std::vector<uint8_t> header;
+    putBigEndian(header, width);
+    putBigEndian(header, height);
+    const uint8_t format[5] = {16, 0, 0, 0, 0}; // bit depth, grayscale, deflate, no filter choice, no interlace
+    header.insert(header.end(), format, format + 5);
+
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::vector<uint8_t> png(signature, signature + 8);
+    putChunk(png, "IHDR", header);
+    putChunk(png, "IDAT", zlib);
+    putChunk(png, "IEND", std::vector<uint8_t>());
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return -1;
+    size_t written = fwrite(png.data(), 1, png.size(), file);
+    if (fclose(file) != 0 || written != png.size()) return -1;
+    return 0;
+}
+
+int writeNpy(const char *path, const Image &image) {
+    /*!
+     * \brief writes the image as a float32 .npy array of shape (height, width)
+     * @return 0, -1 if the file could not be written
+     */
+
+    char dict[128];
+    int dictLength = snprintf(dict, sizeof(dict), "{'descr': '<f4', 'fortran_order': False, 'shape': (%d, %d), }",
+            image.height, image.width);
+
+    // magic, version 1.0, header length, then the dictionary padded with spaces to a 64 byte boundary
+    std::string header("\x93NUMPY\x01\x00", 8);
+    int padded = (10 + dictLength + 1 + 63) / 64 * 64;
+    int headerLength = padded - 10;
+    header += (char) (headerLength & 0xff);
+    header += (char) (headerLength >> 8);
+    header.append(dict, dictLength);
+    header.append(padded - header.size() - 1, ' ');
+    header += '\n';
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return -1;
+    size_t written = fwrite(header.data(), 1, header.size(), file);
+    written += fwrite(image.data.data(), sizeof(float), image.data.size(), file) * sizeof(float);
+    if (fclose(file) != 0 || written != header.size() + image.data.size() * sizeof(float)) return -1;
+    return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * export.h
+ * Writes images as 16-bit grayscale PNG and as NumPy float arrays
+ */
+
+#ifndef export_h
+#define export_h
+
+#include "scanframe.h"
+
+/*
+ * The PNG is for viewing: values between low and high map onto 0 to 65535, and imageRange() picks the two from
+ * percentiles so a few spikes do not flatten the contrast. Its deflate stream is stored, not compressed, which
+ * every reader accepts and costs no time. The .npy file keeps the float values as they are, row 0 first, for
+ * NumPy, Gwyddion's raw import or anything else that reads a header and a float32 array.
+ */
+
+void imageRange(const Image &image, float lowPercent, float highPercent, float *low, float *high);
+int writePng16(const char *path, const Image &image, float low, float high);
+int writeNpy(const char *path, const Image &image);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * fftfilter.cpp
+ * Spatial frequency filtering of images with a 2D FFT
+ */
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "fftfilter.h"
+#include "kernels.h"
+#include "parallel.h"
+
+void fft(float *data, int n, bool inverse) {
+    /*!
+     * \brief in-place radix-2 FFT, unscaled
+     * @param *data n complex values, real and imaginary interleaved
+     * @param n a power of two
+     */
+
+    // twiddles, kept per thread for the length last used
+    static thread_local std::vector<float> twiddles;
+    static thread_local int twiddleLength = 0;
+    if (twiddleLength != n) {
+        twiddles.resize(n);
+        for (int k = 0; k < n / 2; k++) {
+            double angle = -2 * M_PI * k / n;
+            twiddles[2 * k] = cos(angle);
+            twiddles[2 * k + 1] = sin(angle);
+        }
+        twiddleLength = n;
+    }
+
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[2 * i], data[2 * j]);
+            std::swap(data[2 * i + 1], data[2 * j + 1]);
+        }
+    }
+
+    float sign = inverse ? -1 : 1;
+    for (int length = 2; length <= n; length <<= 1) {
+        int half = length / 2;
+        int stride = n / length;
+        for (int i = 0; i < n; i += length) {
+            float *a = data + 2 * i;
+            float *b = a + 2 * half;
+            for (int k = 0; k < half; k++) {
+                float wr = twiddles[2 * k * stride];
+                float wi = sign * twiddles[2 * k * stride + 1];
+                float tr = b[2 * k] * wr - b[2 * k + 1] * wi;
+                float ti = b[2 * k] * wi + b[2 * k + 1] * wr;
+                b[2 * k] = a[2 * k] - tr;
+                b[2 * k + 1] = a[2 * k + 1] - ti;
+                a[2 * k] += tr;
+                a[2 * k + 1] += ti;
+            }
+        }
+    }
+}
+
+static int nextPowerOfTwo(int n) {
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+static int mirror(int i, int n) {
+    // index into 0 to n - 1, reflected about the last sample
+    if (i < n) return i;
+    return std::max(2 * n - 2 - i, 0);
+}
+
+static float filterGain(int kind, float f, float cutoff, float cutoffHigh) {
+    // fourth order Butterworth magnitude responses
+    float low = kind == FFT_BANDPASS ? cutoffHigh : cutoff;
+    float gain = 1;
+    if (kind != FFT_HIGHPASS) gain *= 1 / sqrtf(1 + powf(f / low, 8));
+    if (kind != FFT_LOWPASS) gain *= f > 0 ? 1 / sqrtf(1 + powf(cutoff / f, 8)) : 0;
+    return gain;
+}
+
+static void transpose(const std::vector<float> &in, int rows, int cols, std::vector<float> &out, int threads) {
+    // complex rows x cols to cols x rows, in blocks that stay in cache
+    const int block = 32;
+    out.resize(in.size());
+    parallelFor(0, (cols + block - 1) / block, threads, [&](int blockCol) {
+        int c0 = blockCol * block;
+        int c1 = std::min(c0 + block, cols);
+        for (int r0 = 0; r0 < rows; r0 += block) {
+            int r1 = std::min(r0 + block, rows);
+            for (int c = c0; c < c1; c++) {
+                for (int r = r0; r < r1; r++) {
+                    out[2 * ((size_t) c * rows + r)] = in[2 * ((size_t) r * cols + c)];
+                    out[2 * ((size_t) c * rows + r) + 1] = in[2 * ((size_t) r * cols + c) + 1];
+                }
+            }
+        }
+    });
+}
+
+void fftFilter(Image &image, int kind, float cutoff, float cutoffHigh, int threads) {
+    /*!
+     * \brief filters the image in spatial frequency
+     * @param kind FFT_LOWPASS, FFT_HIGHPASS or FFT_BANDPASS
+     * @param cutoff in cycles per pixel, the low pass cutoff, or the high pass cutoff of a high or band pass
+     * @param cutoffHigh the low pass cutoff of a band pass
+     */
+
+    int width = image.width;
+    int height = image.height;
+    if (width < 2 || height < 2 || cutoff <= 0) return;
+    int paddedWidth = nextPowerOfTwo(width);
+    int paddedHeight = nextPowerOfTwo(height);
+
+    // rows, mirrored out to the padded size
+    std::vector<float> rows((size_t) 2 * paddedWidth * paddedHeight);
+    parallelFor(0, paddedHeight, threads, [&](int y) {
+        const float *source = image.row(mirror(y, height));
+        float *row = &rows[(size_t) 2 * paddedWidth * y];
+        for (int x = 0; x < paddedWidth; x++) {
+            row[2 * x] = source[mirror(x, width)];
+            row[2 * x + 1] = 0;
+        }
+        fft(row, paddedWidth, false);
+    });
+
+    // columns, filtered in place of their transform
+    std::vector<float> columns;
+    transpose(rows, paddedHeight, paddedWidth, columns, threads);
+    parallelFor(0, paddedWidth, threads, [&](int u) {
+        float *column = &columns[(size_t) 2 * paddedHeight * u];
+        fft(column, paddedHeight, false);
+
+        float fx = (float) (u <= paddedWidth / 2 ? u : u - paddedWidth) / paddedWidth;
+        std::vector<float> gain(paddedHeight);
+        for (int v = 0; v < paddedHeight; v++) {
+            float fy = (float) (v <= paddedHeight / 2 ? v : v - paddedHeight) / paddedHeight;
+            gain[v] = filterGain(kind, sqrtf(fx * fx + fy * fy), cutoff, cutoffHigh);
+        }
+        scaleComplex(column, gain.data(), paddedHeight);
+
+        fft(column, paddedHeight, true);
+    });
+
+    transpose(columns, paddedWidth, paddedHeight, rows, threads);
+    float scale = 1.0f / ((float) paddedWidth * paddedHeight);
+    parallelFor(0, height, threads, [&](int y) {
+        float *row = &rows[(size_t) 2 * paddedWidth * y];
+        fft(row, paddedWidth, true);
+        float *out = image.row(y);
+        for (int x = 0; x < width; x++) out[x] = row[2 * x] * scale;
+    });
+}
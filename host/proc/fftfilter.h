@@ -0,0 +1,27 @@
+/*
+ * fftfilter.h
+ * Spatial frequency filtering of images with a 2D FFT
+ */
+
+#ifndef fftfilter_h
+#define fftfilter_h
+
+#include "scanframe.h"
+
+/*
+ * The image is mirrored out to a power of two on each side, so its edges do not wrap onto each other, and
+ * transformed a row at a time in parallel, then transposed and transformed again for the columns. The filters are
+ * fourth order Butterworth responses in radial spatial frequency, cycles per pixel from 0 to 0.5: a low pass for
+ * noise, a high pass for the slow background left after flattening, a band pass for both.
+ */
+
+enum FftFilterKind {
+    FFT_LOWPASS,
+    FFT_HIGHPASS,
+    FFT_BANDPASS
+};
+
+void fft(float *data, int n, bool inverse);
+void fftFilter(Image &image, int kind, float cutoff, float cutoffHigh, int threads);
+
+#endif
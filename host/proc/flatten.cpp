@@ -0,0 +1,158 @@
+/*
+ * flatten.cpp
+ * Levelling: plane and per-line background subtraction, and scar removal
+ */
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "flatten.h"
+#include "kernels.h"
+#include "parallel.h"
+
+void planeFit(const Image &image, int threads, double *offset, double *slopeX, double *slopeY) {
+    /*!
+     * \brief least squares plane through the image, value = offset + slopeX x + slopeY y in pixels
+     */
+
+    int width = image.width;
+    int height = image.height;
+    std::vector<double> rowSum(height), rowSumX(height);
+    parallelFor(0, height, threads, [&](int y) {
+        rowMoments(image.row(y), width, &rowSum[y], &rowSumX[y]);
+    });
+
+    double sum = 0, sumX = 0, sumY = 0;
+    for (int y = 0; y < height; y++) {
+        sum += rowSum[y];
+        sumX += rowSumX[y];
+        sumY += y * rowSum[y];
+    }
+
+    // on a full grid x and y are uncorrelated, so each slope is fit on its own about the centre
+    double n = (double) width * height;
+    double xMean = (width - 1) / 2.0;
+    double yMean = (height - 1) / 2.0;
+    double xVariance = height * (double) width * ((double) width * width - 1) / 12;
+    double yVariance = width * (double) height * ((double) height * height - 1) / 12;
+    *slopeX = xVariance > 0 ? (sumX - xMean * sum) / xVariance : 0;
+    *slopeY = yVariance > 0 ? (sumY - yMean * sum) / yVariance : 0;
+    *offset = sum / n - *slopeX * xMean - *slopeY * yMean;
+}
+
+void flattenPlane(Image &image, int threads) {
+    /*!
+     * \brief subtracts the least squares plane
+     */
+
+    if (image.data.empty()) return;
+    double offset, slopeX, slopeY;
+    planeFit(image, threads, &offset, &slopeX, &slopeY);
+    parallelFor(0, image.height, threads, [&](int y) {
+        subtractRamp(image.row(y), image.width, offset + slopeY * y, slopeX);
+    });
+}
+
+void flattenLines(Image &image, int order, int threads) {
+    /*!
+     * \brief subtracts each line's own background
+     * @param order 0 for the line's median, 1 for its least squares line
+     */
+
+    if (image.data.empty()) return;
+    int width = image.width;
+    parallelFor(0, image.height, threads, [&](int y) {
+        float *row = image.row(y);
+        if (order == 0) {
+            std::vector<float> sorted(row, row + width);
+            std::nth_element(sorted.begin(), sorted.begin() + width / 2, sorted.end());
+            subtractRamp(row, width, sorted[width / 2], 0);
+            return;
+        }
+
+        double sum, sumX;
+        rowMoments(row, width, &sum, &sumX);
+        double xMean = (width - 1) / 2.0;
+        double xVariance = width * ((double) width * width - 1) / 12;
+        double slope = xVariance > 0 ? (sumX - xMean * sum) / xVariance : 0;
+        double offset = sum / width - slope * xMean;
+
+        // refit without the pixels far off the first fit, so a scar or a step does not tilt the whole line
+        std::vector<float> residuals(width);
+        for (int x = 0; x < width; x++) residuals[x] = fabsf(row[x] - (float) (offset + slope * x));
+        std::vector<float> sorted = residuals;
+        std::nth_element(sorted.begin(), sorted.begin() + width / 2, sorted.end());
+        float limit = 3 * 1.4826f * sorted[width / 2];
+        double n = 0, s = 0, sx = 0, sxx = 0, sxv = 0;
+        for (int x = 0; x < width; x++) {
+            if (residuals[x] > limit) continue;
+            n += 1;
+            s += row[x];
+            sx += x;
+            sxx += (double) x * x;
+            sxv += (double) x * row[x];
+        }
+        double determinant = n * sxx - sx * sx;
+        if (limit > 0 && n > 1 && determinant > 0) {
+            slope = (n * sxv - sx * s) / determinant;
+            offset = (s - slope * sx) / n;
+        }
+        subtractRamp(row, width, offset, slope);
+    });
+}
+
+long removeScars(Image &image, float threshold, int minLength, int threads) {
+    /*!
+     * \brief replaces scars with the mean of the lines above and below
+     * @param threshold in robust standard deviations of the line-to-line differences
+     * @param minLength shortest run along a line that counts as a scar
+     * @return the number of pixels replaced
+     */
+
+    int width = image.width;
+    int height = image.height;
+    if (height < 3) return 0;
+
+    // robust spread of vertical differences, from a sample of them
+    std::vector<float> differences;
+    size_t total = (size_t) width * (height - 1);
+    size_t stride = std::max((size_t) 1, total / 65536);
+    for (size_t i = 0; i < total; i += stride) {
+        differences.push_back(fabsf(image.data[i + width] - image.data[i]));
+    }
+    std::nth_element(differences.begin(), differences.begin() + differences.size() / 2, differences.end());
+    float sigma = 1.4826f * differences[differences.size() / 2];
+    float limit = std::max(threshold * sigma, 1e-6f);
+
+    const Image original = image;
+    std::vector<long> rowReplaced(height, 0);
+    parallelFor(1, height - 1, threads, [&](int y) {
+        const float *above = original.row(y - 1);
+        const float *row = original.row(y);
+        const float *below = original.row(y + 1);
+        float *out = image.row(y);
+
+        int runStart = -1;
+        for (int x = 0; x <= width; x++) {
+            bool scar = false;
+            if (x < width) {
+                float up = row[x] - above[x];
+                float down = row[x] - below[x];
+                scar = up * down > 0 && fabsf(up) > limit && fabsf(down) > limit;
+            }
+            if (scar && runStart < 0) runStart = x;
+            if (scar || runStart < 0) continue;
+
+            if (x - runStart >= minLength) {
+                for (int k = runStart; k < x; k++) out[k] = (above[k] + below[k]) / 2;
+                rowReplaced[y] += x - runStart;
+            }
+            runStart = -1;
+        }
+    });
+
+    long replaced = 0;
+    for (int y = 0; y < height; y++) replaced += rowReplaced[y];
+    return replaced;
+}
@@ -0,0 +1,26 @@
+/*
+ * flatten.h
+ * Levelling: plane and per-line background subtraction, and scar removal
+ */
+
+#ifndef flatten_h
+#define flatten_h
+
+#include "scanframe.h"
+
+/*
+ * flattenPlane() subtracts the least squares plane, the sample tilt. flattenLines() then takes out what differs
+ * from line to line: order 0 subtracts each line's median, which a step edge does not pull, order 1 each line's
+ * least squares line, for drift along the fast axis, refit without the pixels far off the first fit.
+ *
+ * A scar is a stretch of a single line that jumped, a tip change or a lost pixel run, and stands off from the lines
+ * above and below on the same side. removeScars() replaces runs of at least minLength such pixels, further than
+ * threshold times the robust spread of line-to-line differences from both neighbours, with their mean.
+ */
+
+void planeFit(const Image &image, int threads, double *offset, double *slopeX, double *slopeY);
+void flattenPlane(Image &image, int threads);
+void flattenLines(Image &image, int order, int threads);
+long removeScars(Image &image, float threshold, int minLength, int threads);
+
+#endif
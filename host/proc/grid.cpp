@@ -0,0 +1,352 @@
+/*
+ * grid.cpp
+ * Builds images from frames: raster pixels as commanded, resampled at the measured positions, or scattered samples
+ */
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "scanchannels.h"
+#include "grid.h"
+#include "parallel.h"
+
+// a raster frame's pixels in grid order, later rows of a pixel replacing earlier ones
+struct raster_struct {
+    int width;
+    int height;              // lines up to the last one received
+    std::vector<float> value;
+    std::vector<float> x;    // measured positions, if the frame has them
+    std::vector<float> y;
+    std::vector<unsigned char> have;
+};
+
+static float channelSign(int channel) {
+    return (1 << channel) == CH_ZPOS ? -1 : 1;
+}
+
+static void placeRaster(const ScanFrame &frame, int channel, bool positions, raster_struct &raster) {
+    int offset = frame.channelOffset(channel);
+    int xOffset = frame.channelOffset(0);
+    int yOffset = frame.channelOffset(1);
+    int width = frame.width;
+    size_t size = (size_t) width * frame.height;
+    float sign = channelSign(channel);
+
+    raster.width = width;
+    raster.height = 0;
+    raster.value.assign(size, 0);
+    raster.have.assign(size, 0);
+    if (positions) {
+        raster.x.assign(size, 0);
+        raster.y.assign(size, 0);
+    }
+
+    for (int r = 0; r < frame.numRows(); r++) {
+        int pixel = frame.pixels[r];
+        if (pixel < 0 || (size_t) pixel >= size) continue;
+        int line = pixel / width;
+        int i = pixel % width;
+        size_t index = (size_t) line * width + (line % 2 == 0 ? i : width - 1 - i);
+
+        const int *values = &frame.values[(size_t) r * frame.numChannels];
+        raster.value[index] = sign * values[offset];
+        raster.have[index] = 1;
+        if (positions) {
+            raster.x[index] = values[xOffset];
+            raster.y[index] = values[yOffset];
+        }
+        if (line + 1 > raster.height) raster.height = line + 1;
+    }
+}
+
+static void fillGaps(Image &image, const std::vector<unsigned char> &have, int threads) {
+    // along each row between received pixels, then whole rows from the nearest row that has any
+    std::vector<unsigned char> rowEmpty(image.height, 0);
+
+    parallelFor(0, image.height, threads, [&](int y) {
+        float *row = image.row(y);
+        const unsigned char *rowHave = &have[(size_t) y * image.width];
+        int previous = -1;
+        for (int x = 0; x < image.width; x++) {
+            if (!rowHave[x]) continue;
+            for (int k = previous + 1; k < x; k++) {
+                if (previous < 0) row[k] = row[x];
+                else row[k] = row[previous] + (row[x] - row[previous]) * (k - previous) / (x - previous);
+            }
+            previous = x;
+        }
+        if (previous < 0) {
+            rowEmpty[y] = 1;
+            return;
+        }
+        for (int k = previous + 1; k < image.width; k++) row[k] = row[previous];
+    });
+
+    int source = -1;
+    for (int y = 0; y < image.height && source < 0; y++) {
+        if (!rowEmpty[y]) source = y;
+    }
+    if (source < 0) return;
+    for (int y = 0; y < image.height; y++) {
+        if (!rowEmpty[y]) source = y;
+        else memcpy(image.row(y), image.row(source), image.width * sizeof(float));
+    }
+}
+
+Image rasterImage(const ScanFrame &frame, int channel, int threads) {
+    /*!
+     * \brief a raster frame's pixels at their commanded positions
+     * @param channel channel index, see scanchannels.h
+     * @return the image, empty if the frame does not carry the channel or has no pixels
+     */
+
+    if (frame.channelOffset(channel) < 0 || frame.width <= 0) return Image();
+
+    raster_struct raster;
+    placeRaster(frame, channel, false, raster);
+    if (raster.height == 0) return Image();
+
+    Image image;
+    image.width = raster.width;
+    image.height = raster.height;
+    image.step = frame.step;
+    raster.value.resize((size_t) raster.width * raster.height);
+    raster.have.resize(raster.value.size());
+    image.data.swap(raster.value);
+
+    fillGaps(image, raster.have, threads);
+    return image;
+}
+
+// linear interpolation at t through points sorted by position, held at the ends
+static float interpolate(const float *position, const float *value, int n, float t, int *cursor) {
+    if (t <= position[0]) return value[0];
+    if (t >= position[n - 1]) return value[n - 1];
+    int k = *cursor;
+    while (k + 1 < n - 1 && position[k + 1] <= t) k++;
+    *cursor = k;
+    float span = position[k + 1] - position[k];
+    if (span <= 0) return value[k];
+    return value[k] + (value[k + 1] - value[k]) * (t - position[k]) / span;
+}
+
+struct point_struct {
+    float position;
+    float other;
+    float value;
+    bool operator<(const point_struct &p) const { return position < p.position; }
+};
+
+static float medianOf(std::vector<float> &v) {
+    if (v.empty()) return 0;
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+}
+
+Image regridActual(const ScanFrame &frame, int channel, int threads) {
+    /*!
+     * \brief a raster frame resampled at the positions the head measured, onto the commanded grid
+     * @param channel channel index, see scanchannels.h
+     * @return the image, empty if the frame lacks x, y or the channel
+     */
+
+    if (frame.channelOffset(channel) < 0 || frame.channelOffset(0) < 0 || frame.channelOffset(1) < 0) return Image();
+    if (frame.width <= 0 || frame.step <= 0) return Image();
+
+    raster_struct raster;
+    placeRaster(frame, channel, true, raster);
+    if (raster.height == 0) return Image();
+
+    int width = raster.width;
+    int height = raster.height;
+    float step = frame.step;
+
+    // the grid origin that best fits the measured positions
+    std::vector<float> xOrigins, yOrigins;
+    for (int line = 0; line < height; line++) {
+        for (int col = 0; col < width; col += 4) {
+            size_t index = (size_t) line * width + col;
+            if (!raster.have[index]) continue;
+            xOrigins.push_back(raster.x[index] - col * step);
+            yOrigins.push_back(raster.y[index] - line * step);
+        }
+    }
+    float xOrigin = medianOf(xOrigins);
+    float yOrigin = medianOf(yOrigins);
+
+    // each line onto the grid columns, with the y it was measured at there
+    std::vector<float> lineValue((size_t) width * height), lineY((size_t) width * height);
+    std::vector<unsigned char> lineUsable(height, 0);
+    parallelFor(0, height, threads, [&](int line) {
+        std::vector<point_struct> points;
+        points.reserve(width);
+        for (int col = 0; col < width; col++) {
+            size_t index = (size_t) line * width + col;
+            if (!raster.have[index]) continue;
+            point_struct point = {raster.x[index], raster.y[index], raster.value[index]};
+            points.push_back(point);
+        }
+        if (points.size() < 2) return;
+        lineUsable[line] = 1;
+
+        // hysteresis can fold a line back on itself near the turnaround
+        if (!std::is_sorted(points.begin(), points.end())) std::stable_sort(points.begin(), points.end());
+
+        int n = points.size();
+        std::vector<float> position(n), value(n), other(n);
+        for (int k = 0; k < n; k++) {
+            position[k] = points[k].position;
+            value[k] = points[k].value;
+            other[k] = points[k].other;
+        }
+        int cursorValue = 0, cursorOther = 0;
+        for (int col = 0; col < width; col++) {
+            float t = xOrigin + col * step;
+            lineValue[(size_t) line * width + col] = interpolate(position.data(), value.data(), n, t, &cursorValue);
+            lineY[(size_t) line * width + col] = interpolate(position.data(), other.data(), n, t, &cursorOther);
+        }
+    });
+
+    std::vector<int> lines;
+    for (int line = 0; line < height; line++) {
+        if (lineUsable[line]) lines.push_back(line);
+    }
+    if (lines.empty()) return Image();
+
+    // then each column onto the grid rows
+    Image image(width, height);
+    image.step = step;
+    parallelFor(0, width, threads, [&](int col) {
+        int n = lines.size();
+        std::vector<point_struct> points(n);
+        for (int k = 0; k < n; k++) {
+            size_t index = (size_t) lines[k] * width + col;
+            points[k].position = lineY[index];
+            points[k].value = lineValue[index];
+        }
+        if (!std::is_sorted(points.begin(), points.end())) std::stable_sort(points.begin(), points.end());
+
+        std::vector<float> position(n), value(n);
+        for (int k = 0; k < n; k++) {
+            position[k] = points[k].position;
+            value[k] = points[k].value;
+        }
+        int cursor = 0;
+        for (int row = 0; row < height; row++) {
+            image.data[(size_t) row * width + col] = interpolate(position.data(), value.data(), n,
+                    yOrigin + row * step, &cursor);
+        }
+    });
+
+    return image;
+}
+
+Image regridScattered(const ScanFrame &frame, int channel, int n, int threads) {
+    /*!
+     * \brief cell averages of a frame's samples over the square they span, gaps filled from neighbouring cells
+     * @param channel channel index, see scanchannels.h
+     * @param n image width and height
+     * @return the image, empty if the frame lacks x, y or the channel
+     */
+
+    int offset = frame.channelOffset(channel);
+    int xOffset = frame.channelOffset(0);
+    int yOffset = frame.channelOffset(1);
+    int numRows = frame.numRows();
+    if (offset < 0 || xOffset < 0 || yOffset < 0 || numRows == 0 || n < 2) return Image();
+
+    const int *values = frame.values.data();
+    int numChannels = frame.numChannels;
+    float xMin = values[xOffset], xMax = xMin, yMin = values[yOffset], yMax = yMin;
+    for (int r = 1; r < numRows; r++) {
+        const int *row = values + (size_t) r * numChannels;
+        xMin = std::min(xMin, (float) row[xOffset]);
+        xMax = std::max(xMax, (float) row[xOffset]);
+        yMin = std::min(yMin, (float) row[yOffset]);
+        yMax = std::max(yMax, (float) row[yOffset]);
+    }
+    float cellX = (xMax - xMin) / n + 1e-6;
+    float cellY = (yMax - yMin) / n + 1e-6;
+    float sign = channelSign(channel);
+
+    // each thread sums its share of the samples, then the sums are added up
+    int numParts = std::min(threadCount(threads), std::max(1, numRows / 65536));
+    std::vector<std::vector<double> > sums(numParts);
+    std::vector<std::vector<int> > counts(numParts);
+    parallelFor(0, numParts, numParts, [&](int part) {
+        std::vector<double> &sum = sums[part];
+        std::vector<int> &count = counts[part];
+        sum.assign((size_t) n * n, 0);
+        count.assign((size_t) n * n, 0);
+        int first = (int) ((long) numRows * part / numParts);
+        int last = (int) ((long) numRows * (part + 1) / numParts);
+        for (int r = first; r < last; r++) {
+            const int *row = values + (size_t) r * numChannels;
+            int cx = std::min((int) ((row[xOffset] - xMin) / cellX), n - 1);
+            int cy = std::min((int) ((row[yOffset] - yMin) / cellY), n - 1);
+            sum[(size_t) cy * n + cx] += row[offset];
+            count[(size_t) cy * n + cx] += 1;
+        }
+    });
+
+    Image image(n, n);
+    image.step = (cellX + cellY) / 2;
+    std::vector<unsigned char> filled((size_t) n * n, 0);
+    long numEmpty = 0;
+    for (size_t i = 0; i < (size_t) n * n; i++) {
+        double sum = 0;
+        int count = 0;
+        for (int part = 0; part < numParts; part++) {
+            sum += sums[part][i];
+            count += counts[part][i];
+        }
+        if (count > 0) {
+            image.data[i] = sign * sum / count;
+            filled[i] = 1;
+        }
+        else numEmpty += 1;
+    }
+
+    // empty cells, between spiral turns and outside the spiral, take the mean of their filled neighbours, growing
+    // inward from the sampled cells
+    std::vector<float> next = image.data;
+    std::vector<unsigned char> nextFilled = filled;
+    std::vector<int> rowFilled(n);
+    while (numEmpty > 0) {
+        parallelFor(0, n, threads, [&](int cy) {
+            rowFilled[cy] = 0;
+            for (int cx = 0; cx < n; cx++) {
+                size_t index = (size_t) cy * n + cx;
+                next[index] = image.data[index];
+                nextFilled[index] = filled[index];
+                if (filled[index]) continue;
+
+                float neighbourSum = 0;
+                int neighbours = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = cx + dx;
+                        int ny = cy + dy;
+                        if (nx < 0 || ny < 0 || nx >= n || ny >= n || !filled[(size_t) ny * n + nx]) continue;
+                        neighbourSum += image.data[(size_t) ny * n + nx];
+                        neighbours += 1;
+                    }
+                }
+                if (neighbours > 0) {
+                    next[index] = neighbourSum / neighbours;
+                    nextFilled[index] = 1;
+                    rowFilled[cy] += 1;
+                }
+            }
+        });
+
+        image.data.swap(next);
+        filled.swap(nextFilled);
+        long newlyFilled = 0;
+        for (int cy = 0; cy < n; cy++) newlyFilled += rowFilled[cy];
+        numEmpty -= newlyFilled;
+    }
+
+    return image;
+}
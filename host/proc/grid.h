@@ -0,0 +1,26 @@
+/*
+ * grid.h
+ * Builds images from frames: raster pixels as commanded, resampled at the measured positions, or scattered samples
+ */
+
+#ifndef grid_h
+#define grid_h
+
+#include "scanframe.h"
+
+/*
+ * rasterImage() places a ScanJob frame's pixels at their commanded grid positions, undoing the serpentine order
+ * the way framePixel() does on the head. regridActual() resamples the same frame at the x and y the head measured
+ * for each pixel: every line is interpolated onto the commanded columns first, then every column onto the
+ * commanded rows, which takes out piezo hysteresis and creep that the commanded positions hide. regridScattered()
+ * averages the samples of a spiral, Lissajous or track frame into an n x n grid and fills the cells between them.
+ *
+ * Z is gridded as height, negated, as on the head's preview. Pixels the stream lost are filled from their
+ * neighbours, and lines after the last one received are cropped, so every image is dense.
+ */
+
+Image rasterImage(const ScanFrame &frame, int channel, int threads);
+Image regridActual(const ScanFrame &frame, int channel, int threads);
+Image regridScattered(const ScanFrame &frame, int channel, int n, int threads);
+
+#endif
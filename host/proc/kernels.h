@@ -0,0 +1,120 @@
+/*
+ * kernels.h
+ * Vectorized row kernels the processing steps are built on
+ */
+
+#ifndef kernels_h
+#define kernels_h
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Eight float lanes with GCC and Clang vector extensions, which compile to SSE/AVX on x86 and NEON on ARM without
+ * intrinsics for either. Rows are processed a vector at a time with a scalar tail, unaligned. Sums are kept per lane
+ * and only added across lanes at the end, so a 1024 pixel row is eight independent chains of 128.
+ */
+
+typedef float vfloat __attribute__((vector_size(32)));
+static const int lanes = 8;
+
+inline vfloat loadLanes(const float *p) {
+    vfloat v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void storeLanes(float *p, vfloat v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+inline vfloat splat(float x) {
+    vfloat v = {x, x, x, x, x, x, x, x};
+    return v;
+}
+
+inline float sumLanes(vfloat v) {
+    float sum = 0;
+    for (int i = 0; i < lanes; i++) sum += v[i];
+    return sum;
+}
+
+/*!
+ * \brief sums of a row and of the row weighted by its index, for least squares line fits
+ * @param *row n values
+ * @param *sum sum of row[i]
+ * @param *sumI sum of i row[i]
+ */
+inline void rowMoments(const float *row, int n, double *sum, double *sumI) {
+    vfloat s = splat(0), si = splat(0);
+    vfloat index = {0, 1, 2, 3, 4, 5, 6, 7};
+    const vfloat stride = splat(lanes);
+    int i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        vfloat v = loadLanes(row + i);
+        s += v;
+        si += v * index;
+        index += stride;
+    }
+    double total = sumLanes(s);
+    double totalI = sumLanes(si);
+    for (; i < n; i++) {
+        total += row[i];
+        totalI += (double) i * row[i];
+    }
+    *sum = total;
+    *sumI = totalI;
+}
+
+/*!
+ * \brief subtracts offset + slope i from row[i]
+ */
+inline void subtractRamp(float *row, int n, float offset, float slope) {
+    vfloat ramp = {0, slope, 2 * slope, 3 * slope, 4 * slope, 5 * slope, 6 * slope, 7 * slope};
+    ramp += splat(offset);
+    const vfloat stride = splat(lanes * slope);
+    int i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        storeLanes(row + i, loadLanes(row + i) - ramp);
+        ramp += stride;
+    }
+    for (; i < n; i++) row[i] -= offset + slope * i;
+}
+
+/*!
+ * \brief multiplies n interleaved complex values by a real gain each
+ * @param *complex 2n floats, real and imaginary
+ * @param *gain n gains
+ */
+inline void scaleComplex(float *complex, const float *gain, int n) {
+    int i = 0;
+    for (; i + lanes / 2 <= n; i += lanes / 2) {
+        vfloat g = {gain[i], gain[i], gain[i + 1], gain[i + 1], gain[i + 2], gain[i + 2], gain[i + 3], gain[i + 3]};
+        storeLanes(complex + 2 * i, loadLanes(complex + 2 * i) * g);
+    }
+    for (; i < n; i++) {
+        complex[2 * i] *= gain[i];
+        complex[2 * i + 1] *= gain[i];
+    }
+}
+
+/*!
+ * \brief maps (v - low) * scale onto 0 to 65535, clamped
+ */
+inline void quantize16(const float *row, int n, float low, float scale, uint16_t *out) {
+    const vfloat vlow = splat(low), vscale = splat(scale), zero = splat(0), top = splat(65535);
+    int i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        vfloat v = (loadLanes(row + i) - vlow) * vscale;
+        v = v < zero ? zero : v;
+        v = v > top ? top : v;
+        for (int k = 0; k < lanes; k++) out[i + k] = (uint16_t) (v[k] + 0.5f);
+    }
+    for (; i < n; i++) {
+        float v = (row[i] - low) * scale;
+        v = v < 0 ? 0 : (v > 65535 ? 65535 : v);
+        out[i] = (uint16_t) (v + 0.5f);
+    }
+}
+
+#endif
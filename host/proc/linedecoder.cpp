@@ -0,0 +1,159 @@
+/*
+ * linedecoder.cpp
+ * Decodes the head's Rice coded #zline records back into data rows
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "linecodec.cpp"
+#include "linedecoder.h"
+#include "scanframe.h"
+
+// six bit value of each digit, -1 for characters that are not digits
+struct digit_table_struct {
+    int8_t value[256];
+
+    digit_table_struct() {
+        memset(value, -1, sizeof(value));
+        for (int i = 0; i < 64; i++) value[(uint8_t) lineCodeDigits[i]] = i;
+    }
+};
+
+static const digit_table_struct digitTable;
+
+// reads the bit string of a record most significant bit first, refilling six bits per digit
+struct bit_reader_struct {
+    const char *p;
+    const char *end;
+    uint64_t bits = 0;
+    int count = 0;
+    bool failed = false;
+
+    bit_reader_struct(const char *p, const char *end) : p(p), end(end) {}
+
+    void refill() {
+        while (count <= 58 && p < end) {
+            int digit = digitTable.value[(uint8_t) *p++];
+            if (digit < 0) failed = true;
+            bits = (bits << 6) | (uint64_t) (digit & 63);
+            count += 6;
+        }
+    }
+
+    uint32_t read(int n) {
+        if (n == 0) return 0;
+        if (count < n) refill();
+        if (count < n) {
+            failed = true;
+            return 0;
+        }
+        count -= n;
+        return (uint32_t) ((bits >> count) & (((uint64_t) 1 << n) - 1));
+    }
+
+    uint32_t readRice(int k) {
+        if (count < lineCodeMaxUnary + 32) refill();
+        int quotient = 0;
+        while (quotient < lineCodeMaxUnary && read(1) == 1) quotient++;
+        if (quotient == lineCodeMaxUnary) return read(32);
+        return ((uint32_t) quotient << k) | read(k);
+    }
+};
+
+LineDecoder::LineDecoder() {
+    numChannels = 0;
+    sequence = -1;
+    referenceRows = 0;
+}
+
+void LineDecoder::beginFrame(int channels) {
+    /*!
+     * \brief forgets the reference at a #frame header
+     * @param channels the header's channel mask
+     */
+
+    numChannels = channelCount(channels);
+    sequence = -1;
+    referenceRows = 0;
+    reference.clear();
+}
+
+int LineDecoder::decode(const char *fields, const char *end, int *lineIndex, std::vector<int> &pixels,
+        std::vector<int> &values) {
+    /*!
+     * \brief decodes one #zline record
+     * @param fields the record after "#zline,", up to end
+     * @param lineIndex set to the record's line index
+     * @param pixels, values the rows, replacing their contents: a pixel index per row, and numChannels values
+     * @return the number of rows, -1 if the record is malformed or its reference was not decoded
+     */
+
+    pixels.clear();
+    values.clear();
+
+    // line, first pixel, rows, sequence, referenced, a code per channel, then the digits
+    const char *digits = end;
+    while (digits > fields && digits[-1] != ',') digits--;
+    int header[5 + numScanChannels];
+    int numFields = digits > fields ? parseIntFields(fields, digits - 1, header, 5 + numScanChannels) : -1;
+    if (numFields != 5 + numChannels) {
+        sequence = -1;
+        return -1;
+    }
+
+    *lineIndex = header[0];
+    int firstPixel = header[1];
+    int rows = header[2];
+    int recordSequence = header[3];
+    bool referenced = header[4] != 0;
+    const int *codes = header + 5;
+
+    // every value takes at least a bit, which bounds the rows before anything is allocated
+    if (rows < 0 || (long) rows * numChannels > (long) (end - digits) * 6) {
+        sequence = -1;
+        return -1;
+    }
+    if (referenced && (sequence < 0 || sequence != recordSequence - 1 || referenceRows == 0)) {
+        sequence = -1;
+        return -1;
+    }
+    for (int ch = 0; ch < numChannels; ch++) {
+        int predictor = codes[ch] >> 5;
+        if (codes[ch] < 0 || predictor >= numLinePredictors) {
+            sequence = -1;
+            return -1;
+        }
+        if (predictor != PREDICT_LEFT && (!referenced || referenceRows != rows)) {
+            sequence = -1;
+            return -1;
+        }
+    }
+
+    const int *ref = referenced ? reference.data() : NULL;
+    int refRows = referenced ? referenceRows : 0;
+    pixels.resize(rows);
+    values.resize((size_t) rows * numChannels);
+    bit_reader_struct reader(digits, end);
+
+    for (int pixel = 0; pixel < rows; pixel++) {
+        pixels[pixel] = firstPixel + pixel;
+        int *row = values.data() + (size_t) pixel * numChannels;
+        const int *left = pixel > 0 ? row - numChannels : NULL;
+        for (int ch = 0; ch < numChannels; ch++) {
+            uint32_t prediction = predictChannel(codes[ch] >> 5, pixel, left, ref, refRows, numChannels, ch);
+            row[ch] = (int) (prediction + unzigzag(reader.readRice(codes[ch] & 31)));
+        }
+    }
+
+    // the padding, and nothing after it
+    if (reader.failed || reader.p != end || reader.count >= 6 || (reader.bits & ((1u << reader.count) - 1)) != 0) {
+        sequence = -1;
+        return -1;
+    }
+
+    sequence = recordSequence;
+    referenceRows = rows;
+    reference = values;
+    return rows;
+}
@@ -0,0 +1,34 @@
+/*
+ * linedecoder.h
+ * Decodes the head's Rice coded #zline records back into data rows
+ */
+
+#ifndef linedecoder_h
+#define linedecoder_h
+
+#include <stddef.h>
+#include <vector>
+
+/*
+ * The coding is described in src/linecodec.cpp, whose predictor the decoder shares. A record predicted from the
+ * one before can only be decoded if that one was, so a record lost from a frame also costs the records after it
+ * up to the next key record, or the next after a line too long for the head to keep.
+ */
+
+class LineDecoder
+{
+    public:
+        LineDecoder();
+
+        void beginFrame(int channels);
+        int decode(const char *fields, const char *end, int *lineIndex, std::vector<int> &pixels,
+                std::vector<int> &values);
+
+    private:
+        int numChannels;
+        int sequence;       // of the last record decoded, -1 if it failed
+        int referenceRows;
+        std::vector<int> reference;
+};
+
+#endif
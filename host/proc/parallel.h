@@ -0,0 +1,46 @@
+/*
+ * parallel.h
+ * Splits a loop over rows, lines or frames across threads
+ */
+
+#ifndef parallel_h
+#define parallel_h
+
+#include <thread>
+#include <vector>
+
+/*!
+ * \brief number of threads to use
+ * @param threads requested threads, 0 for one per core
+ */
+inline int threadCount(int threads) {
+    if (threads > 0) return threads;
+    int cores = (int) std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+}
+
+/*!
+ * \brief runs fn(i) for i from begin to end - 1, in contiguous blocks, one per thread. Returns when all are done
+ * @param threads threads to use, 0 for one per core
+ */
+template<class Fn> void parallelFor(int begin, int end, int threads, Fn fn) {
+    int n = end - begin;
+    threads = threadCount(threads);
+    if (threads > n) threads = n;
+    if (threads <= 1) {
+        for (int i = begin; i < end; i++) fn(i);
+        return;
+    }
+
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++) {
+        int first = begin + (int) ((long) n * t / threads);
+        int last = begin + (int) ((long) n * (t + 1) / threads);
+        pool.push_back(std::thread([first, last, &fn] {
+            for (int i = first; i < last; i++) fn(i);
+        }));
+    }
+    for (size_t t = 0; t < pool.size(); t++) pool[t].join();
+}
+
+#endif
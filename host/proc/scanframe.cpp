@@ -0,0 +1,173 @@
+/*
+ * scanframe.cpp
+ * Frames of a scan stream read back from a file, and the float image they are processed as
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "scanchannels.h"
+#include "archive.h"
+#include "linedecoder.h"
+#include "scanframe.h"
+
+int ScanFrame::channelOffset(int channel) const {
+    /*!
+     * \brief column of a channel within a row's values
+     * @return the offset, -1 if the frame does not carry the channel
+     */
+
+    if (!(channels & (1 << channel))) return -1;
+    return channelCount(channels & ((1 << channel) - 1));
+}
+
+int channelByName(const char *name) {
+    /*!
+     * \brief channel index from its stream name, "z", "current" ...
+     * @return the index, -1 if there is no such channel
+     */
+
+    for (int ch = 0; ch < numScanChannels; ch++) {
+        if (strcmp(scanChannelNames[ch], name) == 0) return ch;
+    }
+    return -1;
+}
+
+static const char *parseInt(const char *p, const char *end, int *value) {
+    // decimal integer, NULL if there is none
+    bool negative = false;
+    if (p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+    if (p >= end || *p < '0' || *p > '9') return NULL;
+    long v = 0;
+    while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+    *value = (int) (negative ? -v : v);
+    return p;
+}
+
+int parseIntFields(const char *p, const char *end, int *fields, int maxFields) {
+    /*!
+     * \brief parses comma separated integers up to end
+     * @return the count, -1 if any is not a number or there are more than maxFields
+     */
+
+    int count = 0;
+    while (p < end) {
+        if (count == maxFields) return -1;
+        p = parseInt(p, end, &fields[count]);
+        if (p == NULL) return -1;
+        count += 1;
+        if (p < end && *p != ',') return -1;
+        if (p < end) p++;
+    }
+    return count;
+}
+
+int parseFrames(const char *text, size_t length, std::vector<ScanFrame> &frames) {
+    /*!
+     * \brief parses every frame in a stream, skipping text between them. Malformed rows and #zline records are
+     *        dropped
+     * @param frames the frames are appended here
+     * @return the number of frames appended
+     */
+
+    const char *p = text;
+    const char *textEnd = text + length;
+    ScanFrame *frame = NULL;
+    int appended = 0;
+    bool started = false; // a data row or #line seen, after which events no longer set the kind
+    LineDecoder decoder;
+    std::vector<int> pixels, values;
+
+    while (p < textEnd) {
+        const char *end = (const char *) memchr(p, '\n', textEnd - p);
+        if (end == NULL) end = textEnd;
+        const char *next = end + 1;
+        if (end > p && end[-1] == '\r') end--;
+
+        int fields[1 + numScanChannels];
+
+        if (*p == '#') {
+            const char *name = p + 1;
+            const char *comma = (const char *) memchr(name, ',', end - name);
+            size_t nameLength = (comma ? comma : end) - name;
+            int numFields = comma ? parseIntFields(comma + 1, end, fields, 4) : 0;
+
+            if (nameLength == 5 && memcmp(name, "frame", 5) == 0 && numFields == 4) {
+                frames.push_back(ScanFrame());
+                frame = &frames.back();
+                frame->channels = fields[0];
+                frame->width = fields[1];
+                frame->height = fields[2];
+                frame->step = fields[3];
+                frame->numChannels = channelCount(frame->channels);
+                frame->values.reserve((size_t) frame->width * frame->height * frame->numChannels);
+                frame->pixels.reserve((size_t) frame->width * frame->height);
+                appended += 1;
+                started = false;
+                decoder.beginFrame(frame->channels);
+            }
+            else if (frame != NULL && nameLength == 3 && memcmp(name, "end", 3) == 0 && numFields == 1) {
+                frame->endStatus = fields[0];
+                frame = NULL;
+            }
+            else if (frame != NULL && nameLength == 6 && memcmp(name, "params", 6) == 0 && comma != NULL) {
+                frame->params.assign(comma + 1, end);
+            }
+            else if (frame != NULL && nameLength == 4 && memcmp(name, "line", 4) == 0) {
+                started = true;
+            }
+            else if (frame != NULL && nameLength == 5 && memcmp(name, "zline", 5) == 0 && comma != NULL) {
+                // a coded line, dropped whole if it or its reference is damaged
+                started = true;
+                int lineIndex;
+                if (decoder.decode(comma + 1, end, &lineIndex, pixels, values) > 0) {
+                    frame->pixels.insert(frame->pixels.end(), pixels.begin(), pixels.end());
+                    frame->values.insert(frame->values.end(), values.begin(), values.end());
+                }
+            }
+            else if (frame != NULL && !started) {
+                std::string event(name, nameLength);
+                if (event == "spiral" || event == "lissajous" || event == "track" || event == "spec") {
+                    frame->kind = event;
+                }
+            }
+        }
+        else if (frame != NULL && *p >= '0' && *p <= '9') {
+            started = true;
+            int numFields = parseIntFields(p, end, fields, 1 + numScanChannels);
+            if (numFields == 1 + frame->numChannels) {
+                frame->pixels.push_back(fields[0]);
+                frame->values.insert(frame->values.end(), fields + 1, fields + numFields);
+            }
+        }
+
+        p = next;
+    }
+
+    return appended;
+}
+
+int readFrames(const char *path, std::vector<ScanFrame> &frames) {
+    /*!
+     * \brief reads a stream file, as saved by the acquisition daemon or captured from the port, or an archive
+     * @return the number of frames appended, -1 if the file could not be read
+     */
+
+    if (isArchive(path)) return readArchiveFrames(path, frames);
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return -1;
+
+    std::vector<char> text;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) text.insert(text.end(), buf, buf + n);
+    bool failed = ferror(file);
+    fclose(file);
+    if (failed) return -1;
+
+    return parseFrames(text.data(), text.size(), frames);
+}
@@ -0,0 +1,57 @@
+/*
+ * scanframe.h
+ * Frames of a scan stream read back from a file, and the float image they are processed as
+ */
+
+#ifndef scanframe_h
+#define scanframe_h
+
+#include <limits.h>
+#include <string>
+#include <vector>
+
+/*
+ * A frame holds its data rows as they arrived: the pixel index the head sent and the channel values, in the
+ * header's bit order. A raster line sent again after a retry repeats its pixel indices, and the later rows win
+ * when the frame is gridded. kind is the event a fast scan, track or spectroscopy frame starts with ("spiral",
+ * "lissajous", "track", "spec"), and "raster" for a ScanJob frame.
+ */
+
+static const int noEndStatus = INT_MIN; // the end status of a frame the stream stopped before #end
+
+struct ScanFrame {
+    int channels = 0;
+    int width = 0;
+    int height = 0;
+    int step = 0;
+    int endStatus = noEndStatus;
+    std::string kind = "raster";
+    std::string params; // the #params record's key=value list
+
+    int numChannels = 0;
+    std::vector<int> pixels; // pixel index of each row
+    std::vector<int> values; // numChannels per row
+
+    int numRows() const { return (int) pixels.size(); }
+    int channelOffset(int channel) const;
+    bool isRaster() const { return kind == "raster"; }
+};
+
+struct Image {
+    int width = 0;
+    int height = 0;
+    float step = 1;          // DAC LSB per pixel
+    std::vector<float> data; // row major, row 0 first
+
+    Image() {}
+    Image(int width, int height) : width(width), height(height), data((size_t) width * height, 0) {}
+    float *row(int y) { return &data[(size_t) y * width]; }
+    const float *row(int y) const { return &data[(size_t) y * width]; }
+};
+
+int readFrames(const char *path, std::vector<ScanFrame> &frames);
+int parseFrames(const char *text, size_t length, std::vector<ScanFrame> &frames);
+int channelByName(const char *name);
+int parseIntFields(const char *p, const char *end, int *fields, int maxFields);
+
+#endif
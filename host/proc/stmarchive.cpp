@@ -0,0 +1,195 @@
+/*
+ * stmarchive.cpp
+ * Packs scan streams into archives, lists them, and writes frames or lines back out as stream text.
+ *
+ * usage: stmarchive pack [-r] archive.stma stream.txt ...   pack captured streams or daemon frame files,
+ *                                                            delta encoded unless -r
+ *        stmarchive list [-p] archive.stma                   one line per frame, -p with its parameters
+ *        stmarchive dump archive.stma [frame [line]]         a frame, or one line of it, as stream text
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+#include "scanchannels.h"
+
+static void usage() {
+    fprintf(stderr,
+            "usage: stmarchive pack [-r] archive.stma stream.txt ...\n"
+            "       stmarchive list [-p] archive.stma\n"
+            "       stmarchive dump archive.stma [frame [line]]\n");
+}
+
+static int pack(int argc, char **argv) {
+    int encoding = ENCODE_DELTA;
+    int first = 0;
+    if (argc > 0 && strcmp(argv[0], "-r") == 0) {
+        encoding = ENCODE_RAW;
+        first = 1;
+    }
+    if (argc - first < 2) {
+        usage();
+        return 1;
+    }
+
+    ArchiveWriter writer;
+    if (writer.open(argv[first], encoding) != 0) {
+        perror(argv[first]);
+        return 1;
+    }
+
+    long textBytes = 0;
+    int status = 0;
+    std::vector<char> line(1 << 16);
+    for (int i = first + 1; i < argc; i++) {
+        FILE *in = fopen(argv[i], "r");
+        if (in == NULL) {
+            perror(argv[i]);
+            status = 1;
+            continue;
+        }
+
+        // each file's frames are closed at its end, a daemon frame file holds one
+        StreamArchiver archiver(writer);
+        while (fgets(line.data(), line.size(), in) != NULL) {
+            size_t length = strlen(line.data());
+            textBytes += length;
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) length--;
+            if (archiver.feed(line.data(), length) != 0) status = 1;
+        }
+        if (archiver.finish() != 0) status = 1;
+        fclose(in);
+    }
+
+    long rawBytes = writer.rawBytes;
+    int frames = writer.frames();
+    if (writer.close() != 0) status = 1;
+    if (status != 0) fprintf(stderr, "stmarchive: write error\n");
+    fprintf(stderr, "stmarchive: %d frames, %ld bytes of text in %ld bytes (%ld raw)\n", frames, textBytes,
+            writer.bytesWritten, rawBytes);
+    return status;
+}
+
+static int list(int argc, char **argv) {
+    bool params = argc == 2 && strcmp(argv[0], "-p") == 0;
+    if (argc != (params ? 2 : 1)) {
+        usage();
+        return 1;
+    }
+    const char *path = argv[argc - 1];
+
+    ArchiveReader reader;
+    if (reader.open(path) < 0) {
+        fprintf(stderr, "%s: not a readable archive\n", path);
+        return 1;
+    }
+    if (reader.recovered) printf("# no index, recovered from the chunks\n");
+
+    for (int i = 0; i < reader.numFrames(); i++) {
+        const ArchiveFrame &frame = reader.frame(i);
+        long rows = 0;
+        for (size_t k = 0; k < frame.lines.size(); k++) rows += frame.lines[k].rows;
+        char stamp[32];
+        time_t when = frame.captureTime;
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&when));
+        printf("%d %s %s %dx%d step=%d channels=%d rows=%ld chunks=%zu", i, stamp, frame.kind.c_str(), frame.width,
+                frame.height, frame.step, frame.channels, rows, frame.lines.size());
+        if (frame.endStatus != noEndStatus) printf(" status=%d", frame.endStatus);
+        else printf(" unended");
+        if (frame.linesReceived >= 0) printf(" missing=%d malformed=%d", frame.rowsMissing, frame.rowsMalformed);
+        printf("\n");
+        if (params && !frame.params.empty()) printf("  %s\n", frame.params.c_str());
+    }
+    return 0;
+}
+
+static void printRows(const std::vector<int> &pixels, const std::vector<int> &values) {
+    size_t numChannels = pixels.empty() ? 0 : values.size() / pixels.size();
+    for (size_t r = 0; r < pixels.size(); r++) {
+        printf("%d", pixels[r]);
+        for (size_t c = 0; c < numChannels; c++) printf(",%d", values[r * numChannels + c]);
+        printf("\n");
+    }
+}
+
+static int dump(int argc, char **argv) {
+    if (argc < 1 || argc > 3) {
+        usage();
+        return 1;
+    }
+
+    ArchiveReader reader;
+    if (reader.open(argv[0]) < 0) {
+        fprintf(stderr, "%s: not a readable archive\n", argv[0]);
+        return 1;
+    }
+    int firstFrame = argc > 1 ? atoi(argv[1]) : 0;
+    int lastFrame = argc > 1 ? firstFrame : reader.numFrames() - 1;
+    int onlyLine = argc > 2 ? atoi(argv[2]) : -1;
+    if (firstFrame < 0 || firstFrame >= reader.numFrames()) {
+        fprintf(stderr, "%s: no frame %d\n", argv[0], firstFrame);
+        return 1;
+    }
+
+    std::vector<int> pixels, values;
+    for (int i = firstFrame; i <= lastFrame; i++) {
+        const ArchiveFrame &frame = reader.frame(i);
+
+        if (onlyLine >= 0) {
+            // every transmission of the line, the last one winning where they overlap
+            for (size_t k = 0; k < frame.lines.size(); k++) {
+                if (frame.lines[k].lineIndex != onlyLine) continue;
+                if (reader.readLine(i, k, pixels, values) < 0) return 1;
+                printRows(pixels, values);
+            }
+            continue;
+        }
+
+        printf("#frame,%d,%d,%d,%d\nstep", frame.channels, frame.width, frame.height, frame.step);
+        for (int ch = 0; ch < numScanChannels; ch++) {
+            if (frame.channels & (1 << ch)) printf(",%s", scanChannelNames[ch]);
+        }
+        printf("\n");
+        if (!frame.params.empty()) printf("#params,%s\n", frame.params.c_str());
+
+        // events and lines in the order they arrived
+        std::vector<archive_event_struct> events = reader.events(i);
+        size_t e = 0;
+        for (size_t k = 0; k <= frame.lines.size(); k++) {
+            uint64_t before = k < frame.lines.size() ? frame.lines[k].offset : UINT64_MAX;
+            for (; e < events.size() && events[e].offset < before; e++) {
+                printf("#%s,%d,%d\n", events[e].name.c_str(), events[e].line, events[e].value);
+            }
+            if (k == frame.lines.size()) break;
+            if (reader.readLine(i, k, pixels, values) < 0) {
+                fprintf(stderr, "%s: frame %d line chunk %zu damaged\n", argv[0], i, k);
+                return 1;
+            }
+            printf("#line,%d\n", frame.lines[k].lineIndex);
+            printRows(pixels, values);
+        }
+        if (frame.endStatus != noEndStatus) printf("#end,%d\n", frame.endStatus);
+        if (frame.linesReceived >= 0) {
+            printf("#received,%d,%d,%d\n", frame.linesReceived, frame.rowsMissing, frame.rowsMalformed);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    if (strcmp(argv[1], "pack") == 0) return pack(argc - 2, argv + 2);
+    if (strcmp(argv[1], "list") == 0) return list(argc - 2, argv + 2);
+    if (strcmp(argv[1], "dump") == 0) return dump(argc - 2, argv + 2);
+    usage();
+    return 1;
+}
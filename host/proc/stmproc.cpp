@@ -0,0 +1,234 @@
+/*
+ * stmproc.cpp
+ * Turns saved scan streams into flattened, filtered images, many frames at once.
+ * Reads frame files as the acquisition daemon saves them, or any captured stream, and writes a 16-bit PNG and a
+ * float32 .npy per frame.
+ *
+ * usage: stmproc [options] stream.txt ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "export.h"
+#include "fftfilter.h"
+#include "flatten.h"
+#include "grid.h"
+#include "parallel.h"
+#include "scanframe.h"
+
+enum GridMode {
+    GRID_AUTO,     // commanded positions for raster frames, scattered for the rest
+    GRID_COMMANDED,
+    GRID_MEASURED,
+    GRID_SCATTERED
+};
+
+struct options_struct {
+    const char *channelName = NULL; // z, or current if the frame has no z
+    int grid = GRID_AUTO;
+    int scatteredSize = 256;
+    bool plane = false;
+    int lineOrder = -1;             // -1 for no line flattening
+    float scarThreshold = 0;        // 0 for no scar removal
+    int scarLength = 4;
+    int filter = -1;
+    float cutoff = 0;
+    float cutoffHigh = 0;
+    std::string directory = ".";
+    bool png = true;
+    bool npy = true;
+    int threads = 0;
+};
+
+static void usage() {
+    fprintf(stderr,
+            "usage: stmproc [options] stream.txt ...\n"
+            "  -c channel     channel to image, default z, or current without z\n"
+            "  -g grid        commanded, measured (resampled at the measured x,y) or scattered; default commanded\n"
+            "                 for raster frames, scattered for spiral, Lissajous and track frames\n"
+            "  -n size        scattered grid size, default 256\n"
+            "  -p             subtract the least squares plane\n"
+            "  -l order       subtract each line's median (0) or least squares line (1)\n"
+            "  -s threshold   remove scars further than threshold robust deviations from both neighbouring lines\n"
+            "  -f filter      lowpass:<cutoff>, highpass:<cutoff> or bandpass:<cutoff>,<cutoff>, in cycles/pixel\n"
+            "  -o directory   output directory, default .\n"
+            "  -x format      png or npy only\n"
+            "  -t threads     default one per core\n");
+}
+
+static int parseFilter(const char *spec, options_struct &options) {
+    if (strncmp(spec, "lowpass:", 8) == 0) {
+        options.filter = FFT_LOWPASS;
+        options.cutoff = atof(spec + 8);
+    }
+    else if (strncmp(spec, "highpass:", 9) == 0) {
+        options.filter = FFT_HIGHPASS;
+        options.cutoff = atof(spec + 9);
+    }
+    else if (strncmp(spec, "bandpass:", 9) == 0) {
+        const char *comma = strchr(spec + 9, ',');
+        if (comma == NULL) return -1;
+        options.filter = FFT_BANDPASS;
+        options.cutoff = atof(spec + 9);
+        options.cutoffHigh = atof(comma + 1);
+        if (options.cutoffHigh <= options.cutoff) return -1;
+    }
+    else return -1;
+    return options.cutoff > 0 && options.cutoff <= 0.5 ? 0 : -1;
+}
+
+static std::string baseName(const char *path) {
+    // file name without directory or extension
+    std::string name = path;
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos) name = name.substr(slash + 1);
+    size_t dot = name.rfind('.');
+    if (dot != std::string::npos && dot > 0) name = name.substr(0, dot);
+    return name;
+}
+
+static int processFrame(const ScanFrame &frame, const std::string &outName, const options_struct &options,
+        int threads, char *report, size_t reportSize) {
+    // grid, level, filter and export one frame. Returns 0, or -1 with the reason in report
+    int channel = channelByName(options.channelName != NULL ? options.channelName : "z");
+    if (options.channelName == NULL && frame.channelOffset(channel) < 0) channel = channelByName("current");
+    if (frame.channelOffset(channel) < 0) {
+        snprintf(report, reportSize, "%s: no %s channel", outName.c_str(), options.channelName ? options.channelName :
+                "z or current");
+        return -1;
+    }
+
+    int grid = options.grid;
+    if (grid == GRID_AUTO) grid = frame.isRaster() ? GRID_COMMANDED : GRID_SCATTERED;
+
+    Image image;
+    if (grid == GRID_COMMANDED) image = rasterImage(frame, channel, threads);
+    else if (grid == GRID_MEASURED) image = regridActual(frame, channel, threads);
+    else image = regridScattered(frame, channel, options.scatteredSize, threads);
+    if (image.data.empty()) {
+        snprintf(report, reportSize, "%s: no %s image in the frame", outName.c_str(),
+                grid == GRID_SCATTERED ? "scattered" : "raster");
+        return -1;
+    }
+
+    if (options.plane) flattenPlane(image, threads);
+    if (options.lineOrder >= 0) flattenLines(image, options.lineOrder, threads);
+    long scars = 0;
+    if (options.scarThreshold > 0) scars = removeScars(image, options.scarThreshold, options.scarLength, threads);
+    if (options.filter >= 0) fftFilter(image, options.filter, options.cutoff, options.cutoffHigh, threads);
+
+    float low, high;
+    imageRange(image, 0.5, 99.5, &low, &high);
+    std::string path = options.directory + "/" + outName;
+    if (options.png && writePng16((path + ".png").c_str(), image, low, high) != 0) {
+        snprintf(report, reportSize, "%s.png: could not write", path.c_str());
+        return -1;
+    }
+    if (options.npy && writeNpy((path + ".npy").c_str(), image) != 0) {
+        snprintf(report, reportSize, "%s.npy: could not write", path.c_str());
+        return -1;
+    }
+
+    snprintf(report, reportSize, "%s: %s %dx%d %s, range %.1f to %.1f, %ld scar pixels", outName.c_str(),
+            frame.kind.c_str(), image.width, image.height, frame.endStatus == 0 ? "complete" : "incomplete", low,
+            high, scars);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    options_struct options;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "-c") == 0 && hasValue) options.channelName = argv[++i];
+        else if (strcmp(argv[i], "-g") == 0 && hasValue) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "commanded") == 0) options.grid = GRID_COMMANDED;
+            else if (strcmp(mode, "measured") == 0) options.grid = GRID_MEASURED;
+            else if (strcmp(mode, "scattered") == 0) options.grid = GRID_SCATTERED;
+            else {
+                usage();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-n") == 0 && hasValue) options.scatteredSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0) options.plane = true;
+        else if (strcmp(argv[i], "-l") == 0 && hasValue) options.lineOrder = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && hasValue) options.scarThreshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && hasValue) {
+            if (parseFilter(argv[++i], options) != 0) {
+                usage();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-o") == 0 && hasValue) options.directory = argv[++i];
+        else if (strcmp(argv[i], "-x") == 0 && hasValue) {
+            const char *format = argv[++i];
+            options.png = strcmp(format, "png") == 0;
+            options.npy = strcmp(format, "npy") == 0;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && hasValue) options.threads = atoi(argv[++i]);
+        else if (argv[i][0] != '-') paths.push_back(argv[i]);
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (paths.empty() || (options.channelName != NULL && channelByName(options.channelName) < 0) ||
+            options.scatteredSize < 2 || options.lineOrder > 1 || (!options.png && !options.npy)) {
+        usage();
+        return 1;
+    }
+
+    // files in parallel, each read, processed and released by one thread; a file gets the spare threads when there
+    // are fewer files than cores
+    int threads = threadCount(options.threads);
+    int fileThreads = std::min(threads, (int) paths.size());
+    int frameThreads = std::max(1, threads / fileThreads);
+
+    std::mutex printLock;
+    std::vector<int> fileFrames(paths.size(), 0), fileFailures(paths.size(), 0);
+    auto start = std::chrono::steady_clock::now();
+
+    parallelFor(0, paths.size(), fileThreads, [&](int f) {
+        std::vector<ScanFrame> frames;
+        int numFrames = readFrames(paths[f], frames);
+        if (numFrames <= 0) {
+            std::lock_guard<std::mutex> lock(printLock);
+            fprintf(stderr, "%s: %s\n", paths[f], numFrames < 0 ? "could not read" : "no frames");
+            fileFailures[f] += 1;
+            return;
+        }
+
+        std::string name = baseName(paths[f]);
+        for (int i = 0; i < numFrames; i++) {
+            char suffix[32] = "";
+            if (numFrames > 1) snprintf(suffix, sizeof(suffix), "_%d", i);
+            char report[512];
+            int status = processFrame(frames[i], name + suffix, options, frameThreads, report, sizeof(report));
+
+            std::lock_guard<std::mutex> lock(printLock);
+            fprintf(status == 0 ? stdout : stderr, "%s\n", report);
+            if (status == 0) fileFrames[f] += 1;
+            else fileFailures[f] += 1;
+        }
+    });
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int numFrames = 0, numFailures = 0;
+    for (size_t f = 0; f < paths.size(); f++) {
+        numFrames += fileFrames[f];
+        numFailures += fileFailures[f];
+    }
+    fprintf(stderr, "stmproc: %d frames from %zu files in %.2f s on %d threads, %d failed\n", numFrames,
+            paths.size(), seconds, threads, numFailures);
+    return numFailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Arduino.h
+ * Host shim for the subset of the Teensy Arduino core used by the firmware. Time is simulated:
+ * every call to micros() or millis() advances the clock by 1us, delays advance it by their length,
+ * and IntervalTimer callbacks fire as the clock passes their period. Hardware access is routed
+ * to the simulated board in simboard.h.
+ */
+
+#ifndef arduino_shim_h
+#define arduino_shim_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define A5 19
+#define A6 20
+#define A7 21
+#define A8 22
+#define A9 23
+
+#define DEC 10
+#define HEX 16
+
+#define DMAMEM
+#define F_CPU_ACTUAL 600000000
+
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+
+template<class T> T min(T a, T b) { return a < b ? a : b; }
+template<class T> T max(T a, T b) { return a > b ? a : b; }
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+
+uint32_t micros();
+uint32_t millis();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void noInterrupts();
+void interrupts();
+void yield();
+
+// simulated clock
+extern uint64_t simTimeUs;
+void simAdvance(uint64_t us);
+
+// DWT cycle counter. The host counts its own elapsed time, not the simulated clock, in cycles of F_CPU_ACTUAL, so
+// a count reads as it would on a Teensy as fast as the host
+#define ARM_DWT_CYCCNT (simCycleCount())
+uint32_t simCycleCount();
+
+class Print
+{
+    public:
+        FILE *sink = NULL; // NULL discards output
+
+        size_t write(uint8_t c);
+        size_t write(const uint8_t *buf, size_t len);
+
+        size_t print(const char *s);
+        size_t print(char c);
+        size_t print(int n, int base = DEC);
+        size_t print(unsigned int n, int base = DEC);
+        size_t print(long n, int base = DEC);
+        size_t print(unsigned long n, int base = DEC);
+        size_t print(long long n, int base = DEC);
+        size_t print(unsigned long long n, int base = DEC);
+        size_t print(double n, int digits = 2);
+
+        size_t println();
+        template<class T> size_t println(T value) { size_t n = print(value); return n + println(); }
+        template<class T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+};
+
+class usb_serial_class : public Print
+{
+    public:
+        void begin(long baud);
+        int available();
+        int read();
+        int peek();
+        void flush();
+        operator bool() { return true; }
+
+        // queues host input for read()
+        void inject(const char *s);
+
+    private:
+        char input[4096];
+        int inputHead = 0;
+        int inputTail = 0;
+};
+
+extern usb_serial_class Serial;
+
+class elapsedMicros
+{
+    public:
+        elapsedMicros() { start = micros(); }
+        elapsedMicros(unsigned long val) { start = micros() - val; }
+        operator unsigned long() const { return micros() - start; }
+        elapsedMicros &operator=(unsigned long val) { start = micros() - val; return *this; }
+    private:
+        uint32_t start;
+};
+
+class elapsedMillis
+{
+    public:
+        elapsedMillis() { start = millis(); }
+        elapsedMillis(unsigned long val) { start = millis() - val; }
+        operator unsigned long() const { return millis() - start; }
+        elapsedMillis &operator=(unsigned long val) { start = millis() - val; return *this; }
+    private:
+        uint32_t start;
+};
+
+class IntervalTimer
+{
+    public:
+        ~IntervalTimer() { end(); }
+        bool begin(void (*callback)(), int periodUs);
+        void end();
+        void priority(uint8_t) {}
+};
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * CircularBuffer.h
+ * Host stand-in for the CircularBuffer library, same interface and overwrite-oldest push
+ */
+
+#ifndef circularbuffer_shim_h
+#define circularbuffer_shim_h
+
+template<typename T, unsigned S>
+class CircularBuffer
+{
+    public:
+        bool push(T value) {
+            buffer[(head + count) % S] = value;
+            if (count == S) {
+                head = (head + 1) % S;
+                return false;
+            }
+            count += 1;
+            return true;
+        }
+        bool unshift(T value) {
+            head = (head + S - 1) % S;
+            buffer[head] = value;
+            if (count == S) return false;
+            count += 1;
+            return true;
+        }
+        T shift() {
+            T value = buffer[head];
+            head = (head + 1) % S;
+            count -= 1;
+            return value;
+        }
+        T pop() {
+            count -= 1;
+            return buffer[(head + count) % S];
+        }
+        T first() const { return buffer[head]; }
+        T last() const { return buffer[(head + count - 1) % S]; }
+        T operator[](unsigned index) const { return buffer[(head + index) % S]; }
+        unsigned size() const { return count; }
+        unsigned available() const { return S - count; }
+        unsigned capacity() const { return S; }
+        bool isEmpty() const { return count == 0; }
+        bool isFull() const { return count == S; }
+        void clear() { head = 0; count = 0; }
+
+    private:
+        T buffer[S];
+        unsigned head = 0;
+        unsigned count = 0;
+};
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * SPI.h
+ * Host shim for the Teensy SPI library, transfers go to the simulated board
+ */
+
+#ifndef spi_shim_h
+#define spi_shim_h
+
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+#define SPI_MODE1 1
+#define SPI_MODE3 3
+
+struct SPISettings {
+    SPISettings() {}
+    SPISettings(uint32_t, uint8_t, uint8_t) {}
+};
+
+class SPIClass
+{
+    public:
+        SPIClass(int bus) : bus(bus) {}
+        void begin() {}
+        void beginTransaction(SPISettings) {}
+        void endTransaction() {}
+        void setMISO(uint8_t) {}
+        uint8_t transfer(uint8_t data);
+    private:
+        int bus;
+};
+
+extern SPIClass SPI;
+extern SPIClass SPI1;
+
+#endif
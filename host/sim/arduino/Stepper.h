@@ -0,0 +1,23 @@
+/*
+ * Stepper.h
+ * Host shim for the Arduino Stepper library, steps move the simulated coarse approach
+ */
+
+#ifndef stepper_shim_h
+#define stepper_shim_h
+
+#include <stdint.h>
+
+class Stepper
+{
+    public:
+        Stepper(int numberOfSteps, int, int, int, int) : numberOfSteps(numberOfSteps) {}
+        void setSpeed(long rpm) { this->rpm = rpm; }
+        void step(int steps);
+    private:
+        int numberOfSteps;
+        long rpm = 1;
+        uint64_t lastStepUs = 0;
+};
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * Wire.h
+ * Host shim for the Teensy Wire library. Nothing simulated sits on I2C, so the buses are only named
+ */
+
+#ifndef wire_shim_h
+#define wire_shim_h
+
+class TwoWire
+{
+};
+
+extern TwoWire Wire;
+extern TwoWire Wire1;
+
+#endif
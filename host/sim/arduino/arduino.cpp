@@ -0,0 +1,193 @@
+/*
+ * arduino.cpp
+ * Host shim for the Teensy Arduino core: simulated clock, interval timers, serial and pin routing
+ */
+
+#include <chrono>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "Wire.h"
+#include "Stepper.h"
+#include "../simboard.h"
+
+uint64_t simTimeUs = 0;
+
+usb_serial_class Serial;
+SPIClass SPI(0);
+SPIClass SPI1(1);
+TwoWire Wire;
+TwoWire Wire1;
+
+// interval timers, fired from simAdvance
+struct sim_timer_struct {
+    IntervalTimer *owner;
+    void (*callback)();
+    uint32_t periodUs;
+    uint64_t nextUs;
+};
+
+static const int maxTimers = 4;
+static sim_timer_struct timers[maxTimers];
+static int numTimers = 0;
+static bool inInterrupt = false;
+static bool interruptsEnabled = true;
+
+void simAdvance(uint64_t us) {
+    uint64_t target = simTimeUs + us;
+
+    // interrupts do not nest, and time spent in an interrupt does not fire more interrupts
+    if (inInterrupt || !interruptsEnabled) {
+        simTimeUs = target;
+        simBoard.advance(simTimeUs);
+        return;
+    }
+
+    while (true) {
+        int next = -1;
+        for (int i = 0; i < numTimers; i++) {
+            if (timers[i].nextUs <= target && (next < 0 || timers[i].nextUs < timers[next].nextUs)) next = i;
+        }
+        if (next < 0) break;
+
+        if (timers[next].nextUs > simTimeUs) simTimeUs = timers[next].nextUs;
+        simBoard.advance(simTimeUs);
+        timers[next].nextUs += timers[next].periodUs;
+
+        inInterrupt = true;
+        timers[next].callback();
+        inInterrupt = false;
+
+        if (simTimeUs > target) target = simTimeUs;
+    }
+
+    simTimeUs = target;
+    simBoard.advance(simTimeUs);
+}
+
+uint32_t micros() {
+    simAdvance(1);
+    return (uint32_t) simTimeUs;
+}
+
+uint32_t millis() {
+    simAdvance(1);
+    return (uint32_t) (simTimeUs / 1000);
+}
+
+uint32_t simCycleCount() {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    return (uint32_t) (ns * (F_CPU_ACTUAL / 100000000) / 10);
+}
+
+void delay(uint32_t ms) { simAdvance((uint64_t) ms * 1000); }
+void delayMicroseconds(uint32_t us) { simAdvance(us); }
+void noInterrupts() { interruptsEnabled = false; }
+void interrupts() { interruptsEnabled = true; }
+void yield() { simAdvance(1); }
+
+void pinMode(int, int) {}
+void digitalWrite(int pin, int value) { simBoard.pinWrite(pin, value); }
+int digitalRead(int) { return HIGH; } // inputs are active low, nothing pressed
+int analogRead(int) { return 512; }
+
+bool IntervalTimer::begin(void (*callback)(), int periodUs) {
+    end();
+    if (numTimers >= maxTimers) return false;
+    timers[numTimers].owner = this;
+    timers[numTimers].callback = callback;
+    timers[numTimers].periodUs = periodUs;
+    timers[numTimers].nextUs = simTimeUs + periodUs;
+    numTimers += 1;
+    return true;
+}
+
+void IntervalTimer::end() {
+    for (int i = 0; i < numTimers; i++) {
+        if (timers[i].owner == this) {
+            timers[i] = timers[numTimers - 1];
+            numTimers -= 1;
+            return;
+        }
+    }
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+    return simBoard.spiTransfer(bus, data);
+}
+
+void Stepper::step(int steps) {
+    // Arduino Stepper waits until 60s / (steps per rev * rpm) after its last step before each step
+    uint64_t stepUs = 60000000ULL / numberOfSteps / (rpm > 0 ? rpm : 1);
+    int direction = steps > 0 ? 1 : -1;
+    for (int i = 0; i < abs(steps); i++) {
+        if (simTimeUs < lastStepUs + stepUs) simAdvance(lastStepUs + stepUs - simTimeUs);
+        lastStepUs = simTimeUs;
+        simBoard.stepStepper(direction);
+    }
+}
+
+size_t Print::write(uint8_t c) {
+    if (sink != NULL) fputc(c, sink);
+    return 1;
+}
+
+size_t Print::write(const uint8_t *buf, size_t len) {
+    if (sink != NULL) fwrite(buf, 1, len, sink);
+    return len;
+}
+
+size_t Print::print(const char *s) { return write((const uint8_t *) s, strlen(s)); }
+size_t Print::print(char c) { return write((uint8_t) c); }
+
+static size_t printFormatted(Print *p, const char *format, long long n, int base) {
+    char buf[40];
+    if (base == HEX) snprintf(buf, sizeof(buf), "%llX", n);
+    else snprintf(buf, sizeof(buf), format, n);
+    return p->print(buf);
+}
+
+size_t Print::print(int n, int base) { return printFormatted(this, "%lld", n, base); }
+size_t Print::print(unsigned int n, int base) { return printFormatted(this, "%llu", n, base); }
+size_t Print::print(long n, int base) { return printFormatted(this, "%lld", n, base); }
+size_t Print::print(unsigned long n, int base) { return printFormatted(this, "%llu", n, base); }
+size_t Print::print(long long n, int base) { return printFormatted(this, "%lld", n, base); }
+size_t Print::print(unsigned long long n, int base) { return printFormatted(this, "%llu", (long long) n, base); }
+
+size_t Print::print(double n, int digits) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", digits, n);
+    return print(buf);
+}
+
+size_t Print::println() { return print("\r\n"); }
+
+void usb_serial_class::begin(long) {}
+
+int usb_serial_class::available() {
+    return (inputTail - inputHead + (int) sizeof(input)) % (int) sizeof(input);
+}
+
+int usb_serial_class::read() {
+    if (inputHead == inputTail) return -1;
+    char c = input[inputHead];
+    inputHead = (inputHead + 1) % sizeof(input);
+    return c;
+}
+
+int usb_serial_class::peek() {
+    if (inputHead == inputTail) return -1;
+    return input[inputHead];
+}
+
+void usb_serial_class::flush() {
+    if (sink != NULL) fflush(sink);
+}
+
+void usb_serial_class::inject(const char *s) {
+    for (; *s != '\0'; s++) {
+        input[inputTail] = *s;
+        inputTail = (inputTail + 1) % sizeof(input);
+    }
+}
@@ -0,0 +1,32 @@
+/*
+ * board.h
+ * Board traits of the simulated head: the control board's pins, with its SPI buses on the simulated board
+ */
+
+#ifndef sim_board_h
+#define sim_board_h
+
+#include "controlboard.h"
+#include "simboard.h"
+
+// found before ../src/board.h on the host include path, so the firmware's ScanHead is built on this board
+struct SimControlBoard : ControlBoard
+{
+    struct PiezoBus {
+        static void begin() {}
+        static void select() { simBoard.pinWrite(piezo_struct::cs, LOW); }
+        static void deselect() { simBoard.pinWrite(piezo_struct::cs, HIGH); }
+        static uint8_t transfer(uint8_t data) { return simBoard.spiTransfer(0, data); }
+    };
+
+    struct TiaBus {
+        static void begin() {}
+        static void select() { simBoard.pinWrite(tia_struct::cs, LOW); }
+        static void deselect() { simBoard.pinWrite(tia_struct::cs, HIGH); }
+        static uint8_t transfer(uint8_t data) { return simBoard.spiTransfer(1, data); }
+    };
+};
+
+typedef SimControlBoard Board;
+
+#endif
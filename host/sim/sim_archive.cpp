@@ -0,0 +1,502 @@
+/*
+ * sim_archive.cpp
+ * Checks the host's stream and archive code against the firmware's stream. A frame is streamed by ScanStream as
+ * text rows and as #zline records, parsed by StreamParser, packed by StreamArchiver, read back, and written out
+ * again by stmarchive dump, and has to come back value for value. Streams with rows, lines or coded records
+ * lost or damaged have to be counted as the daemon counts them, and archives cut off or with a byte damaged
+ * anywhere have to give back every whole chunk before the damage and nothing wrong.
+ *
+ * usage: sim_archive [directory]    where the scratch archives go (/tmp)
+ *
+ * stmarchive is run from the directory sim_archive was started from. Prints each check, and exits 1 if any
+ * failed.
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "simfirmware.h"
+#include "archive.h"
+#include "streamparser.h"
+
+static const int frameChannels = CH_XPOS | CH_ZPOS | CH_CURRENT | CH_BIAS;
+static const int frameWidth = 48;
+static const int frameHeight = 12;
+static const int frameStep = 7;
+static const int retriedLine = 5; // sent twice, a #retry between
+
+static int checks = 0;
+static int failures = 0;
+
+static bool check(bool passed, const char *format, ...) {
+    /*!
+     * \brief prints one check's result
+     * @return passed
+     */
+
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf(passed ? ": ok\n" : ": FAILED\n");
+    checks += 1;
+    if (!passed) failures += 1;
+    return passed;
+}
+
+static void lineValues(int transmission, int lineIndex, std::vector<int> &data) {
+    /*!
+     * \brief fills one line's values into the frame buffer: a ramp, a smooth surface with noise, outliers large
+     *        enough for the codec's escape, and a constant, so every predictor and code length is used
+     * @param transmission 0 for a line's first transmission, 1 for a retry, which differs
+     */
+
+    uint32_t seed = 2654435761u * (lineIndex + 1) + 40503u * transmission;
+    for (int x = 0; x < frameWidth; x++) {
+        seed = seed * 1664525u + 1013904223u;
+        int noise = (int) (seed >> 24) - 128;
+        int pixel = lineIndex * frameWidth + x;
+        int *row = &data[(size_t) pixel * 4];
+        row[0] = -frameWidth * frameStep / 2 + x * frameStep + noise / 64;
+        row[1] = (int) (3000 * sinf(x * 0.2f + lineIndex * 0.3f)) + noise;
+        row[2] = x % 17 == 3 ? 5000000 - (int) seed % 1000 : 100 + noise / 8;
+        row[3] = -250;
+    }
+}
+
+static std::vector<std::string> streamFrame(bool compressed, ScanFrame &expected) {
+    /*!
+     * \brief writes the test frame through a ScanStream, as the head sends it
+     * @param expected set to the rows as they were sent, a retried line's twice
+     * @return the stream's lines
+     */
+
+    char *text = NULL;
+    size_t length = 0;
+    Serial.sink = open_memstream(&text, &length);
+
+    expected = ScanFrame();
+    expected.channels = frameChannels;
+    expected.width = frameWidth;
+    expected.height = frameHeight;
+    expected.step = frameStep;
+    expected.endStatus = 0;
+    expected.numChannels = channelCount(frameChannels);
+
+    std::vector<int> data((size_t) frameWidth * frameHeight * expected.numChannels);
+    ScanStream *stream = new ScanStream(); // its reference lines are too large for the stack
+    stream->compressed = compressed;
+    stream->beginFrame(frameChannels, frameWidth, frameHeight, frameStep);
+    for (int y = 0; y < frameHeight; y++) {
+        for (int transmission = 0; transmission < (y == retriedLine ? 2 : 1); transmission++) {
+            if (transmission > 0) stream->writeEvent("retry", y, -1);
+            lineValues(transmission, y, data);
+            stream->writeLine(y, data.data(), y * frameWidth, frameWidth);
+
+            for (int x = 0; x < frameWidth; x++) {
+                int pixel = y * frameWidth + x;
+                expected.pixels.push_back(pixel);
+                expected.values.insert(expected.values.end(), &data[(size_t) pixel * 4], &data[(size_t) pixel * 4 + 4]);
+            }
+        }
+    }
+    stream->endFrame(0);
+    delete stream;
+
+    fclose(Serial.sink);
+    Serial.sink = NULL;
+
+    std::vector<std::string> lines;
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] != '\n') continue;
+        size_t end = i > start && text[i - 1] == '\r' ? i - 1 : i;
+        lines.push_back(std::string(text + start, end - start));
+        start = i + 1;
+    }
+    free(text);
+    return lines;
+}
+
+static std::string joinLines(const std::vector<std::string> &lines) {
+    std::string text;
+    for (size_t i = 0; i < lines.size(); i++) text += lines[i] + "\n";
+    return text;
+}
+
+static bool sameRows(const ScanFrame &a, const ScanFrame &b) {
+    return a.pixels == b.pixels && a.values == b.values;
+}
+
+static bool parse(const std::vector<std::string> &lines, StreamParser &parser) {
+    /*!
+     * \brief feeds a stream to a parser
+     * @return whether exactly one frame was opened and closed
+     */
+
+    parser.reset();
+    for (size_t i = 0; i < lines.size(); i++) parser.feed(lines[i]);
+    return parser.frames == 1 && !parser.inFrame;
+}
+
+static bool pack(const std::vector<std::string> &lines, int copies, const std::string &path, int encoding) {
+    /*!
+     * \brief packs a stream into a new archive, copies frames of it
+     * @return whether everything was written
+     */
+
+    ArchiveWriter writer;
+    if (writer.open(path.c_str(), encoding) != 0) return false;
+    int status = 0;
+    for (int copy = 0; copy < copies; copy++) {
+        StreamArchiver archiver(writer);
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (archiver.feed(lines[i].data(), lines[i].size()) != 0) status = -1;
+        }
+        if (archiver.finish() != 0) status = -1;
+    }
+    if (writer.close() != 0) status = -1;
+    return status == 0;
+}
+
+static std::string dump(const std::string &stmarchive, const std::string &path) {
+    /*!
+     * \brief runs stmarchive dump on an archive
+     * @return its output, empty if it failed
+     */
+
+    std::string command = stmarchive + " dump " + path;
+    FILE *out = popen(command.c_str(), "r");
+    if (out == NULL) return "";
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), out)) > 0) text.append(buf, n);
+    if (pclose(out) != 0) return "";
+    return text;
+}
+
+struct chunk_struct {
+    uint64_t offset;
+    uint32_t type;
+    uint32_t length;
+    uint64_t end;  // of the payload, without the padding
+    uint64_t next; // where the next chunk starts
+};
+
+static std::vector<chunk_struct> walkChunks(const std::vector<uint8_t> &file) {
+    /*!
+     * \brief lists an intact archive's chunks, header to footer, as archive.h lays them out
+     */
+
+    std::vector<chunk_struct> chunks;
+    uint64_t offset = 24;
+    while (offset + 16 <= file.size() - 16) {
+        chunk_struct chunk;
+        chunk.offset = offset;
+        memcpy(&chunk.type, &file[offset], 4);
+        memcpy(&chunk.length, &file[offset + 4], 4);
+        chunk.end = offset + 16 + chunk.length;
+        chunk.next = offset + 16 + (chunk.length + 7) / 8 * 8;
+        chunks.push_back(chunk);
+        offset = chunk.next;
+    }
+    return chunks;
+}
+
+struct line_data_struct {
+    int frame;
+    std::vector<int> pixels;
+    std::vector<int> values;
+};
+
+static bool readBack(const std::string &path, std::map<uint64_t, line_data_struct> &lines, bool *recovered) {
+    /*!
+     * \brief opens an archive and reads every line chunk its index lists
+     * @param lines set to the lines that read back, by chunk offset
+     * @param recovered set to whether the index was rebuilt
+     * @return false if the archive did not open, or listed a line chunk that does not read
+     */
+
+    lines.clear();
+    ArchiveReader reader;
+    if (reader.open(path.c_str()) < 0) return false;
+    *recovered = reader.recovered;
+    bool readable = true;
+    for (int f = 0; f < reader.numFrames(); f++) {
+        for (size_t k = 0; k < reader.frame(f).lines.size(); k++) {
+            line_data_struct line;
+            line.frame = f;
+            if (reader.readLine(f, k, line.pixels, line.values) < 0) readable = false;
+            else lines[reader.frame(f).lines[k].offset] = line;
+        }
+    }
+    return readable;
+}
+
+static bool sameLines(const std::map<uint64_t, line_data_struct> &got, const std::map<uint64_t, line_data_struct> &all,
+        uint64_t before, uint64_t except) {
+    /*!
+     * \brief whether got holds exactly the lines of all whose chunks start before an offset, but the one at except,
+     *        in the same frames with the same rows
+     */
+
+    size_t expected = 0;
+    for (std::map<uint64_t, line_data_struct>::const_iterator it = all.begin(); it != all.end(); ++it) {
+        if (it->first >= before || it->first == except) continue;
+        expected += 1;
+        std::map<uint64_t, line_data_struct>::const_iterator found = got.find(it->first);
+        if (found == got.end() || found->second.frame != it->second.frame ||
+                found->second.pixels != it->second.pixels || found->second.values != it->second.values) {
+            return false;
+        }
+    }
+    return got.size() == expected;
+}
+
+static void checkStream(bool compressed, const std::string &stmarchive, const std::string &directory) {
+    /*!
+     * \brief parses, packs, reads back and dumps the test frame streamed one way
+     */
+
+    const char *name = compressed ? "#zline" : "text";
+    ScanFrame expected;
+    std::vector<std::string> lines = streamFrame(compressed, expected);
+    ScanFrame unused;
+    std::string plain = joinLines(streamFrame(false, unused));
+
+    StreamParser parser;
+    bool parsed = parse(lines, parser);
+    check(parsed && parser.linesReceived == frameHeight + 1 && parser.rowsMissing == 0 && parser.rowsMalformed == 0 &&
+            parser.endStatus == 0, "%s stream parses whole: %ld lines, %ld missing, %ld malformed rows", name,
+            parser.linesReceived, parser.rowsMissing, parser.rowsMalformed);
+
+    std::vector<ScanFrame> frames;
+    std::string text = joinLines(lines);
+    check(parseFrames(text.data(), text.size(), frames) == 1 && sameRows(frames[0], expected),
+            "%s stream reads back as sent", name);
+
+    for (int encoding = ENCODE_RAW; encoding <= ENCODE_DELTA; encoding++) {
+        const char *encodingName = encoding == ENCODE_RAW ? "raw" : "delta";
+        std::string path = directory + "/sim_archive_" + std::to_string(getpid()) + ".stma";
+        if (!check(pack(lines, 1, path, encoding), "%s stream packs %s", name, encodingName)) continue;
+
+        ArchiveReader reader;
+        ScanFrame frame;
+        bool read = reader.open(path.c_str()) == 1 && !reader.recovered && reader.readFrame(0, frame) >= 0;
+        check(read && frame.channels == frameChannels && frame.width == frameWidth && frame.height == frameHeight &&
+                frame.step == frameStep && frame.endStatus == 0 && sameRows(frame, expected),
+                "%s stream archived %s reads back as sent", name, encodingName);
+        std::vector<archive_event_struct> events = read ? reader.events(0) : std::vector<archive_event_struct>();
+        check(events.size() == 1 && events[0].name == "retry" && events[0].line == retriedLine && events[0].value == -1,
+                "%s stream archived %s keeps its event", name, encodingName);
+        reader.close();
+
+        // a #zline comes back out as the #line and rows it stands for
+        check(dump(stmarchive, path) == plain, "%s stream archived %s dumps as the text stream", name, encodingName);
+        unlink(path.c_str());
+    }
+}
+
+static void checkDamagedStream(bool compressed, const std::vector<std::string> &lines, const ScanFrame &expected,
+        const char *damage, const std::string &directory) {
+    /*!
+     * \brief parses and packs a damaged stream: the rows the parser counts lost have to be the rows the archive
+     *        is short, and every row archived has to be one that was sent
+     */
+
+    StreamParser parser;
+    bool parsed = parse(lines, parser);
+    long lost = parser.rowsMissing + parser.rowsMalformed;
+
+    std::string path = directory + "/sim_archive_" + std::to_string(getpid()) + ".stma";
+    ScanFrame frame;
+    ArchiveReader reader;
+    bool read = pack(lines, 1, path, ENCODE_DELTA) && reader.open(path.c_str()) == 1 && reader.readFrame(0, frame) >= 0;
+    reader.close();
+    unlink(path.c_str());
+
+    // archived rows in the order they were sent, with the lost ones left out
+    int numChannels = expected.numChannels;
+    size_t e = 0;
+    bool subset = read;
+    for (int r = 0; subset && r < frame.numRows(); r++) {
+        while (e < (size_t) expected.numRows() && (expected.pixels[e] != frame.pixels[r] ||
+                !std::equal(&frame.values[(size_t) r * numChannels], &frame.values[(size_t) (r + 1) * numChannels],
+                            &expected.values[e * numChannels]))) {
+            e++;
+        }
+        if (e == (size_t) expected.numRows()) subset = false;
+        else e++;
+    }
+
+    check(parsed && lost > 0 && subset && frame.numRows() == expected.numRows() - lost,
+            "%s stream with %s: %ld missing, %ld malformed rows counted, %d of %d archived",
+            compressed ? "#zline" : "text", damage, parser.rowsMissing, parser.rowsMalformed, frame.numRows(), expected.numRows());
+}
+
+static void checkDamagedStreams(const std::string &directory) {
+    ScanFrame expected;
+    std::vector<std::string> text = streamFrame(false, expected);
+
+    // the first line header, and the rows and line header of lines after the retried one
+    size_t firstLine = 0;
+    while (firstLine < text.size() && text[firstLine].compare(0, 6, "#line,") != 0) firstLine++;
+    size_t laterLine = firstLine;
+    for (int seen = 0; laterLine < text.size(); laterLine++) {
+        if (text[laterLine].compare(0, 6, "#line,") == 0 && ++seen == retriedLine + 3) break;
+    }
+
+    std::vector<std::string> lines = text;
+    lines.erase(lines.begin() + firstLine + 3);
+    checkDamagedStream(false, lines, expected, "a row lost", directory);
+
+    lines = text;
+    lines[firstLine + 3] = lines[firstLine + 3].substr(0, lines[firstLine + 3].size() - 2) + "x1";
+    checkDamagedStream(false, lines, expected, "a row garbled", directory);
+
+    lines = text;
+    lines.erase(lines.begin() + laterLine, lines.begin() + laterLine + 1 + frameWidth);
+    checkDamagedStream(false, lines, expected, "a line lost", directory);
+
+    lines = text;
+    lines.erase(lines.begin() + laterLine + 1 + frameWidth, lines.end() - 1);
+    checkDamagedStream(false, lines, expected, "the last lines lost", directory);
+
+    std::vector<std::string> coded = streamFrame(true, expected);
+    size_t firstRecord = 0;
+    while (firstRecord < coded.size() && coded[firstRecord].compare(0, 7, "#zline,") != 0) firstRecord++;
+
+    // records predicted from a lost one are lost as well, up to the next key record
+    lines = coded;
+    lines[firstRecord + 2] = lines[firstRecord + 2].substr(0, lines[firstRecord + 2].size() - 1);
+    checkDamagedStream(true, lines, expected, "a record cut short", directory);
+
+    lines = coded;
+    lines.erase(lines.begin() + firstRecord + 2);
+    checkDamagedStream(true, lines, expected, "a record lost", directory);
+}
+
+static void checkDamagedArchive(int encoding, const std::string &directory) {
+    /*!
+     * \brief cuts off and damages an archive of two frames at every byte, which has to read back as every whole
+     *        chunk before the damage, rebuilding the index where it is lost, and never as a wrong row
+     */
+
+    const char *encodingName = encoding == ENCODE_RAW ? "raw" : "delta";
+    ScanFrame expected;
+    std::vector<std::string> lines = streamFrame(true, expected);
+    std::string path = directory + "/sim_archive_" + std::to_string(getpid()) + ".stma";
+    if (!check(pack(lines, 2, path, encoding), "two frames pack %s", encodingName)) return;
+
+    std::vector<uint8_t> file;
+    FILE *in = fopen(path.c_str(), "rb");
+    if (in != NULL) {
+        uint8_t buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) file.insert(file.end(), buf, buf + n);
+        fclose(in);
+    }
+    std::vector<chunk_struct> chunks = walkChunks(file);
+    uint64_t indexOffset = chunks.empty() ? file.size() : chunks.back().offset;
+
+    std::map<uint64_t, line_data_struct> all, got;
+    bool recovered = true;
+    bool opened = readBack(path, all, &recovered);
+    check(opened && !recovered && all.size() == 2 * (frameHeight + 1),
+            "two frames archived %s read back through the index, %zu line chunks", encodingName, all.size());
+
+    // cut off at every byte, from the whole file down to its header
+    long cutFailures = 0;
+    for (long size = file.size(); size >= 0; size--) {
+        if (truncate(path.c_str(), size) != 0) {
+            cutFailures += 1;
+            break;
+        }
+        opened = readBack(path, got, &recovered);
+        bool passed;
+        if (size < 24) passed = !opened && got.empty();
+        else if ((size_t) size == file.size()) passed = opened && !recovered && sameLines(got, all, UINT64_MAX, 0);
+        else {
+            // every chunk whose payload is whole, the padding after the last one need not be
+            uint64_t before = 0;
+            for (size_t c = 0; c < chunks.size() && chunks[c].end <= (uint64_t) size; c++) before = chunks[c].next;
+            passed = opened && recovered && sameLines(got, all, before, 0);
+        }
+        if (!passed) cutFailures += 1;
+    }
+    check(cutFailures == 0, "archive %s cut off at each of %zu bytes reads back to the last whole chunk, %ld wrong",
+            encodingName, file.size() + 1, cutFailures);
+
+    // a byte damaged at a time, with the index and without it
+    for (int withIndex = 1; withIndex >= 0; withIndex--) {
+        size_t size = withIndex ? file.size() : indexOffset;
+        FILE *out = fopen(path.c_str(), "wb");
+        if (out == NULL || fwrite(file.data(), 1, size, out) != size) {
+            check(false, "archive %s written for damage", encodingName);
+            if (out != NULL) fclose(out);
+            continue;
+        }
+        fclose(out);
+
+        long damageFailures = 0;
+        int fd = open(path.c_str(), O_RDWR);
+        for (size_t i = 0; fd >= 0 && i < size; i++) {
+            uint8_t damaged = file[i] ^ 0x5a;
+            if (pwrite(fd, &damaged, 1, i) != 1) {
+                damageFailures += 1;
+                break;
+            }
+
+            // the chunk hit, if it is not the padding after one or its frame number, which nothing reads
+            const chunk_struct *hit = NULL;
+            for (size_t c = 0; c < chunks.size(); c++) {
+                bool frameNumber = i >= chunks[c].offset + 8 && i < chunks[c].offset + 12;
+                if (i >= chunks[c].offset && i < chunks[c].end && !frameNumber) hit = &chunks[c];
+            }
+            bool inIndex = hit != NULL && hit->offset == indexOffset;
+
+            bool opened = readBack(path, got, &recovered);
+            bool passed;
+            if (i < 8) passed = !opened; // the magic
+            else if (i < 24 || hit == NULL) passed = !opened || sameLines(got, all, UINT64_MAX, 0);
+            else if (!withIndex) passed = sameLines(got, all, hit->offset, 0);
+            else if (inIndex || i >= file.size() - 16) passed = recovered && sameLines(got, all, UINT64_MAX, 0);
+            else {
+                // the index still lists the damaged chunk, which must not read back
+                passed = !recovered && sameLines(got, all, UINT64_MAX, hit->offset);
+            }
+            if (!passed) damageFailures += 1;
+
+            if (pwrite(fd, &file[i], 1, i) != 1) {
+                damageFailures += 1;
+                break;
+            }
+        }
+        if (fd >= 0) close(fd);
+        else damageFailures += 1;
+        check(damageFailures == 0, "archive %s %s the index damaged at each of %zu bytes reads back all but the "
+                "damage, %ld wrong", encodingName, withIndex ? "with" : "without", size, damageFailures);
+    }
+    unlink(path.c_str());
+}
+
+int main(int argc, char **argv) {
+    std::string directory = argc > 1 ? argv[1] : "/tmp";
+    std::string self = argv[0];
+    size_t slash = self.rfind('/');
+    std::string stmarchive = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + "/stmarchive";
+
+    checkStream(false, stmarchive, directory);
+    checkStream(true, stmarchive, directory);
+    checkDamagedStreams(directory);
+    checkDamagedArchive(ENCODE_RAW, directory);
+    checkDamagedArchive(ENCODE_DELTA, directory);
+
+    printf("%d of %d checks failed\n", failures, checks);
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * sim_bench.cpp
+ * Times the control loop's kernels (see bench.h) on the host, through the same code the head's bench command
+ * runs, and compares the results with an earlier run's to catch regressions.
+ *
+ * usage: sim_bench [-n calls] [-b baseline.txt] [-t percent] [results.txt]
+ *
+ *   -n           calls timed per kernel (4096)
+ *   -b           compares with the #bench records in a file: an earlier sim_bench output, or a capture of the
+ *                head's bench command such as the daemon's device.log
+ *   -t           slowdown of a kernel's fastest call over the baseline's that counts as a regression (10%)
+ *   results.txt  compares the #bench records in this file instead of timing the host, for the head's results
+ *
+ * The records are printed as the head prints them, so the output of one run is the baseline of the next. Exits
+ * 1 if any kernel regressed, or its checksum changed where it is the same on every target.
+ */
+
+#include <map>
+#include <string>
+
+#include "simfirmware.h"
+#include "bench.h"
+
+static Bench bench;
+
+struct record_struct {
+    int calls;
+    float minCycles;
+    float meanCycles;
+    uint32_t check;
+};
+
+static bool readRecords(const char *path, std::map<std::string, record_struct> &records) {
+    /*!
+     * \brief reads the #bench records in a file, anywhere in a line, keeping each kernel's last
+     * @return false if the file could not be read
+     */
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return false;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        const char *at = strstr(line, "#bench,");
+        if (at == NULL) continue;
+
+        char kernel[32];
+        record_struct record;
+        float minNs, meanNs;
+        if (sscanf(at, "#bench,%31[^,],%d,%f,%f,%f,%f,%u", kernel, &record.calls, &record.minCycles,
+                   &record.meanCycles, &minNs, &meanNs, &record.check) == 7) {
+            records[kernel] = record;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static void timeHost(int calls, std::map<std::string, record_struct> &records) {
+    /*!
+     * \brief runs every kernel on a simulated head, printing its record
+     */
+
+    // no sampling interrupt and a fixed TIA reading, as the simulated board would otherwise model the piezos on
+    // every clock read, which is no cost of the head's
+    simBoot();
+    simStopSampling();
+    simBoard.tiaOverride = 32768;
+
+    Serial.sink = stdout;
+    Serial.print("ok cpuhz=");
+    Serial.println(F_CPU_ACTUAL);
+    for (int k = 0; k < Bench::numKernels; k++) {
+        Bench::result_struct result = bench.run(scanhead, k, calls);
+        bench.print(k, result);
+
+        record_struct &record = records[Bench::kernelNames[k]];
+        record.calls = result.calls;
+        record.minCycles = result.minCycles;
+        record.meanCycles = result.meanCycles;
+        record.check = result.check;
+    }
+    Serial.sink = NULL;
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    int calls = Bench::defaultCalls;
+    float tolerance = 10;
+    const char *baselinePath = NULL;
+    const char *resultsPath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) calls = max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) baselinePath = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) tolerance = atof(argv[++i]);
+        else if (argv[i][0] != '-' && resultsPath == NULL) resultsPath = argv[i];
+        else {
+            fprintf(stderr, "usage: sim_bench [-n calls] [-b baseline.txt] [-t percent] [results.txt]\n");
+            return 1;
+        }
+    }
+
+    std::map<std::string, record_struct> baseline;
+    if (baselinePath != NULL && !readRecords(baselinePath, baseline)) {
+        fprintf(stderr, "%s: could not read\n", baselinePath);
+        return 1;
+    }
+
+    std::map<std::string, record_struct> results;
+    if (resultsPath == NULL) timeHost(calls, results);
+    else if (!readRecords(resultsPath, results)) {
+        fprintf(stderr, "%s: could not read\n", resultsPath);
+        return 1;
+    }
+    else if (results.empty()) {
+        fprintf(stderr, "%s: no #bench records\n", resultsPath);
+        return 1;
+    }
+
+    if (baselinePath == NULL) return 0;
+
+    // checksums that match across targets, so a change in them is a change in what the kernel computes
+    const char *exact[] = {"dac", "linecode"};
+
+    printf("\nkernel      baseline   cycles  change  (fastest call, cycles)\n");
+    int regressed = 0;
+    for (int k = 0; k < Bench::numKernels; k++) {
+        const char *name = Bench::kernelNames[k];
+        if (results.count(name) == 0 || baseline.count(name) == 0) {
+            printf("%-10s  %s\n", name, results.count(name) == 0 ? "not timed" : "not in the baseline");
+            continue;
+        }
+        const record_struct &was = baseline[name];
+        const record_struct &now = results[name];
+
+        float change = was.minCycles > 0 ? 100 * (now.minCycles / was.minCycles - 1) : 0;
+        bool slower = change > tolerance;
+        bool differs = false;
+        for (int e = 0; e < 2; e++) {
+            if (strcmp(name, exact[e]) == 0 && now.calls == was.calls && now.check != was.check) differs = true;
+        }
+        if (slower || differs) regressed += 1;
+
+        printf("%-10s %9.1f %8.1f %+6.1f%%%s%s\n", name, was.minCycles, now.minCycles, change,
+               slower ? "  slower" : "", differs ? "  checksum changed" : "");
+    }
+
+    if (regressed > 0) printf("%d of %d kernels regressed\n", regressed, Bench::numKernels);
+    return regressed > 0 ? 1 : 0;
+}
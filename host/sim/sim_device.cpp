@@ -0,0 +1,157 @@
+/*
+ * sim_device.cpp
+ * Emulates an OpenSTM head on a pseudo terminal: the firmware's serial commands, job queue and scan stream run on
+ * the simulated board behind a pty, so host tools can be pointed at it like a Teensy's /dev/ttyACM port.
+ *
+ * usage: sim_device [link]    prints the pty path, and symlinks it to link if given
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "simfirmware.h"
+#include "jobqueue.h"
+#include "commands.h"
+#include "scheduler.h"
+#include "noisespectrum.h"
+
+static JobQueue *jobQueue;
+static Commands *commands;
+static Scheduler scheduler;
+static NoiseSpectrum spectrum;
+static Bench bench;
+
+static const int frameBufSize = 100000;
+static int frameBuf[frameBufSize];
+static const int traceBufSize = 32768; // as on the head
+static uint16_t traceBuf[traceBufSize];
+
+static const int streamPixelsPerRun = 8;
+
+static volatile sig_atomic_t stopping = 0;
+static const char *linkPath = NULL;
+
+// the firmware's tasks, as main.cpp registers them, minus the UI
+
+static void superviseTask() {
+    if (!scanhead->isOvercurrent() || jobQueue->state == JobQueue::QUEUE_WITHDRAWING) return;
+
+    Serial.print("overcurrent ");
+    Serial.print(scanhead->current);
+    Serial.println("pA, retracting");
+
+    jobQueue->withdraw();
+}
+
+static void trajectoryTask() {
+    jobQueue->update();
+}
+
+static void streamTask() {
+    scanhead->stream.update(streamPixelsPerRun);
+}
+
+static void spectrumTask() {
+    if (!spectrum.finished()) spectrum.update();
+}
+
+static void commandTask() {
+    commands->poll();
+}
+
+static void onSignal(int) {
+    stopping = 1;
+}
+
+static int openPty(int *slave) {
+    /*!
+     * \brief opens a raw pty pair. The slave stays open here too, so the master keeps buffering while no host
+     *        has the port open, as the Teensy's USB serial does
+     * @return master fd, -1 on failure
+     */
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) return -1;
+
+    *slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (*slave < 0) return -1;
+
+    struct termios tio;
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    return master;
+}
+
+static void readHost(int master) {
+    // everything the host has written so far, into the firmware's serial input
+    char buf[256];
+    while (true) {
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)) return;
+        int n = read(master, buf, sizeof(buf) - 1);
+        if (n <= 0) return;
+        buf[n] = '\0';
+        Serial.inject(buf);
+    }
+}
+
+int main(int argc, char **argv) {
+    linkPath = argc > 1 ? argv[1] : NULL;
+
+    int slave;
+    int master = openPty(&slave);
+    if (master < 0) {
+        perror("sim_device: pty");
+        return 1;
+    }
+    const char *path = ptsname(master);
+    if (linkPath != NULL) {
+        unlink(linkPath);
+        if (symlink(path, linkPath) != 0) {
+            perror("sim_device: symlink");
+            return 1;
+        }
+    }
+    printf("%s\n", linkPath != NULL ? linkPath : path);
+    fflush(stdout);
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    Serial.sink = fdopen(master, "w");
+
+    Serial.println("OpenSTM V0.1 Startup...");
+    simBoot();
+    jobQueue = new JobQueue(scanhead, &bench, frameBuf, frameBufSize);
+    commands = new Commands(scanhead, jobQueue, &scheduler, &spectrum, traceBuf, traceBufSize);
+    scanhead->stream.buffered = true;
+
+    scheduler.addTask("supervisor", superviseTask, 0, 1000, 50);
+    scheduler.addTask("trajectory", trajectoryTask, 1, scanhead->controlPeriodUs, 400);
+    scheduler.addTask("stream", streamTask, 2, 0, 300);
+    scheduler.addTask("spectrum", spectrumTask, 2, 0, 100);
+    scheduler.addTask("command", commandTask, 3, 10000, 200);
+    Serial.println("Startup Complete");
+    Serial.flush();
+
+    uint64_t nextPollUs = 0;
+    while (!stopping) {
+        scheduler.runOnce();
+        if (simTimeUs < nextPollUs) continue;
+        nextPollUs = simTimeUs + 1000;
+
+        Serial.flush();
+        readHost(master);
+
+        // simulated time runs flat out while a job runs, and keeps to wall time while idle
+        if (!jobQueue->busy() && !scanhead->stream.pending() && spectrum.finished()) usleep(1000);
+    }
+
+    if (linkPath != NULL) unlink(linkPath);
+    close(slave);
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * sim_drift.cpp
+ * Repeated frames of one region on a drifting sample, with and without drift correction. Prints the
+ * registration error of every frame: the sample drift at mid frame minus the offset applied to the piezo.
+ */
+
+#include "simfirmware.h"
+#include "jobqueue.h"
+
+static const int size = 400;
+static const int step = 10;
+static const int numFrames = 15; // within JobQueue::maxJobs
+static const float driftRate[3] = {3, -2, 1}; // LSB per second
+
+static const int frameBufSize = 100000;
+static int frameBuf[frameBufSize];
+
+struct frame_struct {
+    float seconds;  // mid frame
+    float error[3]; // sample drift minus applied offset, LSB
+};
+
+static void runFrames(bool correction, frame_struct *frames) {
+    /*!
+     * \brief scans the same region numFrames times back to back through the job queue
+     */
+
+    scanhead->driftCorrection = correction;
+    scanhead->drift.reset();
+    JobQueue queue(scanhead, NULL, frameBuf, frameBufSize);
+
+    Job job;
+    job.x = -size / 2;
+    job.y = -size / 2;
+    job.sizeX = size;
+    job.sizeY = size;
+    job.step = step;
+    job.channels = CH_ZPOS;
+    for (int i = 0; i < numFrames; i++) queue.enqueue(job);
+
+    int frame = 0;
+    bool sampled = false;
+    while (queue.busy()) {
+        simControlPeriod();
+        queue.update();
+        if (queue.state != JobQueue::QUEUE_SCANNING) {
+            sampled = false;
+            continue;
+        }
+        if (sampled || queue.scanJob.lineIndex < queue.scanJob.numLines / 2) continue;
+
+        unsigned long now = millis();
+        float offset[3] = {0, 0, 0};
+        if (correction) {
+            offset[0] = scanhead->drift.offsetX(now);
+            offset[1] = scanhead->drift.offsetY(now);
+            offset[2] = scanhead->drift.offsetZ(now);
+        }
+        frames[frame].seconds = simSeconds();
+        for (int a = 0; a < 3; a++) frames[frame].error[a] = simBoard.sampleDrift(a) - offset[a];
+        frame += 1;
+        sampled = true;
+    }
+
+    scanhead->driftCorrection = false;
+}
+
+int main() {
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    // drifting from here on, both runs see the same rate
+    float start = simSeconds();
+    for (int a = 0; a < 3; a++) simBoard.driftPerS[a] = driftRate[a];
+
+    frame_struct uncorrected[numFrames];
+    frame_struct corrected[numFrames];
+    runFrames(false, uncorrected);
+    float runSeconds = simSeconds() - start;
+
+    // the second run starts from the drift the first left, so errors are relative to its first frame
+    runFrames(true, corrected);
+
+    printf("\n%d frames of %d LSB at step %d, drift %.0f,%.0f,%.0f LSB/s, %.1fs per frame\n", numFrames, size, step,
+            driftRate[0], driftRate[1], driftRate[2], runSeconds / numFrames);
+    printf("frame, error x, y, z uncorrected (LSB), error x, y, z corrected (LSB)\n");
+    for (int i = 0; i < numFrames; i++) {
+        printf("%d", i);
+        for (int a = 0; a < 3; a++) printf(",%.1f", uncorrected[i].error[a] - uncorrected[0].error[a]);
+        for (int a = 0; a < 3; a++) printf(",%.1f", corrected[i].error[a] - corrected[0].error[a]);
+        printf("\n");
+    }
+
+    printf("\nlast match correlation %.2f, rate %.2f,%.2f,%.2f LSB/s\n", scanhead->drift.correlation,
+            scanhead->drift.vx, scanhead->drift.vy, scanhead->drift.vz);
+    printf("tip crashes: %d\n", simBoard.crashes);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * sim_feedforward.cpp
+ * Topography error against scan speed on a tilted, textured sample with Z feed-forward off, from the fitted
+ * plane, and from the plane and previous line. Runs full ScanJob frames through the firmware.
+ */
+
+#include "simfirmware.h"
+#include "scanjob.h"
+
+static const int sizeX = 1000;
+static const int sizeY = 300;
+static const int step = 10;
+static const int skipLines = 2;      // plane fit warm-up, excluded from the error for every mode
+static const float budget = 20;      // rms topography error budget, LSB
+
+static const int numModes = 3;
+static const char * const modeNames[numModes] = {"off", "plane", "plane+line"};
+
+static int frameBuf[(sizeX / step + 1) * (sizeY / step + 1)];
+
+static float topographyError(int mode, int speed) {
+    /*!
+     * \brief scans one frame and compares Z with the true surface under the tip at every pixel
+     * @param mode zFeedForward mode
+     * @param speed maxTransverseStep, LSB per control cycle
+     * @return rms topography error in LSB, after removing the mean offset
+     */
+
+    scanhead->zFeedForward = mode;
+    scanhead->zPredictor.reset();
+    scanhead->maxTransverseStep = speed;
+
+    // starting from the frame corner, settled
+    while (simPositionStep(-sizeX / 2, -sizeY / 2, scanhead->setpoint) == 0) ;
+    for (int i = 0; i < 200; i++) simPositionStep(-sizeX / 2, -sizeY / 2, scanhead->setpoint);
+
+    ScanJob job;
+    job.begin(scanhead, frameBuf, CH_ZPOS, sizeX, sizeY, step, true);
+
+    double sum = 0;
+    double sumSq = 0;
+    long count = 0;
+    int lastSteps = 0;
+
+    while (!job.finished()) {
+        simControlPeriod();
+        job.update();
+        if (job.numSteps == lastSteps) continue;
+        lastSteps = job.numSteps;
+        if (job.lineIndex < skipLines) continue;
+
+        // z + height is constant for perfect tracking
+        float err = scanhead->zpos + scanhead->zStitchOffset
+                  + simBoard.surfaceHeight(simBoard.lateralPos(0), simBoard.lateralPos(1));
+        sum += err;
+        sumSq += err * err;
+        count += 1;
+    }
+
+    scanhead->zFeedForward = 0;
+    scanhead->maxTransverseStep = 5;
+
+    if (job.result() != 0 || count == 0) return -1;
+    double mean = sum / count;
+    return sqrt(sumSq / count - mean * mean);
+}
+
+static void sweep(const char *sample, int *fastest) {
+    /*!
+     * \brief prints topography error against speed for every feed-forward mode on the current sample
+     * @param sample sample description
+     * @param fastest numModes long array to store the fastest speed within budget, per mode
+     */
+
+    const int speeds[] = {1, 2, 3, 5, 10};
+    const int numSpeeds = sizeof(speeds) / sizeof(speeds[0]);
+    float errors[numModes][numSpeeds];
+
+    printf("\n%s: tilt %.2f x %.2f LSB/LSB, texture %.0f LSB\n", sample, simBoard.planeX, simBoard.planeY, simBoard.textureAmplitude);
+    printf("speed (LSB/cycle), pixel rate (Hz), rms topography error (LSB) with feed-forward off, plane, plane+line\n");
+    for (int i = 0; i < numSpeeds; i++) {
+        float pixelHz = 1e6 / (max((float) step / speeds[i], 1.0f) * scanhead->controlPeriodUs);
+        printf("%d,%.0f", speeds[i], pixelHz);
+
+        for (int mode = 0; mode < numModes; mode++) {
+            errors[mode][i] = topographyError(mode, speeds[i]);
+            printf(",%.1f", errors[mode][i]);
+        }
+        printf("\n");
+    }
+
+    // fastest speed such that every slower speed also meets the budget
+    for (int mode = 0; mode < numModes; mode++) {
+        fastest[mode] = 0;
+        for (int i = 0; i < numSpeeds; i++) {
+            if (errors[mode][i] < 0 || errors[mode][i] > budget) break;
+            fastest[mode] = speeds[i];
+        }
+    }
+
+    printf("fastest speed within %.0f LSB rms:", budget);
+    for (int mode = 0; mode < numModes; mode++) printf(" %s %d", modeNames[mode], fastest[mode]);
+    printf(" LSB/cycle\n");
+}
+
+int main() {
+    simBoard.planeX = 0.5;
+    simBoard.planeY = 0.3;
+    simBoard.textureAmplitude = 20;
+
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    int fastest[numModes];
+    sweep("smooth tilted sample", fastest);
+
+    simBoard.textureAmplitude = 300;
+    sweep("textured tilted sample", fastest);
+
+    printf("\ntip crashes: %d\n", simBoard.crashes);
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * sim_hysteresis.cpp
+ * Lateral tracking error against scan speed, with and without hysteresis and creep compensation.
+ * Runs the firmware calibration routines on a simulated Bouc-Wen piezo with creep and a 2kHz resonance,
+ * then sweeps maxTransverseStep over triangle scans along each axis.
+ */
+
+#include "simfirmware.h"
+
+static const int amplitude = 2000;   // LSB, triangle scan amplitude
+static const int numLines = 6;
+static const float budget = 0.01;    // rms error budget as a fraction of amplitude
+
+static float trackingError(int axis, int speed) {
+    /*!
+     * \brief rms error between true and intended position over triangle scans along one axis, skipping the first line
+     * @param axis 0 for X, 1 for Y
+     * @param speed maxTransverseStep, LSB per control cycle
+     * @return rms error in LSB
+     */
+
+    scanhead->maxTransverseStep = speed;
+
+    while (simPositionStep(axis == 0 ? -amplitude / 2 : 0, axis == 1 ? -amplitude / 2 : 0, scanhead->setpoint) == 0) ;
+
+    double sumSq = 0;
+    long count = 0;
+
+    for (int line = 0; line < numLines; line++) {
+        int target = line % 2 == 0 ? amplitude / 2 : -amplitude / 2;
+        int moveStatus = 0;
+        while (moveStatus == 0) {
+            moveStatus = simPositionStep(axis == 0 ? target : 0, axis == 1 ? target : 0, scanhead->setpoint);
+            if (line == 0) continue;
+            float err = simBoard.lateralPos(axis) - (axis == 0 ? scanhead->xpos : scanhead->ypos);
+            sumSq += err * err;
+            count += 1;
+        }
+    }
+
+    scanhead->maxTransverseStep = 5;
+    return sqrt(sumSq / count);
+}
+
+int main() {
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    const int speeds[] = {2, 5, 10, 20, 50, 100, 200, 400};
+    const int numSpeeds = sizeof(speeds) / sizeof(speeds[0]);
+    // rms errors uncompensated, with hysteresis compensation, and with hysteresis and creep compensation
+    const int numStages = 3;
+    const char *stageNames[numStages] = {"uncompensated", "hysteresis", "hysteresis+creep"};
+    float errors[numStages][2][numSpeeds];
+
+    for (int stage = 0; stage < numStages; stage++) {
+        if (stage > 0) {
+            scanhead->enableLateralCompensation(false);
+            Serial.sink = stdout;
+            for (int axis = 0; axis < 2; axis++) {
+                int status = stage == 1 ? scanhead->calibrateHysteresis(axis, amplitude)
+                                        : scanhead->calibrateCreep(axis, amplitude / 2, 4000);
+                if (status != 0) {
+                    Serial.sink = NULL;
+                    printf("axis %d %s calibration failed: %d\n", axis, stage == 1 ? "hysteresis" : "creep", status);
+                    return 1;
+                }
+            }
+            Serial.sink = NULL;
+            scanhead->enableLateralCompensation(true);
+        }
+
+        for (int axis = 0; axis < 2; axis++) {
+            for (int i = 0; i < numSpeeds; i++) errors[stage][axis][i] = trackingError(axis, speeds[i]);
+        }
+    }
+
+    printf("\nspeed (LSB/cycle), line rate (Hz), then rms error x, y (LSB) %s, %s, %s\n", stageNames[0], stageNames[1],
+            stageNames[2]);
+    int fastest[numStages][2] = {};
+    for (int i = 0; i < numSpeeds; i++) {
+        float lineHz = 1e6 / ((float) amplitude / speeds[i] * scanhead->controlPeriodUs);
+        printf("%d,%.2f", speeds[i], lineHz);
+        for (int stage = 0; stage < numStages; stage++) {
+            for (int axis = 0; axis < 2; axis++) {
+                printf(",%.1f", errors[stage][axis][i]);
+                if (errors[stage][axis][i] <= budget * amplitude) fastest[stage][axis] = speeds[i];
+            }
+        }
+        printf("\n");
+    }
+
+    printf("\nfastest speed within %.0f LSB rms (LSB/cycle):\n", budget * amplitude);
+    for (int stage = 0; stage < numStages; stage++) {
+        printf("%s x %d, y %d\n", stageNames[stage], fastest[stage][0], fastest[stage][1]);
+    }
+    printf("tip crashes: %d\n", simBoard.crashes);
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * sim_kalman.cpp
+ * Z feedback on the per-cycle mean current against feedback on the Kalman estimate, across Z gains and TIA
+ * noise levels: current regulation while holding, topography error while scanning, and the estimator's cycle cost.
+ */
+
+#include <chrono>
+#include "simfirmware.h"
+
+static const int holdCycles = 4000;
+static const int scanAmplitude = 1000;
+static const int scanSpeed = 5;       // LSB per control cycle
+static const int scanLines = 6;
+
+struct result_struct {
+    float currentError;  // rms true current error while holding, % of setpoint
+    float zJitter;       // rms Z variation while holding, LSB
+    float topography;    // rms topography error while scanning, LSB
+};
+
+static result_struct measure() {
+    /*!
+     * \brief holds the tip in place, then scans back and forth over a line
+     * @return regulation and tracking errors
+     */
+
+    result_struct result;
+
+    for (int i = 0; i < 500; i++) simPositionStep(0, 0, scanhead->setpoint);
+
+    double currentSumSq = 0;
+    double zSum = 0;
+    double zSumSq = 0;
+    for (int i = 0; i < holdCycles; i++) {
+        simPositionStep(0, 0, scanhead->setpoint);
+        float err = simBoard.junctionPA() - scanhead->setpoint;
+        currentSumSq += err * err;
+        zSum += scanhead->zpos;
+        zSumSq += (double) scanhead->zpos * scanhead->zpos;
+    }
+    float zMean = zSum / holdCycles;
+    result.currentError = 100 * sqrt(currentSumSq / holdCycles) / scanhead->setpoint;
+    result.zJitter = sqrt(zSumSq / holdCycles - zMean * zMean);
+
+    // z + height is constant for perfect tracking
+    scanhead->maxTransverseStep = scanSpeed;
+    double sum = 0;
+    double sumSq = 0;
+    long count = 0;
+    for (int line = 0; line < scanLines; line++) {
+        int target = line % 2 == 0 ? scanAmplitude / 2 : -scanAmplitude / 2;
+        while (simPositionStep(target, 0, scanhead->setpoint) == 0) {
+            if (line == 0) continue;
+            float err = scanhead->zpos + scanhead->zStitchOffset
+                      + simBoard.surfaceHeight(simBoard.lateralPos(0), simBoard.lateralPos(1));
+            sum += err;
+            sumSq += err * err;
+            count += 1;
+        }
+    }
+    while (simPositionStep(0, 0, scanhead->setpoint) == 0) ;
+    scanhead->maxTransverseStep = 5;
+
+    double mean = sum / count;
+    result.topography = sqrt(sumSq / count - mean * mean);
+    return result;
+}
+
+static float updateCostNs() {
+    /*!
+     * \brief times HeightEstimator::update on the host
+     * @return mean time per update in ns
+     */
+
+    HeightEstimator estimator;
+    const int n = 1000000;
+    volatile float sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) sink = estimator.update(500 + (i % 7), (i % 3) - 1);
+    auto end = std::chrono::steady_clock::now();
+
+    (void) sink;
+    return std::chrono::duration<float, std::nano>(end - start).count() / n;
+}
+
+int main() {
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d, true decay length %.0f LSB\n",
+            simSeconds(), scanhead->current, scanhead->zpos, simBoard.decayLSB);
+
+    const float noiseLevels[] = {20, 100};
+    const int numNoiseLevels = sizeof(noiseLevels) / sizeof(noiseLevels[0]);
+    const float gains[] = {0.5, 1, 2, 4};
+    const int numGains = sizeof(gains) / sizeof(gains[0]);
+
+    for (int i = 0; i < numNoiseLevels; i++) {
+        simBoard.currentNoisePA = noiseLevels[i];
+
+        printf("\nTIA noise %.0fpA rms per sample. ", noiseLevels[i]);
+        fflush(stdout);
+        Serial.sink = stdout;
+        scanhead->zEstimation = false;
+        int calStatus = scanhead->calibrateEstimator(100);
+        Serial.sink = NULL;
+        if (calStatus != 0) {
+            printf("estimator calibration failed: %d\n", calStatus);
+            return 1;
+        }
+
+        printf("Z gain (LSB/pA), estimator, current error (%% rms), Z jitter (LSB rms), topography error (LSB rms)\n");
+        for (int g = 0; g < numGains; g++) {
+            scanhead->pidZP = gains[g];
+            for (int estimate = 0; estimate < 2; estimate++) {
+                scanhead->zEstimation = estimate == 1;
+                scanhead->zEstimator.reset();
+                result_struct result = measure();
+                printf("%.1f,%s,%.2f,%.1f,%.1f\n", gains[g], estimate ? "kalman" : "mean",
+                        result.currentError, result.zJitter, result.topography);
+            }
+        }
+        scanhead->pidZP = 0.5;
+    }
+
+    printf("\nestimator update: %.0f ns on this host\n", updateCostNs());
+    printf("tip crashes: %d\n", simBoard.crashes);
+    return 0;
+}
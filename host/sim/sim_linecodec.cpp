@@ -0,0 +1,267 @@
+/*
+ * sim_linecodec.cpp
+ * Compression ratio and throughput of the stream's line coding on recorded frames. Each frame is streamed again
+ * through the firmware's ScanStream as text rows and as #zline records, and the coded stream is parsed back by the
+ * host library and checked against the frame value for value. The encoder and decoder are then timed alone, with
+ * the slowest pixel, which bounds the encoder's share of a streaming task run.
+ *
+ * usage: sim_linecodec [stream.txt ...]    frames saved by stmd, captured streams or archives; without any, a
+ *                                          frame scanned on the simulator
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "simfirmware.h"
+#include "jobqueue.h"
+#include "linedecoder.h"
+#include "scanframe.h"
+
+static const int frameBufSize = 100000;
+static int frameBuf[frameBufSize];
+
+static const int timingRuns = 5;
+
+struct line_struct {
+    int first; // row of the frame
+    int rows;
+};
+
+struct result_struct {
+    long rows = 0;
+    long values = 0;
+    long textBytes = 0;
+    long codedBytes = 0;
+    long mismatches = 0;   // rows not decoded to the frame's values
+    double encodeNs = 0;   // per pixel
+    double worstPixelNs = 0;
+    double decodeNs = 0;
+};
+
+static std::vector<line_struct> splitLines(const ScanFrame &frame) {
+    // rows run on a pixel at a time within a line; a line starts where that breaks or at a multiple of the width
+    std::vector<line_struct> lines;
+    for (int r = 0; r < frame.numRows(); r++) {
+        int pixel = frame.pixels[r];
+        bool starts = lines.empty() || pixel != frame.pixels[r - 1] + 1 || (frame.width > 0 && pixel % frame.width == 0);
+        if (starts) lines.push_back({r, 0});
+        lines.back().rows += 1;
+    }
+    return lines;
+}
+
+static std::vector<char> streamFrame(const ScanFrame &frame, const std::vector<line_struct> &lines, bool compressed) {
+    /*!
+     * \brief writes the frame through a ScanStream, as the head would have sent it
+     * @return the stream text
+     */
+
+    char *text = NULL;
+    size_t length = 0;
+    Serial.sink = open_memstream(&text, &length);
+
+    int maxPixel = 0;
+    for (int r = 0; r < frame.numRows(); r++) maxPixel = max(maxPixel, frame.pixels[r]);
+    std::vector<int> data((size_t) (maxPixel + 1) * frame.numChannels);
+
+    ScanStream *stream = new ScanStream(); // its reference lines are too large for the stack
+    stream->compressed = compressed;
+    stream->beginFrame(frame.channels, frame.width, frame.height, frame.step);
+    for (size_t i = 0; i < lines.size(); i++) {
+        int first = frame.pixels[lines[i].first];
+        const int *values = frame.values.data() + (size_t) lines[i].first * frame.numChannels;
+        std::copy(values, values + lines[i].rows * frame.numChannels, data.begin() + (size_t) first * frame.numChannels);
+        stream->writeLine(i, data.data(), first, lines[i].rows);
+    }
+    stream->endFrame(0);
+    delete stream;
+
+    fclose(Serial.sink);
+    Serial.sink = NULL;
+    std::vector<char> out(text, text + length);
+    free(text);
+    return out;
+}
+
+static result_struct measure(const ScanFrame &frame) {
+    /*!
+     * \brief streams, decodes and times one frame
+     * @return sizes, mismatches and timings
+     */
+
+    result_struct result;
+    std::vector<line_struct> lines = splitLines(frame);
+    int numChannels = frame.numChannels;
+    result.rows = frame.numRows();
+    result.values = (long) frame.numRows() * numChannels;
+
+    std::vector<char> text = streamFrame(frame, lines, false);
+    std::vector<char> coded = streamFrame(frame, lines, true);
+    result.textBytes = text.size();
+    result.codedBytes = coded.size();
+
+    std::vector<ScanFrame> decoded;
+    if (parseFrames(coded.data(), coded.size(), decoded) != 1 || decoded[0].numRows() != frame.numRows()) {
+        result.mismatches = frame.numRows();
+    }
+    else {
+        for (int r = 0; r < frame.numRows(); r++) {
+            bool same = decoded[0].pixels[r] == frame.pixels[r];
+            for (int ch = 0; ch < numChannels; ch++) {
+                same = same && decoded[0].values[(size_t) r * numChannels + ch] == frame.values[(size_t) r * numChannels + ch];
+            }
+            if (!same) result.mismatches += 1;
+        }
+    }
+
+    // the encoder alone, as the streaming task runs it
+    LineEncoder *encoder = new LineEncoder();
+    char digits[LineEncoder::maxPixelDigits];
+    volatile int sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int run = 0; run < timingRuns; run++) {
+        encoder->beginFrame(numChannels);
+        for (size_t i = 0; i < lines.size(); i++) {
+            const int *values = frame.values.data() + (size_t) lines[i].first * numChannels;
+            encoder->beginLine(lines[i].rows);
+            for (int p = 0; p < lines[i].rows; p++) sink = sink + encoder->encodePixel(values + p * numChannels, digits);
+            sink = sink + encoder->endLine(digits);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    result.encodeNs = std::chrono::duration<double, std::nano>(end - start).count() / timingRuns / frame.numRows();
+
+    // each pixel's fastest run, so the worst is the coding's and not the host scheduler's
+    std::vector<double> pixelNs(frame.numRows(), 1e12);
+    for (int run = 0; run < timingRuns; run++) {
+        encoder->beginFrame(numChannels);
+        for (size_t i = 0; i < lines.size(); i++) {
+            const int *values = frame.values.data() + (size_t) lines[i].first * numChannels;
+            encoder->beginLine(lines[i].rows);
+            for (int p = 0; p < lines[i].rows; p++) {
+                auto pixelStart = std::chrono::steady_clock::now();
+                sink = sink + encoder->encodePixel(values + p * numChannels, digits);
+                auto pixelEnd = std::chrono::steady_clock::now();
+                double &ns = pixelNs[lines[i].first + p];
+                ns = std::min(ns, std::chrono::duration<double, std::nano>(pixelEnd - pixelStart).count());
+            }
+            sink = sink + encoder->endLine(digits);
+        }
+    }
+    result.worstPixelNs = *std::max_element(pixelNs.begin(), pixelNs.end());
+    delete encoder;
+
+    // the decoder on the #zline records alone
+    std::vector<std::pair<const char *, const char *>> records;
+    for (const char *p = coded.data(), *textEnd = coded.data() + coded.size(); p < textEnd;) {
+        const char *lineEnd = (const char *) memchr(p, '\n', textEnd - p);
+        if (lineEnd == NULL) lineEnd = textEnd;
+        const char *next = lineEnd + 1;
+        if (lineEnd > p && lineEnd[-1] == '\r') lineEnd--;
+        if (lineEnd - p > 7 && memcmp(p, "#zline,", 7) == 0) records.push_back(std::make_pair(p + 7, lineEnd));
+        p = next;
+    }
+    LineDecoder decoder;
+    std::vector<int> pixels, values;
+    int lineIndex;
+    start = std::chrono::steady_clock::now();
+    for (int run = 0; run < timingRuns; run++) {
+        decoder.beginFrame(frame.channels);
+        for (size_t i = 0; i < records.size(); i++) {
+            sink = sink + decoder.decode(records[i].first, records[i].second, &lineIndex, pixels, values);
+        }
+    }
+    end = std::chrono::steady_clock::now();
+    result.decodeNs = std::chrono::duration<double, std::nano>(end - start).count() / timingRuns / frame.numRows();
+
+    return result;
+}
+
+static void printResult(const char *name, const result_struct &result) {
+    printf("%s,%ld,%ld,%ld,%.2f,%.2f,%.1f,%.1f,%.0f,%.1f,%ld\n", name, result.rows, result.textBytes, result.codedBytes,
+            (double) result.textBytes / result.codedBytes, (double) result.values * 4 / result.codedBytes,
+            8.0 * result.codedBytes / result.values, result.encodeNs, result.worstPixelNs, result.decodeNs,
+            result.mismatches);
+}
+
+static int scanFrame(std::vector<ScanFrame> &frames) {
+    /*!
+     * \brief scans a textured sample on the simulator, capturing the stream
+     * @return 0, -1 if the approach failed
+     */
+
+    simBoot();
+    if (simApproach() != 0) return -1;
+
+    char *text = NULL;
+    size_t length = 0;
+    Serial.sink = open_memstream(&text, &length);
+
+    JobQueue queue(scanhead, NULL, frameBuf, frameBufSize);
+    Job job;
+    job.x = -320;
+    job.y = -320;
+    job.sizeX = 640;
+    job.sizeY = 640;
+    job.step = 10;
+    job.channels = CH_XPOS | CH_YPOS | CH_ZPOS | CH_CURRENT;
+    queue.enqueue(job);
+    while (queue.busy()) {
+        simControlPeriod();
+        queue.update();
+    }
+    scanhead->stream.flush();
+
+    fclose(Serial.sink);
+    Serial.sink = NULL;
+    parseFrames(text, length, frames);
+    free(text);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    std::vector<ScanFrame> frames;
+    std::vector<std::string> names;
+
+    if (argc < 2) {
+        if (scanFrame(frames) != 0) {
+            printf("approach failed\n");
+            return 1;
+        }
+        names.push_back("simulated");
+    }
+    for (int i = 1; i < argc; i++) {
+        size_t before = frames.size();
+        if (readFrames(argv[i], frames) < 0) {
+            fprintf(stderr, "%s: could not read\n", argv[i]);
+            return 1;
+        }
+        for (size_t f = before; f < frames.size(); f++) names.push_back(argv[i]);
+    }
+
+    printf("frame,rows,text bytes,coded bytes,ratio to text,ratio to int32,bits per value,encode ns/pixel,"
+            "worst pixel ns,decode ns/pixel,mismatched rows\n");
+    result_struct total;
+    for (size_t f = 0; f < frames.size(); f++) {
+        if (frames[f].numRows() == 0) continue;
+        result_struct result = measure(frames[f]);
+        printResult(names[f].c_str(), result);
+
+        total.encodeNs = (total.encodeNs * total.rows + result.encodeNs * result.rows) / (total.rows + result.rows);
+        total.decodeNs = (total.decodeNs * total.rows + result.decodeNs * result.rows) / (total.rows + result.rows);
+        total.worstPixelNs = std::max(total.worstPixelNs, result.worstPixelNs);
+        total.rows += result.rows;
+        total.values += result.values;
+        total.textBytes += result.textBytes;
+        total.codedBytes += result.codedBytes;
+        total.mismatches += result.mismatches;
+    }
+    if (total.rows == 0) return 1;
+    printResult("total", total);
+
+    printf("\nat most %d digits per pixel of %d channels; coded losslessly: %s\n", LineEncoder::maxPixelDigits,
+            numScanChannels, total.mismatches == 0 ? "yes" : "NO");
+    return total.mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,158 @@
+/*
+ * sim_lockin.cpp
+ * dI/dV lock-in against a junction with a density of states resonance. Prints the lock-in conductance against
+ * the junction's at a range of biases, the noise for a few time constants, and a single pass dI/dV image of a
+ * sample whose resonance is confined to a few patches, correlated with the patches and the topography.
+ */
+
+#include "simfirmware.h"
+#include "scanjob.h"
+
+static const float peakV = -0.3; // the feedback needs a negative bias
+static const float peakWidthV = 0.08;
+static const float peakHeight = 3;
+
+static const int imageSize = 400;
+static const int imageStep = 10;
+static const int imagePixels = imageSize / imageStep;
+static int frameBuf[imagePixels * imagePixels * 2];
+
+struct patch_struct {
+    float x;
+    float y;
+};
+
+static const int numPatches = 4;
+static const patch_struct patches[numPatches] = {{100, 100}, {300, 120}, {150, 300}, {320, 310}};
+static const float patchRadius = 50;
+
+static float patchWeight(float x, float y) {
+    // resonance only on discs with soft edges
+    float weight = 0;
+    for (int i = 0; i < numPatches; i++) {
+        float r = sqrtf((x - patches[i].x) * (x - patches[i].x) + (y - patches[i].y) * (y - patches[i].y));
+        weight += 1 / (1 + expf((r - patchRadius) / 5));
+    }
+    return weight > 1 ? 1 : weight;
+}
+
+struct reading_struct {
+    float didv;       // lock-in in phase, pS
+    float quadrature; // pS
+    float model;      // the junction's dI/dV, pS
+    float noise;      // rms of the in-phase output about its mean, pS
+};
+
+static reading_struct hold(int cycles) {
+    /*!
+     * \brief holds (0, 0) under feedback, averaging the lock-in outputs and the junction conductance every cycle
+     */
+
+    double sum = 0, sumSq = 0, sumQ = 0, sumModel = 0;
+    for (int i = 0; i < cycles; i++) {
+        simPositionStep(0, 0, scanhead->setpoint);
+        float didv = scanhead->didvPS();
+        sum += didv;
+        sumSq += didv * didv;
+        sumQ += scanhead->didvQuadraturePS();
+        sumModel += simBoard.conductancePS();
+    }
+
+    reading_struct reading;
+    reading.didv = sum / cycles;
+    reading.quadrature = sumQ / cycles;
+    reading.model = sumModel / cycles;
+    float variance = sumSq / cycles - reading.didv * reading.didv;
+    reading.noise = sqrtf(variance > 0 ? variance : 0);
+    return reading;
+}
+
+static float correlation(const float *a, const float *b, int n) {
+    double ma = 0, mb = 0;
+    for (int i = 0; i < n; i++) {
+        ma += a[i] / n;
+        mb += b[i] / n;
+    }
+    double ab = 0, aa = 0, bb = 0;
+    for (int i = 0; i < n; i++) {
+        ab += (a[i] - ma) * (b[i] - mb);
+        aa += (a[i] - ma) * (a[i] - ma);
+        bb += (b[i] - mb) * (b[i] - mb);
+    }
+    return ab / sqrt(aa * bb);
+}
+
+int main() {
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    simBoard.ldosPeakV = peakV;
+    simBoard.ldosPeakWidthV = peakWidthV;
+    simBoard.ldosPeakHeight = peakHeight;
+
+    LockIn &lockIn = scanhead->lockIn;
+    printf("\nresonance %.2fV, %.2fV wide, %.0fx the flat density of states\n", peakV, peakWidthV, peakHeight);
+    printf("modulation %.0fHz, %.0fmV, time constant %.0fus\n", lockIn.frequencyHz, lockIn.amplitudeMV,
+            lockIn.timeConstantUs);
+    printf("bias (mV), lock-in dI/dV (pS), junction dI/dV (pS), error (%%), quadrature (pS)\n");
+
+    const int biases[] = {-800, -600, -500, -400, -350, -300, -250, -200, -150, -100};
+    scanhead->enableLockIn(true);
+    for (int i = 0; i < 10; i++) {
+        scanhead->setBias(biases[i]);
+        hold(300);
+        reading_struct reading = hold(2000);
+        printf("%d,%.0f,%.0f,%.1f,%.0f\n", biases[i], reading.didv, reading.model,
+                100 * (reading.didv - reading.model) / reading.model, reading.quadrature);
+    }
+
+    printf("\nat the resonance: time constant (us), in-phase noise (pS rms), mean (pS)\n");
+    const float timeConstants[] = {300, 1000, 3000, 10000};
+    scanhead->setBias(peakV * 1000);
+    for (int i = 0; i < 4; i++) {
+        lockIn.timeConstantUs = timeConstants[i];
+        scanhead->enableLockIn(true);
+        hold(20 * (int) (timeConstants[i] / 1000) + 100);
+        reading_struct reading = hold(1000);
+        printf("%.0f,%.1f,%.0f\n", timeConstants[i], reading.noise, reading.didv);
+    }
+
+    // single pass image, resonance on the patches only
+    lockIn.timeConstantUs = 1000;
+    scanhead->enableLockIn(true);
+    simBoard.ldosWeight = patchWeight;
+    while (simPositionStep(0, 0, scanhead->setpoint) == 0) ;
+    hold(500);
+
+    ScanJob job;
+    float start = simSeconds();
+    job.begin(scanhead, frameBuf, CH_ZPOS | CH_DIDV, imageSize, imageSize, imageStep, true);
+    while (!job.finished()) {
+        simControlPeriod();
+        job.update();
+    }
+    float seconds = simSeconds() - start;
+
+    const int n = imagePixels * imagePixels;
+    static float weight[n], didv[n], z[n];
+    for (int row = 0; row < imagePixels; row++) {
+        for (int col = 0; col < imagePixels; col++) {
+            int i = row * imagePixels + col;
+            weight[i] = patchWeight(col * imageStep, row * imageStep);
+            z[i] = framePixel(frameBuf, 2, 0, imagePixels, col, row);
+            didv[i] = -framePixel(frameBuf, 2, 1, imagePixels, col, row); // negative at negative bias
+        }
+    }
+    printf("\n%dx%d image at %.0fmV in %.1fs, result %d\n", imagePixels, imagePixels, peakV * 1000, seconds,
+            job.result());
+    printf("correlation with the resonance patches: |dI/dV| %.2f, topography %.2f\n", correlation(didv, weight, n),
+            correlation(z, weight, n));
+
+    scanhead->enableLockIn(false);
+    printf("\ntip crashes: %d\n", simBoard.crashes);
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * sim_preview.cpp
+ * Live scan preview over a tilted, textured sample. Drains the preview's dirty pages after every line as the display
+ * task would, prints the pages and bytes pushed per line and the range growth, then the final preview as text.
+ */
+
+#include "simfirmware.h"
+#include "jobqueue.h"
+
+static const int sizeX = 800;
+static const int sizeY = 400;
+static const int step = 10;
+
+static const int frameBufSize = 100000;
+static int frameBuf[frameBufSize];
+
+int main() {
+    simBoot();
+    simBoard.planeX = 0.4; // far more tilt than texture, which the line leveling removes
+    simBoard.planeY = 0.2;
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    JobQueue queue(scanhead, NULL, frameBuf, frameBufSize);
+    Job job;
+    job.x = -sizeX / 2;
+    job.y = -sizeY / 2;
+    job.sizeX = sizeX;
+    job.sizeY = sizeY;
+    job.step = step;
+    job.channels = CH_ZPOS;
+    queue.enqueue(job);
+
+    ScanPreview &preview = scanhead->preview;
+    uint8_t page[ScanPreview::width];
+    int lines = 0;
+    int pagesPushed = 0;
+    int maxPages = 0;
+    int regrows = 0;
+    int lastLow = 0;
+    int lastHigh = 0;
+
+    printf("\nline, pages pushed, low, high\n");
+    while (queue.busy()) {
+        simControlPeriod();
+        queue.update();
+        if (preview.linesAdded == lines) continue;
+        lines = preview.linesAdded;
+
+        int pages = 0;
+        for (int p = preview.nextDirtyPage(); p >= 0; p = preview.nextDirtyPage()) {
+            preview.renderPage(p, page);
+            pages += 1;
+        }
+        pagesPushed += pages;
+        if (pages > maxPages) maxPages = pages;
+        if (lines > 1 && (preview.low != lastLow || preview.high != lastHigh)) regrows += 1;
+        lastLow = preview.low;
+        lastHigh = preview.high;
+        if (lines <= 8 || lines % 8 == 0) printf("%d,%d,%d,%d\n", lines, pages, preview.low, preview.high);
+    }
+
+    printf("\n%d lines: %.2f pages (%.0f bytes) per line, at most %d, range grew on %d lines\n", lines,
+            (float) pagesPushed / lines, (float) pagesPushed * ScanPreview::width / lines, maxPages, regrows);
+
+    // the final preview, one character per pixel
+    preview.invalidate();
+    uint8_t pages[ScanPreview::numPages][ScanPreview::width];
+    for (int p = preview.nextDirtyPage(); p >= 0; p = preview.nextDirtyPage()) preview.renderPage(p, pages[p]);
+    printf("\n");
+    for (int row = 0; row < ScanPreview::height; row++) {
+        for (int col = 0; col < ScanPreview::width; col++) {
+            putchar((pages[row / 8][col] >> (row % 8)) & 1 ? '#' : '.');
+        }
+        putchar('\n');
+    }
+
+    printf("tip crashes: %d\n", simBoard.crashes);
+    return 0;
+}
@@ -0,0 +1,431 @@
+/*
+ * sim_replay.cpp
+ * Replays a control loop trace (trace dump on the head) through the firmware: every recorded TIA reading goes
+ * through readTia(), the notch filter and the integrators, and every control cycle through setPositionStep(), in
+ * the recorded order and at the recorded times. The DAC writes the replay makes are compared with the recorded
+ * ones, and the replay is timed against the time the trace took.
+ *
+ * usage: sim_replay [-r runs] [name=value ...] [trace.txt]
+ *
+ *   -r          replays to time, the fastest is reported (5)
+ *   name=value  replays with a changed parameter: zgain (milli LSB per pA), zstep, transstep, notch (Hz)
+ *   trace.txt   a file holding the printed trace, such as a terminal capture or the daemon's device.log. Without
+ *               one, a trace of a scan is recorded on the simulator and replayed
+ *
+ * With the firmware unchanged and no parameter changed the replay must write what the head wrote, and exits 1 if
+ * it did not. Changing the filter or controller, or a parameter, shows what it would have done with the same
+ * readings, which do not respond to the changed output: the replay runs open loop.
+ */
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "simfirmware.h"
+#include "jobqueue.h"
+
+static const int frameBufSize = 100000;
+static int frameBuf[frameBufSize];
+
+static const int recordWords = 1 << 18; // trace recorded on the simulator, about 6s of scanning
+
+struct trace_struct {
+    ScanHead::trace_state_struct state;
+    std::vector<uint16_t> words;
+    bool full = false;
+};
+
+struct dac_write_struct {
+    int channel;
+    int value;
+    int cycle; // control cycles before the write
+};
+
+struct replay_struct {
+    std::vector<dac_write_struct> writes;
+    long samples = 0;
+    long cycles = 0;
+    double seconds = 0;  // host time
+    bool full = false;   // the replay's own trace ran out of room
+};
+
+static bool parseBits(const char *text, float *value) {
+    char *end;
+    uint32_t bits = strtoul(text, &end, 16);
+    memcpy(value, &bits, sizeof(bits));
+    return end != text;
+}
+
+static bool parseState(const char *fields, ScanHead::trace_state_struct &t) {
+    /*!
+     * \brief reads a #tstate record's key=value list into a snapshot
+     * @return true if every key the snapshot needs was present
+     */
+
+    std::map<std::string, std::string> values;
+    std::string text = fields;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t comma = text.find(',', start);
+        if (comma == std::string::npos) comma = text.size();
+        std::string item = text.substr(start, comma - start);
+        size_t eq = item.find('=');
+        if (eq != std::string::npos) values[item.substr(0, eq)] = item.substr(eq + 1);
+        start = comma + 1;
+    }
+
+    struct { const char *key; int *field; } ints[] = {
+        {"xpos", &t.xpos}, {"ypos", &t.ypos}, {"zpos", &t.zpos}, {"zstitch", &t.zStitchOffset},
+        {"current", &t.current}, {"currentraw", &t.currentRaw}, {"sum", &t.currentSum},
+        {"sumraw", &t.currentSumRaw}, {"samples", &t.numCurrentSamples}, {"zlaststep", &t.zLastStep},
+        {"maxzstep", &t.maxZStep}, {"maxxystep", &t.maxTransverseStep}, {"controlus", &t.controlPeriodUs},
+        {"bias", &t.sampleBias}, {"zff", &t.zFeedForward}};
+    struct { const char *key; float *field; } floats[] = {
+        {"xint", &t.xIntErr}, {"yint", &t.yIntErr}, {"zint", &t.zIntErr}, {"xprev", &t.xPrevErr},
+        {"yprev", &t.yPrevErr}, {"zprev", &t.zPrevErr}, {"zffrem", &t.zFeedForwardRemainder},
+        {"zerocurrent", &t.calibratedNoCurrent}, {"pidzp", &t.pidZP}, {"notchhz", &t.notchHz}};
+    struct { const char *key; bool *field; } flags[] = {
+        {"zest", &t.zEstimation}, {"drift", &t.driftCorrection}, {"lateralcomp", &t.lateralCompensation},
+        {"lockin", &t.lockIn}};
+
+    if (values.count("startus") == 0) return false;
+    t.startUs = strtoul(values["startus"].c_str(), NULL, 10);
+    for (auto &f : ints) {
+        if (values.count(f.key) == 0) return false;
+        *f.field = atoi(values[f.key].c_str());
+    }
+    for (auto &f : floats) {
+        if (values.count(f.key) == 0 || !parseBits(values[f.key].c_str(), f.field)) return false;
+    }
+    for (auto &f : flags) {
+        if (values.count(f.key) == 0) return false;
+        *f.field = atoi(values[f.key].c_str()) != 0;
+    }
+
+    // the filter state, '/' separated
+    if (values.count("filter") == 0) return false;
+    const char *p = values["filter"].c_str();
+    for (int i = 0; i < SOS::stateSize; i++) {
+        if (!parseBits(p, &t.filter[i])) return false;
+        p = strchr(p, '/');
+        if (p == NULL && i < SOS::stateSize - 1) return false;
+        if (p != NULL) p++;
+    }
+    return true;
+}
+
+static int parseTrace(const char *text, size_t length, trace_struct &trace) {
+    /*!
+     * \brief finds the last complete trace in printed text. Records may follow a prefix, as in device.log
+     * @return 0, -1 if there is no complete trace
+     */
+
+    trace_struct current;
+    bool open = false;
+    bool found = false;
+    int expected = 0;
+
+    for (const char *p = text, *textEnd = text + length; p < textEnd;) {
+        const char *lineEnd = (const char *) memchr(p, '\n', textEnd - p);
+        if (lineEnd == NULL) lineEnd = textEnd;
+        std::string line(p, lineEnd);
+        p = lineEnd + 1;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+
+        size_t hash = line.find("#t");
+        if (hash == std::string::npos) continue;
+        const char *s = line.c_str() + hash;
+
+        if (strncmp(s, "#trace,", 7) == 0) {
+            current = trace_struct();
+            int full = 0;
+            open = sscanf(s + 7, "%d,%d", &expected, &full) == 2 && expected >= 0;
+            current.full = full != 0;
+            current.words.reserve(expected);
+        }
+        else if (!open) continue;
+        else if (strncmp(s, "#tstate,", 8) == 0) {
+            open = parseState(s + 8, current.state);
+        }
+        else if (strncmp(s, "#tdata,", 7) == 0) {
+            // a record lost on the way leaves a gap in the offsets, and the trace cannot be replayed past it
+            char *digits;
+            long offset = strtol(s + 7, &digits, 10);
+            if (*digits != ',' || offset != (long) current.words.size()) {
+                open = false;
+                continue;
+            }
+            digits++;
+            size_t n = strlen(digits);
+            for (size_t i = 0; i + 4 <= n; i += 4) {
+                char word[5] = {digits[i], digits[i + 1], digits[i + 2], digits[i + 3], '\0'};
+                current.words.push_back((uint16_t) strtoul(word, NULL, 16));
+            }
+        }
+        else if (strncmp(s, "#tend,", 6) == 0) {
+            if (atoi(s + 6) == expected && (int) current.words.size() == expected) {
+                trace = current;
+                found = true;
+            }
+            open = false;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+static std::vector<dac_write_struct> dacWrites(const uint16_t *words, int length) {
+    /*!
+     * \brief lists a trace's DAC writes, each with the control cycles before it
+     */
+
+    std::vector<dac_write_struct> writes;
+    int cycle = 0;
+    for (int i = 0; i < length; i++) {
+        if (words[i] != traceEscape) continue;
+        if (++i >= length) break;
+        int kind = words[i] & 0xff;
+        if (kind == TRACE_DAC && i + 1 < length) {
+            writes.push_back({words[i] >> 8, words[i + 1], cycle});
+            i += 1;
+        }
+        else if (kind == TRACE_CONTROL) {
+            cycle += 1;
+            i += 8;
+        }
+    }
+    return writes;
+}
+
+static replay_struct replay(const trace_struct &trace, const ScanHead::trace_state_struct &state) {
+    /*!
+     * \brief runs a trace through a fresh ScanHead, with no sampling interrupt: the trace's readings are the only
+     *        samples it takes
+     * @param state the snapshot to start from, the trace's own or with changed parameters
+     * @return the DAC writes of the replay, what it processed and how long it took
+     */
+
+    replay_struct result;
+    delete scanhead;
+    scanhead = new ScanHead();
+    scanhead->restoreTrace(state);
+
+    std::vector<uint16_t> out(trace.words.size() * 2 + 64);
+    scanhead->beginTrace(out.data(), out.size());
+
+    // recorded microseconds map onto the simulated clock from the snapshot on
+    uint64_t baseUs = simTimeUs;
+    const uint16_t *words = trace.words.data();
+    int length = trace.words.size();
+    bool pending = false;
+    int args[3] = {0, 0, 0};
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < length; i++) {
+        int word = words[i];
+        if (word != traceEscape) {
+            simBoard.tiaOverride = word;
+            scanhead->sampleCurrent();
+            result.samples += 1;
+            continue;
+        }
+        if (++i >= length) break;
+
+        int kind = words[i] & 0xff;
+        if (kind == TRACE_SAMPLE) {
+            simBoard.tiaOverride = traceEscape;
+            scanhead->sampleCurrent();
+            result.samples += 1;
+        }
+        else if (kind == TRACE_DAC) i += 1;
+        else if (kind == TRACE_CONTROL && i + 8 < length) {
+            uint32_t fields[4];
+            for (int f = 0; f < 4; f++) fields[f] = words[i + 1 + 2 * f] | (uint32_t) words[i + 2 + 2 * f] << 16;
+            i += 8;
+
+            uint64_t atUs = baseUs + (uint32_t) (fields[0] - state.startUs);
+            if (atUs > simTimeUs) simAdvance(atUs - simTimeUs);
+            for (int a = 0; a < 3; a++) args[a] = (int) fields[a + 1];
+            pending = true;
+        }
+        else if (kind == TRACE_FETCH) {
+            // a control cycle's own fetch, or another caller's
+            if (pending) {
+                scanhead->setPositionStep(args[0], args[1], args[2]);
+                result.cycles += 1;
+            }
+            else scanhead->fetchCurrent();
+            pending = false;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    scanhead->trace.stop();
+    simBoard.tiaOverride = -1;
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.full = scanhead->trace.full;
+    result.writes = dacWrites(out.data(), scanhead->trace.length);
+    return result;
+}
+
+static int recordTrace(std::vector<char> &text) {
+    /*!
+     * \brief scans a textured sample on the simulator and prints a trace of its control loop, from a second in
+     * @return 0, -1 if the approach failed
+     */
+
+    simBoot();
+    if (simApproach() != 0) return -1;
+
+    JobQueue queue(scanhead, NULL, frameBuf, frameBufSize);
+    Job job;
+    job.x = -500;
+    job.y = -500;
+    job.sizeX = 1000;
+    job.sizeY = 1000;
+    job.step = 10;
+    queue.enqueue(job);
+
+    std::vector<uint16_t> words(recordWords);
+    float traceAt = simSeconds() + 1;
+    while (queue.busy() && (scanhead->trace.active || !scanhead->trace.full)) {
+        simControlPeriod();
+        queue.update();
+        if (!scanhead->trace.active && !scanhead->trace.full && simSeconds() > traceAt) {
+            scanhead->beginTrace(words.data(), recordWords);
+        }
+    }
+    scanhead->trace.stop();
+    simStopSampling();
+
+    char *buf = NULL;
+    size_t length = 0;
+    Serial.sink = open_memstream(&buf, &length);
+    scanhead->printTrace();
+    fclose(Serial.sink);
+    Serial.sink = NULL;
+    text.assign(buf, buf + length);
+    free(buf);
+    return 0;
+}
+
+static bool readFile(const char *path, std::vector<char> &text) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return false;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) text.insert(text.end(), buf, buf + n);
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    const char *path = NULL;
+    std::vector<std::pair<std::string, float>> changes;
+
+    for (int i = 1; i < argc; i++) {
+        const char *eq = strchr(argv[i], '=');
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) runs = max(atoi(argv[++i]), 1);
+        else if (eq != NULL) changes.push_back(std::make_pair(std::string((const char *) argv[i], eq), (float) atof(eq + 1)));
+        else if (argv[i][0] != '-' && path == NULL) path = argv[i];
+        else {
+            fprintf(stderr, "usage: sim_replay [-r runs] [name=value ...] [trace.txt]\n");
+            return 1;
+        }
+    }
+
+    std::vector<char> text;
+    if (path == NULL) {
+        if (recordTrace(text) != 0) {
+            printf("approach failed\n");
+            return 1;
+        }
+        path = "simulated";
+    }
+    else if (!readFile(path, text)) {
+        fprintf(stderr, "%s: could not read\n", path);
+        return 1;
+    }
+
+    trace_struct trace;
+    if (parseTrace(text.data(), text.size(), trace) != 0) {
+        fprintf(stderr, "%s: no complete trace\n", path);
+        return 1;
+    }
+
+    ScanHead::trace_state_struct state = trace.state;
+    for (size_t c = 0; c < changes.size(); c++) {
+        const std::string &name = changes[c].first;
+        float value = changes[c].second;
+        if (name == "zgain") state.pidZP = value / 1000;
+        else if (name == "zstep") state.maxZStep = (int) value;
+        else if (name == "transstep") state.maxTransverseStep = (int) value;
+        else if (name == "notch") state.notchHz = value;
+        else {
+            fprintf(stderr, "unknown parameter %s, one of zgain, zstep, transstep, notch\n", name.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<dac_write_struct> recorded = dacWrites(trace.words.data(), trace.words.size());
+    replay_struct result;
+    double fastest = 1e30;
+    for (int run = 0; run < runs; run++) {
+        result = replay(trace, state);
+        fastest = std::min(fastest, result.seconds);
+    }
+
+    // the trace's span, from the snapshot to its last control cycle
+    uint32_t lastUs = trace.state.startUs;
+    for (size_t i = 0; i + 9 < trace.words.size(); i++) {
+        if (trace.words[i] == traceEscape && (trace.words[i + 1] & 0xff) == TRACE_CONTROL) {
+            lastUs = trace.words[i + 2] | (uint32_t) trace.words[i + 3] << 16;
+            i += 9;
+        }
+        else if (trace.words[i] == traceEscape) i += 1;
+    }
+    double spanS = (uint32_t) (lastUs - trace.state.startUs) * 1e-6;
+
+    printf("%s: %d halfwords%s, %ld readings, %ld control cycles, %ld DAC writes over %.3fs\n", path,
+           (int) trace.words.size(), trace.full ? " (buffer filled)" : "", result.samples, result.cycles,
+           (long) recorded.size(), spanS);
+    if (trace.state.zFeedForward != 0 || trace.state.zEstimation || trace.state.driftCorrection ||
+            trace.state.lateralCompensation || trace.state.lockIn) {
+        printf("recorded with feed-forward, estimator, drift, compensation or lock-in on, which restart afresh\n");
+    }
+    printf("replay: %.1fms, %.0f times real time, %.1fns per reading, %.0fns per control cycle\n", fastest * 1e3,
+           spanS / fastest, fastest * 1e9 / max(result.samples, 1L), fastest * 1e9 / max(result.cycles, 1L));
+
+    // recorded and replayed DAC writes, pairwise
+    size_t n = std::min(recorded.size(), result.writes.size());
+    long differing = 0;
+    int firstDiffering = -1;
+    int largest = 0;
+    double sumSq = 0;
+    for (size_t i = 0; i < n; i++) {
+        int diff = result.writes[i].value - recorded[i].value;
+        if (result.writes[i].channel != recorded[i].channel) diff = 65536;
+        if (diff == 0) continue;
+        if (firstDiffering < 0) firstDiffering = i;
+        differing += 1;
+        largest = max(largest, abs(diff));
+        sumSq += (double) diff * diff;
+    }
+    // a trace that filled may have lost the rest of its last cycle's four writes, which the replay still makes
+    long unchecked = result.writes.size() > recorded.size() ? result.writes.size() - recorded.size() : 0;
+    bool identical = differing == 0 && !result.full && (result.writes.size() == recorded.size() ||
+            (trace.full && unchecked <= 4 && result.writes.size() > recorded.size()));
+
+    printf("DAC writes: %ld recorded, %ld replayed, %ld differing", (long) recorded.size(),
+           (long) result.writes.size(), differing);
+    if (firstDiffering >= 0) {
+        printf(" from control cycle %d, largest %d LSB, rms %.1f LSB", recorded[firstDiffering].cycle, largest,
+               sqrt(sumSq / n));
+    }
+    if (trace.full && unchecked > 0 && unchecked <= 4) printf(", %ld more after the buffer filled", unchecked);
+    printf("\nreplay matches the head: %s\n", identical ? "yes" : "NO");
+
+    if (!changes.empty()) return 0;
+    return identical ? 0 : 1;
+}
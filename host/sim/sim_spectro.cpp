@@ -0,0 +1,147 @@
+/*
+ * sim_spectro.cpp
+ * Grid spectroscopy through the job queue: a 64x64 I(V) map of 200 point curves and a small I(z) grid. Prints
+ * the map time against one point per control cycle, the I(V) error against the simulated ohmic junction, and
+ * the decay length fitted to the I(z) curves against the simulated one. Curves are parsed back from the stream.
+ */
+
+#include "simfirmware.h"
+#include "jobqueue.h"
+
+static const int frameBufSize = 100000; // as on the Teensy
+static int frameBuf[frameBufSize];
+
+struct curve_stats_struct {
+    int curves;
+    int points;
+    double sumSqErr;     // I(V): squared error against the ohmic junction at the setpoint
+    double sumLogSlope;  // I(z): slope of ln(current) against z, per curve
+    int slopes;
+};
+
+static float runGrid(JobQueue &queue, const Job &job, FILE *stream) {
+    /*!
+     * \brief runs one spectroscopy job, streaming to stream as the scheduler would between control cycles
+     * @return seconds taken
+     */
+
+    Serial.sink = stream;
+    scanhead->stream.buffered = true;
+    queue.enqueue(job);
+
+    float start = simSeconds();
+    while (queue.busy()) {
+        simControlPeriod();
+        queue.update();
+        scanhead->stream.update(8);
+    }
+    scanhead->stream.flush();
+    float seconds = simSeconds() - start;
+
+    Serial.sink = NULL;
+    scanhead->stream.buffered = false;
+    return seconds;
+}
+
+static curve_stats_struct readCurves(FILE *stream, int setpoint, int referenceMV) {
+    /*!
+     * \brief parses the curves of the last frame in stream, rows of point, z, current, bias
+     */
+
+    curve_stats_struct stats = {0, 0, 0, 0, 0};
+    rewind(stream);
+
+    char line[256];
+    double sumZ = 0, sumZZ = 0, sumL = 0, sumZL = 0;
+    int n = 0;
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        if (strncmp(line, "#line,", 6) == 0 || strncmp(line, "#end,", 5) == 0) {
+            if (n > 2) {
+                stats.sumLogSlope += (n * sumZL - sumZ * sumL) / (n * sumZZ - sumZ * sumZ);
+                stats.slopes += 1;
+            }
+            sumZ = sumZZ = sumL = sumZL = 0;
+            n = 0;
+            if (line[1] == 'l') stats.curves += 1;
+            continue;
+        }
+        if (line[0] < '0' || line[0] > '9') continue;
+
+        int point, z, current, bias;
+        if (sscanf(line, "%d,%d,%d,%d", &point, &z, &current, &bias) != 4) continue;
+        stats.points += 1;
+
+        float expected = (float) setpoint * bias / referenceMV;
+        stats.sumSqErr += (current - expected) * (current - expected);
+
+        // well above the noise, so the log stays unbiased
+        if (current > 100) {
+            double l = log((double) current);
+            sumZ += z;
+            sumZZ += (double) z * z;
+            sumL += l;
+            sumZL += z * l;
+            n += 1;
+        }
+    }
+    return stats;
+}
+
+int main() {
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    JobQueue queue(scanhead, NULL, frameBuf, frameBufSize);
+    Spectroscopy &spec = queue.spectroscopy;
+    FILE *stream = tmpfile();
+
+    // I(V) map
+    Job job;
+    job.type = JOB_SPEC;
+    job.x = -320;
+    job.y = -320;
+    job.sizeX = 640;
+    job.sizeY = 640;
+    job.step = 10;
+    spec.mode = Spectroscopy::SPEC_IV;
+    spec.setLinearTable(-1000, 1000, 200);
+
+    float seconds = runGrid(queue, job, stream);
+    curve_stats_struct iv = readCurves(stream, scanhead->setpoint, scanhead->sampleBias);
+    int numPixels = spec.numPixels;
+    float pointUs = (spec.settleSamples + spec.averageSamples) * 50;
+    float perPointCycle = numPixels * (spec.numPoints + spec.settleCycles + 1) * scanhead->controlPeriodUs * 1e-6;
+
+    printf("\nI(V) map: %d pixels of %d points, settle %d cycles, %d+%d samples per point\n", numPixels,
+            spec.numPoints, spec.settleCycles, spec.settleSamples, spec.averageSamples);
+    printf("result %d, %d curves, %d points streamed\n", queue.lastResult, iv.curves, iv.points);
+    printf("map time %.1fs (%.1fms per pixel, sweep %.1fms), one point per control cycle would take %.1fs\n",
+            seconds, seconds * 1000 / numPixels, spec.numPoints * pointUs / 1000, perPointCycle);
+    printf("rms current error against the ohmic junction %.1fpA, TIA noise %.0fpA per sample\n",
+            sqrt(iv.sumSqErr / iv.points), simBoard.currentNoisePA);
+
+    // I(z) grid, retracting from the setpoint
+    fclose(stream);
+    stream = tmpfile();
+    job.x = 0;
+    job.y = 0;
+    job.sizeX = 80;
+    job.sizeY = 80;
+    spec.mode = Spectroscopy::SPEC_IZ;
+    spec.setLinearTable(0, -6000, 100);
+    seconds = runGrid(queue, job, stream);
+    curve_stats_struct iz = readCurves(stream, scanhead->setpoint, scanhead->sampleBias);
+    float decay = iz.slopes / iz.sumLogSlope;
+
+    printf("\nI(z) grid: %d pixels of %d points over %d LSB\n", spec.numPixels, spec.numPoints, spec.tableEnd());
+    printf("result %d, %d curves in %.2fs, fitted decay length %.0f LSB, simulated %.0f LSB\n", queue.lastResult,
+            iz.curves, seconds, decay, simBoard.decayLSB);
+
+    printf("\nbias restored to %.3fV, tip crashes: %d\n", simBoard.biasV(), simBoard.crashes);
+    fclose(stream);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * sim_spectrum.cpp
+ * TIA noise spectrum on a site with 50Hz mains pickup, its harmonics and a switching supply spur, with the tip
+ * retracted. Prints the analyzer's report, its noise floor against the simulated one, the mains lines before and
+ * after retuning the 60Hz notch to the measured frequency, and the mains estimate error over a range of
+ * frequencies.
+ */
+
+#include "simfirmware.h"
+#include "noisespectrum.h"
+
+static NoiseSpectrum spectrum;
+
+static float runSpectrum(int blocks) {
+    /*!
+     * \brief averages blocks, one analyzer pass per control period as the scheduler would run it
+     * @return seconds taken
+     */
+
+    float start = simSeconds();
+    spectrum.begin(scanhead, blocks);
+    while (!spectrum.finished()) {
+        spectrum.update();
+        delayMicroseconds(scanhead->controlPeriodUs);
+    }
+    return simSeconds() - start;
+}
+
+static float lineAmplitude(int channel, float hz) {
+    // rms over the main lobe around hz, floor removed, pA
+    int bin = (int) (hz / spectrum.binHz() + 0.5);
+    float floor = spectrum.noiseFloor(channel) * spectrum.noiseFloor(channel);
+    float power = 0;
+    for (int k = bin - 2; k <= bin + 2; k++) power += spectrum.psd(channel, k) - floor;
+    power *= spectrum.binHz();
+    return sqrtf(power > 0 ? power : 0);
+}
+
+int main() {
+    simBoot();
+
+    simBoard.mainsHz = 50;
+    simBoard.mainsPA = 40;
+    simBoard.mainsHarmonicPA[0] = 8;
+    simBoard.mainsHarmonicPA[1] = 15;
+    simBoard.mainsHarmonicPA[3] = 4;
+    simBoard.spurPA = 5;
+    delay(2000); // the notch settles on the new pickup
+
+    float expectedFloor = simBoard.currentNoisePA / sqrtf(5e5 / ScanHead::samplePeriodUs);
+    printf("site: mains %.1fHz %.0fpA, harmonics 2-5 %.0f/%.0f/%.0f/%.0fpA, spur %.0fHz %.0fpA, white noise %.0fpA rms\n",
+            simBoard.mainsHz, simBoard.mainsPA, simBoard.mainsHarmonicPA[0], simBoard.mainsHarmonicPA[1],
+            simBoard.mainsHarmonicPA[2], simBoard.mainsHarmonicPA[3], simBoard.spurHz, simBoard.spurPA,
+            simBoard.currentNoisePA);
+
+    float seconds = runSpectrum(16);
+    printf("\n16 blocks in %.1fs\n", seconds);
+    Serial.sink = stdout;
+    spectrum.printReport();
+    Serial.flush();
+    Serial.sink = NULL;
+    printf("simulated floor %.3fpA/rtHz\n", expectedFloor);
+
+    float mains = spectrum.estimateMains();
+    printf("\nmains estimate %.3fHz, error %.3fHz\n", mains, mains - simBoard.mainsHz);
+    printf("notch %.2fHz: filtered 50Hz %.2fpA, 100Hz %.2fpA\n", scanhead->notchHz(),
+            lineAmplitude(NoiseSpectrum::SPECTRUM_FILTERED, 50), lineAmplitude(NoiseSpectrum::SPECTRUM_FILTERED, 100));
+
+    scanhead->tuneNotch(mains);
+    delay(2000);
+    runSpectrum(16);
+    printf("notch %.2fHz: filtered 50Hz %.2fpA, 100Hz %.2fpA\n", scanhead->notchHz(),
+            lineAmplitude(NoiseSpectrum::SPECTRUM_FILTERED, 50), lineAmplitude(NoiseSpectrum::SPECTRUM_FILTERED, 100));
+
+    printf("\nmains (Hz), estimate (Hz), error (Hz), 8 blocks\n");
+    const float mainsHz[] = {49.8, 50.0, 50.13, 59.9, 60.0, 60.27};
+    for (int i = 0; i < 6; i++) {
+        simBoard.mainsHz = mainsHz[i];
+        runSpectrum(8);
+        float estimate = spectrum.estimateMains();
+        printf("%.2f,%.3f,%.3f\n", mainsHz[i], estimate, estimate - mainsHz[i]);
+    }
+    return 0;
+}
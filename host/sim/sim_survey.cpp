@@ -0,0 +1,155 @@
+/*
+ * sim_survey.cpp
+ * Coarse survey then zoom through the job queue, on a tilted flat sample with three islands of bumps of
+ * different heights, 300, 200 and 100 LSB. Prints the tallest bump each zoom scan covered, which should be the
+ * islands in that order, and compares the time with a full field scan at the zoom step.
+ */
+
+#include "simfirmware.h"
+#include "jobqueue.h"
+
+static const int field = 2000;
+static const int surveyStep = 40;
+static const int zoomSize = 400;
+static const int zoomStep = 10;
+
+static const int frameBufSize = 200000;
+static int frameBuf[frameBufSize];
+
+struct island_struct {
+    float x;
+    float y;
+    float height;
+};
+
+// well apart, so no zoom region covers two islands
+static const int numIslands = 3;
+static const island_struct islands[numIslands] = {
+    { 400, -400, 100},
+    {-400,    0, 300},
+    {   0,  400, 200}
+};
+
+static float islandSurface(float x, float y) {
+    float height = 2e-3 * x + 1e-3 * y;
+    for (int i = 0; i < numIslands; i++) {
+        // bumps on an 80 LSB grid within 120 LSB of the island center
+        for (int bx = -1; bx <= 1; bx++) {
+            for (int by = -1; by <= 1; by++) {
+                float dx = x - islands[i].x - bx * 80;
+                float dy = y - islands[i].y - by * 80;
+                height += islands[i].height * expf(-(dx * dx + dy * dy) / (2 * 25 * 25));
+            }
+        }
+    }
+    return height;
+}
+
+static float runQueue(JobQueue &queue) {
+    /*!
+     * \brief runs the queue to empty, one update per control cycle
+     * @return seconds taken
+     */
+
+    float start = simSeconds();
+    while (queue.busy()) {
+        simControlPeriod();
+        queue.update();
+    }
+    return simSeconds() - start;
+}
+
+int main() {
+    simBoard.surface = islandSurface;
+
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    // uncompensated, forward and reverse lines land several survey pixels apart and smear the islands
+    // across region boundaries
+    for (int axis = 0; axis < 2; axis++) {
+        if (scanhead->calibrateHysteresis(axis, field) != 0) {
+            printf("lateral calibration failed\n");
+            return 1;
+        }
+
+        // the islands repeat every 80 LSB, within a creep profile's shift range, so on some runs the profile
+        // shifts alias and no decay is fitted. Hysteresis is what separates the raster directions
+        int creepStatus = scanhead->calibrateCreep(axis, field / 2, 4000);
+        if (creepStatus == -3) printf("no creep fitted on axis %d, compensating hysteresis only\n", axis);
+        else if (creepStatus != 0) {
+            printf("lateral calibration failed\n");
+            return 1;
+        }
+    }
+    scanhead->enableLateralCompensation(true);
+
+    // settled at the survey corner, so the loop's start-up ringing is not scored as roughness
+    while (simPositionStep(-field / 2, -field / 2, scanhead->setpoint) == 0) ;
+    for (int i = 0; i < 5000; i++) simPositionStep(-field / 2, -field / 2, scanhead->setpoint);
+
+    JobQueue queue(scanhead, NULL, frameBuf, frameBufSize);
+
+    Job survey;
+    survey.type = JOB_SURVEY;
+    survey.x = -field / 2;
+    survey.y = -field / 2;
+    survey.sizeX = field;
+    survey.sizeY = field;
+    survey.step = surveyStep;
+    survey.regions = numIslands;
+    survey.zoomSize = zoomSize;
+    survey.zoomStep = zoomStep;
+    if (queue.enqueue(survey) != 0) {
+        printf("survey rejected\n");
+        return 1;
+    }
+
+    // the survey queues its zooms at the front, so the queue runs survey then zooms
+    printf("\nsurvey %d LSB at step %d, %d zooms of %d LSB at step %d\n", field, surveyStep, numIslands, zoomSize, zoomStep);
+    int zoomsFound = 0;
+    float peak = 0;
+    float surveyStart = simSeconds();
+    while (queue.busy()) {
+        int completed = queue.jobsCompleted;
+        simControlPeriod();
+        queue.update();
+
+        // tallest bump under the true tip during each zoom
+        if (queue.state == JobQueue::QUEUE_SCANNING && queue.active.type == JOB_SCAN) {
+            float x = simBoard.lateralPos(0);
+            float y = simBoard.lateralPos(1);
+            float bump = islandSurface(x, y) - 2e-3 * x - 1e-3 * y;
+            if (bump > peak) peak = bump;
+        }
+
+        if (queue.jobsCompleted == completed || queue.active.type != JOB_SCAN) continue;
+        printf("zoom %d at %d,%d: tallest bump %.0f\n", zoomsFound, queue.active.x, queue.active.y, peak);
+        zoomsFound += 1;
+        peak = 0;
+    }
+    float surveySeconds = simSeconds() - surveyStart;
+    printf("survey and zooms: %d zooms, %.1fs, last result %d\n", zoomsFound, surveySeconds, queue.lastResult);
+
+    Job full;
+    full.type = JOB_SCAN;
+    full.x = -field / 2;
+    full.y = -field / 2;
+    full.sizeX = field;
+    full.sizeY = field;
+    full.step = zoomStep;
+    full.channels = CH_ZPOS;
+    if (queue.enqueue(full) != 0) {
+        printf("full scan rejected\n");
+        return 1;
+    }
+    float fullSeconds = runQueue(queue);
+    printf("full field at step %d: %.1fs, last result %d\n", zoomStep, fullSeconds, queue.lastResult);
+
+    printf("\ntip crashes: %d\n", simBoard.crashes);
+    return 0;
+}
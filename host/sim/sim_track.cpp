@@ -0,0 +1,142 @@
+/*
+ * sim_track.cpp
+ * Atom tracking on a hexagonal lattice of bumps drifting across the sample. Starts off center of one atom
+ * and reports the lock-in time and the error of the true tip circle center against the atom, and the drift
+ * rate recovered from the logged track, for a few drift rates and demodulation lags. The logged track is in
+ * commanded piezo coordinates, so without lateral compensation it carries the piezo's creep.
+ */
+
+#include "simfirmware.h"
+#include "atomtrack.h"
+
+static const float spacing = 200;   // lattice constant, LSB
+static const float atomHeight = 80;
+static const float atomSigma = 35;
+static const int startOffset = 30;  // start distance from the atom, LSB
+static const int numCycles = 20000;
+static const float lockError = 10;  // LSB
+
+static int logBuf[numCycles * 4];
+
+static float latticeSurface(float x, float y) {
+    // nearest sites of a hexagonal lattice with rows along x
+    float rowPitch = spacing * 0.8660254f;
+    int row = (int) floorf(y / rowPitch);
+    float height = 0;
+    for (int r = row - 1; r <= row + 2; r++) {
+        float shift = (r % 2 == 0) ? 0 : spacing / 2;
+        int col = (int) floorf((x - shift) / spacing);
+        for (int c = col - 1; c <= col + 2; c++) {
+            float dx = x - (c * spacing + shift);
+            float dy = y - r * rowPitch;
+            height += atomHeight * expf(-(dx * dx + dy * dy) / (2 * atomSigma * atomSigma));
+        }
+    }
+    return height;
+}
+
+struct result_struct {
+    float lockSeconds;  // until the tip error first comes within lockError
+    float error;        // rms tip error after 2s, LSB
+    float rate;         // drift rate along x from a line through the logged track, LSB per second
+};
+
+static result_struct track(float driftRate, int lagCycles) {
+    /*!
+     * \brief tracks the atom at the origin for numCycles from startOffset away, drifting along x
+     */
+
+    // every run starts next to the atom at the origin, so the piezo does not carry creep from a long move
+    simBoard.resetDrift();
+    int startX = startOffset;
+    int startY = 0;
+    while (simPositionStep(startX, startY, scanhead->setpoint) == 0) ;
+    for (int i = 0; i < 500; i++) simPositionStep(startX, startY, scanhead->setpoint);
+
+    simBoard.driftPerS[0] = driftRate;
+
+    AtomTrack tracker;
+    tracker.lagCycles = lagCycles;
+    tracker.begin(scanhead, logBuf, startX, startY, numCycles, true);
+
+    result_struct result = {-1, 0, 0};
+    float start = simSeconds();
+    double sumSq = 0;
+    long count = 0;
+    double sumT = 0, sumTT = 0, sumX = 0, sumTX = 0;
+
+    // the tip's circle center, from the true lateral position over the last turn
+    const int turn = tracker.circleCycles;
+    float tipX[AtomTrack::maxCircleCycles];
+    float tipY[AtomTrack::maxCircleCycles];
+    long cycle = 0;
+
+    while (!tracker.finished()) {
+        simControlPeriod();
+        tracker.update();
+        if (tracker.state != AtomTrack::TRACK_RUN) continue;
+
+        tipX[cycle % turn] = simBoard.lateralPos(0);
+        tipY[cycle % turn] = simBoard.lateralPos(1);
+        cycle += 1;
+        if (cycle < turn) continue;
+
+        float centerX = 0;
+        float centerY = 0;
+        for (int i = 0; i < turn; i++) {
+            centerX += tipX[i] / turn;
+            centerY += tipY[i] / turn;
+        }
+
+        float t = simSeconds() - start;
+        float dx = centerX - simBoard.sampleDrift(0);
+        float dy = centerY - simBoard.sampleDrift(1);
+        float err = sqrtf(dx * dx + dy * dy);
+
+        if (err < lockError && result.lockSeconds < 0) result.lockSeconds = t;
+
+        if (t > 2) {
+            sumSq += err * err;
+            count += 1;
+            sumT += t;
+            sumTT += t * t;
+            sumX += tracker.centerX;
+            sumTX += t * tracker.centerX;
+        }
+    }
+
+    simBoard.driftPerS[0] = 0;
+    if (count > 0) {
+        result.error = sqrt(sumSq / count);
+        result.rate = (count * sumTX - sumT * sumX) / (count * sumTT - sumT * sumT);
+    }
+    return result;
+}
+
+int main() {
+    simBoard.surface = latticeSurface;
+
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    AtomTrack defaults;
+    printf("\nlattice %.0f LSB, atoms %.0f LSB high, circle radius %d over %d cycles, %d cycles per run\n",
+            spacing, atomHeight, defaults.radius, defaults.circleCycles, numCycles);
+    printf("drift (LSB/s), lag (cycles), lock time (s), rms tip error after 2s (LSB), logged drift rate (LSB/s)\n");
+
+    const float rates[] = {5, 50, 200};
+    const int lags[] = {0, 3, 5, 7};
+    for (int r = 0; r < 3; r++) {
+        for (int i = 0; i < 4; i++) {
+            result_struct result = track(rates[r], lags[i]);
+            printf("%.0f,%d,%.2f,%.1f,%.2f\n", rates[r], lags[i], result.lockSeconds, result.error, result.rate);
+        }
+    }
+
+    printf("\ntip crashes: %d\n", simBoard.crashes);
+    return 0;
+}
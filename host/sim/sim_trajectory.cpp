@@ -0,0 +1,121 @@
+/*
+ * sim_trajectory.cpp
+ * Lateral tracking error and frame time of serpentine raster, spiral and Lissajous scans of the same area and
+ * line count at increasing tip speeds, on the simulated piezo with hysteresis, creep and a 2kHz resonance.
+ * Writes a spiral frame's stream at the line spacing per cycle to spiral_stream.txt, for host/build/regrid.
+ */
+
+#include "simfirmware.h"
+#include "scanjob.h"
+#include "fastscan.h"
+
+static const int size = 1000;
+static const int lines = 50;
+static const int spacing = size / lines;
+
+static int frameBuf[200000];
+
+struct result_struct {
+    float error;   // rms |true - commanded| lateral position, LSB
+    float seconds; // frame time
+    int status;
+};
+
+static double errSumSq;
+static long errCount;
+
+static void trackError() {
+    float dx = simBoard.lateralPos(0) - scanhead->xpos;
+    float dy = simBoard.lateralPos(1) - scanhead->ypos;
+    errSumSq += dx * dx + dy * dy;
+    errCount += 1;
+}
+
+static result_struct runRaster(int speed) {
+    /*!
+     * \brief serpentine ScanJob over size x size, one pixel per line spacing
+     */
+
+    while (simPositionStep(-size / 2, -size / 2, scanhead->setpoint) == 0) ;
+    scanhead->maxTransverseStep = speed;
+
+    errSumSq = 0;
+    errCount = 0;
+    float start = simSeconds();
+
+    ScanJob job;
+    job.begin(scanhead, frameBuf, defaultScanChannels, size, size, spacing, true);
+    while (!job.finished()) {
+        simControlPeriod();
+        job.update();
+        trackError();
+    }
+
+    scanhead->maxTransverseStep = 5;
+    result_struct result = {(float) sqrt(errSumSq / errCount), simSeconds() - start, job.result()};
+    return result;
+}
+
+static result_struct runTrajectory(int pattern, int speed) {
+    /*!
+     * \brief FastScan centered on the origin, sampling every line spacing along the path
+     */
+
+    while (simPositionStep(0, 0, scanhead->setpoint) == 0) ;
+
+    errSumSq = 0;
+    errCount = 0;
+    float start = simSeconds();
+
+    FastScan scan;
+    scan.begin(scanhead, frameBuf, defaultScanChannels, pattern, 0, 0, size, lines, speed, spacing, true);
+    while (!scan.finished()) {
+        bool running = scan.state == FastScan::FAST_RUN;
+        simControlPeriod();
+        scan.update();
+        if (running) trackError();
+    }
+
+    result_struct result = {(float) sqrt(errSumSq / errCount), simSeconds() - start, scan.result()};
+    return result;
+}
+
+int main() {
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+    printf("%d LSB field, %d lines\n", size, lines);
+
+    // the raster moves at most one pixel per control cycle, so it tops out at the line spacing
+    const int speeds[] = {5, 10, 20, 50, 100};
+    const int numSpeeds = sizeof(speeds) / sizeof(speeds[0]);
+
+    printf("\nspeed (LSB/cycle), raster error (LSB rms), raster time (s), spiral error, spiral time, lissajous error, lissajous time\n");
+    for (int i = 0; i < numSpeeds; i++) {
+        printf("%d", speeds[i]);
+
+        if (speeds[i] <= spacing) {
+            result_struct raster = runRaster(speeds[i]);
+            printf(",%.1f,%.1f", raster.error, raster.seconds);
+        }
+        else printf(",-,-");
+
+        result_struct spiral = runTrajectory(Trajectory::TRAJ_SPIRAL, speeds[i]);
+        result_struct lissajous = runTrajectory(Trajectory::TRAJ_LISSAJOUS, speeds[i]);
+        printf(",%.1f,%.1f,%.1f,%.1f\n", spiral.error, spiral.seconds, lissajous.error, lissajous.seconds);
+    }
+
+    // one sample per cycle at the line spacing, for the regrid tool
+    FILE *streamFile = fopen("spiral_stream.txt", "w");
+    Serial.sink = streamFile;
+    runTrajectory(Trajectory::TRAJ_SPIRAL, spacing);
+    scanhead->stream.flush();
+    Serial.sink = NULL;
+    fclose(streamFile);
+
+    printf("\ntip crashes: %d\n", simBoard.crashes);
+    return 0;
+}
@@ -0,0 +1,379 @@
+/*
+ * sim_tune.cpp
+ * Searches the scan parameters for the fastest frame that tracks the sample within a topography error budget. Every
+ * candidate scans a full ScanJob frame through the firmware on the simulated sample, a textured tilted one or a
+ * recorded Z map, and the recommendation is printed as the set commands that load it onto the head.
+ *
+ * usage: sim_tune [-b budget] [-j workers] [-a size] [-o commands.txt] [-step list] [-transstep list]
+ *                 [-zstep list] [-zgain list] [-setpoint list] [zmap.txt]
+ *
+ *   -b          rms topography error budget, LSB (20)
+ *   -j          candidates scanned at once, one per core by default
+ *   -a          frame side, LSB (400, or the Z map's extent)
+ *   -o          also write the recommended set commands to a file
+ *   lists       comma separated values to search, in the units of the set command (zgain in milli LSB per pA)
+ *   zmap.txt    a recorded raster frame with Z, a stmd frame file, captured stream or archive, as the sample
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "simfirmware.h"
+#include "scanjob.h"
+#include "grid.h"
+#include "parallel.h"
+#include "scanframe.h"
+
+/*
+ * The simulator is one board and one firmware in globals, so candidates run in processes rather than threads: the
+ * head is approached once, then forked for each candidate, which changes its parameters, settles, scans a frame
+ * and writes its result back through a pipe before exiting. Each candidate so starts from the same approached tip.
+ *
+ * Scan speed (transstep) sets most of the frame time, and the error grows with it, so for every combination of the
+ * other parameters the fastest speed within budget is bisected for rather than scanned for, assuming as
+ * sim_feedforward does that a speed meeting the budget means every slower one does too. Candidates that crash the
+ * tip or fail their frame never meet it. Frame time is simulated time, as the head would take.
+ */
+
+static const int skipLines = 2; // settling after the setpoint and gain change, excluded from the error
+
+struct candidate_struct {
+    int step;
+    int transStep;
+    int zStep;
+    int zGain;     // milli LSB per pA, as set zgain takes it
+    int setpoint;  // pA
+};
+
+struct result_struct {
+    int status = -1;      // the frame's ScanJob result, -1 if it never ran
+    int crashes = 0;
+    float rmsError = 0;   // LSB, after removing the mean offset
+    float maxError = 0;
+    float frameS = 0;     // simulated frame time
+};
+
+// a combination of every parameter but the speed, bisected over the speed list
+struct chain_struct {
+    candidate_struct base;
+    int low = -1;         // fastest speed index known to meet the budget
+    int high;             // slowest known not to
+    bool running = false;
+    result_struct best;
+};
+
+static int frameSize = 400;
+static float budget = 20;
+
+// recorded Z map as the sample, height in LSB over the frame centered on zero
+static Image zMap;
+static float zMapOffset = 0;
+
+static float zMapHeight(float x, float y) {
+    // bilinear, held at the edges
+    float fx = std::min(std::max(x / zMap.step + (zMap.width - 1) / 2.0f, 0.0f), (float) (zMap.width - 1));
+    float fy = std::min(std::max(y / zMap.step + (zMap.height - 1) / 2.0f, 0.0f), (float) (zMap.height - 1));
+    int x0 = std::min((int) fx, zMap.width - 2);
+    int y0 = std::min((int) fy, zMap.height - 2);
+    float tx = fx - x0;
+    float ty = fy - y0;
+    const float *r0 = zMap.row(y0);
+    const float *r1 = zMap.row(y0 + 1);
+    float top = r0[x0] + tx * (r0[x0 + 1] - r0[x0]);
+    float bottom = r1[x0] + tx * (r1[x0 + 1] - r1[x0]);
+    return top + ty * (bottom - top) - zMapOffset;
+}
+
+static int loadZMap(const char *path) {
+    /*!
+     * \brief reads the first raster frame with Z in a file as the simulated sample
+     * @param path stmd frame file, captured stream or archive
+     * @return 0, -1 if there is no such frame
+     */
+
+    std::vector<ScanFrame> frames;
+    if (readFrames(path, frames) < 0) return -1;
+    int channel = channelByName("z");
+    for (size_t f = 0; f < frames.size(); f++) {
+        if (!frames[f].isRaster()) continue;
+        zMap = rasterImage(frames[f], channel, 0);
+        if (zMap.width < 2 || zMap.height < 2) continue;
+
+        double sum = 0;
+        for (size_t i = 0; i < zMap.data.size(); i++) sum += zMap.data[i];
+        zMapOffset = sum / zMap.data.size();
+        simBoard.surface = zMapHeight;
+        frameSize = (int) (std::min(zMap.width, zMap.height) - 1) * zMap.step;
+        return 0;
+    }
+    return -1;
+}
+
+static result_struct scanCandidate(const candidate_struct &c) {
+    /*!
+     * \brief scans one frame with a candidate's parameters, in a forked child
+     * @return the frame's status, crashes, topography error and time
+     */
+
+    result_struct result;
+    scanhead->maxTransverseStep = c.transStep;
+    scanhead->maxZStep = c.zStep;
+    scanhead->pidZP = c.zGain / 1000.0;
+    scanhead->setpoint = c.setpoint;
+
+    // to the frame corner, then settled on the new setpoint
+    while (simPositionStep(-frameSize / 2, -frameSize / 2, scanhead->setpoint) == 0) ;
+    for (int i = 0; i < 500; i++) simPositionStep(-frameSize / 2, -frameSize / 2, scanhead->setpoint);
+    int crashesBefore = simBoard.crashes;
+
+    int side = frameSize / c.step + 1;
+    std::vector<int> frameBuf((size_t) side * side);
+    ScanJob job;
+    float start = simSeconds();
+    job.begin(scanhead, frameBuf.data(), CH_ZPOS, frameSize, frameSize, c.step, true);
+
+    double sum = 0;
+    double sumSq = 0;
+    long count = 0;
+    float lowest = 1e9;
+    float highest = -1e9;
+    int lastSteps = 0;
+
+    while (!job.finished()) {
+        simControlPeriod();
+        job.update();
+        if (job.numSteps == lastSteps) continue;
+        lastSteps = job.numSteps;
+        if (job.lineIndex < skipLines) continue;
+
+        // z + height is constant for perfect tracking
+        float err = scanhead->zpos + scanhead->zStitchOffset
+                  + simBoard.surfaceHeight(simBoard.lateralPos(0), simBoard.lateralPos(1));
+        sum += err;
+        sumSq += err * err;
+        lowest = std::min(lowest, err);
+        highest = std::max(highest, err);
+        count += 1;
+    }
+
+    result.frameS = simSeconds() - start;
+    result.status = job.result();
+    result.crashes = simBoard.crashes - crashesBefore;
+    if (count > 0) {
+        double mean = sum / count;
+        result.rmsError = sqrt(std::max(sumSq / count - mean * mean, 0.0));
+        result.maxError = std::max(highest - (float) mean, (float) mean - lowest);
+    }
+    return result;
+}
+
+static bool meetsBudget(const result_struct &result) {
+    return result.status == 0 && result.crashes == 0 && result.rmsError <= budget;
+}
+
+static std::vector<int> parseList(const char *text) {
+    std::vector<int> values;
+    for (const char *p = text; *p != '\0';) {
+        char *end;
+        long value = strtol(p, &end, 10);
+        if (end == p || value <= 0) return std::vector<int>();
+        values.push_back(value);
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') return std::vector<int>();
+    }
+    return values;
+}
+
+static void printCandidate(FILE *out, const candidate_struct &c) {
+    fprintf(out, "set step %d\nset transstep %d\nset zstep %d\nset zgain %d\nset setpoint %d\n",
+            c.step, c.transStep, c.zStep, c.zGain, c.setpoint);
+}
+
+int main(int argc, char **argv) {
+    std::vector<int> steps = {5, 10};
+    std::vector<int> speeds = {1, 2, 3, 5, 8, 12, 20};
+    std::vector<int> zSteps = {50, 100, 200, 400};
+    std::vector<int> zGains = {250, 500, 1000, 2000};
+    std::vector<int> setpoints = {500, 1000, 2000};
+    const char *zMapPath = NULL;
+    const char *commandsPath = NULL;
+    int sizeArg = 0;
+    int workers = 0;
+
+    std::map<std::string, std::vector<int> *> lists = {{"-step", &steps}, {"-transstep", &speeds},
+            {"-zstep", &zSteps}, {"-zgain", &zGains}, {"-setpoint", &setpoints}};
+    for (int i = 1; i < argc; i++) {
+        bool ok = true;
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) budget = atof(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) sizeArg = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) commandsPath = argv[++i];
+        else if (lists.count(argv[i]) != 0 && i + 1 < argc) {
+            std::vector<int> *list = lists[argv[i]];
+            *list = parseList(argv[++i]);
+            ok = !list->empty();
+        }
+        else if (argv[i][0] != '-' && zMapPath == NULL) zMapPath = argv[i];
+        else ok = false;
+
+        if (!ok || budget <= 0) {
+            fprintf(stderr, "usage: sim_tune [-b budget] [-j workers] [-a size] [-o commands.txt] [-step list] "
+                    "[-transstep list] [-zstep list] [-zgain list] [-setpoint list] [zmap.txt]\n");
+            return 1;
+        }
+    }
+    std::sort(speeds.begin(), speeds.end());
+    workers = threadCount(workers);
+
+    if (zMapPath != NULL) {
+        if (loadZMap(zMapPath) != 0) {
+            fprintf(stderr, "%s: no raster frame with Z\n", zMapPath);
+            return 1;
+        }
+        printf("sample: %s, %dx%d pixels of %.0f LSB\n", zMapPath, zMap.width, zMap.height, zMap.step);
+    }
+    else {
+        simBoard.planeX = 0.5;
+        simBoard.planeY = 0.3;
+        printf("sample: tilted %.2f x %.2f LSB/LSB, texture %.0f LSB\n", simBoard.planeX, simBoard.planeY,
+                simBoard.textureAmplitude);
+    }
+    if (sizeArg > 0) frameSize = sizeArg;
+
+    simBoot();
+    if (simApproach() != 0) {
+        printf("approach failed\n");
+        return 1;
+    }
+    printf("approached at %.1fs, current %dpA, zpos %d\n", simSeconds(), scanhead->current, scanhead->zpos);
+
+    std::vector<chain_struct> chains;
+    for (int step : steps) for (int zStep : zSteps) for (int zGain : zGains) for (int setpoint : setpoints) {
+        chain_struct chain;
+        chain.base = {step, 0, zStep, zGain, setpoint};
+        // a pixel takes at least a cycle, so speeds past the step only add error
+        chain.high = std::lower_bound(speeds.begin(), speeds.end(), step) - speeds.begin() + 1;
+        chain.high = std::min(chain.high, (int) speeds.size());
+        chains.push_back(chain);
+    }
+    printf("%d LSB frames within %.0f LSB rms, %d parameter sets over %d speeds, %d at once\n", frameSize, budget,
+            (int) chains.size(), (int) speeds.size(), workers);
+    printf("step,transstep,zstep,zgain,setpoint,status,crashes,rms error (LSB),max error (LSB),frame (s)\n");
+    fflush(stdout);
+
+    struct child_struct {
+        int chain;
+        int speed;
+        int fd;
+    };
+    std::map<pid_t, child_struct> children;
+    size_t nextChain = 0;
+    int scanned = 0;
+
+    while (true) {
+        // start the next probe of every idle chain, round robin, while there are free workers
+        for (size_t n = 0; n < chains.size() && (int) children.size() < workers; n++) {
+            size_t ci = (nextChain + n) % chains.size();
+            chain_struct &chain = chains[ci];
+            if (chain.running || chain.high - chain.low <= 1) continue;
+
+            candidate_struct c = chain.base;
+            int speed = (chain.low + chain.high + 1) / 2;
+            c.transStep = speeds[speed];
+
+            int fds[2];
+            if (pipe(fds) != 0) {
+                perror("pipe");
+                return 1;
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0) {
+                close(fds[0]);
+                result_struct result = scanCandidate(c);
+                ssize_t written = write(fds[1], &result, sizeof(result));
+                _exit(written == sizeof(result) ? 0 : 1);
+            }
+            close(fds[1]);
+            children[pid] = {(int) ci, speed, fds[0]};
+            chain.running = true;
+            nextChain = ci + 1;
+        }
+        if (children.empty()) break;
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            perror("wait");
+            return 1;
+        }
+        auto it = children.find(pid);
+        if (it == children.end()) continue;
+        child_struct child = it->second;
+        children.erase(it);
+
+        result_struct result;
+        if (read(child.fd, &result, sizeof(result)) != sizeof(result)) result = result_struct();
+        close(child.fd);
+
+        chain_struct &chain = chains[child.chain];
+        chain.running = false;
+        if (meetsBudget(result)) {
+            chain.low = child.speed;
+            chain.best = result;
+        }
+        else chain.high = child.speed;
+        scanned += 1;
+
+        const candidate_struct &c = chain.base;
+        printf("%d,%d,%d,%d,%d,%d,%d,%.1f,%.1f,%.2f\n", c.step, speeds[child.speed], c.zStep, c.zGain, c.setpoint,
+                result.status, result.crashes, result.rmsError, result.maxError, result.frameS);
+        fflush(stdout);
+    }
+
+    // the fastest frame of all, the lower error between equally fast ones
+    int bestChain = -1;
+    for (size_t ci = 0; ci < chains.size(); ci++) {
+        if (chains[ci].low < 0) continue;
+        if (bestChain < 0) {
+            bestChain = ci;
+            continue;
+        }
+        const result_struct &a = chains[ci].best;
+        const result_struct &b = chains[bestChain].best;
+        if (a.frameS < b.frameS * 0.99 || (a.frameS <= b.frameS * 1.01 && a.rmsError < b.rmsError)) bestChain = ci;
+    }
+
+    printf("\n%d frames scanned\n", scanned);
+    if (bestChain < 0) {
+        printf("no parameters within %.0f LSB rms\n", budget);
+        return 1;
+    }
+    candidate_struct best = chains[bestChain].base;
+    best.transStep = speeds[chains[bestChain].low];
+    const result_struct &r = chains[bestChain].best;
+    printf("fastest within %.0f LSB rms: %.2fs per %d LSB frame, %.1f LSB rms, %.1f LSB max\n", budget, r.frameS,
+           frameSize, r.rmsError, r.maxError);
+    printCandidate(stdout, best);
+
+    if (commandsPath != NULL) {
+        FILE *out = fopen(commandsPath, "w");
+        if (out == NULL) {
+            perror(commandsPath);
+            return 1;
+        }
+        printCandidate(out, best);
+        fclose(out);
+    }
+    return 0;
+}
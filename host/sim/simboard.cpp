@@ -0,0 +1,203 @@
+/*
+ * simboard.cpp
+ * Simulated STM control board: piezo DAC, TIA ADC, steppers, lateral piezo and tip-sample junction
+ */
+
+#include "simboard.h"
+#include <math.h>
+
+SimBoard simBoard;
+
+SimBoard::SimBoard() : rng(1234), gauss(0, 1) {
+    for (int ch = 0; ch < 8; ch++) dac[ch] = 32768;
+    stepperSteps = 0;
+    crashes = 0;
+    lastUs = 0;
+    nowUs = 0;
+    dacBytes = 0;
+    tiaSample = 0;
+    tiaBytes = 0;
+    for (int a = 0; a < 3; a++) drift[a] = 0;
+}
+
+void SimBoard::pinWrite(int pin, int value) {
+    if (pin == piezoCs) {
+        if (value == 0) dacBytes = 0;
+        else if (dacBytes == 4 && (dacFrame[0] & 0x0f) == 0x03) {
+            // write and update: channel in the top nibble, 16 bit value across the next 20 bits
+            int channel = dacFrame[1] >> 4;
+            uint16_t value = (dacFrame[1] & 0x0f) << 12 | dacFrame[2] << 4 | dacFrame[3] >> 4;
+            writeDac(channel, value);
+        }
+    }
+    else if (pin == tiaCs && value != 0) tiaBytes = 0;
+}
+
+uint8_t SimBoard::spiTransfer(int bus, uint8_t data) {
+    if (bus == 0) {
+        if (dacBytes < 4) dacFrame[dacBytes++] = data;
+        return 0;
+    }
+
+    // TIA ADC: converts on the first byte of a read, MSB first
+    if (tiaBytes == 0 && tiaOverride >= 0) tiaSample = (uint16_t) tiaOverride;
+    else if (tiaBytes == 0) {
+        float code = (currentPA() + tiaZeroPA) * 65536.0 / tiaFullScalePA;
+        if (code < 0) code = 0;
+        if (code > 65535) code = 65535;
+        tiaSample = (uint16_t) code;
+    }
+    tiaBytes += 1;
+    if (tiaBytes == 1) return tiaSample >> 8;
+    return tiaSample & 0xff;
+}
+
+void SimBoard::stepStepper(int steps) {
+    // the three steppers move together, each contributing a third of a full step
+    stepperSteps += steps / 3.0;
+}
+
+void SimBoard::advance(uint64_t now) {
+    nowUs = now;
+    if (now <= lastUs) return;
+
+    float dt = now - lastUs;
+    lastUs = now;
+    if (tiaOverride >= 0) return;
+
+    for (int a = 0; a < 3; a++) drift[a] += driftPerS[a] * dt * 1e-6;
+
+    // the piezos follow the DAC pairs as they stand between control cycles, not each channel write: a Z move
+    // changes both channels of a pair, and the microseconds between the two writes are no lateral move
+    setLateralCommand(axis[0], ((float) dac[chX_P] - dac[chX_N]) / 2);
+    setLateralCommand(axis[1], ((float) dac[chY_P] - dac[chY_N]) / 2);
+
+    // sub-stepping so the lateral resonance stays well resolved
+    const float maxStepUs = 2;
+    int substeps = (int) ceilf(dt / maxStepUs);
+    if (substeps > 5000) {
+        // long idle stretches only need the settled state
+        for (int a = 0; a < 2; a++) integrateLateral(axis[a], dt - 5000 * maxStepUs);
+        substeps = 5000;
+        dt = 5000 * maxStepUs;
+    }
+    for (int i = 0; i < substeps; i++) {
+        for (int a = 0; a < 2; a++) integrateLateral(axis[a], dt / substeps);
+    }
+}
+
+void SimBoard::writeDac(int channel, uint16_t value) {
+    dac[channel] = value;
+}
+
+void SimBoard::setLateralCommand(lateral_axis_struct &ax, float command) {
+    // Bouc-Wen is rate independent, so it is stepped along the command change in 1 LSB pieces
+    float delta = command - ax.command;
+    int pieces = (int) ceilf(fabsf(delta));
+    if (pieces < 1) pieces = 1;
+    float dx = delta / pieces;
+
+    for (int i = 0; i < pieces; i++) {
+        ax.h += ax.boucAlpha * dx - ax.boucBeta * fabsf(dx) * ax.h - ax.boucGamma * dx * fabsf(ax.h);
+    }
+
+    ax.command = command;
+    ax.hysteresisOut = command - ax.h;
+}
+
+void SimBoard::integrateLateral(lateral_axis_struct &ax, float dtUs) {
+    float creepOut = ax.hysteresisOut;
+    for (int k = 0; k < 2; k++) {
+        float alpha = dtUs / ax.creepTauUs[k];
+        if (alpha > 1) alpha = 1;
+        ax.creepState[k] += alpha * (ax.hysteresisOut - ax.creepState[k]);
+        creepOut += ax.creepGain[k] * ax.creepState[k];
+    }
+
+    // semi-implicit Euler on the resonance, time in seconds
+    float omega = 2 * M_PI * ax.resonanceHz;
+    float dt = dtUs * 1e-6;
+    if (dt * omega > 0.2) {
+        // step too long to resolve the resonance, settle instead
+        ax.vel = 0;
+        ax.pos = creepOut;
+        return;
+    }
+    ax.vel += (omega * omega * (creepOut - ax.pos) - 2 * ax.damping * omega * ax.vel) * dt;
+    ax.pos += ax.vel * dt;
+}
+
+float SimBoard::zPiezo() {
+    // all four channels move together for Z, zpos = 32767 - channel
+    float mean = ((float) dac[chX_P] + dac[chX_N] + dac[chY_P] + dac[chY_N]) / 4;
+    return 65535 / 2 - mean;
+}
+
+float SimBoard::biasV() {
+    return (32768.0 - dac[chSample]) * biasPerLSB;
+}
+
+float SimBoard::surfaceHeight(float x, float y) {
+    if (surface != NULL) return surface(x, y);
+
+    // three plane waves with incommensurate wavelengths and directions
+    static const float wavelengths[3] = {317, 523, 871};
+    static const float angles[3] = {0.3, 1.4, 2.5};
+    static const float phases[3] = {0.0, 1.1, 2.3};
+
+    float texture = 0;
+    for (int i = 0; i < 3; i++) {
+        float k = 2 * M_PI / (wavelengths[i] * textureScale);
+        texture += cosf(k * (x * cosf(angles[i]) + y * sinf(angles[i])) + phases[i]);
+    }
+
+    return planeX * x + planeY * y + textureAmplitude * texture / 3;
+}
+
+float SimBoard::gap() {
+    return baseGap - stepperSteps * zPerStepper - zPiezo() + sampleDrift(2)
+         - surfaceHeight(axis[0].pos - sampleDrift(0), axis[1].pos - sampleDrift(1));
+}
+
+float SimBoard::junctionPA() {
+    float g = gap();
+    if (g < 0) g = 0;
+    float height = peakHeight();
+    return currentAtContactPA * integratedLdos(biasV(), height) / integratedLdos(referenceBiasV, height) * expf(-g / decayLSB);
+}
+
+float SimBoard::conductancePS() {
+    float g = gap();
+    if (g < 0) g = 0;
+    float height = peakHeight();
+    float d = (biasV() - ldosPeakV) / ldosPeakWidthV;
+    float ldos = 1 + height * expf(-d * d / 2);
+    return currentAtContactPA * ldos / integratedLdos(referenceBiasV, height) * expf(-g / decayLSB);
+}
+
+float SimBoard::peakHeight() {
+    if (ldosWeight == NULL) return ldosPeakHeight;
+    return ldosPeakHeight * ldosWeight(axis[0].pos - sampleDrift(0), axis[1].pos - sampleDrift(1));
+}
+
+float SimBoard::integratedLdos(float biasV, float height) {
+    // integral of the density of states from zero to biasV
+    if (height == 0) return biasV;
+    float s = ldosPeakWidthV * sqrtf(2);
+    return biasV + height * ldosPeakWidthV * sqrtf(M_PI / 2) * (erff((biasV - ldosPeakV) / s) + erff(ldosPeakV / s));
+}
+
+float SimBoard::currentPA() {
+    if (gap() < 0) crashes += 1;
+
+    float current = junctionPA();
+    current += currentNoisePA * gauss(rng);
+    // phases in cycles, so they stay exact over long runs
+    double mainsCycles = mainsHz * nowUs * 1e-6;
+    if (mainsPA != 0) current += mainsPA * sin(2 * M_PI * fmod(mainsCycles, 1.0));
+    for (int h = 0; h < 4; h++) {
+        if (mainsHarmonicPA[h] != 0) current += mainsHarmonicPA[h] * sin(2 * M_PI * fmod((h + 2) * mainsCycles, 1.0));
+    }
+    if (spurPA != 0) current += spurPA * sin(2 * M_PI * fmod(spurHz * nowUs * 1e-6, 1.0));
+    return current;
+}
@@ -0,0 +1,125 @@
+/*
+ * simboard.h
+ * Simulated STM control board: piezo DAC, TIA ADC, steppers, lateral piezo and tip-sample junction
+ */
+
+#ifndef simboard_h
+#define simboard_h
+
+#include <stdint.h>
+#include <random>
+
+class SimBoard
+{
+    public:
+        SimBoard();
+
+        // board pins, mirroring ControlBoard
+        static const int piezoCs = 10;
+        static const int tiaCs = 34;
+        static const int chSample = 0;
+        static const int chX_P = 1;
+        static const int chY_P = 3;
+        static const int chY_N = 5;
+        static const int chX_N = 7;
+
+        // Lateral piezo axis: Bouc-Wen hysteresis, then linear creep, then a second order resonance
+        struct lateral_axis_struct {
+            float boucAlpha = 0.12;   // hysteresis loop size
+            float boucBeta = 0.0008;  // hysteresis saturation, loop half width ~ alpha/(beta+gamma)
+            float boucGamma = 0.0004;
+            float creepGain[2] = {0.04, 0.02}; // fraction of a step added by creep
+            float creepTauUs[2] = {1500000, 80000};
+            float resonanceHz = 2000;
+            float damping = 0.1;
+
+            // state
+            float command = 0;
+            float h = 0;
+            float hysteresisOut = 0;
+            float creepState[2] = {0, 0};
+            float pos = 0;
+            float vel = 0;
+        } axis[2];
+
+        // tip-sample junction. Gap and heights are in Z piezo LSB, larger zpos moves the tip toward the sample
+        float baseGap = 60000;        // gap with steppers at zero and the Z piezo centered
+        float zPerStepper = 8000;     // gap closed per stepper step
+        float decayLSB = 2000;        // gap for an e-fold change in current
+        float currentAtContactPA = 3e6; // current at zero gap and reference bias
+        float referenceBiasV = -0.5;  // bias the junction current is specified at
+        float biasPerLSB = 0.5 / 4732; // sample pad DAC to bias, 37500 -> -0.5V
+
+        // sample density of states: flat, an ohmic junction, plus a Gaussian resonance at ldosPeakV of relative
+        // height ldosPeakHeight, scaled by ldosWeight(x, y) when set. The current is its integral up to the bias
+        float ldosPeakV = 0.3;
+        float ldosPeakWidthV = 0.05;
+        float ldosPeakHeight = 0;
+        float (*ldosWeight)(float x, float y) = NULL;
+
+        // sample topography, LSB
+        float planeX = 0;
+        float planeY = 0;
+        float textureAmplitude = 300; // non-periodic texture, so profile shifts are unambiguous
+        float textureScale = 1;      // stretches the texture wavelengths (317, 523 and 871 LSB)
+        float (*surface)(float x, float y) = NULL; // replaces plane and texture when set
+        float driftPerS[3] = {0, 0, 0};   // sample drift in x, y and z (away from the tip, as zpos), LSB per second
+
+        // TIA
+        float tiaZeroPA = 3500;       // TIA offset, removed by calibrateZeroCurrent
+        float currentNoisePA = 20;    // white noise rms
+        float mainsPA = 0;            // mains pickup amplitude
+        float mainsHz = 60;
+        float mainsHarmonicPA[4] = {0, 0, 0, 0}; // pickup at 2 to 5 times mainsHz
+        float spurPA = 0;             // switching supply pickup
+        float spurHz = 3300;
+        float tiaFullScalePA = 33000; // 16 bit ADC over 3.3V at 100M gain
+        int tiaOverride = -1;         // when not negative the TIA reads this code, and the piezo and junction models
+                                      // are left where they were, for trace replay
+
+        // piezo and stepper state
+        uint16_t dac[8];
+        float stepperSteps;
+        int crashes;                  // ADC reads taken with the tip touching the sample
+
+        // hardware interface, used by the Arduino shim
+        void pinWrite(int pin, int value);
+        uint8_t spiTransfer(int bus, uint8_t data);
+        void stepStepper(int steps);
+        void advance(uint64_t nowUs);
+
+        // model outputs
+        float lateralPos(int axisIndex) { return axis[axisIndex].pos; }
+        float zPiezo();
+        float biasV();
+        float surfaceHeight(float x, float y);
+        float sampleDrift(int axisIndex) { return drift[axisIndex]; }
+        void resetDrift() { drift[0] = drift[1] = drift[2] = 0; }
+        float gap();
+        float junctionPA();           // noise free tunneling current
+        float conductancePS();        // noise free dI/dV at the present gap and bias
+        float currentPA();            // as seen by the TIA
+
+    private:
+        uint64_t lastUs;
+        uint64_t nowUs;
+        double drift[3];              // accumulated sample drift, LSB, double as it grows by tiny steps
+
+        uint8_t dacFrame[4];
+        int dacBytes;
+        uint16_t tiaSample;
+        int tiaBytes;
+
+        std::mt19937 rng;
+        std::normal_distribution<float> gauss;
+
+        void writeDac(int channel, uint16_t value);
+        void setLateralCommand(lateral_axis_struct &ax, float command);
+        void integrateLateral(lateral_axis_struct &ax, float dtUs);
+        float peakHeight();
+        float integratedLdos(float biasV, float height);
+};
+
+extern SimBoard simBoard;
+
+#endif
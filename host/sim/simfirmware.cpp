@@ -0,0 +1,78 @@
+/*
+ * simfirmware.cpp
+ * Boots the firmware ScanHead on the simulated board, as setup() does on the Teensy
+ */
+
+#include "simfirmware.h"
+
+ScanHead *scanhead;
+
+static IntervalTimer currentSampleTimer;
+
+static void sampleScanHeadCurrent() {
+    scanhead->sampleCurrent();
+}
+
+void simBoot() {
+    /*!
+     * \brief constructs the ScanHead, starts 20kHz current sampling and calibrates zero current
+     */
+
+    scanhead = new ScanHead();
+    currentSampleTimer.begin(sampleScanHeadCurrent, ScanHead::samplePeriodUs);
+    scanhead->calibrateZeroCurrent();
+}
+
+void simStopSampling() {
+    /*!
+     * \brief stops the sampling interrupt, so the ScanHead only sees readings its caller feeds it
+     */
+
+    currentSampleTimer.end();
+}
+
+int simApproach() {
+    /*!
+     * \brief auto approaches to the ScanHead setpoint, settles and recenters Z with the steppers
+     * @return 0 on success, -1 if the surface was not found
+     */
+
+    CircularBuffer<int,1000> currentBuf;
+    CircularBuffer<int,1000> zposBuf;
+
+    int approachSteps = 0;
+    while (scanhead->autoApproachStep(scanhead->setpoint, currentBuf, zposBuf) == 0) {
+        if (++approachSteps > 500) return -1;
+    }
+
+    for (int i = 0; i < 1000; i++) simPositionStep(0, 0, scanhead->setpoint);
+
+    // the approach stops wherever the surface comes into range, usually near the end of the Z piezo
+    if (scanhead->recenterZ(scanhead->setpoint) < 0) return -1;
+    return 0;
+}
+
+void simControlPeriod() {
+    /*!
+     * \brief waits for the next run of the trajectory task, which the scheduler starts controlPeriodUs after the
+     *        last. Call before each control cycle or job update() a sim runs itself
+     */
+
+    static uint64_t lastRunUs = 0;
+    uint64_t dueUs = lastRunUs + scanhead->controlPeriodUs;
+    if (simTimeUs < dueUs) simAdvance(dueUs - simTimeUs);
+    lastRunUs = simTimeUs;
+}
+
+int simPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
+    /*!
+     * \brief one setPositionStep() control cycle, paced as the trajectory task runs it
+     */
+
+    simControlPeriod();
+    return scanhead->setPositionStep(xpos_set, ypos_set, zcurr_set);
+}
+
+float simSeconds() {
+    return simTimeUs * 1e-6;
+}
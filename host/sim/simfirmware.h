@@ -0,0 +1,22 @@
+/*
+ * simfirmware.h
+ * Boots the firmware ScanHead on the simulated board, as setup() does on the Teensy
+ */
+
+#ifndef simfirmware_h
+#define simfirmware_h
+
+#include "Arduino.h"
+#include "scanhead.h"
+#include "simboard.h"
+
+extern ScanHead *scanhead;
+
+void simBoot();
+void simStopSampling();
+int simApproach();
+void simControlPeriod();
+int simPositionStep(int xpos_set, int ypos_set, int zcurr_set);
+float simSeconds();
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * regrid.cpp
+ * Resamples a streamed spiral or Lissajous frame onto a regular grid.
+ * Reads the scan stream on stdin, writes the last frame as an n x n CSV grid of one channel on stdout.
+ *
+ * usage: regrid [n] [channel] < stream.txt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "scanchannels.h"
+
+struct sample_struct {
+    float x;
+    float y;
+    float value;
+};
+
+static int channelColumn(int mask, int channel) {
+    // column of a channel in a data row, after the pixel index
+    int column = 1;
+    for (int ch = 0; ch < channel; ch++) {
+        if (mask & (1 << ch)) column += 1;
+    }
+    return column;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 128;
+    const char *channelName = argc > 2 ? argv[2] : "z";
+
+    int channel = -1;
+    for (int ch = 0; ch < numScanChannels; ch++) {
+        if (strcmp(scanChannelNames[ch], channelName) == 0) channel = ch;
+    }
+    if (n < 2 || channel < 0) {
+        fprintf(stderr, "usage: regrid [n] [channel] < stream.txt\n");
+        return 1;
+    }
+
+    std::vector<sample_struct> samples;
+    int mask = 0;
+    char line[1024];
+
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        if (strncmp(line, "#frame,", 7) == 0) {
+            mask = atoi(line + 7);
+            samples.clear();
+            continue;
+        }
+        if (line[0] < '0' || line[0] > '9' || mask == 0) continue;
+        if (!(mask & CH_XPOS) || !(mask & CH_YPOS) || !(mask & (1 << channel))) continue;
+
+        // data row: pixel index, then the selected channels in bit order
+        float values[1 + numScanChannels];
+        int numValues = 0;
+        char *field = strtok(line, ",\r\n");
+        while (field != NULL && numValues < 1 + numScanChannels) {
+            values[numValues++] = atof(field);
+            field = strtok(NULL, ",\r\n");
+        }
+        if (numValues != 1 + channelCount(mask)) continue;
+
+        sample_struct sample = {
+            values[channelColumn(mask, 0)],
+            values[channelColumn(mask, 1)],
+            values[channelColumn(mask, channel)]
+        };
+        samples.push_back(sample);
+    }
+
+    if (samples.empty()) {
+        fprintf(stderr, "no samples with x, y and %s in the input\n", channelName);
+        return 1;
+    }
+
+    float xMin = samples[0].x, xMax = samples[0].x;
+    float yMin = samples[0].y, yMax = samples[0].y;
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (samples[i].x < xMin) xMin = samples[i].x;
+        if (samples[i].x > xMax) xMax = samples[i].x;
+        if (samples[i].y < yMin) yMin = samples[i].y;
+        if (samples[i].y > yMax) yMax = samples[i].y;
+    }
+    float cellX = (xMax - xMin) / n + 1e-6;
+    float cellY = (yMax - yMin) / n + 1e-6;
+
+    // cell averages
+    std::vector<double> sum(n * n, 0);
+    std::vector<int> count(n * n, 0);
+    for (size_t i = 0; i < samples.size(); i++) {
+        int cx = (int) ((samples[i].x - xMin) / cellX);
+        int cy = (int) ((samples[i].y - yMin) / cellY);
+        if (cx >= n) cx = n - 1;
+        if (cy >= n) cy = n - 1;
+        sum[cy * n + cx] += samples[i].value;
+        count[cy * n + cx] += 1;
+    }
+
+    std::vector<float> grid(n * n, 0);
+    std::vector<bool> filled(n * n, false);
+    int numEmpty = 0;
+    for (int i = 0; i < n * n; i++) {
+        if (count[i] > 0) {
+            grid[i] = sum[i] / count[i];
+            filled[i] = true;
+        }
+        else numEmpty += 1;
+    }
+
+    // empty cells (between spiral turns, outside the spiral) take the mean of their filled neighbours,
+    // growing inward from the sampled cells
+    while (numEmpty > 0) {
+        std::vector<float> next = grid;
+        std::vector<bool> nextFilled = filled;
+        int newlyFilled = 0;
+
+        for (int cy = 0; cy < n; cy++) {
+            for (int cx = 0; cx < n; cx++) {
+                if (filled[cy * n + cx]) continue;
+
+                float neighbourSum = 0;
+                int neighbours = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = cx + dx;
+                        int ny = cy + dy;
+                        if (nx < 0 || ny < 0 || nx >= n || ny >= n || !filled[ny * n + nx]) continue;
+                        neighbourSum += grid[ny * n + nx];
+                        neighbours += 1;
+                    }
+                }
+
+                if (neighbours > 0) {
+                    next[cy * n + cx] = neighbourSum / neighbours;
+                    nextFilled[cy * n + cx] = true;
+                    newlyFilled += 1;
+                }
+            }
+        }
+
+        grid = next;
+        filled = nextFilled;
+        numEmpty -= newlyFilled;
+    }
+
+    printf("#grid,%d,%.1f,%.1f,%.1f,%.1f,%s,%zu\n", n, xMin, xMax, yMin, yMax, channelName, samples.size());
+    for (int cy = 0; cy < n; cy++) {
+        for (int cx = 0; cx < n; cx++) {
+            printf(cx == 0 ? "%.1f" : ",%.1f", grid[cy * n + cx]);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
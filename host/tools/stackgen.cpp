@@ -0,0 +1,108 @@
+/*
+ * stackgen.cpp
+ * Writes a stack of synthetic raster frames as scan stream files, for timing stmproc on frames of any size.
+ * Each frame is a serpentine raster with the default channels: the measured x and y lag the commanded grid and
+ * jitter about it, and z is a textured surface on a tilted plane with line offsets, scars and noise, so every
+ * stage of stmproc has work to do. The same arguments always write the same files.
+ *
+ * usage: stackgen [-n frames] [-s size] directory    writes directory/frame_<k>.txt, 8 frames of 1024 x 1024
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "scanchannels.h"
+
+static const int frameStep = 4; // LSB per pixel
+
+static uint32_t rngState;
+
+static float uniform() {
+    // xorshift, uniform in [-1, 1)
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return (rngState >> 8) * (2.0f / 16777216.0f) - 1;
+}
+
+static float surface(float x, float y) {
+    // three plane waves, as the simulator's sample, in LSB
+    static const float wavelengths[3] = {317, 523, 871};
+    static const float angles[3] = {0.3, 1.4, 2.5};
+    float z = 0;
+    for (int i = 0; i < 3; i++) {
+        float k = 2 * M_PI / wavelengths[i];
+        z += cosf(k * (x * cosf(angles[i]) + y * sinf(angles[i])) + i);
+    }
+    return 100 * z;
+}
+
+static int writeFrame(const char *path, int index, int size) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) return -1;
+
+    int channels = CH_XPOS | CH_YPOS | CH_ZPOS | CH_CURRENT;
+    rngState = 2463534242u + 7919u * index;
+
+    fprintf(out, "#frame,%d,%d,%d,%d\nstep", channels, size, size, frameStep);
+    for (int ch = 0; ch < numScanChannels; ch++) {
+        if (channels & (1 << ch)) fprintf(out, ",%s", scanChannelNames[ch]);
+    }
+    fprintf(out, "\n#params,setpoint=100,bias=500,frame=%d\n", index);
+
+    for (int line = 0; line < size; line++) {
+        fprintf(out, "#line,%d\n", line);
+        float lineOffset = 20 * uniform();
+        bool scar = uniform() > 0.98f;
+        for (int i = 0; i < size; i++) {
+            // odd lines run backwards, and the tip lags the command by a pixel in the direction of travel
+            int column = line % 2 == 0 ? i : size - 1 - i;
+            float lag = line % 2 == 0 ? -1 : 1;
+            float x = (column + lag + 0.3f * uniform()) * frameStep;
+            float y = (line + 0.3f * uniform()) * frameStep;
+            float z = surface(x, y) + 0.05f * x - 0.03f * y + lineOffset + 2 * uniform();
+            if (scar && i > size / 3 && i < size / 2) z += 150;
+            int current = 100 + (int) (5 * uniform());
+            fprintf(out, "%d,%d,%d,%d,%d\n", line * size + i, (int) lroundf(x), (int) lroundf(y), (int) lroundf(z),
+                    current);
+        }
+    }
+    fprintf(out, "#end,0\n");
+
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int frames = 8;
+    int size = 1024;
+    const char *directory = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) size = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && directory == NULL) directory = argv[i];
+        else {
+            frames = 0;
+            break;
+        }
+    }
+    if (directory == NULL || frames < 1 || size < 2) {
+        fprintf(stderr, "usage: stackgen [-n frames] [-s size] directory\n");
+        return 1;
+    }
+
+    mkdir(directory, 0777);
+    for (int k = 0; k < frames; k++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/frame_%d.txt", directory, k);
+        if (writeFrame(path, k, size) != 0) {
+            perror(path);
+            return 1;
+        }
+    }
+    return 0;
+}
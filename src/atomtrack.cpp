@@ -0,0 +1,213 @@
+/*
+ * atomtrack.cpp
+ * Locks the tip onto a local height maximum by circling it and feeding the demodulated gradient into X/Y
+ */
+
+#include "Arduino.h"
+#include "atomtrack.h"
+#include "scanjob.h"
+
+AtomTrack::AtomTrack() {
+    state = TRACK_IDLE;
+    centerX = 0;
+    centerY = 0;
+    gradientX = 0;
+    gradientY = 0;
+    numSteps = 0;
+    chunkIndex = 0;
+    failStatus = 0;
+}
+
+void AtomTrack::begin(ScanHead *scanhead, int *dataArr, int x, int y, long numSamples, bool heightControl) {
+    /*!
+     * \brief starts tracking the feature nearest (x, y)
+     * @param *scanhead ScanHead to track with
+     * @param *dataArr array of at least numSamples * channelCount(logChannels) ints
+     * @param x starting center, LSB
+     * @param y starting center, LSB
+     * @param numSamples control cycles to track for, one logged sample each
+     * @param heightControl true to demodulate Z under height control, false for the current at constant height
+     */
+
+    this->scanhead = scanhead;
+    this->dataArr = dataArr;
+    maxSamples = numSamples;
+
+    setCurrent = heightControl ? scanhead->setpoint : -1;
+    period = circleCycles < 4 ? 4 : (circleCycles > maxCircleCycles ? maxCircleCycles : circleCycles);
+    for (int i = 0; i < period; i++) {
+        cosTable[i] = cos(2 * M_PI * i / period);
+        sinTable[i] = sin(2 * M_PI * i / period);
+    }
+
+    centerX = x;
+    centerY = y;
+    gradientX = 0;
+    gradientY = 0;
+    numSteps = 0;
+    chunkIndex = 0;
+    failStatus = 0;
+
+    // the circle is not a line, so nothing for the previous-line feed-forward
+    scanhead->zPredictor.beginFrame(0, 1, 0);
+
+    int numChunks = (maxSamples + samplesPerChunk - 1) / samplesPerChunk;
+    scanhead->stream.beginFrame(logChannels, samplesPerChunk, numChunks, radius);
+    scanhead->writeFrameParams();
+    scanhead->stream.writeEvent("track", 0, radius);
+
+    if (heightControl && scanhead->zNearLimit(abs(x) + abs(y) + radius)) {
+        scanhead->beginRecenterZ();
+        state = TRACK_RECENTER;
+    }
+    else state = TRACK_START;
+}
+
+int AtomTrack::update() {
+    /*!
+     * \brief advances tracking by one control cycle. Call until finished()
+     * @return the new tracking state
+     */
+
+    switch (state) {
+
+    case TRACK_RECENTER:
+        if (scanhead->recenterZStep(setCurrent) != 0) state = TRACK_START;
+        break;
+
+    case TRACK_START: {
+        int moveStatus = scanhead->setPositionStep((int) centerX + radius, (int) centerY, setCurrent);
+        if (moveStatus == 1) {
+            restartDemodulation();
+            state = TRACK_RUN;
+        }
+        else if (moveStatus != 0) finish(TRACK_FAILED, moveStatus);
+        break;
+    }
+
+    case TRACK_RUN: {
+        int moveStatus = scanhead->setPositionStep((int) (centerX + radius * cosTable[phase]),
+                (int) (centerY + radius * sinTable[phase]), setCurrent);
+        if (moveStatus < 0) {
+            Serial.println("Tracking failed with error");
+            Serial.println(moveStatus);
+            writeChunk();
+            finish(TRACK_FAILED, moveStatus);
+            break;
+        }
+
+        // larger zpos is closer to the sample, so height is -zpos
+        float signal = setCurrent >= 0 ? -(scanhead->zpos + scanhead->zStitchOffset) : scanhead->current;
+        signal *= polarity;
+
+        // products against the phase commanded lagCycles ago, one slot per phase holds the last turn
+        int lagged = ((phase - lagCycles) % period + period) % period;
+        productX[phase] = signal * cosTable[lagged];
+        productY[phase] = signal * sinTable[lagged];
+        if (filled < period) filled += 1;
+
+        if (filled == period) {
+            // summed afresh each cycle, so rounding does not accumulate over a long track
+            float sumX = 0;
+            float sumY = 0;
+            for (int i = 0; i < period; i++) {
+                sumX += productX[i];
+                sumY += productY[i];
+            }
+            gradientX = 2 * sumX / (period * radius);
+            gradientY = 2 * sumY / (period * radius);
+            centerX += gain * gradientX;
+            centerY += gain * gradientY;
+        }
+
+        int *sample = dataArr + numSteps * channelCount(logChannels);
+        sample[0] = (int) centerX;
+        sample[1] = (int) centerY;
+        scanhead->fetchPixel(sample + 2, CH_ZPOS | CH_CURRENT);
+        numSteps += 1;
+        if (numSteps % samplesPerChunk == 0) writeChunk();
+
+        phase = (phase + 1) % period;
+
+        if (numSteps >= maxSamples) {
+            writeChunk();
+            finish(TRACK_DONE, 0);
+        }
+        break;
+    }
+
+    case TRACK_PAUSED:
+        scanhead->setPositionStep((int) centerX, (int) centerY, setCurrent);
+        break;
+
+    default:
+        break;
+    }
+
+    return state;
+}
+
+void AtomTrack::pause() {
+    if (state != TRACK_RUN) return;
+    scanhead->stream.writeEvent("pause", chunkIndex, numSteps);
+    state = TRACK_PAUSED;
+}
+
+void AtomTrack::resume() {
+    /*!
+     * \brief drives back onto the circle and restarts the demodulation
+     */
+
+    if (state != TRACK_PAUSED) return;
+    scanhead->stream.writeEvent("resume", chunkIndex, 0);
+    state = TRACK_START;
+}
+
+void AtomTrack::abort() {
+    /*!
+     * \brief stops tracking, streaming the samples logged so far
+     */
+
+    if (finished() || state == TRACK_IDLE) return;
+
+    writeChunk();
+    finish(TRACK_ABORTED, ScanJob::abortedStatus);
+}
+
+bool AtomTrack::finished() {
+    return state == TRACK_DONE || state == TRACK_FAILED || state == TRACK_ABORTED;
+}
+
+int AtomTrack::result() {
+    if (state == TRACK_DONE) return 0;
+    return failStatus;
+}
+
+void AtomTrack::restartDemodulation() {
+    // the center only moves once a full turn of products is in
+    phase = 0;
+    filled = 0;
+    for (int i = 0; i < period; i++) {
+        productX[i] = 0;
+        productY[i] = 0;
+    }
+
+    // clearing integration from the move
+    int discard[2];
+    scanhead->fetchPixel(discard, CH_ZPOS | CH_CURRENT);
+}
+
+void AtomTrack::writeChunk() {
+    // streams the samples since the last full chunk
+    long first = (long) chunkIndex * samplesPerChunk;
+    if (numSteps <= first) return;
+
+    scanhead->stream.writeLine(chunkIndex, dataArr, first, numSteps - first);
+    chunkIndex += 1;
+}
+
+void AtomTrack::finish(int newState, int status) {
+    failStatus = status;
+    state = newState;
+    scanhead->stream.endFrame(status);
+}
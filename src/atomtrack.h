@@ -0,0 +1,86 @@
+/*
+ * atomtrack.h
+ * Locks the tip onto a local height maximum by circling it and feeding the demodulated gradient into X/Y
+ */
+
+#ifndef atomtrack_h
+#define atomtrack_h
+
+#include "Arduino.h"
+#include "scanhead.h"
+
+/*
+ * The tip is driven around a circle of radius LSB about the tracked center, one turn per circleCycles
+ * control cycles. Every cycle the height (or the current, without height control) is multiplied by the
+ * cosine and sine of the circle phase lagCycles earlier, and summed over the last full turn, which gives
+ * the gradient at the center. The center climbs the gradient by gain LSB per unit gradient per cycle.
+ *
+ * The tracked center, Z and current are logged every control cycle and streamed in chunks of
+ * samplesPerChunk, after a #track event giving the radius. x and y in the stream are the tracked center.
+ */
+
+class AtomTrack
+{
+    public:
+        AtomTrack();
+
+        enum State {
+            TRACK_IDLE,
+            TRACK_RECENTER, // recentering Z with the steppers before the start
+            TRACK_START,   // driving to the start point on the circle
+            TRACK_RUN,
+            TRACK_PAUSED,  // holding the center under feedback
+            TRACK_DONE,
+            TRACK_FAILED,
+            TRACK_ABORTED
+        };
+
+        static const int samplesPerChunk = 64;
+        static const int maxCircleCycles = 64;
+        static const int logChannels = CH_XPOS | CH_YPOS | CH_ZPOS | CH_CURRENT;
+
+        int radius = 20;       // modulation radius, LSB
+        int circleCycles = 32; // control cycles per turn, at most maxCircleCycles
+        int lagCycles = 5;     // delay of the height response behind the lateral command, control cycles
+        float gain = 0.5;      // center step per cycle per unit gradient, LSB
+        int polarity = 1;      // 1 locks onto a protrusion, -1 onto a depression
+
+        void begin(ScanHead *scanhead, int *dataArr, int x, int y, long numSamples, bool heightControl);
+        int update();
+        void pause();
+        void resume();
+        void abort();
+
+        bool finished();
+        int result();
+
+        int state;
+        float centerX;     // tracked position, LSB
+        float centerY;
+        float gradientX;   // height gradient at the center over the last turn
+        float gradientY;
+        long numSteps;     // samples logged
+        int chunkIndex;
+
+    private:
+        ScanHead *scanhead;
+
+        int *dataArr;
+        long maxSamples;
+        int setCurrent;
+        int period;        // circleCycles, clamped when the track begins
+        int phase;         // circle phase of the current cycle, 0 to period - 1
+        int filled;        // demodulation products summed, up to one turn
+        int failStatus;
+
+        float cosTable[maxCircleCycles];
+        float sinTable[maxCircleCycles];
+        float productX[maxCircleCycles]; // last turn of demodulation products, by phase
+        float productY[maxCircleCycles];
+
+        void restartDemodulation();
+        void writeChunk();
+        void finish(int newState, int status);
+};
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * bench.cpp
+ * Cycle counted benchmarks of the control loop's kernels, run alike on the head and on the host simulator
+ */
+
+#include "Arduino.h"
+#include "bench.h"
+
+const char * const Bench::kernelNames[numKernels] = {
+    "biquad", "sos", "pid", "dac", "units", "linecode"
+};
+
+// the first stage of SOS's 60Hz notch
+static const float benchStage[6] = {
+    0.9994278369285194, -1.9985006758765964, 0.9994278369285192, 1.0, -1.9986924420198302, 0.9990474740641058
+};
+
+Bench::Bench() {
+    scanhead = NULL;
+    firstKernel = 0;
+    lastKernel = -1;
+    kernel = 0;
+    stage.setcoeffs(benchStage);
+    lineNumber = 0;
+    counterCycles = 0;
+
+    // a triangle wave over the table and uniform noise, in integers so every target reads the same table
+    uint32_t seed = 12345;
+    for (int n = 0; n < numInputs; n++) {
+        seed = seed * 1664525 + 1013904223;
+        inputs[n] = 32768 + abs((n * 8) % 2048 - 1024) - 512 + (int) (seed >> 24) - 128;
+    }
+}
+
+int Bench::kernelByName(const char *name) {
+    for (int k = 0; k < numKernels; k++) {
+        if (strcmp(name, kernelNames[k]) == 0) return k;
+    }
+    return -1;
+}
+
+void Bench::begin(ScanHead *scanhead, int kernel, int calls) {
+    /*!
+     * \brief starts timing one or all kernels, a few batches per update()
+     * @param *scanhead ScanHead for the pid and units kernels
+     * @param kernel Kernel, -1 for all
+     * @param calls calls to time per kernel, rounded up to whole batches
+     */
+
+    this->scanhead = scanhead;
+    this->calls = calls;
+    firstKernel = kernel < 0 ? 0 : kernel;
+    lastKernel = kernel < 0 ? numKernels - 1 : kernel;
+    this->kernel = firstKernel;
+
+    counterCycles = 0xffffffff;
+    for (int i = 0; i < 16; i++) {
+        uint32_t start = ARM_DWT_CYCCNT;
+        uint32_t end = ARM_DWT_CYCCNT;
+        if (end - start < counterCycles) counterCycles = end - start;
+    }
+
+    // the controller holds its position meanwhile
+    savedStatus = scanhead->status;
+    beginKernel();
+}
+
+void Bench::update() {
+    /*!
+     * \brief times the next batchesPerUpdate batches, or the next call of the pid kernel, which is a control cycle.
+     *         Call until finished()
+     */
+
+    if (finished()) return;
+
+    result_struct &result = results[kernel];
+    int batchesLeft = kernel == BENCH_PID ? 1 : batchesPerUpdate;
+    for (; batchesLeft > 0 && batch < batches; batchesLeft--, batch++) {
+        uint32_t cycles = runBatch(kernel, batch * perBatch, result.check);
+        if (cycles < fastest) fastest = cycles;
+        total += cycles;
+    }
+    if (batch < batches) return;
+
+    result.calls = batches * perBatch;
+    result.minCycles = (float) fastest / perBatch;
+    result.meanCycles = (float) total / result.calls;
+
+    kernel += 1;
+    if (kernel <= lastKernel) beginKernel();
+    else scanhead->status = savedStatus;
+}
+
+void Bench::abort() {
+    /*!
+     * \brief stops timing, dropping the kernel being timed from printResults()
+     */
+
+    if (finished()) return;
+    lastKernel = kernel - 1;
+    scanhead->status = savedStatus;
+}
+
+bool Bench::finished() {
+    return kernel > lastKernel;
+}
+
+void Bench::printResults() {
+    /*!
+     * \brief prints the clock and the record of every kernel finished since begin()
+     */
+
+    Serial.print("bench cpuhz=");
+    Serial.println(F_CPU_ACTUAL);
+    for (int k = firstKernel; k <= lastKernel; k++) print(k, results[k]);
+}
+
+Bench::result_struct Bench::run(ScanHead *scanhead, int kernel, int calls) {
+    /*!
+     * \brief times a kernel, restoring any scan head state it changes. This is blocking!
+     * @param *scanhead ScanHead for the pid and units kernels
+     * @param kernel Kernel
+     * @param calls calls to time, rounded up to whole batches
+     * @return cycles per call of the fastest batch and on average
+     */
+
+    begin(scanhead, kernel, calls);
+    while (!finished()) update();
+    return results[kernel];
+}
+
+void Bench::beginKernel() {
+    perBatch = kernel == BENCH_PID ? 1 : batchCalls;
+    batches = calls > perBatch ? (calls + perBatch - 1) / perBatch : 1;
+    batch = 0;
+    fastest = 0xffffffff;
+    total = 0;
+    results[kernel].check = 0;
+
+    encoder.beginFrame(numScanChannels);
+    lineNumber = 0;
+}
+
+uint32_t Bench::runBatch(int kernel, int first, uint32_t &check) {
+    /*!
+     * \brief times one batch of a kernel, from reading first of the input table on
+     * @param &check the kernel's outputs are added to this
+     * @return cycles taken, less the counter's own
+     */
+
+    uint32_t start = 0;
+    uint32_t end = 0;
+
+    switch (kernel) {
+        case BENCH_BIQUAD:
+        case BENCH_SOS: {
+            float filtered[batchCalls];
+            start = ARM_DWT_CYCCNT;
+            if (kernel == BENCH_BIQUAD) {
+                for (int i = 0; i < batchCalls; i++) filtered[i] = stage.filter((float) inputs[(first + i) & (numInputs - 1)]);
+            }
+            else {
+                for (int i = 0; i < batchCalls; i++) filtered[i] = cascade.filter((float) inputs[(first + i) & (numInputs - 1)]);
+            }
+            end = ARM_DWT_CYCCNT;
+            for (int i = 0; i < batchCalls; i++) check += (uint32_t) (int) filtered[i];
+            break;
+        }
+        case BENCH_PID: {
+            int x = scanhead->xpos;
+            int y = scanhead->ypos;
+            start = ARM_DWT_CYCCNT;
+            int reached = scanhead->setPositionStep(x, y, -1);
+            end = ARM_DWT_CYCCNT;
+            check += reached;
+            break;
+        }
+        case BENCH_DAC: {
+            byte frames[batchCalls][ScanHead::dacFrameBytes];
+            start = ARM_DWT_CYCCNT;
+            for (int i = 0; i < batchCalls; i++) {
+                ScanHead::packDacFrame(i & 7, inputs[(first + i) & (numInputs - 1)], frames[i]);
+            }
+            end = ARM_DWT_CYCCNT;
+            for (int i = 0; i < batchCalls; i++) {
+                for (int j = 0; j < ScanHead::dacFrameBytes; j++) check += frames[i][j];
+            }
+            break;
+        }
+        case BENCH_UNITS: {
+            int codes[batchCalls];
+            start = ARM_DWT_CYCCNT;
+            for (int i = 0; i < batchCalls; i++) {
+                codes[i] = scanhead->currentToTia(scanhead->tiaToCurrent(inputs[(first + i) & (numInputs - 1)]));
+            }
+            end = ARM_DWT_CYCCNT;
+            for (int i = 0; i < batchCalls; i++) check += codes[i];
+            break;
+        }
+        case BENCH_LINECODE: {
+            fillLine(first);
+            encoder.beginLine(batchCalls);
+            int written = 0;
+            start = ARM_DWT_CYCCNT;
+            for (int i = 0; i < batchCalls; i++) written += encoder.encodePixel(line + i * numScanChannels, digits + written);
+            end = ARM_DWT_CYCCNT;
+            written += encoder.endLine(digits + written);
+            for (int i = 0; i < written; i++) check += digits[i];
+            break;
+        }
+    }
+
+    uint32_t cycles = end - start;
+    return cycles > counterCycles ? cycles - counterCycles : 0;
+}
+
+void Bench::fillLine(int first) {
+    /*!
+     * \brief fills the next line for the line coding kernel: raster positions, and channels following the input
+     *        table from the batch's first reading on, scaled down channel by channel
+     */
+
+    for (int p = 0; p < batchCalls; p++) {
+        int *pixel = line + p * numScanChannels;
+        pixel[0] = p * 16;
+        pixel[1] = lineNumber * 16;
+        for (int ch = 2; ch < numScanChannels; ch++) pixel[ch] = inputs[(first + p + 7 * ch) & (numInputs - 1)] >> (ch - 2);
+    }
+    lineNumber += 1;
+}
+
+void Bench::print(int kernel, const result_struct &result) {
+    /*!
+     * \brief prints a kernel's #bench record (see bench.h)
+     */
+
+    Serial.print("#bench,");
+    Serial.print(kernelNames[kernel]);
+    Serial.print(",");
+    Serial.print(result.calls);
+    Serial.print(",");
+    Serial.print(result.minCycles, 1);
+    Serial.print(",");
+    Serial.print(result.meanCycles, 1);
+    Serial.print(",");
+    Serial.print(result.minCycles * 1e9 / F_CPU_ACTUAL, 1);
+    Serial.print(",");
+    Serial.print(result.meanCycles * 1e9 / F_CPU_ACTUAL, 1);
+    Serial.print(",");
+    Serial.println(result.check);
+}
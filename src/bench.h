@@ -0,0 +1,101 @@
+/*
+ * bench.h
+ * Cycle counted benchmarks of the control loop's kernels, run alike on the head and on the host simulator
+ */
+
+#ifndef bench_h
+#define bench_h
+
+#include "Arduino.h"
+#include "scanhead.h"
+#include "linecodec.cpp"
+
+/*
+ * Every kernel is called in batches, timed with the DWT cycle counter (on the host, see Arduino.h) less the cost
+ * of reading it, on a fixed table of TIA like readings so runs are comparable. A call is:
+ *   biquad    one reading through a Biquad stage of the mains notch
+ *   sos       one reading through the whole notch cascade, as sampleCurrent() filters it
+ *   pid       one setPositionStep() holding the current position without height control, DAC writes included
+ *   dac       packing one DAC write's SPI frame
+ *   units     one tiaToCurrent() and one currentToTia()
+ *   linecode  coding one pixel of all channels, lines of batchCalls pixels
+ * The fastest batch gives the cost of a call undisturbed by interrupts, the mean over all batches its cost among
+ * them. The pid kernel times a call per batch, as the sampling interrupt comes around every few calls.
+ * The bench command queues a JOB_BENCH, which runs batchesPerUpdate batches per control cycle, a single one of
+ * the pid kernel, so the supervisor and the stream keep running between them.
+ *
+ * Each kernel prints one record:
+ *   #bench,kernel,calls,mincycles,meancycles,minns,meanns,check
+ * with cycles and ns per call and a checksum of the kernel's outputs, which keeps them from being optimized away
+ * and, for the dac and linecode kernels, is the same on the head and the host.
+ */
+
+class Bench
+{
+    public:
+        Bench();
+
+        enum Kernel {
+            BENCH_BIQUAD,
+            BENCH_SOS,
+            BENCH_PID,
+            BENCH_DAC,
+            BENCH_UNITS,
+            BENCH_LINECODE,
+            numKernels
+        };
+
+        static const char * const kernelNames[numKernels];
+        static const int batchCalls = 16;
+        static const int defaultCalls = 4096;
+        static const int maxCalls = 1 << 20;
+        static const int batchesPerUpdate = 8; // batches per update(), a few hundred microseconds at most
+
+        struct result_struct {
+            int calls;
+            float minCycles;  // per call
+            float meanCycles;
+            uint32_t check;
+        };
+
+        static int kernelByName(const char *name); // -1 if there is none
+        void begin(ScanHead *scanhead, int kernel, int calls); // kernel -1 for all of them
+        void update();
+        void abort();
+        bool finished();
+        void printResults(); // the records of the kernels run since begin()
+        result_struct run(ScanHead *scanhead, int kernel, int calls); // blocking
+        void print(int kernel, const result_struct &result);
+
+        result_struct results[numKernels];
+
+    private:
+        ScanHead *scanhead;
+        int firstKernel; // kernels run since begin(), in order
+        int lastKernel;
+        int kernel;      // the kernel being timed, past lastKernel once finished
+        int calls;
+        int batch;
+        int batches;
+        int perBatch;
+        uint32_t fastest;
+        uint64_t total;
+        int savedStatus; // scan head status, restored once finished
+        Biquad stage;
+        SOS cascade;
+        LineEncoder encoder;
+
+        static const int numInputs = 256;
+        int inputs[numInputs];  // TIA LSB
+        int line[batchCalls * numScanChannels];
+        char digits[batchCalls * LineEncoder::maxPixelDigits + 1];
+        int lineNumber;
+
+        uint32_t counterCycles; // cost of the two counter reads around a batch
+
+        void beginKernel();
+        uint32_t runBatch(int kernel, int first, uint32_t &check);
+        void fillLine(int first);
+};
+
+#endif
@@ -23,18 +23,39 @@ class Biquad
          */
 		void setcoeffs(const float *coeffs) {
 
-            a[0] = coeffs[0];
-            a[1] = coeffs[1];
-            a[2] = coeffs[2];
-            b[0] = coeffs[3];
-            b[1] = coeffs[4];
-            b[2] = coeffs[5];
+            retune(coeffs);
 
             x0 = 0;
             x1 = 0;
             y0 = 0;
             y1 = 0;
 		}
+        /*!
+         * \brief changes filter coefficients, keeping the filter state
+         */
+        void retune(const float *coeffs) {
+            a[0] = coeffs[0];
+            a[1] = coeffs[1];
+            a[2] = coeffs[2];
+            b[0] = coeffs[3];
+            b[1] = coeffs[4];
+            b[2] = coeffs[5];
+        }
+        /*!
+         * \brief copies out the filter state, four floats, so a trace replay can start where the recording did
+         */
+        void getState(float *state) const {
+            state[0] = x0;
+            state[1] = x1;
+            state[2] = y0;
+            state[3] = y1;
+        }
+        void setState(const float *state) {
+            x0 = state[0];
+            x1 = state[1];
+            y0 = state[2];
+            y1 = state[3];
+        }
         /*!
          * \brief adds an element to the filter and returns the filtered output
          * @param in the input value
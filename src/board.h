@@ -0,0 +1,14 @@
+/*
+ * board.h
+ * Selects the board traits the firmware is built for
+ */
+
+#ifndef board_h
+#define board_h
+
+#include "controlboard.h"
+
+// included as <board.h>, so a build can put its own first on the include path, as the host simulator does
+typedef ControlBoard Board;
+
+#endif
@@ -0,0 +1,765 @@
+/*
+ * commands.cpp
+ * Non-blocking serial command interface for setting parameters and queueing jobs
+ */
+
+#include "Arduino.h"
+#include "commands.h"
+
+Commands::Commands(ScanHead *scanhead, JobQueue *queue, Scheduler *scheduler, NoiseSpectrum *spectrum,
+        uint16_t *traceBuf, int traceBufSize) {
+    this->scanhead = scanhead;
+    this->queue = queue;
+    this->scheduler = scheduler;
+    this->spectrum = spectrum;
+    this->traceBuf = traceBuf;
+    this->traceBufSize = traceBufSize;
+    lineLength = 0;
+}
+
+void Commands::poll() {
+    /*!
+     * \brief reads any available serial characters, dispatching each completed line. Never blocks
+     */
+
+    // a stopped jog sets the origin of the next scan
+    if (queue->jogSelected) {
+        queue->jogSelected = false;
+        scanDefaults.x = (int) queue->jog.x;
+        scanDefaults.y = (int) queue->jog.y;
+    }
+
+    while (Serial.available() > 0) {
+        char c = Serial.read();
+
+        if (c == '\r') continue;
+
+        if (c == '\n') {
+            lineBuf[lineLength] = '\0';
+            if (lineLength > 0) dispatch(lineBuf);
+            lineLength = 0;
+        }
+        else if (lineLength < maxLineLength - 1) {
+            lineBuf[lineLength++] = c;
+        }
+    }
+}
+
+void Commands::dispatch(char *line) {
+    /*!
+     * \brief parses and runs a single command line
+     * @param *line null terminated command, modified by parsing
+     */
+
+    char *cmd = strtok(line, " \t");
+    if (cmd == NULL) return;
+
+    if (strcmp(cmd, "set") == 0) {
+        char *name = strtok(NULL, " \t");
+        char *value = strtok(NULL, " \t");
+        if (name == NULL || value == NULL) Serial.println("err usage: set <param> <value>");
+        else setParam(name, value);
+    }
+    else if (strcmp(cmd, "get") == 0) printParams();
+    else if (strcmp(cmd, "status") == 0) printStatus();
+    else if (strcmp(cmd, "approach") == 0) {
+        Job job;
+        job.type = JOB_APPROACH;
+        replyEnqueue(queue->enqueue(job));
+    }
+    else if (strcmp(cmd, "scan") == 0) {
+        Job job = scanDefaults;
+        job.type = JOB_SCAN;
+        int *fields[] = {&job.x, &job.y, &job.sizeX, &job.sizeY, &job.step};
+        if (readFields(strtok(NULL, " \t"), fields, 5, 0)) replyEnqueue(queue->enqueue(job));
+    }
+    else if (strcmp(cmd, "survey") == 0) {
+        Job job = scanDefaults;
+        job.type = JOB_SURVEY;
+        int *fields[] = {&job.x, &job.y, &job.sizeX, &job.sizeY, &job.step};
+        if (readFields(strtok(NULL, " \t"), fields, 5, 0)) replyEnqueue(queue->enqueue(job));
+    }
+    else if (strcmp(cmd, "zoom") == 0) {
+        int col, row, pixels;
+        int *fields[] = {&col, &row, &pixels};
+        if (readFields(strtok(NULL, " \t"), fields, 3, 3)) {
+            int zoomStatus = queue->zoom(col, row, pixels);
+            if (zoomStatus == -5) Serial.println("err no survey");
+            else replyEnqueue(zoomStatus);
+        }
+    }
+    else if (strcmp(cmd, "spiral") == 0 || strcmp(cmd, "lissajous") == 0) {
+        Job job = scanDefaults;
+        job.type = strcmp(cmd, "spiral") == 0 ? JOB_SPIRAL : JOB_LISSAJOUS;
+        int *fields[] = {&job.x, &job.y, &job.sizeX, &job.lines, &job.speed};
+        if (readFields(strtok(NULL, " \t"), fields, 5, 0)) replyEnqueue(queue->enqueue(job));
+    }
+    else if (strcmp(cmd, "track") == 0) {
+        Job job = scanDefaults;
+        job.type = JOB_TRACK;
+        int *fields[] = {&job.x, &job.y, &job.cycles};
+        if (readFields(strtok(NULL, " \t"), fields, 3, 0)) replyEnqueue(queue->enqueue(job));
+    }
+    else if (strcmp(cmd, "spec") == 0) {
+        Job job = scanDefaults;
+        job.type = JOB_SPEC;
+        int *fields[] = {&job.x, &job.y, &job.sizeX, &job.sizeY, &job.step};
+        if (readFields(strtok(NULL, " \t"), fields, 5, 0)) replyEnqueue(queue->enqueue(job));
+    }
+    else if (strcmp(cmd, "spectable") == 0) {
+        // long tables are sent over several lines, the first starting with clear
+        Spectroscopy &spec = queue->spectroscopy;
+        char *arg = strtok(NULL, " \t");
+        if (queue->state == JobQueue::QUEUE_SPECTROSCOPY) Serial.println("err spectroscopy running");
+        else if (arg == NULL) printTable();
+        else {
+            bool clearTable = strcmp(arg, "clear") == 0;
+            if (clearTable) arg = strtok(NULL, " \t");
+
+            // the table is left alone unless every value is good. Each takes a digit and a separator of the line
+            int values[maxLineLength / 2];
+            int count = 0;
+            for (; arg != NULL; arg = strtok(NULL, " \t")) {
+                if (!readInt(arg, "value", -maxTableValue, maxTableValue, &values[count])) return;
+                count += 1;
+            }
+            if ((clearTable ? 0 : spec.numPoints) + count > ScanHead::maxSweepPoints) Serial.println("err table full");
+            else {
+                if (clearTable) spec.numPoints = 0;
+                for (int i = 0; i < count; i++) spec.appendTable(values[i]);
+                Serial.print("ok points=");
+                Serial.println(spec.numPoints);
+            }
+        }
+    }
+    else if (strcmp(cmd, "jog") == 0) {
+        char *arg = strtok(NULL, " \t");
+        if (arg != NULL && strcmp(arg, "stop") == 0) {
+            if (queue->state != JobQueue::QUEUE_JOGGING) Serial.println("err not jogging");
+            else {
+                queue->jog.stop();
+                Serial.println("ok");
+            }
+        }
+        else if (arg != NULL && strcmp(arg, "speed") == 0) {
+            char *index = strtok(NULL, " \t");
+            int speedIndex;
+            if (index == NULL) Serial.println("err usage: jog speed <0-4>");
+            else if (readInt(index, "speed", 0, Jog::numSpeeds - 1, &speedIndex)) {
+                queue->jog.selectSpeed(speedIndex);
+                Serial.print("ok speed=");
+                Serial.println(queue->jog.speedIndex);
+            }
+        }
+        else {
+            Job job = scanDefaults;
+            job.type = JOB_JOG;
+            int *fields[] = {&job.x, &job.y};
+            if (readFields(arg, fields, 2, 0)) replyEnqueue(queue->enqueue(job));
+        }
+    }
+    else if (strcmp(cmd, "retract") == 0) {
+        Job job;
+        job.type = JOB_RETRACT;
+        char *arg = strtok(NULL, " \t");
+        if (arg == NULL || readInt(arg, "steps", 1, maxRetractSteps, &job.steps)) replyEnqueue(queue->enqueue(job));
+    }
+    else if (strcmp(cmd, "pause") == 0) {
+        queue->pause();
+        Serial.println("ok");
+    }
+    else if (strcmp(cmd, "resume") == 0) {
+        queue->resume();
+        Serial.println("ok");
+    }
+    else if (strcmp(cmd, "abort") == 0) {
+        queue->abort();
+        Serial.println("ok");
+    }
+    else if (strcmp(cmd, "clear") == 0) {
+        queue->clear();
+        Serial.println("ok");
+    }
+    else if (strcmp(cmd, "calibrate") == 0) calibrateCommand(strtok(NULL, " \t"));
+    else if (strcmp(cmd, "drift") == 0) {
+        char *arg = strtok(NULL, " \t");
+        if (arg != NULL && strcmp(arg, "reset") == 0) {
+            scanhead->drift.reset();
+            Serial.println("ok");
+        }
+        else printDrift();
+    }
+    else if (strcmp(cmd, "spectrum") == 0) spectrumCommand(strtok(NULL, " \t"));
+    else if (strcmp(cmd, "trace") == 0) traceCommand(strtok(NULL, " \t"));
+    else if (strcmp(cmd, "bench") == 0) benchCommand(strtok(NULL, " \t"));
+    else if (strcmp(cmd, "comp") == 0) {
+        Serial.println("ok");
+        scanhead->printCompensation();
+    }
+    else if (strcmp(cmd, "tasks") == 0) {
+        Serial.println("ok");
+        scheduler->printStats();
+        char *arg = strtok(NULL, " \t");
+        if (arg != NULL && strcmp(arg, "reset") == 0) scheduler->resetStats();
+    }
+    else {
+        Serial.print("err unknown command ");
+        Serial.println(cmd);
+    }
+}
+
+// parameters a job or the control loop cannot run with outside these bounds. A setpoint must never select
+// setPositionStep's -1 (no height control) or -2 (retract), and a zero step never reaches its target
+static const struct {
+    const char *name;
+    int min;
+    int max;
+} paramRanges[] = {
+    {"setpoint",    1, Commands::noLimit},
+    {"sizex",       1, Commands::noLimit},
+    {"sizey",       1, Commands::noLimit},
+    {"step",        1, Commands::noLimit},
+    {"channels",    1, (1 << numScanChannels) - 1},
+    {"lines",       1, Commands::noLimit},
+    {"speed",       1, Commands::noLimit},
+    {"regions",     1, max_regions},
+    {"zoomsize",    1, Commands::noLimit},
+    {"zoomstep",    1, Commands::noLimit},
+    {"roi",         0, 1},
+    {"cycles",      1, Commands::noLimit},
+    {"trackradius", 1, Commands::noLimit},
+    {"trackperiod", 4, AtomTrack::maxCircleCycles},
+    {"specpoints",  2, ScanHead::maxSweepPoints},
+    {"specsettle",  0, Commands::noLimit},
+    {"specdelay",   0, Commands::noLimit},
+    {"specavg",     1, Commands::noLimit},
+    {"lockinfreq",  1, 500000 / ScanHead::samplePeriodUs}, // below the sampling Nyquist frequency
+    {"lockintau",   1, Commands::noLimit},
+    {"zmargin",     0, Commands::noLimit},
+    {"zrecenter",   1, Commands::noLimit},
+    {"retries",     0, 100},
+    {"reapproach", -1, 100},
+    {"transstep",   1, Commands::noLimit},
+    {"zstep",       1, Commands::noLimit},
+};
+
+static bool parseInt(const char *text, int *value) {
+    /*!
+     * \brief reads a whole decimal or 0x-prefixed hex integer
+     * @return false if text is empty or has anything after the number
+     */
+
+    char *end;
+    long parsed = strtol(text, &end, 0);
+    if (end == text || *end != '\0') return false;
+    *value = (int) parsed;
+    return true;
+}
+
+static bool parseFloat(const char *text, float *value) {
+    /*!
+     * \brief reads a whole decimal number
+     * @return false if text is empty or has anything after the number
+     */
+
+    char *end;
+    double parsed = strtod(text, &end);
+    if (end == text || *end != '\0') return false;
+    *value = (float) parsed;
+    return true;
+}
+
+bool Commands::readInt(const char *arg, const char *name, int min, int max, int *value) {
+    /*!
+     * \brief reads a single integer argument within min to max
+     * @param *name argument name for the err reply
+     * @return true if read, false after an err reply. value is only changed if read
+     */
+
+    int parsed;
+    if (!parseInt(arg, &parsed)) {
+        Serial.print("err malformed argument ");
+        Serial.println(arg);
+        return false;
+    }
+    if (parsed < min || parsed > max) {
+        replyRange(name, min, max);
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+bool Commands::readFields(char *arg, int * const *fields, int numFields, int required) {
+    /*!
+     * \brief reads a command's integer arguments into fields, in order. Omitted arguments after the required
+     *        ones keep their fields' values. Nothing is changed unless every argument is well formed
+     * @param *arg the first argument, NULL if there is none, the rest are taken from strtok
+     * @param required arguments that must be given
+     * @return true if read, false after an err reply naming the missing, malformed or extra argument
+     */
+
+    int values[maxFields];
+    int count = 0;
+    for (; arg != NULL; arg = strtok(NULL, " \t")) {
+        if (count == numFields) {
+            Serial.print("err unexpected argument ");
+            Serial.println(arg);
+            return false;
+        }
+        if (!parseInt(arg, &values[count])) {
+            Serial.print("err malformed argument ");
+            Serial.println(arg);
+            return false;
+        }
+        count += 1;
+    }
+    if (count < required) {
+        Serial.print("err missing argument ");
+        Serial.print(count + 1);
+        Serial.print(" of ");
+        Serial.println(required);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) *fields[i] = values[i];
+    return true;
+}
+
+void Commands::setParam(const char *name, const char *value) {
+    /*!
+     * \brief sets a named parameter
+     * @param *name parameter name as listed by get
+     * @param *value integer value, decimal or 0x-prefixed hex
+     */
+
+    int val;
+    if (!parseInt(value, &val)) {
+        Serial.print("err malformed value ");
+        Serial.println(value);
+        return;
+    }
+    for (unsigned int i = 0; i < sizeof(paramRanges) / sizeof(paramRanges[0]); i++) {
+        if (strcmp(name, paramRanges[i].name) == 0 && (val < paramRanges[i].min || val > paramRanges[i].max)) {
+            replyRange(name, paramRanges[i].min, paramRanges[i].max);
+            return;
+        }
+    }
+    Spectroscopy &spec = queue->spectroscopy;
+
+    // the bias DAC and the sweep table belong to the sweep while a grid runs
+    bool specParam = strncmp(name, "spec", 4) == 0 || strcmp(name, "bias") == 0;
+    if (specParam && queue->state == JobQueue::QUEUE_SPECTROSCOPY) {
+        Serial.println("err spectroscopy running");
+        return;
+    }
+
+    if (strcmp(name, "setpoint") == 0)        scanhead->setpoint = val;
+    else if (strcmp(name, "x") == 0)          scanDefaults.x = val;
+    else if (strcmp(name, "y") == 0)          scanDefaults.y = val;
+    else if (strcmp(name, "sizex") == 0)      scanDefaults.sizeX = val;
+    else if (strcmp(name, "sizey") == 0)      scanDefaults.sizeY = val;
+    else if (strcmp(name, "step") == 0)       scanDefaults.step = val;
+    else if (strcmp(name, "channels") == 0)   scanDefaults.channels = val;
+    else if (strcmp(name, "lines") == 0)      scanDefaults.lines = val;
+    else if (strcmp(name, "speed") == 0)      scanDefaults.speed = val;
+    else if (strcmp(name, "regions") == 0)    scanDefaults.regions = val;
+    else if (strcmp(name, "zoomsize") == 0)   scanDefaults.zoomSize = val;
+    else if (strcmp(name, "zoomstep") == 0)   scanDefaults.zoomStep = val;
+    else if (strcmp(name, "roi") == 0)        scanDefaults.roi = val;
+    else if (strcmp(name, "cycles") == 0)     scanDefaults.cycles = val;
+    else if (strcmp(name, "trackradius") == 0)   queue->atomTrack.radius = val;
+    else if (strcmp(name, "trackperiod") == 0)   queue->atomTrack.circleCycles = val;
+    else if (strcmp(name, "tracklag") == 0)      queue->atomTrack.lagCycles = val;
+    else if (strcmp(name, "trackgain") == 0)     queue->atomTrack.gain = val / 1000.0; // milli LSB per unit gradient
+    else if (strcmp(name, "trackpolarity") == 0) queue->atomTrack.polarity = val < 0 ? -1 : 1;
+    else if (strcmp(name, "bias") == 0)       scanhead->setBias(val); // mV
+    else if (strcmp(name, "specmode") == 0)   spec.mode = val == 0 ? Spectroscopy::SPEC_IV : Spectroscopy::SPEC_IZ;
+    else if (strcmp(name, "specstart") == 0)  spec.setLinearTable(val, spec.tableEnd(), spec.numPoints);
+    else if (strcmp(name, "specend") == 0)    spec.setLinearTable(spec.tableStart(), val, spec.numPoints);
+    else if (strcmp(name, "specpoints") == 0) spec.setLinearTable(spec.tableStart(), spec.tableEnd(), val);
+    else if (strcmp(name, "specsettle") == 0) spec.settleCycles = val;
+    else if (strcmp(name, "specdelay") == 0)  spec.settleSamples = val;
+    else if (strcmp(name, "specavg") == 0)    spec.averageSamples = val;
+    else if (strcmp(name, "lockin") == 0)     scanhead->lockIn.enabled = val != 0;
+    else if (strcmp(name, "lockinfreq") == 0) scanhead->lockIn.frequencyHz = val;
+    else if (strcmp(name, "lockinamp") == 0)  scanhead->lockIn.amplitudeMV = val;
+    else if (strcmp(name, "lockintau") == 0)  scanhead->lockIn.timeConstantUs = val;
+    else if (strcmp(name, "lockinphase") == 0) scanhead->lockIn.phaseDeg = val;
+    else if (strcmp(name, "zmargin") == 0)    scanhead->zRangeMargin = val;
+    else if (strcmp(name, "zrecenter") == 0)  scanhead->zRecenterTarget = val;
+    else if (strcmp(name, "retries") == 0)    queue->scanJob.maxLineRetries = val;
+    else if (strcmp(name, "reapproach") == 0) queue->scanJob.reapproachAfterRetries = val;
+    else if (strcmp(name, "stream") == 0)     scanhead->stream.enabled = val != 0;
+    else if (strcmp(name, "compress") == 0)   scanhead->stream.compressed = val != 0;
+    else if (strcmp(name, "preview") == 0)    scanhead->preview.enabled = val != 0;
+    else if (strcmp(name, "transstep") == 0)  scanhead->maxTransverseStep = val;
+    else if (strcmp(name, "zstep") == 0)      scanhead->maxZStep = val;
+    else if (strcmp(name, "zgain") == 0)      scanhead->pidZP = val / 1000.0; // milli LSB per pA
+    else if (strcmp(name, "comp") == 0)       scanhead->enableLateralCompensation(val != 0);
+    else if (strcmp(name, "ff") == 0) {
+        // a new feed-forward mode starts from a fresh plane fit
+        scanhead->zFeedForward = val;
+        scanhead->zPredictor.reset();
+    }
+    else if (strcmp(name, "drift") == 0) {
+        // a new run of drift correction starts from a new reference frame
+        scanhead->driftCorrection = val != 0;
+        scanhead->drift.reset();
+    }
+    else if (strcmp(name, "kalman") == 0) {
+        scanhead->zEstimation = val != 0;
+        scanhead->zEstimator.reset();
+    }
+    else {
+        Serial.print("err unknown parameter ");
+        Serial.println(name);
+        return;
+    }
+
+    // lock-in parameters only take effect when the demodulation restarts
+    if (strncmp(name, "lockin", 6) == 0) scanhead->enableLockIn(scanhead->lockIn.enabled);
+
+    Serial.println("ok");
+}
+
+void Commands::printParams() {
+    Serial.print("ok setpoint=");
+    Serial.print(scanhead->setpoint);
+    Serial.print(" x=");
+    Serial.print(scanDefaults.x);
+    Serial.print(" y=");
+    Serial.print(scanDefaults.y);
+    Serial.print(" sizex=");
+    Serial.print(scanDefaults.sizeX);
+    Serial.print(" sizey=");
+    Serial.print(scanDefaults.sizeY);
+    Serial.print(" step=");
+    Serial.print(scanDefaults.step);
+    Serial.print(" channels=");
+    Serial.print(scanDefaults.channels);
+    Serial.print(" lines=");
+    Serial.print(scanDefaults.lines);
+    Serial.print(" speed=");
+    Serial.print(scanDefaults.speed);
+    Serial.print(" regions=");
+    Serial.print(scanDefaults.regions);
+    Serial.print(" zoomsize=");
+    Serial.print(scanDefaults.zoomSize);
+    Serial.print(" zoomstep=");
+    Serial.print(scanDefaults.zoomStep);
+    Serial.print(" roi=");
+    Serial.print(scanDefaults.roi);
+    Serial.print(" cycles=");
+    Serial.print(scanDefaults.cycles);
+    Serial.print(" trackradius=");
+    Serial.print(queue->atomTrack.radius);
+    Serial.print(" trackperiod=");
+    Serial.print(queue->atomTrack.circleCycles);
+    Serial.print(" tracklag=");
+    Serial.print(queue->atomTrack.lagCycles);
+    Serial.print(" trackgain=");
+    Serial.print((int) (queue->atomTrack.gain * 1000));
+    Serial.print(" trackpolarity=");
+    Serial.print(queue->atomTrack.polarity);
+    Serial.print(" bias=");
+    Serial.print(scanhead->sampleBias);
+    Serial.print(" specmode=");
+    Serial.print(queue->spectroscopy.mode);
+    Serial.print(" specstart=");
+    Serial.print(queue->spectroscopy.tableStart());
+    Serial.print(" specend=");
+    Serial.print(queue->spectroscopy.tableEnd());
+    Serial.print(" specpoints=");
+    Serial.print(queue->spectroscopy.numPoints);
+    Serial.print(" specsettle=");
+    Serial.print(queue->spectroscopy.settleCycles);
+    Serial.print(" specdelay=");
+    Serial.print(queue->spectroscopy.settleSamples);
+    Serial.print(" specavg=");
+    Serial.print(queue->spectroscopy.averageSamples);
+    Serial.print(" lockin=");
+    Serial.print(scanhead->lockIn.enabled ? 1 : 0);
+    Serial.print(" lockinfreq=");
+    Serial.print((int) scanhead->lockIn.frequencyHz);
+    Serial.print(" lockinamp=");
+    Serial.print((int) scanhead->lockIn.amplitudeMV);
+    Serial.print(" lockintau=");
+    Serial.print((int) scanhead->lockIn.timeConstantUs);
+    Serial.print(" lockinphase=");
+    Serial.print((int) scanhead->lockIn.phaseDeg);
+    Serial.print(" zmargin=");
+    Serial.print(scanhead->zRangeMargin);
+    Serial.print(" zrecenter=");
+    Serial.print(scanhead->zRecenterTarget);
+    Serial.print(" retries=");
+    Serial.print(queue->scanJob.maxLineRetries);
+    Serial.print(" reapproach=");
+    Serial.print(queue->scanJob.reapproachAfterRetries);
+    Serial.print(" stream=");
+    Serial.print(scanhead->stream.enabled ? 1 : 0);
+    Serial.print(" compress=");
+    Serial.print(scanhead->stream.compressed ? 1 : 0);
+    Serial.print(" preview=");
+    Serial.print(scanhead->preview.enabled ? 1 : 0);
+    Serial.print(" transstep=");
+    Serial.print(scanhead->maxTransverseStep);
+    Serial.print(" zstep=");
+    Serial.print(scanhead->maxZStep);
+    Serial.print(" zgain=");
+    Serial.print((int) (scanhead->pidZP * 1000));
+    Serial.print(" comp=");
+    Serial.print(scanhead->lateralCompensation ? 1 : 0);
+    Serial.print(" ff=");
+    Serial.print(scanhead->zFeedForward);
+    Serial.print(" kalman=");
+    Serial.print(scanhead->zEstimation ? 1 : 0);
+    Serial.print(" drift=");
+    Serial.println(scanhead->driftCorrection ? 1 : 0);
+}
+
+void Commands::printStatus() {
+    Serial.print("ok state=");
+    Serial.print(queue->state);
+    Serial.print(" scan=");
+    Serial.print(queue->scanJob.state);
+    Serial.print(" line=");
+    Serial.print(queue->scanJob.lineIndex);
+    Serial.print("/");
+    Serial.print(queue->scanJob.numLines);
+    Serial.print(" queued=");
+    Serial.print(queue->size());
+    Serial.print(" done=");
+    Serial.print(queue->jobsCompleted);
+    Serial.print(" last=");
+    Serial.print(queue->lastResult);
+    Serial.print(" pos=");
+    Serial.print(scanhead->xpos);
+    Serial.print(",");
+    Serial.print(scanhead->ypos);
+    Serial.print(",");
+    Serial.print(scanhead->zpos);
+    Serial.print(" stepper=");
+    Serial.print(scanhead->zposStepper);
+    Serial.print(" current=");
+    Serial.print(scanhead->current);
+    Serial.print(" didv=");
+    Serial.print((int) scanhead->didvPS());
+    Serial.print(",");
+    Serial.println((int) scanhead->didvQuadraturePS());
+}
+
+void Commands::printDrift() {
+    DriftTracker &drift = scanhead->drift;
+    unsigned long now = millis();
+    Serial.print("ok reference=");
+    Serial.print(drift.hasReference ? 1 : 0);
+    Serial.print(" matches=");
+    Serial.print(drift.measurements);
+    Serial.print(" corr=");
+    Serial.print(drift.correlation);
+    Serial.print(" offset=");
+    Serial.print(drift.offsetX(now));
+    Serial.print(",");
+    Serial.print(drift.offsetY(now));
+    Serial.print(",");
+    Serial.print(drift.offsetZ(now));
+    Serial.print(" rate=");
+    Serial.print(drift.vx);
+    Serial.print(",");
+    Serial.print(drift.vy);
+    Serial.print(",");
+    Serial.println(drift.vz);
+}
+
+void Commands::printTable() {
+    Spectroscopy &spec = queue->spectroscopy;
+    Serial.print("ok points=");
+    Serial.print(spec.numPoints);
+    for (int i = 0; i < spec.numPoints; i++) {
+        Serial.print(i == 0 ? " " : ",");
+        Serial.print(spec.table[i]);
+    }
+    Serial.println();
+}
+
+void Commands::spectrumCommand(char *arg) {
+    /*!
+     * \brief starts, reports on or stops the noise spectrum, or retunes the mains notch
+     * @param *arg first argument, NULL if there is none
+     */
+
+    if (arg == NULL || (arg[0] >= '0' && arg[0] <= '9')) {
+        if (!spectrum->finished()) {
+            Serial.println("err spectrum running");
+            return;
+        }
+        int blocks = 16;
+        if (arg != NULL && !readInt(arg, "blocks", 1, maxSpectrumBlocks, &blocks)) return;
+        spectrum->begin(scanhead, blocks);
+        Serial.println("ok");
+    }
+    else if (strcmp(arg, "report") == 0) spectrum->printReport();
+    else if (strcmp(arg, "psd") == 0) {
+        Serial.println("ok");
+        spectrum->printPsd();
+    }
+    else if (strcmp(arg, "stop") == 0) {
+        spectrum->abort();
+        Serial.println("ok");
+    }
+    else if (strcmp(arg, "notch") == 0) {
+        char *value = strtok(NULL, " \t");
+        float hz;
+        if (value == NULL) hz = spectrum->estimateMains();
+        else if (!parseFloat(value, &hz)) {
+            Serial.print("err malformed argument ");
+            Serial.println(value);
+            return;
+        }
+
+        if (hz >= spectrum->mainsMinHz && hz <= spectrum->mainsMaxHz) {
+            scanhead->tuneNotch(hz);
+            Serial.print("ok notch=");
+            Serial.println(hz, 2);
+        }
+        else if (value == NULL) Serial.println("err no mains frequency");
+        else replyRange("hz", (int) spectrum->mainsMinHz, (int) spectrum->mainsMaxHz);
+    }
+    else Serial.println("err usage: spectrum [blocks] | report | psd | stop | notch [hz]");
+}
+
+void Commands::traceCommand(char *arg) {
+    /*!
+     * \brief starts, stops or prints the control loop trace, or reports its state
+     * @param *arg first argument, NULL if there is none
+     */
+
+    TraceRecorder &trace = scanhead->trace;
+
+    if (arg == NULL) {
+        Serial.print("ok trace=");
+        Serial.print(trace.active ? "recording" : (trace.full ? "full" : "stopped"));
+        Serial.print(" words=");
+        Serial.print(trace.length);
+        Serial.print("/");
+        Serial.println(traceBufSize);
+    }
+    else if (strcmp(arg, "start") == 0) {
+        scanhead->beginTrace(traceBuf, traceBufSize);
+        Serial.println("ok");
+    }
+    else if (strcmp(arg, "stop") == 0) {
+        trace.stop();
+        Serial.println("ok");
+    }
+    else if (strcmp(arg, "dump") == 0) {
+        if (trace.active) Serial.println("err trace running");
+        else {
+            Serial.println("ok");
+            scanhead->printTrace();
+        }
+    }
+    else Serial.println("err usage: trace [start | stop | dump]");
+}
+
+void Commands::calibrateCommand(char *kind) {
+    /*!
+     * \brief queues a calibration. Its lateral range is checked when it starts, from where the tip is then
+     * @param *kind first argument, NULL if there is none
+     */
+
+    Job job;
+    job.calSize = 100; // decay probe excursion
+    if (kind != NULL && strcmp(kind, "decay") == 0) {
+        int *fields[] = {&job.calSize};
+        if (!readFields(strtok(NULL, " \t"), fields, 1, 0)) return;
+        if (job.calSize <= 0) {
+            replyRange("probe", 1, noLimit);
+            return;
+        }
+        job.type = JOB_DECAY;
+    }
+    else if (kind != NULL && (strcmp(kind, "hyst") == 0 || strcmp(kind, "creep") == 0)) {
+        int *fields[] = {&job.axis, &job.calSize, &job.holdMs};
+        job.type = strcmp(kind, "hyst") == 0 ? JOB_HYSTERESIS : JOB_CREEP;
+        if (!readFields(strtok(NULL, " \t"), fields, job.type == JOB_CREEP ? 3 : 2, 2)) return;
+        if (job.axis != 0 && job.axis != 1) {
+            replyRange("axis", 0, 1);
+            return;
+        }
+        if (job.type == JOB_HYSTERESIS && job.calSize <= 0) {
+            replyRange("amplitude", 1, noLimit);
+            return;
+        }
+        if (job.calSize == 0) {
+            Serial.println("err step must not be 0");
+            return;
+        }
+        if (job.holdMs <= 0 || job.holdMs > ScanHead::maxCreepHoldMs) {
+            replyRange("holdms", 1, ScanHead::maxCreepHoldMs);
+            return;
+        }
+    }
+    else {
+        Serial.println("err usage: calibrate hyst|creep <axis> <amplitude|step> [holdms] | calibrate decay [probe]");
+        return;
+    }
+
+    replyEnqueue(queue->enqueue(job));
+}
+
+void Commands::benchCommand(char *arg) {
+    /*!
+     * \brief queues timing one or all of the benchmark kernels, see bench.h
+     * @param *arg first argument, NULL if there is none
+     */
+
+    Job job;
+    job.type = JOB_BENCH;
+    int kernel = -1;
+    if (arg != NULL && strcmp(arg, "all") != 0) {
+        kernel = Bench::kernelByName(arg);
+        if (kernel < 0) {
+            Serial.println("err usage: bench [biquad | sos | pid | dac | units | linecode | all] [calls]");
+            return;
+        }
+    }
+    char *value = strtok(NULL, " \t");
+    if (value != NULL && !readInt(value, "calls", 1, Bench::maxCalls, &job.calls)) return;
+
+    if (!spectrum->finished() || scanhead->trace.active) {
+        Serial.println("err spectrum or trace running");
+        return;
+    }
+
+    job.kernel = kernel;
+    replyEnqueue(queue->enqueue(job));
+}
+
+void Commands::replyEnqueue(int enqueueStatus) {
+    if (enqueueStatus == 0) {
+        Serial.print("ok queued=");
+        Serial.println(queue->size());
+    }
+    else if (enqueueStatus == -1) Serial.println("err queue full");
+    else if (enqueueStatus == -2) Serial.println("err scan does not fit frame buffer");
+    else if (enqueueStatus == -3) Serial.println("err size, step, lines, speed and cycles must be positive, zoomsize at least 2 steps");
+    else Serial.println("err sweep table empty");
+}
+
+void Commands::replyRange(const char *name, int min, int max) {
+    Serial.print("err ");
+    Serial.print(name);
+    if (max == noLimit) {
+        Serial.print(" must be at least ");
+        Serial.println(min);
+    }
+    else {
+        Serial.print(" must be ");
+        Serial.print(min);
+        Serial.print(" to ");
+        Serial.println(max);
+    }
+}
+
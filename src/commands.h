@@ -0,0 +1,97 @@
+/*
+ * commands.h
+ * Non-blocking serial command interface for setting parameters and queueing jobs
+ */
+
+#ifndef commands_h
+#define commands_h
+
+#include "Arduino.h"
+#include "scanhead.h"
+#include "jobqueue.h"
+#include "scheduler.h"
+#include "noisespectrum.h"
+
+/*
+ * One command per line, whitespace separated. Replies start with "ok" or "err".
+ *   set <param> <value>   set a parameter (see get)
+ *   get                   print all parameters
+ *   status                print scan head and queue status
+ *   approach              queue an auto approach to the setpoint
+ *   scan [x y sizex sizey step]   queue a scan, omitted arguments use the current parameters
+ *   survey [x y sizex sizey step]   queue a coarse scan followed by zoom scans of its roughest regions
+ *                         (regions, zoomsize, zoomstep, roi 0 = roughness 1 = contrast)
+ *   zoom <col> <row> <pixels>        queue a zoom scan of a box in the last survey frame
+ *   spiral [x y size lines speed]      queue a spiral scan centered on (x, y), step sets the sample spacing
+ *   lissajous [x y size lines speed]   queue a Lissajous scan centered on (x, y)
+ *   track [x y cycles]    queue atom tracking of the feature at (x, y), logging its position every cycle
+ *   spec [x y sizex sizey step]   queue a spectroscopy grid: a curve of the sweep table at every pixel
+ *                         (specmode 0 = I(V) over bias in mV, 1 = I(z) over Z offsets in LSB)
+ *   spectable [clear] [values...]   print the sweep table, or append to it, optionally clearing it first
+ *   jog [x y]             queue a joystick jog starting from (x, y); the encoder sets the speed and encoder next
+ *                         (or jog stop) keeps the position as the next scan's origin
+ *   jog stop | speed <n>  end the jog keeping the position, or set its speed 0 to 4
+ *   retract [steps]       queue a stepper retract
+ *   pause | resume | abort   control the active scan
+ *   clear                 drop all queued jobs
+ *   tasks [reset]         print scheduler task stats, optionally resetting them
+ *   calibrate hyst <axis> <amplitude>         queue identifying lateral hysteresis (axis 0 = X, 1 = Y)
+ *   calibrate creep <axis> <step> [holdms]    queue identifying lateral creep
+ *   calibrate decay [probe]                   queue measuring current decay length and noise for the Z estimator
+ *   comp                  print the lateral compensation models
+ *   drift [reset]         print the tracked sample drift, or drop its reference frame
+ *   spectrum [blocks]     start averaging the TIA noise spectrum over blocks (default 16)
+ *   spectrum report|psd|stop        print the peaks and noise floor, print the spectra, or stop averaging
+ *   spectrum notch [hz]   retune the mains notch to hz, or to the measured mains frequency
+ *   trace [start|stop|dump]   record the control loop's TIA readings, DAC writes and cycles until the buffer fills,
+ *                         stop, print the trace for host replay, or print whether one is recording
+ *   bench [kernel|all] [calls]   queue timing the control loop kernels, printing a #bench record for each when done
+ *                         (see bench.h)
+ */
+
+class Commands
+{
+    public:
+        Commands(ScanHead *scanhead, JobQueue *queue, Scheduler *scheduler, NoiseSpectrum *spectrum,
+                uint16_t *traceBuf, int traceBufSize);
+
+        void poll();
+
+        Job scanDefaults; // parameters for the next queued scan
+
+        static const int noLimit = 0x7fffffff; // an argument or parameter range without an upper bound
+
+    private:
+        ScanHead *scanhead;
+        JobQueue *queue;
+        Scheduler *scheduler;
+        NoiseSpectrum *spectrum;
+        uint16_t *traceBuf;
+        int traceBufSize;
+
+        static const int maxLineLength = 96;
+        char lineBuf[maxLineLength];
+        int lineLength;
+
+        static const int maxFields = 5; // integer arguments of the longest command
+        static const int maxRetractSteps = 10000;
+        static const int maxSpectrumBlocks = 1024;
+        static const int maxTableValue = 65535; // sweep table entries, bias mV or Z offset LSB
+
+        bool readInt(const char *arg, const char *name, int min, int max, int *value);
+        bool readFields(char *arg, int * const *fields, int numFields, int required);
+        void dispatch(char *line);
+        void setParam(const char *name, const char *value);
+        void printParams();
+        void printStatus();
+        void printDrift();
+        void printTable();
+        void spectrumCommand(char *arg);
+        void traceCommand(char *arg);
+        void calibrateCommand(char *kind);
+        void benchCommand(char *arg);
+        void replyEnqueue(int enqueueStatus);
+        void replyRange(const char *name, int min, int max);
+};
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * controlboard.h
+ * Board traits of the OpenSTM control board: pins, DAC channel map and bus drivers for ScanHead and UI
+ */
+
+#ifndef controlboard_h
+#define controlboard_h
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "Wire.h"
+
+/*
+ * ScanHead and UI are templates on a board traits type (see board.h), which supplies everything they know of the
+ * hardware as compile time constants and static inline bus drivers, so each access compiles to the same pin and
+ * SPI calls as when they were written into the classes. A board revision derives from ControlBoard and replaces
+ * what changed; the host build's board replaces the buses with the simulated board's.
+ */
+
+struct ControlBoard
+{
+    // piezo DAC chip select and channel map: the four quadrant electrodes and the sample pad
+    struct piezo_struct {
+        static const int cs = 10;
+        static const int chX_P = 1;
+        static const int chY_P = 3;
+        static const int chY_N = 5;
+        static const int chX_N = 7;
+        static const int samplePad = 0;
+    };
+
+    struct tia_struct {
+        static const int cs   = 34;
+        static const int din  = 38;
+        static const int miso = 39;
+    };
+
+    // coarse approach stepper coils
+    struct stepper0_struct {
+        static const int A = 5;
+        static const int B = 4;
+        static const int C = 3;
+        static const int D = 2;
+    };
+    struct stepper1_struct {
+        static const int A = 9;
+        static const int B = 8;
+        static const int C = 7;
+        static const int D = 6;
+    };
+    struct stepper2_struct {
+        static const int A = 32;
+        static const int B = 33;
+        static const int C = 25;
+        static const int D = 24;
+    };
+
+    /*!
+     * \brief the piezo DAC's SPI bus. A write is select(), the frame's bytes through transfer(), deselect()
+     */
+    struct PiezoBus {
+        static void begin() {
+            pinMode(piezo_struct::cs, OUTPUT);
+            SPI.begin();
+            SPI.beginTransaction(SPISettings(1000000, MSBFIRST, SPI_MODE1));
+        }
+        static void select() { digitalWrite(piezo_struct::cs, LOW); }
+        static void deselect() { digitalWrite(piezo_struct::cs, HIGH); }
+        static uint8_t transfer(uint8_t data) { return SPI.transfer(data); }
+    };
+
+    /*!
+     * \brief the TIA ADC's SPI bus. Its chip select also starts conversions, see ScanHead::readTia()
+     */
+    struct TiaBus {
+        static void begin() {
+            pinMode(tia_struct::cs, OUTPUT);
+            pinMode(tia_struct::din, OUTPUT);
+            digitalWrite(tia_struct::din, HIGH);
+            SPI1.setMISO(tia_struct::miso);
+            SPI1.begin();
+            SPI1.beginTransaction(SPISettings(300000, MSBFIRST, SPI_MODE3));
+        }
+        static void select() { digitalWrite(tia_struct::cs, LOW); }
+        static void deselect() { digitalWrite(tia_struct::cs, HIGH); }
+        static uint8_t transfer(uint8_t data) { return SPI1.transfer(data); }
+    };
+
+    // front panel
+    struct dpad_struct {
+        static const int l = 15;
+        static const int r = 14;
+        static const int u = 36;
+        static const int d = 35;
+        static const int c = 40;
+    };
+
+    struct joystick_struct {
+        static const int xax = A9;
+        static const int yax = A8;
+        static const int center = 512;   // analogRead at rest
+        static const int deadband = 40;  // either side of center
+    };
+
+    struct encoder_struct {
+        static const int chA  = 30;
+        static const int chB  = 31;
+        static const int next = 37;
+        static const int sel  = 41;
+    };
+
+    struct voltages_struct {
+        static const int _5 = A7;
+        static const int _10 = A6;
+        static const int _33 = A5;
+        static const int allowedvariance = 20;
+        static const int _5_expected = 488; // calibrated per-board
+        static const int _10_expected = 573; // calibrated per-board
+        static const int _33_expected = 492; // calibrated per-board
+    };
+
+    // OLED on the second I2C bus, the current bar graph on the first
+    struct display_config_struct {
+        static const int width  = 128;
+        static const int height = 64;
+        static const int address = 0x3C;
+    };
+    static const int barAddress = 0x70;
+    static TwoWire *displayBus() { return &Wire1; }
+
+    struct debug_struct {
+        static const int io3 = 18;
+    };
+};
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * drift.cpp
+ * Estimates sample drift by registering repeated frames against a reference patch
+ */
+
+#ifndef drift_h
+#define drift_h
+
+#include <math.h>
+#include "scanchannels.h"
+
+#define drift_patch 32  // largest reference patch side, pixels
+#define drift_search 6  // largest shift searched each way, pixels
+
+/*
+ * The reference is the central patch of the first frame after reset(). Later frames with the same origin,
+ * size and step are searched for it by normalized cross-correlation over +-drift_search pixels, with a
+ * parabolic sub-pixel peak. The Z drift is the change in the patch's mean.
+ *
+ * Only the forward lines are used: piezo lag offsets reverse lines from forward lines, so a one line shift
+ * would compare the two and the correlation would peak on even shifts only. Y is searched in forward lines,
+ * two frame lines apart.
+ *
+ * Drift is in the scan head's commanded coordinates and is added to the piezo command, so a frame recorded
+ * while the correction runs only shows the residual. Each match gives the total drift at the frame's mid time.
+ * A line fitted through the matches gives the drift velocity, which extrapolates the offset until the next one.
+ */
+
+class DriftTracker
+{
+    private:
+        float refPatch[drift_patch * drift_patch]; // zero mean
+        float refMean;
+        float refNorm; // sum of squares of refPatch
+        int patchCols;
+        int patchLines; // forward lines, two frame lines apart
+
+        // reference frame geometry, frames must match it to be measured
+        int refOriginX;
+        int refOriginY;
+        int refWidth;
+        int refHeight;
+        int refStep;
+
+        unsigned long refMs;  // mid time of the reference frame
+        unsigned long lastMs; // mid time of the last match
+
+        // weighted sums of the drift fit, times in seconds from the reference
+        float fitWeight;
+        float fitT;
+        float fitTT;
+        float fitD[3];
+        float fitTD[3];
+
+        float correlate(const int *frame, int numChannels, int channelOffset, int width, int col0, int line0, float *mean) {
+            // NCC of the reference patch with the frame patch at col0 and forward line line0
+            float sum = 0;
+            float sumSq = 0;
+            float sumRef = 0;
+            for (int line = 0; line < patchLines; line++) {
+                for (int col = 0; col < patchCols; col++) {
+                    float a = framePixel(frame, numChannels, channelOffset, width, col0 + col, 2 * (line0 + line));
+                    sum += a;
+                    sumSq += a * a;
+                    sumRef += a * refPatch[line * patchCols + col];
+                }
+            }
+
+            int n = patchCols * patchLines;
+            *mean = sum / n;
+            float variance = sumSq - sum * sum / n;
+            if (variance <= 0 || refNorm <= 0) return 0;
+            return sumRef / sqrt(variance * refNorm);
+        }
+
+        float peakOffset(float before, float peak, float after) {
+            // vertex of the parabola through three samples, in samples from the peak
+            float curvature = before - 2 * peak + after;
+            if (curvature >= 0) return 0;
+            return 0.5 * (before - after) / curvature;
+        }
+
+    public:
+        DriftTracker() {
+            reset();
+        }
+
+        float velocityMemory = 0.8; // weight older matches keep at each new one in the drift fit
+        float minCorrelation = 0.6; // NCC peak below this is not a match
+
+        bool hasReference;
+        int measurements;  // matches since the reference
+        float correlation; // NCC peak of the last match
+
+        float x, y, z;     // drift at the last match, LSB
+        float vx, vy, vz;  // drift velocity, LSB per second
+
+        /*!
+         * \brief drops the reference and the drift estimate
+         */
+        void reset() {
+            hasReference = false;
+            measurements = 0;
+            correlation = 0;
+            x = y = z = 0;
+            vx = vy = vz = 0;
+            refMs = 0;
+            lastMs = 0;
+
+            // the reference itself is the fit's first point, zero drift at time zero
+            fitWeight = 1;
+            fitT = 0;
+            fitTT = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                fitD[axis] = 0;
+                fitTD[axis] = 0;
+            }
+        }
+
+        float offsetX(unsigned long nowMs) { return x + vx * (long) (nowMs - lastMs) / 1000; }
+        float offsetY(unsigned long nowMs) { return y + vy * (long) (nowMs - lastMs) / 1000; }
+        float offsetZ(unsigned long nowMs) { return z + vz * (long) (nowMs - lastMs) / 1000; }
+
+        /*!
+         * \brief takes the central patch of a frame as the reference, restarting the estimate from zero drift
+         * @param *frame packed frame as recorded by ScanJob
+         * @param numChannels ints per packed pixel
+         * @param channelOffset position of the registered channel within a packed pixel
+         * @param width pixels per line
+         * @param height number of lines
+         * @param step pixel spacing, LSB
+         * @param originX frame origin, LSB
+         * @param originY frame origin, LSB
+         * @param midMs millis() halfway through the frame
+         * @return 0 on success, -1 if the frame is too small to search
+         */
+        int setReference(const int *frame, int numChannels, int channelOffset, int width, int height, int step,
+                int originX, int originY, unsigned long midMs) {
+            reset();
+
+            int forwardLines = (height + 1) / 2;
+            patchCols = width - 2 * drift_search;
+            patchLines = forwardLines - 2 * (drift_search / 2);
+            if (patchCols > drift_patch) patchCols = drift_patch;
+            if (patchLines > drift_patch) patchLines = drift_patch;
+            if (patchCols < 8 || patchLines < 4) return -1;
+
+            int col0 = (width - patchCols) / 2;
+            int line0 = (forwardLines - patchLines) / 2;
+            float sum = 0;
+            for (int line = 0; line < patchLines; line++) {
+                for (int col = 0; col < patchCols; col++) {
+                    float a = framePixel(frame, numChannels, channelOffset, width, col0 + col, 2 * (line0 + line));
+                    refPatch[line * patchCols + col] = a;
+                    sum += a;
+                }
+            }
+            refMean = sum / (patchCols * patchLines);
+            refNorm = 0;
+            for (int i = 0; i < patchCols * patchLines; i++) {
+                refPatch[i] -= refMean;
+                refNorm += refPatch[i] * refPatch[i];
+            }
+
+            refOriginX = originX;
+            refOriginY = originY;
+            refWidth = width;
+            refHeight = height;
+            refStep = step;
+            refMs = midMs;
+            lastMs = midMs;
+            hasReference = true;
+            return 0;
+        }
+
+        /*!
+         * \brief registers a frame against the reference and updates the drift and its velocity
+         * @param arguments as setReference(), for a frame recorded under the current offsets
+         * @return 0 on a match, -1 without a reference or if the frame geometry differs, -2 if no shift matches
+         */
+        int measure(const int *frame, int numChannels, int channelOffset, int width, int height, int step,
+                int originX, int originY, unsigned long midMs) {
+            if (!hasReference) return -1;
+            if (originX != refOriginX || originY != refOriginY || width != refWidth || height != refHeight || step != refStep) return -1;
+
+            const int searchLines = drift_search / 2;
+            const int span = 2 * drift_search + 1;
+            const int lineSpan = 2 * searchLines + 1;
+            float scores[span * lineSpan];
+            float means[span * lineSpan];
+            int best = 0;
+            int col0 = (width - patchCols) / 2;
+            int line0 = ((height + 1) / 2 - patchLines) / 2;
+            for (int sy = 0; sy < lineSpan; sy++) {
+                for (int sx = 0; sx < span; sx++) {
+                    int i = sy * span + sx;
+                    scores[i] = correlate(frame, numChannels, channelOffset, width,
+                            col0 + sx - drift_search, line0 + sy - searchLines, &means[i]);
+                    if (scores[i] > scores[best]) best = i;
+                }
+            }
+
+            correlation = scores[best];
+            if (correlation < minCorrelation) return -2;
+
+            int bestX = best % span;
+            int bestY = best / span;
+            float shiftX = bestX - drift_search;
+            float shiftY = bestY - searchLines;
+            if (bestX > 0 && bestX < span - 1) shiftX += peakOffset(scores[best - 1], scores[best], scores[best + 1]);
+            if (bestY > 0 && bestY < lineSpan - 1) shiftY += peakOffset(scores[best - span], scores[best], scores[best + span]);
+
+            // total drift at mid frame: the offset the frame was recorded under plus the residual shift
+            float newX = offsetX(midMs) + shiftX * step;
+            float newY = offsetY(midMs) + shiftY * 2 * step;
+            float newZ = offsetZ(midMs) + means[best] - refMean;
+
+            // line through the matches by exponentially weighted least squares, so single match errors are not
+            // turned into velocity errors by the short time between frames
+            float t = (long) (midMs - refMs) / 1000.0;
+            float drift[3] = {newX, newY, newZ};
+            fitWeight = velocityMemory * fitWeight + 1;
+            fitT = velocityMemory * fitT + t;
+            fitTT = velocityMemory * fitTT + t * t;
+            float fitted[3];
+            float slope[3];
+            float denominator = fitWeight * fitTT - fitT * fitT;
+            for (int axis = 0; axis < 3; axis++) {
+                fitD[axis] = velocityMemory * fitD[axis] + drift[axis];
+                fitTD[axis] = velocityMemory * fitTD[axis] + t * drift[axis];
+                slope[axis] = denominator > 0 ? (fitWeight * fitTD[axis] - fitT * fitD[axis]) / denominator : 0;
+                fitted[axis] = (fitD[axis] + slope[axis] * (t * fitWeight - fitT)) / fitWeight;
+            }
+
+            x = fitted[0];
+            y = fitted[1];
+            z = fitted[2];
+            vx = slope[0];
+            vy = slope[1];
+            vz = slope[2];
+            lastMs = midMs;
+            measurements += 1;
+            return 0;
+        }
+};
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * fastscan.cpp
+ * Runs a spiral or Lissajous trajectory, sampling pixels along the path
+ */
+
+#include "Arduino.h"
+#include "fastscan.h"
+#include "scanjob.h"
+
+FastScan::FastScan() {
+    state = FAST_IDLE;
+    numSteps = 0;
+    chunkIndex = 0;
+    failStatus = 0;
+    savedTransverseStep = 0;
+}
+
+long FastScan::numSamples(int pattern, int size, int lines, int speed, int spacing) {
+    /*!
+     * \brief upper bound on the samples a trajectory will record, for sizing the frame buffer
+     * @return number of samples
+     */
+
+    Trajectory sizing;
+    sizing.begin(pattern, 0, 0, size, lines, speed);
+    int period = max(spacing / max(speed, 1), 1);
+    return sizing.length() / period + samplesPerChunk;
+}
+
+void FastScan::begin(ScanHead *scanhead, int *dataArr, int channels, int pattern, int centerX, int centerY,
+        int size, int lines, int speed, int spacing, bool heightControl) {
+    /*!
+     * \brief starts a trajectory scan
+     * @param *scanhead ScanHead to scan with
+     * @param *dataArr array of at least numSamples() * channelCount(channels | CH_XPOS | CH_YPOS) ints
+     * @param channels OR of ScanChannel values to record at each sample, X and Y are added
+     * @param pattern Trajectory::Pattern
+     * @param centerX pattern center, LSB
+     * @param centerY pattern center, LSB
+     * @param size pattern diameter or width, LSB
+     * @param lines resolution, spiral turns or Lissajous lines across the pattern
+     * @param speed tip speed, LSB per control cycle. maxTransverseStep is raised to match while running
+     * @param spacing path length between samples, LSB
+     * @param heightControl true if height control enabled, false otherwise
+     */
+
+    this->scanhead = scanhead;
+    this->dataArr = dataArr;
+    this->channels = channels | CH_XPOS | CH_YPOS;
+    numChannels = channelCount(this->channels);
+
+    setCurrent = heightControl ? scanhead->setpoint : -1;
+    samplePeriod = max(spacing / max(speed, 1), 1);
+    cyclesInSample = 0;
+    numSteps = 0;
+    chunkIndex = 0;
+    failStatus = 0;
+
+    trajectory.begin(pattern, centerX, centerY, size, lines, speed);
+
+    // the trajectory moves by speed every cycle, so the step limit must not hold it back
+    savedTransverseStep = scanhead->maxTransverseStep;
+    if (scanhead->maxTransverseStep < speed + 1) scanhead->maxTransverseStep = speed + 1;
+
+    // no line structure for the previous-line feed-forward
+    scanhead->zPredictor.beginFrame(0, 1, 0);
+
+    maxSamples = numSamples(pattern, size, lines, speed, spacing);
+    int numChunks = (maxSamples + samplesPerChunk - 1) / samplesPerChunk;
+    scanhead->stream.beginFrame(this->channels, samplesPerChunk, numChunks, spacing);
+    scanhead->writeFrameParams();
+    scanhead->stream.writeEvent(pattern == Trajectory::TRAJ_SPIRAL ? "spiral" : "lissajous", 0, lines);
+
+    if (heightControl && scanhead->zNearLimit(abs(centerX) + abs(centerY) + size)) {
+        scanhead->beginRecenterZ();
+        state = FAST_RECENTER;
+    }
+    else state = FAST_START;
+}
+
+int FastScan::update() {
+    /*!
+     * \brief advances the scan by one control cycle. Call until finished()
+     * @return the new scan state
+     */
+
+    switch (state) {
+
+    case FAST_RECENTER:
+        if (scanhead->recenterZStep(setCurrent) != 0) state = FAST_START;
+        break;
+
+    case FAST_START: {
+        int moveStatus = scanhead->setPositionStep(trajectory.x, trajectory.y, setCurrent);
+        if (moveStatus == 1) {
+            // clearing integration from the move, into the slot the next sample overwrites
+            scanhead->fetchPixel(dataArr + numSteps * numChannels, channels);
+            state = FAST_RUN;
+        }
+        else if (moveStatus != 0) finish(FAST_FAILED, moveStatus);
+        break;
+    }
+
+    case FAST_RUN: {
+        bool running = trajectory.next();
+        int moveStatus = scanhead->setPositionStep(trajectory.x, trajectory.y, setCurrent);
+        if (moveStatus < 0) {
+            Serial.println("Trajectory failed with error");
+            Serial.println(moveStatus);
+            writeChunk();
+            finish(FAST_FAILED, moveStatus);
+            break;
+        }
+
+        if (++cyclesInSample >= samplePeriod) {
+            cyclesInSample = 0;
+            scanhead->fetchPixel(dataArr + numSteps * numChannels, channels);
+            numSteps += 1;
+            if (numSteps % samplesPerChunk == 0) writeChunk();
+        }
+
+        if (!running || numSteps >= maxSamples) {
+            writeChunk();
+            finish(FAST_DONE, 0);
+        }
+        break;
+    }
+
+    case FAST_PAUSED:
+        scanhead->setPositionStep(scanhead->xpos, scanhead->ypos, setCurrent);
+        break;
+
+    default:
+        break;
+    }
+
+    return state;
+}
+
+void FastScan::pause() {
+    if (state != FAST_RUN) return;
+    scanhead->stream.writeEvent("pause", chunkIndex, numSteps);
+    state = FAST_PAUSED;
+}
+
+void FastScan::resume() {
+    /*!
+     * \brief drives back to the point the trajectory was paused at and continues
+     */
+
+    if (state != FAST_PAUSED) return;
+    scanhead->stream.writeEvent("resume", chunkIndex, 0);
+    state = FAST_START;
+}
+
+void FastScan::abort() {
+    /*!
+     * \brief stops the scan, streaming the samples taken so far
+     */
+
+    if (finished() || state == FAST_IDLE) return;
+
+    writeChunk();
+    finish(FAST_ABORTED, ScanJob::abortedStatus);
+}
+
+bool FastScan::finished() {
+    return state == FAST_DONE || state == FAST_FAILED || state == FAST_ABORTED;
+}
+
+int FastScan::result() {
+    if (state == FAST_DONE) return 0;
+    return failStatus;
+}
+
+void FastScan::writeChunk() {
+    // streams the samples since the last full chunk
+    long first = (long) chunkIndex * samplesPerChunk;
+    if (numSteps <= first) return;
+
+    scanhead->stream.writeLine(chunkIndex, dataArr, first, numSteps - first);
+    chunkIndex += 1;
+}
+
+void FastScan::finish(int newState, int status) {
+    failStatus = status;
+    state = newState;
+    scanhead->maxTransverseStep = savedTransverseStep;
+    scanhead->stream.endFrame(status);
+}
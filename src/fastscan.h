@@ -0,0 +1,70 @@
+/*
+ * fastscan.h
+ * Runs a spiral or Lissajous trajectory, sampling pixels along the path
+ */
+
+#ifndef fastscan_h
+#define fastscan_h
+
+#include "Arduino.h"
+#include "scanhead.h"
+#include "trajectory.cpp"
+
+/*
+ * Samples are not on a grid, so X and Y are always recorded. The frame is streamed as chunks of
+ * samplesPerChunk samples, one per stream line, after a #spiral or #lissajous event giving the line count.
+ * The host resamples onto a regular grid.
+ */
+
+class FastScan
+{
+    public:
+        FastScan();
+
+        enum State {
+            FAST_IDLE,
+            FAST_RECENTER, // recentering Z with the steppers before the start
+            FAST_START,   // driving to the trajectory start point
+            FAST_RUN,
+            FAST_PAUSED,  // holding under feedback, the trajectory continues from the same point on resume
+            FAST_DONE,
+            FAST_FAILED,
+            FAST_ABORTED
+        };
+
+        static const int samplesPerChunk = 64;
+
+        static long numSamples(int pattern, int size, int lines, int speed, int spacing);
+        void begin(ScanHead *scanhead, int *dataArr, int channels, int pattern, int centerX, int centerY,
+                int size, int lines, int speed, int spacing, bool heightControl);
+        int update();
+        void pause();
+        void resume();
+        void abort();
+
+        bool finished();
+        int result();
+
+        int state;
+        long numSteps;     // samples taken
+        int chunkIndex;
+
+    private:
+        ScanHead *scanhead;
+        Trajectory trajectory;
+
+        int *dataArr;
+        int channels;
+        int numChannels;
+        long maxSamples;   // dataArr capacity, from numSamples()
+        int samplePeriod;  // control cycles per sample
+        int cyclesInSample;
+        int setCurrent;
+        int savedTransverseStep;
+        int failStatus;
+
+        void writeChunk();
+        void finish(int newState, int status);
+};
+
+#endif
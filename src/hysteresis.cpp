@@ -0,0 +1,228 @@
+/*
+ * hysteresis.cpp
+ * Inverse Prandtl-Ishlinskii hysteresis and linear creep compensation for lateral piezo commands
+ */
+
+#ifndef hysteresis_h
+#define hysteresis_h
+
+#include <math.h>
+
+#define num_play_operators 8
+#define num_creep_terms 2
+#define max_profile_shift 32 // profileShift() search limit, samples
+
+class PiezoCompensator
+{
+    private:
+        // forward model: displacement = sum(weights[i] * play(thresholds[i], command)), thresholds[0] = 0
+        float thresholds[num_play_operators];
+        float weights[num_play_operators];
+
+        // inverse model, same structure
+        float invThresholds[num_play_operators];
+        float invWeights[num_play_operators];
+        float playState[num_play_operators];
+
+        // creep: displacement = command + sum(creepGain[k] * lowpass_k(command))
+        float creepGain[num_creep_terms];
+        float creepAlpha[num_creep_terms];
+        float creepState[num_creep_terms];
+
+        /*!
+         * \brief computes the inverse Prandtl-Ishlinskii operator from the forward thresholds and weights
+         */
+        void invert() {
+            float weightSum = 0;
+            for (int i = 0; i < num_play_operators; i++) {
+                float prevWeightSum = weightSum;
+                weightSum += weights[i];
+
+                invThresholds[i] = 0;
+                for (int j = 0; j <= i; j++) invThresholds[i] += weights[j] * (thresholds[i] - thresholds[j]);
+
+                if (i == 0) invWeights[i] = 1.0 / weights[0];
+                else invWeights[i] = -weights[i] / (weightSum * prevWeightSum);
+            }
+        }
+
+    public:
+        PiezoCompensator() {
+            for (int i = 0; i < num_play_operators; i++) {
+                thresholds[i] = i;
+                weights[i] = 0;
+            }
+            weights[0] = 1; // identity until calibrated
+
+            for (int k = 0; k < num_creep_terms; k++) {
+                creepGain[k] = 0;
+                creepAlpha[k] = 0;
+            }
+
+            invert();
+            reset(0);
+        }
+
+        /*!
+         * \brief sets the forward hysteresis model. Weights must keep every partial sum positive
+         * @param newThresholds num_play_operators increasing play thresholds in LSB, the first must be 0
+         * @param newWeights num_play_operators operator weights
+         */
+        void setHysteresis(const float *newThresholds, const float *newWeights) {
+            for (int i = 0; i < num_play_operators; i++) {
+                thresholds[i] = newThresholds[i];
+                weights[i] = newWeights[i];
+            }
+            invert();
+        }
+
+        /*!
+         * \brief sets one creep term
+         * @param term creep term, 0 to num_creep_terms-1
+         * @param gain fraction of a step that is eventually added by creep
+         * @param tauCycles creep time constant in calls to compensate()
+         */
+        void setCreep(int term, float gain, float tauCycles) {
+            creepGain[term] = gain;
+            creepAlpha[term] = 0;
+            if (tauCycles > 0) creepAlpha[term] = 1.0 / tauCycles;
+        }
+
+        /*!
+         * \brief clears operator and creep memory, as if the piezo had been resting at target
+         * @param target displacement the piezo has settled at
+         */
+        void reset(float target) {
+            float gainSum = 1;
+            for (int k = 0; k < num_creep_terms; k++) gainSum += creepGain[k];
+
+            for (int k = 0; k < num_creep_terms; k++) creepState[k] = target / gainSum;
+            for (int i = 0; i < num_play_operators; i++) playState[i] = target / gainSum;
+        }
+
+        /*!
+         * \brief maps a desired displacement to the piezo command that produces it. Call once per control cycle
+         * \detail the piezo is modeled as hysteresis followed by creep, so creep is inverted first
+         * @param target desired displacement in LSB
+         * @return command in LSB
+         */
+        float compensate(float target) {
+            // inverse creep, the creep lowpass only sees the previous output so this is causal
+            float creepFree = target;
+            for (int k = 0; k < num_creep_terms; k++) creepFree -= creepGain[k] * creepState[k];
+            for (int k = 0; k < num_creep_terms; k++) creepState[k] += creepAlpha[k] * (creepFree - creepState[k]);
+
+            // inverse hysteresis
+            float command = 0;
+            for (int i = 0; i < num_play_operators; i++) {
+                float z = playState[i];
+                if (z < creepFree - invThresholds[i]) z = creepFree - invThresholds[i];
+                else if (z > creepFree + invThresholds[i]) z = creepFree + invThresholds[i];
+                playState[i] = z;
+                command += invWeights[i] * z;
+            }
+
+            return command;
+        }
+
+        const float *getThresholds() { return thresholds; }
+        const float *getWeights() { return weights; }
+        float getCreepGain(int term) { return creepGain[term]; }
+        float getCreepTau(int term) { return creepAlpha[term] > 0 ? 1.0 / creepAlpha[term] : 0; }
+
+        /*!
+         * \brief fits forward model weights from trace/retrace loop widths
+         * \detail thresholds are fixed at i*maxAmplitude/(2*num_play_operators). For a triangle scan of amplitude
+         *         A_k = k*maxAmplitude/num_play_operators the loop width at the scan center depends only on operators
+         *         i < k, so the weights follow from forward substitution. Weights are normalized to a unit slope.
+         * @param loopWidths loop widths in LSB at the center of scans of amplitude A_2 ... A_n (num_play_operators-1 values)
+         * @param maxAmplitude largest scan amplitude in LSB
+         * @param newThresholds num_play_operators long array to store thresholds
+         * @param newWeights num_play_operators long array to store weights
+         */
+        static void fitHysteresis(const float *loopWidths, float maxAmplitude, float *newThresholds, float *newWeights) {
+            const int n = num_play_operators;
+
+            for (int i = 0; i < n; i++) {
+                newThresholds[i] = maxAmplitude * i / (2 * n);
+                newWeights[i] = 0;
+            }
+
+            for (int k = 1; k < n; k++) {
+                float amplitude = maxAmplitude * (k + 1) / n;
+
+                // contribution of the operators already fitted
+                float known = 0;
+                for (int i = 1; i < k; i++) {
+                    float r = newThresholds[i];
+                    if (r <= amplitude / 4) known += newWeights[i] * 2 * r;
+                    else if (r < amplitude / 2) known += newWeights[i] * (amplitude - 2 * r);
+                }
+
+                // operator k contributes maxAmplitude/n per unit weight at this amplitude
+                float w = (loopWidths[k - 1] - known) / (maxAmplitude / n);
+                if (w < 0) w = 0;
+                newWeights[k] = w;
+            }
+
+            float weightSum = 0;
+            for (int i = 1; i < n; i++) weightSum += newWeights[i];
+
+            // keeping a dominant linear term so the inverse stays well conditioned
+            if (weightSum > 0.9) {
+                for (int i = 1; i < n; i++) newWeights[i] *= 0.9 / weightSum;
+                weightSum = 0.9;
+            }
+            newWeights[0] = 1 - weightSum;
+        }
+
+        /*!
+         * \brief estimates the lateral shift between two height profiles sampled on the same command grid
+         * @param a first profile
+         * @param b second profile
+         * @param n profile length
+         * @param maxShift largest shift searched, in samples, at most max_profile_shift
+         * @return subsample shift s such that a[i] best matches b[i - s]
+         */
+        static float profileShift(const int *a, const int *b, int n, int maxShift) {
+            float bestCost = 0;
+            int bestShift = 0;
+            float costs[2 * max_profile_shift + 1];
+            if (maxShift > max_profile_shift) maxShift = max_profile_shift;
+
+            for (int s = -maxShift; s <= maxShift; s++) {
+                // mean-removed sum of absolute differences over the overlap
+                int start = s > 0 ? s : 0;
+                int end = s > 0 ? n : n + s;
+                if (end - start < 4) {
+                    costs[s + maxShift] = 1e30;
+                    continue;
+                }
+
+                float meanDiff = 0;
+                for (int i = start; i < end; i++) meanDiff += a[i] - b[i - s];
+                meanDiff /= (end - start);
+
+                float cost = 0;
+                for (int i = start; i < end; i++) cost += fabsf(a[i] - b[i - s] - meanDiff);
+                cost /= (end - start);
+
+                costs[s + maxShift] = cost;
+                if (s == -maxShift || cost < bestCost) {
+                    bestCost = cost;
+                    bestShift = s;
+                }
+            }
+
+            // parabolic refinement around the minimum
+            if (bestShift == -maxShift || bestShift == maxShift) return bestShift;
+            float cm = costs[bestShift + maxShift - 1];
+            float c0 = costs[bestShift + maxShift];
+            float cp = costs[bestShift + maxShift + 1];
+            float denom = cm - 2 * c0 + cp;
+            if (denom <= 0) return bestShift;
+            return bestShift + 0.5 * (cm - cp) / denom;
+        }
+};
+
+#endif
@@ -0,0 +1,490 @@
+/*
+ * jobqueue.cpp
+ * Queue of approach, scan and retract jobs run back-to-back from loop()
+ */
+
+#include "Arduino.h"
+#include "jobqueue.h"
+
+JobQueue::JobQueue(ScanHead *scanhead, Bench *bench, int *frameBuf, int frameBufSize) {
+    this->scanhead = scanhead;
+    this->bench = bench;
+    this->frameBuf = frameBuf;
+    this->frameBufSize = frameBufSize;
+
+    state = QUEUE_IDLE;
+    jobsCompleted = 0;
+    lastResult = 0;
+    progress = 0;
+    coarseRate = 0;
+    approachLogged = false;
+    surveyed = false;
+    jogSelected = false;
+}
+
+int JobQueue::enqueue(const Job &job) {
+    /*!
+     * \brief adds a job to the end of the queue
+     * @param job job to run
+     * @return 0 if queued, -1 if the queue is full, -2 if a scan frame does not fit the frame buffer, -3 if a size,
+     *         step, line count, speed, cycle or call count is not positive or a survey's zoom is under two steps, -4
+     *         if a spectroscopy grid has no sweep table. Calibrations are checked against the position they start from
+     */
+
+    if (jobs.isFull()) return -1;
+
+    if (job.type == JOB_SCAN || job.type == JOB_SURVEY) {
+        if (job.step <= 0 || job.sizeX <= 0 || job.sizeY <= 0) return -3;
+        int numPixels = ((job.sizeX + job.step - 1)/job.step) * ((job.sizeY + job.step - 1)/job.step);
+        if ((long) numPixels * channelCount(job.channels) > frameBufSize) return -2;
+    }
+    if (job.type == JOB_SURVEY) {
+        if (job.zoomStep <= 0 || job.zoomSize < 2 * job.step) return -3;
+        int zoomPixels = (job.zoomSize + job.zoomStep - 1) / job.zoomStep;
+        if ((long) zoomPixels * zoomPixels * channelCount(job.channels) > frameBufSize) return -2;
+    }
+    else if (job.type == JOB_SPIRAL || job.type == JOB_LISSAJOUS) {
+        if (job.sizeX <= 0 || job.lines <= 0 || job.speed <= 0) return -3;
+        int pattern = job.type == JOB_SPIRAL ? Trajectory::TRAJ_SPIRAL : Trajectory::TRAJ_LISSAJOUS;
+        long numSamples = FastScan::numSamples(pattern, job.sizeX, job.lines, job.speed, job.step);
+        if (numSamples * channelCount(job.channels | CH_XPOS | CH_YPOS) > frameBufSize) return -2;
+    }
+    else if (job.type == JOB_TRACK) {
+        if (job.cycles <= 0) return -3;
+        if ((long) job.cycles * channelCount(AtomTrack::logChannels) > frameBufSize) return -2;
+    }
+    else if (job.type == JOB_SPEC) {
+        if (job.step <= 0 || job.sizeX <= 0 || job.sizeY <= 0) return -3;
+        if (spectroscopy.numPoints <= 0) return -4;
+        if (Spectroscopy::bufferSize(spectroscopy.numPoints) > frameBufSize) return -2;
+    }
+    else if (job.type == JOB_BENCH) {
+        if (job.calls <= 0) return -3;
+    }
+
+    jobs.push(job);
+    return 0;
+}
+
+int JobQueue::zoom(int col, int row, int pixels) {
+    /*!
+     * \brief queues a fine scan of a box picked in the last survey frame, at the survey's zoom step
+     * @param col box corner, survey frame pixels
+     * @param row box corner, survey frame pixels
+     * @param pixels box side, survey frame pixels
+     * @return as enqueue(), or -5 if no survey has completed
+     */
+
+    if (!surveyed) return -5;
+
+    Job job = lastSurvey;
+    job.type = JOB_SCAN;
+    job.x = lastSurvey.x + col * lastSurvey.step;
+    job.y = lastSurvey.y + row * lastSurvey.step;
+    job.sizeX = pixels * lastSurvey.step;
+    job.sizeY = pixels * lastSurvey.step;
+    job.step = lastSurvey.zoomStep;
+    return enqueue(job);
+}
+
+void JobQueue::update() {
+    /*!
+     * \brief advances the active job by one control cycle, starting the next job when idle
+     */
+
+    switch (state) {
+
+    case QUEUE_IDLE:
+        if (!jobs.isEmpty()) startNext();
+        break;
+
+    case QUEUE_MOVING: {
+        int moveStatus = scanhead->setPositionStep(active.x, active.y, scanhead->setpoint);
+        if (moveStatus == 1 && (active.type == JOB_SCAN || active.type == JOB_SURVEY)) {
+            scanJob.begin(scanhead, frameBuf, active.channels, active.sizeX, active.sizeY, active.step, true);
+            scanStartMs = millis();
+            state = QUEUE_SCANNING;
+        }
+        else if (moveStatus == 1 && active.type == JOB_TRACK) {
+            atomTrack.begin(scanhead, frameBuf, active.x, active.y, active.cycles, true);
+            state = QUEUE_TRACKING;
+        }
+        else if (moveStatus == 1 && active.type == JOB_JOG) {
+            jog.begin(scanhead, active.x, active.y);
+            state = QUEUE_JOGGING;
+        }
+        else if (moveStatus == 1 && active.type == JOB_SPEC) {
+            spectroscopy.begin(scanhead, frameBuf, active.sizeX, active.sizeY, active.step);
+            state = QUEUE_SPECTROSCOPY;
+        }
+        else if (moveStatus == 1) {
+            int pattern = active.type == JOB_SPIRAL ? Trajectory::TRAJ_SPIRAL : Trajectory::TRAJ_LISSAJOUS;
+            fastScan.begin(scanhead, frameBuf, active.channels, pattern, active.x, active.y,
+                    active.sizeX, active.lines, active.speed, active.step, true);
+            state = QUEUE_FAST_SCANNING;
+        }
+        else if (moveStatus != 0) finishJob(moveStatus);
+        break;
+    }
+
+    case QUEUE_SCANNING:
+        scanJob.update();
+        if (scanJob.finished()) {
+            if (scanhead->driftCorrection && scanJob.result() == 0) trackDrift();
+            if (active.type == JOB_SURVEY && scanJob.result() == 0) queueZooms();
+            finishJob(scanJob.result());
+        }
+        break;
+
+    case QUEUE_FAST_SCANNING:
+        fastScan.update();
+        if (fastScan.finished()) finishJob(fastScan.result());
+        break;
+
+    case QUEUE_TRACKING:
+        atomTrack.update();
+        if (atomTrack.finished()) {
+            Serial.print("tracked to ");
+            Serial.print(atomTrack.centerX);
+            Serial.print(",");
+            Serial.println(atomTrack.centerY);
+            finishJob(atomTrack.result());
+        }
+        break;
+
+    case QUEUE_SPECTROSCOPY:
+        spectroscopy.update();
+        if (spectroscopy.finished()) finishJob(spectroscopy.result());
+        break;
+
+    case QUEUE_JOGGING:
+        jog.update();
+        if (jog.finished()) {
+            if (jog.result() == 0) {
+                Serial.print("jogged to ");
+                Serial.print((int) jog.x);
+                Serial.print(",");
+                Serial.println((int) jog.y);
+                jogSelected = true;
+            }
+            finishJob(jog.result());
+        }
+        break;
+
+    case QUEUE_COARSE_APPROACHING:
+        // no height control, the current is still measured between stepper steps
+        if (scanhead->stepStepper(coarseRate)) {
+            approachCurrentBuf.push(scanhead->current);
+            approachZposBuf.push(scanhead->zpos);
+        }
+        else scanhead->setPositionStep(scanhead->xpos, scanhead->ypos, -1);
+        break;
+
+    case QUEUE_APPROACHING: {
+        int approachStatus = scanhead->approachCycle(scanhead->setpoint, approachCurrentBuf, approachZposBuf);
+        if (approachStatus == 1) {
+            progress = 0;
+            state = QUEUE_SETTLING;
+        }
+        else if (approachStatus == 2 && ++progress >= maxApproachSteps) finishJob(-1);
+        break;
+    }
+
+    case QUEUE_SETTLING:
+        scanhead->setPositionStep(0, 0, scanhead->setpoint);
+        if (++progress < settleCycles) break;
+
+        if (active.type == JOB_MANUAL_APPROACH) {
+            Serial.print("found current ");
+            Serial.println(scanhead->current);
+            Serial.println("Approach complete");
+            Serial.println("Dumping approach data...");
+            approachLogged = true;
+        }
+        finishJob(0);
+        break;
+
+    case QUEUE_CALIBRATING: {
+        int calStatus = scanhead->calibrationStep();
+        if (calStatus == 1) finishJob(0);
+        else if (calStatus != 0) finishJob(calStatus);
+        break;
+    }
+
+    case QUEUE_BENCHING:
+        bench->update();
+        if (bench->finished()) {
+            bench->printResults();
+            finishJob(0);
+        }
+        break;
+
+    case QUEUE_RETRACTING:
+        if (scanhead->stepStepper(-retractStepRate) && ++progress >= active.steps) finishJob(0);
+        break;
+
+    case QUEUE_WITHDRAWING: {
+        // a cycle of maxZStep at a time, until the Z piezo is at its limit
+        int retractStatus = scanhead->setPositionStep(scanhead->xpos, scanhead->ypos, -2);
+        if (retractStatus != 0 && retractStatus != 1) {
+            scanhead->status = 3;
+            state = QUEUE_IDLE;
+            Serial.println("retracted");
+        }
+        break;
+    }
+    }
+}
+
+void JobQueue::clear() {
+    /*!
+     * \brief drops all queued jobs. The active job keeps running
+     */
+
+    jobs.clear();
+}
+
+void JobQueue::pause() {
+    if (state == QUEUE_SCANNING) scanJob.pause();
+    else if (state == QUEUE_FAST_SCANNING) fastScan.pause();
+    else if (state == QUEUE_TRACKING) atomTrack.pause();
+    else if (state == QUEUE_SPECTROSCOPY) spectroscopy.pause();
+}
+
+void JobQueue::resume() {
+    if (state == QUEUE_SCANNING) scanJob.resume();
+    else if (state == QUEUE_FAST_SCANNING) fastScan.resume();
+    else if (state == QUEUE_TRACKING) atomTrack.resume();
+    else if (state == QUEUE_SPECTROSCOPY) spectroscopy.resume();
+}
+
+void JobQueue::abort() {
+    /*!
+     * \brief aborts the active job. Queued jobs still run
+     */
+
+    if (state == QUEUE_SCANNING) {
+        scanJob.abort();
+        finishJob(scanJob.result());
+    }
+    else if (state == QUEUE_FAST_SCANNING) {
+        fastScan.abort();
+        finishJob(fastScan.result());
+    }
+    else if (state == QUEUE_TRACKING) {
+        atomTrack.abort();
+        finishJob(atomTrack.result());
+    }
+    else if (state == QUEUE_SPECTROSCOPY) {
+        spectroscopy.abort();
+        finishJob(spectroscopy.result());
+    }
+    else if (state == QUEUE_JOGGING) {
+        jog.abort();
+        finishJob(jog.result());
+    }
+    else if (state == QUEUE_CALIBRATING) {
+        scanhead->abortCalibration();
+        finishJob(ScanJob::abortedStatus);
+    }
+    else if (state == QUEUE_BENCHING) {
+        bench->abort();
+        bench->printResults();
+        finishJob(ScanJob::abortedStatus);
+    }
+    else if (state != QUEUE_IDLE && state != QUEUE_WITHDRAWING) finishJob(ScanJob::abortedStatus);
+}
+
+void JobQueue::withdraw() {
+    /*!
+     * \brief aborts the active job, drops the queue and fully retracts the Z piezo, one control cycle per
+     *        update(). Jobs queued meanwhile start once it is retracted, abort() does not stop it
+     */
+
+    abort();
+    clear();
+    state = QUEUE_WITHDRAWING;
+}
+
+void JobQueue::confirmApproach() {
+    /*!
+     * \brief ends a manual approach's coarse stepping, starting its auto approach
+     */
+
+    if (state != QUEUE_COARSE_APPROACHING) return;
+
+    scanhead->beginApproach(0, 0);
+    progress = 0;
+    state = QUEUE_APPROACHING;
+}
+
+int JobQueue::printApproach(int maxLines) {
+    /*!
+     * \brief prints the current,zpos pairs recorded by the last manual approach, oldest first
+     * @param maxLines pairs to print at most, so a long record can be printed over several calls
+     * @return pairs left to print
+     */
+
+    for (int i = 0; i < maxLines && !approachCurrentBuf.isEmpty(); i++) {
+        Serial.print(approachCurrentBuf.shift());
+        Serial.print(",");
+        Serial.println(approachZposBuf.shift());
+    }
+
+    if (approachCurrentBuf.isEmpty()) approachLogged = false;
+    return approachCurrentBuf.size();
+}
+
+int JobQueue::size() {
+    return jobs.size();
+}
+
+bool JobQueue::busy() {
+    return state != QUEUE_IDLE || !jobs.isEmpty();
+}
+
+void JobQueue::startNext() {
+    active = jobs.shift();
+    progress = 0;
+
+    Serial.print("starting job ");
+    Serial.println(jobsCompleted);
+
+    switch (active.type) {
+    case JOB_APPROACH:
+        scanhead->beginApproach(0, 0);
+        state = QUEUE_APPROACHING;
+        break;
+    case JOB_MANUAL_APPROACH:
+        coarseRate = 0;
+        approachLogged = false;
+        approachCurrentBuf.clear();
+        approachZposBuf.clear();
+        state = QUEUE_COARSE_APPROACHING;
+        break;
+    case JOB_SCAN:
+    case JOB_SURVEY:
+    case JOB_SPIRAL:
+    case JOB_LISSAJOUS:
+    case JOB_TRACK:
+    case JOB_SPEC:
+    case JOB_JOG:
+        state = QUEUE_MOVING;
+        break;
+    case JOB_RETRACT:
+        state = QUEUE_RETRACTING;
+        break;
+    case JOB_HYSTERESIS:
+    case JOB_CREEP:
+    case JOB_DECAY: {
+        int mode = ScanHead::CAL_ESTIMATOR;
+        if (active.type == JOB_HYSTERESIS) mode = ScanHead::CAL_HYSTERESIS;
+        else if (active.type == JOB_CREEP) mode = ScanHead::CAL_CREEP;
+
+        // the arguments are only checked against where the tip is now
+        int calStatus = scanhead->beginCalibration(mode, active.axis, active.calSize, active.holdMs);
+        if (calStatus == 0) state = QUEUE_CALIBRATING;
+        else {
+            Serial.println("calibration out of range");
+            finishJob(calStatus);
+        }
+        break;
+    }
+    case JOB_BENCH:
+        bench->begin(scanhead, active.kernel, active.calls);
+        state = QUEUE_BENCHING;
+        break;
+    }
+}
+
+void JobQueue::finishJob(int result) {
+    lastResult = result;
+    jobsCompleted += 1;
+    state = QUEUE_IDLE;
+
+    Serial.print("finished job, returned with code ");
+    Serial.println(result);
+}
+
+void JobQueue::queueZooms() {
+    /*!
+     * \brief picks the highest scoring regions of the survey frame still in frameBuf and queues a zoom scan
+     *        of each at the front of the queue, best first. Regions are zoomSize blocks that do not overlap
+     */
+
+    lastSurvey = active;
+    surveyed = true;
+
+    int channelOffset = imageChannelOffset(active.channels);
+
+    int width = (active.sizeX + active.step - 1) / active.step;
+    int height = (active.sizeY + active.step - 1) / active.step;
+    int blockPixels = active.zoomSize / active.step;
+
+    Region regions[max_regions];
+    int numRegions = regionFinder.find(frameBuf, channelCount(active.channels), channelOffset, width, height,
+            blockPixels, active.roi, regions, active.regions);
+
+    Serial.print("survey found ");
+    Serial.print(numRegions);
+    Serial.println(" regions");
+
+    // unshifted in reverse so the best region runs first
+    for (int i = numRegions - 1; i >= 0; i--) {
+        Job job = active;
+        job.type = JOB_SCAN;
+        job.x = active.x + regions[i].col * active.step;
+        job.y = active.y + regions[i].row * active.step;
+        job.sizeX = active.zoomSize;
+        job.sizeY = active.zoomSize;
+        job.step = active.zoomStep;
+        if (!jobs.unshift(job)) continue;
+
+        Serial.print("zoom region ");
+        Serial.print(job.x);
+        Serial.print(",");
+        Serial.print(job.y);
+        Serial.print(" score ");
+        Serial.println(regions[i].score);
+    }
+}
+
+void JobQueue::trackDrift() {
+    /*!
+     * \brief registers the frame just finished in frameBuf with the drift tracker. The first frame after a
+     *        reset becomes the reference, later frames of the same origin, size and step update the drift
+     */
+
+    int width = (active.sizeX + active.step - 1) / active.step;
+    int height = (active.sizeY + active.step - 1) / active.step;
+    unsigned long midMs = scanStartMs + (millis() - scanStartMs) / 2;
+    DriftTracker &drift = scanhead->drift;
+
+    if (!drift.hasReference) {
+        if (drift.setReference(frameBuf, channelCount(active.channels), imageChannelOffset(active.channels),
+                width, height, active.step, active.x, active.y, midMs) == 0) {
+            Serial.println("drift reference set");
+        }
+        return;
+    }
+
+    int driftStatus = drift.measure(frameBuf, channelCount(active.channels), imageChannelOffset(active.channels),
+            width, height, active.step, active.x, active.y, midMs);
+    if (driftStatus == -2) Serial.println("drift no match");
+    if (driftStatus != 0) return;
+
+    Serial.print("drift ");
+    Serial.print(drift.x);
+    Serial.print(",");
+    Serial.print(drift.y);
+    Serial.print(",");
+    Serial.print(drift.z);
+    Serial.print(" rate ");
+    Serial.print(drift.vx);
+    Serial.print(",");
+    Serial.print(drift.vy);
+    Serial.print(",");
+    Serial.print(drift.vz);
+    Serial.print(" corr ");
+    Serial.println(drift.correlation);
+}
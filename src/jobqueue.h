@@ -0,0 +1,144 @@
+/*
+ * jobqueue.h
+ * Queue of approach, scan and retract jobs run back-to-back from loop()
+ */
+
+#ifndef jobqueue_h
+#define jobqueue_h
+
+#include "Arduino.h"
+#include <CircularBuffer.h>
+#include "scanhead.h"
+#include "scanjob.h"
+#include "fastscan.h"
+#include "atomtrack.h"
+#include "spectroscopy.h"
+#include "jog.h"
+#include "bench.h"
+#include "regions.cpp"
+
+enum JobType {
+    JOB_APPROACH, // auto approach to the current setpoint
+    JOB_SCAN,     // move to (x, y) then run a ScanJob
+    JOB_RETRACT,  // back the steppers off by steps
+    JOB_SPIRAL,   // move to the center (x, y) then run a spiral FastScan
+    JOB_LISSAJOUS, // move to the center (x, y) then run a Lissajous FastScan
+    JOB_SURVEY,    // coarse JOB_SCAN, then queue zoom scans of the highest scoring regions ahead of other jobs
+    JOB_TRACK,     // move to (x, y) then lock onto the feature there with AtomTrack
+    JOB_SPEC,      // move to (x, y) then take a Spectroscopy grid with its origin there
+    JOB_JOG,       // move to (x, y) then Jog from there until stopped
+    JOB_MANUAL_APPROACH, // steppers at coarseRate until confirmApproach(), then as JOB_APPROACH
+    JOB_HYSTERESIS, // identify the lateral hysteresis of axis from where the tip is
+    JOB_CREEP,      // identify the lateral creep of axis from where the tip is
+    JOB_DECAY,      // measure the current decay length and noise for the Z estimator
+    JOB_BENCH       // time the control loop kernels, see bench.h
+};
+
+struct Job {
+    int type = JOB_SCAN;
+    int x = 0;
+    int y = 0;
+    int sizeX = 1000;
+    int sizeY = 1000;
+    int step = 10;
+    int channels = defaultScanChannels;
+    int steps = 50; // JOB_RETRACT only
+    int lines = 64; // JOB_SPIRAL and JOB_LISSAJOUS resolution across sizeX
+    int speed = 20; // JOB_SPIRAL and JOB_LISSAJOUS tip speed, LSB per control cycle, step is the sample spacing
+    int regions = 3;     // JOB_SURVEY zoom scans to queue, at most max_regions
+    int zoomSize = 200;  // JOB_SURVEY zoom scan width and height, LSB
+    int zoomStep = 2;    // JOB_SURVEY zoom scan step, LSB
+    int roi = RegionFinder::ROI_ROUGHNESS; // JOB_SURVEY region criterion
+    int cycles = 10000;  // JOB_TRACK duration, control cycles
+    int axis = 0;        // JOB_HYSTERESIS and JOB_CREEP axis, 0 = X, 1 = Y
+    int calSize = 1000;  // JOB_HYSTERESIS largest amplitude, JOB_CREEP step or JOB_DECAY Z probe excursion, LSB
+    int holdMs = 5000;   // JOB_CREEP settling and tracking time
+    int kernel = -1;     // JOB_BENCH kernel, -1 for all
+    int calls = Bench::defaultCalls; // JOB_BENCH calls per kernel
+};
+
+class JobQueue
+{
+    public:
+        JobQueue(ScanHead *scanhead, Bench *bench, int *frameBuf, int frameBufSize); // bench NULL if no JOB_BENCH is queued
+
+        static const int maxJobs = 16;
+
+        // State of the active job
+        enum State {
+            QUEUE_IDLE,
+            QUEUE_MOVING,      // moving to the scan origin under feedback
+            QUEUE_SCANNING,
+            QUEUE_FAST_SCANNING,
+            QUEUE_TRACKING,
+            QUEUE_SPECTROSCOPY,
+            QUEUE_JOGGING,
+            QUEUE_COARSE_APPROACHING, // steppers following coarseRate, before a manual approach's auto approach
+            QUEUE_APPROACHING,
+            QUEUE_SETTLING,    // holding the setpoint after an approach
+            QUEUE_RETRACTING,
+            QUEUE_WITHDRAWING, // fully retracting the Z piezo after an overcurrent
+            QUEUE_CALIBRATING, // a ScanHead calibration, a control cycle per update()
+            QUEUE_BENCHING     // timing kernels, a few batches per update()
+        };
+
+        int enqueue(const Job &job);
+        int zoom(int col, int row, int pixels);
+        void update();
+        void clear();
+
+        void pause();
+        void resume();
+        void abort();
+        void withdraw();
+        void confirmApproach();
+        int printApproach(int maxLines);
+
+        int size();
+        bool busy();
+
+        int state;
+        Job active;
+        int jobsCompleted;
+        int lastResult; // result of the last finished job, 0 on success
+        int coarseRate;     // stepper steps per second of a manual approach's coarse stepping, set by the UI
+        bool approachLogged; // a finished manual approach's current and zpos are waiting for printApproach()
+
+        Job lastSurvey;     // the last completed survey, for zoom()
+        bool surveyed;
+        bool jogSelected;   // a jog stopped at jog.x, jog.y, cleared by whoever takes the position
+
+
+        ScanJob scanJob;
+        FastScan fastScan;
+        AtomTrack atomTrack;
+        Spectroscopy spectroscopy;
+        Jog jog;
+
+    private:
+        ScanHead *scanhead;
+        Bench *bench;
+
+        int *frameBuf;
+        int frameBufSize;
+
+        int progress; // approach steps, settle cycles or retract steps taken by the active job
+        unsigned long scanStartMs; // when the active ScanJob began, for the drift tracker's frame mid time
+
+        const int settleCycles = 1000;  // feedback cycles after an approach
+        const int maxApproachSteps = 2000; // approach iterations
+        const int retractStepRate = 10;    // stepper steps per second of JOB_RETRACT
+
+        CircularBuffer<Job,maxJobs> jobs;
+        CircularBuffer<int,1000> approachCurrentBuf;
+        CircularBuffer<int,1000> approachZposBuf;
+
+        RegionFinder regionFinder;
+
+        void startNext();
+        void finishJob(int result);
+        void queueZooms();
+        void trackDrift();
+};
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * jog.cpp
+ * Joystick driven lateral positioning of the tip under Z feedback
+ */
+
+#include "Arduino.h"
+#include "jog.h"
+#include "scanjob.h"
+
+Jog::Jog() {
+    scanhead = NULL;
+    state = JOG_IDLE;
+    x = 0;
+    y = 0;
+    vx = 0;
+    vy = 0;
+    deflectionX = 0;
+    deflectionY = 0;
+    failStatus = 0;
+}
+
+void Jog::begin(ScanHead *scanhead, int x, int y) {
+    /*!
+     * \brief starts jogging from (x, y), at rest until the stick is deflected
+     * @param *scanhead ScanHead to move
+     * @param x starting position, LSB
+     * @param y starting position, LSB
+     */
+
+    this->scanhead = scanhead;
+    this->x = x;
+    this->y = y;
+    vx = 0;
+    vy = 0;
+    deflectionX = 0;
+    deflectionY = 0;
+    failStatus = 0;
+    state = JOG_RUN;
+}
+
+void Jog::setDeflection(float dx, float dy) {
+    /*!
+     * \brief sets the stick deflection, held until the next call
+     * @param dx X deflection, -1 to 1
+     * @param dy Y deflection, -1 to 1
+     */
+
+    deflectionX = dx < -1 ? -1 : (dx > 1 ? 1 : dx);
+    deflectionY = dy < -1 ? -1 : (dy > 1 ? 1 : dy);
+}
+
+void Jog::selectSpeed(int index) {
+    speedIndex = index < 0 ? 0 : (index >= numSpeeds ? numSpeeds - 1 : index);
+}
+
+int Jog::update() {
+    /*!
+     * \brief moves the tip by one control cycle of the current velocity. Call until finished()
+     * @return the new jog state
+     */
+
+    if (state != JOG_RUN) return state;
+
+    float speed = speeds[speedIndex];
+    vx = approachVelocity(vx, speed * deflectionX * fabsf(deflectionX));
+    vy = approachVelocity(vy, speed * deflectionY * fabsf(deflectionY));
+
+    x += vx;
+    y += vy;
+
+    // stopping at the edge of the range, not sliding along it
+    if (x < -limit || x > limit) {
+        x = x < 0 ? -limit : limit;
+        vx = 0;
+    }
+    if (y < -limit || y > limit) {
+        y = y < 0 ? -limit : limit;
+        vy = 0;
+    }
+
+    // the transverse loop lags the moving target, so only failures end the jog
+    int moveStatus = scanhead->setPositionStep((int) x, (int) y, scanhead->setpoint);
+    if (moveStatus < 0) {
+        Serial.print("jog failed with error ");
+        Serial.println(moveStatus);
+        failStatus = moveStatus;
+        state = JOG_FAILED;
+    }
+
+    return state;
+}
+
+void Jog::stop() {
+    /*!
+     * \brief ends the jog, keeping the position
+     */
+
+    if (state != JOG_RUN) return;
+    vx = 0;
+    vy = 0;
+    state = JOG_DONE;
+}
+
+void Jog::abort() {
+    if (state != JOG_RUN) return;
+    vx = 0;
+    vy = 0;
+    failStatus = ScanJob::abortedStatus;
+    state = JOG_ABORTED;
+}
+
+bool Jog::finished() {
+    return state == JOG_DONE || state == JOG_FAILED || state == JOG_ABORTED;
+}
+
+int Jog::result() {
+    if (state == JOG_DONE) return 0;
+    return failStatus;
+}
+
+float Jog::approachVelocity(float v, float target) {
+    // slew limited by accel
+    if (target > v + accel) return v + accel;
+    if (target < v - accel) return v - accel;
+    return target;
+}
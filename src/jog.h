@@ -0,0 +1,67 @@
+/*
+ * jog.h
+ * Joystick driven lateral positioning of the tip under Z feedback
+ */
+
+#ifndef jog_h
+#define jog_h
+
+#include "Arduino.h"
+#include "scanhead.h"
+
+/*
+ * The joystick deflection sets the lateral velocity, up to speeds[speedIndex] LSB per control cycle at full
+ * deflection. The deflection is squared, keeping the sign, so small deflections give fine moves at any speed.
+ * The velocity follows it at most accel LSB per cycle per cycle, so releasing the stick or changing speed does
+ * not kick the piezos. Z feedback runs throughout, holding the setpoint.
+ *
+ * Jogging runs until stop(), which keeps the position for the next scan's origin, or abort().
+ */
+
+class Jog
+{
+    public:
+        Jog();
+
+        enum State {
+            JOG_IDLE,
+            JOG_RUN,
+            JOG_DONE,    // stopped, x and y are the selected position
+            JOG_FAILED,
+            JOG_ABORTED
+        };
+
+        static const int numSpeeds = 5;
+
+        const float speeds[numSpeeds] = {0.02, 0.1, 0.5, 2, 8}; // LSB per control cycle at full deflection
+        float accel = 0.02;      // LSB per control cycle per cycle
+        int limit = 30000;       // lateral range, LSB either side of center
+        int speedIndex = 2;
+
+        void begin(ScanHead *scanhead, int x, int y);
+        void setDeflection(float dx, float dy);
+        void selectSpeed(int index);
+        int update();
+        void stop();
+        void abort();
+
+        bool finished();
+        int result();
+
+        int state;
+        float x;    // commanded position, LSB
+        float y;
+        float vx;   // LSB per control cycle
+        float vy;
+
+    private:
+        ScanHead *scanhead;
+
+        float deflectionX; // -1 to 1
+        float deflectionY;
+        int failStatus;
+
+        float approachVelocity(float v, float target);
+};
+
+#endif
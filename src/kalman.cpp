@@ -0,0 +1,95 @@
+/*
+ * kalman.cpp
+ * Two state Kalman filter on log tunneling current, fusing TIA measurements with Z piezo commands
+ */
+
+#ifndef kalman_h
+#define kalman_h
+
+#include <math.h>
+
+class HeightEstimator
+{
+    private:
+        // state: log current and its per-cycle drift (topography under a moving tip, thermal drift)
+        float level;
+        float rate;
+        float p00, p01, p11; // state covariance
+        bool valid;
+
+    public:
+        float decayLSB = 2000;        // Z LSB per e-fold change in current, positive when +Z raises current
+        float measurementNoisePA = 5; // rms noise of one control cycle's mean current
+        float levelNoise = 1e-4;      // log current process variance per cycle
+        float rateNoise = 1e-6;       // drift process variance per cycle
+        float minCurrentPA = 20;      // currents below this carry no height information
+
+        HeightEstimator() {
+            reset();
+        }
+
+        /*!
+         * \brief drops the estimate, the next measurement reinitializes it. Call after moves the filter does not see
+         */
+        void reset() {
+            valid = false;
+            level = 0;
+            rate = 0;
+            p00 = p01 = p11 = 0;
+        }
+
+        /*!
+         * \brief advances the filter by one control cycle
+         * @param currentPA mean current measured over the last control period
+         * @param zStep Z piezo increment applied at the start of that period, LSB
+         * @return estimated current in pA, or currentPA while there is no estimate
+         */
+        float update(float currentPA, int zStep) {
+            if (currentPA < minCurrentPA) {
+                valid = false;
+                return currentPA;
+            }
+
+            float measurement = logf(currentPA);
+
+            if (!valid) {
+                level = measurement;
+                rate = 0;
+                float r = measurementNoisePA / currentPA;
+                p00 = r * r;
+                p01 = 0;
+                p11 = 100 * rateNoise;
+                valid = true;
+                return currentPA;
+            }
+
+            // predict
+            level += rate + zStep / decayLSB;
+            p00 += 2 * p01 + p11 + levelNoise;
+            p01 += p11;
+            p11 += rateNoise;
+
+            // measurement noise in log current scales inversely with the predicted current
+            float predictedPA = expf(level);
+            if (predictedPA < minCurrentPA) predictedPA = minCurrentPA;
+            float r = measurementNoisePA / predictedPA;
+
+            // correct
+            float innovation = measurement - level;
+            float s = p00 + r * r;
+            float k0 = p00 / s;
+            float k1 = p01 / s;
+            level += k0 * innovation;
+            rate += k1 * innovation;
+            p11 -= k1 * p01;
+            p01 -= k0 * p01;
+            p00 -= k0 * p00;
+
+            return expf(level);
+        }
+
+        bool isValid() { return valid; }
+        float getRate() { return rate; }
+};
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * linecodec.cpp
+ * Lossless predictive Rice coding of scan lines for the scan stream
+ */
+
+#ifndef linecodec_h
+#define linecodec_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "scanchannels.h"
+
+/*
+ * A coded line is one #zline record (see scanstream.h): its rows as a bit string, six bits to a character of
+ * lineCodeDigits, the last padded with zeros. Pixel indices are not sent, they count up from the first pixel.
+ *
+ * Every channel value is predicted, and the difference zigzag mapped (0, -1, 1, -2 ... to 0, 1, 2, 3 ...) and Rice
+ * coded with the channel's k: value >> k in unary as ones and a closing zero, then the low k bits, most significant
+ * first. A value of lineCodeMaxUnary or more ones is instead sent as lineCodeMaxUnary ones and all 32 bits, so no
+ * value costs more than lineCodeMaxUnary + 32 bits. Arithmetic wraps at 32 bits, so any int round trips.
+ *
+ * Predictors, from the value before in the line (left) and the record before in the frame (the reference):
+ *   PREDICT_LEFT               left. The first pixel takes the reference's last value, or 0 without a reference
+ *   PREDICT_GRADIENT           left + up - up left, up the reference at the same position. The first pixel takes up
+ *   PREDICT_GRADIENT_REVERSED  the same, the reference read backwards: the line before in a serpentine raster
+ * The gradient predictors need a reference with as many rows. Drift and line to line offsets cancel in them,
+ * while slowly varying channels and the x and y positions code to a few bits in any of them.
+ *
+ * Every lineCodeKeyInterval-th record of a frame is a key record, coded without a reference, so a record lost
+ * on the way costs the host at most the records up to the next key.
+ *
+ * The encoder picks each channel's predictor and k from the line before, measuring all three predictors as it
+ * codes, so a line takes a single pass and a fixed amount of work per pixel.
+ */
+
+static const int lineCodeMaxUnary = 16;
+static const int lineCodeKeyInterval = 16;
+static const int lineCodeDefaultK = 8;  // for the first line of a frame, which has no statistics to go on
+static const char lineCodeDigits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+enum LinePredictor {
+    PREDICT_LEFT,
+    PREDICT_GRADIENT,
+    PREDICT_GRADIENT_REVERSED,
+    numLinePredictors
+};
+
+/*!
+ * \brief maps a difference to an unsigned value, small magnitudes to small values
+ */
+inline uint32_t zigzag(uint32_t difference) {
+    return (difference << 1) ^ (uint32_t) ((int32_t) difference >> 31);
+}
+
+inline uint32_t unzigzag(uint32_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+/*!
+ * \brief predicts one channel value of a coded line, identically on the head and the host
+ * @param predictor LinePredictor
+ * @param pixel position in the line
+ * @param *left the previous pixel's packed values, unused on the first pixel
+ * @param *reference packed values of the reference, NULL if there is none
+ * @param referenceRows rows of the reference. The gradient predictors need as many as the line has
+ * @param numChannels ints per packed pixel
+ * @param channel position of the channel within a packed pixel
+ * @return the prediction, to be subtracted with 32 bit wraparound
+ */
+inline uint32_t predictChannel(int predictor, int pixel, const int *left, const int *reference, int referenceRows,
+        int numChannels, int channel) {
+    if (predictor == PREDICT_LEFT) {
+        if (pixel > 0) return left[channel];
+        if (reference == NULL || referenceRows == 0) return 0;
+        return reference[(referenceRows - 1) * numChannels + channel];
+    }
+
+    int up = predictor == PREDICT_GRADIENT ? pixel : referenceRows - 1 - pixel;
+    uint32_t upValue = reference[up * numChannels + channel];
+    if (pixel == 0) return upValue;
+    int upLeft = predictor == PREDICT_GRADIENT ? up - 1 : up + 1;
+    return (uint32_t) left[channel] + upValue - (uint32_t) reference[upLeft * numChannels + channel];
+}
+
+class LineEncoder
+{
+    public:
+        static const int maxReferenceValues = 2048; // longest line, rows x channels, kept as the next reference
+        static const int maxPixelDigits = (numScanChannels * (lineCodeMaxUnary + 32) + 5) / 6 + 1;
+
+        // header fields of the line being coded
+        int sequence = 0;           // records coded in this frame before this one
+        bool referenced = false;    // predicted from the record before
+        int predictor[numScanChannels];
+        int riceK[numScanChannels];
+
+        /*!
+         * \brief forgets the reference and statistics at the start of a frame
+         * @param numChannels ints per packed pixel
+         */
+        void beginFrame(int numChannels) {
+            this->numChannels = numChannels;
+            sequence = -1;
+            referenceRows = 0;
+            statRows = 0;
+            statGradient = false;
+            numPixels = 0;
+            pixel = 0;
+        }
+
+        /*!
+         * \brief picks the line's predictors and Rice parameters from the line before
+         * @param numPixels rows the line will have
+         */
+        void beginLine(int numPixels) {
+            sequence += 1;
+            referenced = referenceRows > 0 && sequence % lineCodeKeyInterval != 0;
+            bool gradient = referenceRows > 0 && referenceRows == numPixels; // measurable, even on a key record
+
+            for (int ch = 0; ch < numChannels; ch++) {
+                int best = PREDICT_LEFT;
+                if (referenced && gradient && statGradient) {
+                    for (int p = PREDICT_GRADIENT; p < numLinePredictors; p++) {
+                        if (sums[ch][p] < sums[ch][best]) best = p;
+                    }
+                }
+                predictor[ch] = best;
+
+                // 2^k at most the mean coded value, Rice's optimum to within a bit
+                int k = lineCodeDefaultK;
+                if (statRows > 0) {
+                    k = 0;
+                    while (k < 31 && ((uint64_t) statRows << (k + 1)) <= sums[ch][best]) k++;
+                }
+                riceK[ch] = k;
+
+                for (int p = 0; p < numLinePredictors; p++) sums[ch][p] = 0;
+            }
+
+            this->numPixels = numPixels;
+            pixel = 0;
+            statRows = 0;
+            statGradient = gradient;
+            stored = numPixels * numChannels <= maxReferenceValues;
+            bitCount = 0;
+        }
+
+        /*!
+         * \brief codes the next pixel of the line
+         * @param *values the pixel's packed channel values
+         * @param *out digits are written here, at most maxPixelDigits
+         * @return digits written
+         */
+        int encodePixel(const int *values, char *out) {
+            uint64_t pending = bits; // kept local, as the digit stores could alias the members
+            int count = bitCount;
+            int written = 0;
+            int *line = stored ? buffers[1 - referenceBuffer] + pixel * numChannels : NULL;
+            const int *reference = buffers[referenceBuffer];
+
+            for (int ch = 0; ch < numChannels; ch++) {
+                uint32_t value = values[ch];
+                uint32_t coded;
+
+                if (pixel == 0) {
+                    // the first pixel leans on the reference alone, and a key record's has none
+                    coded = zigzag(value - predictChannel(predictor[ch], 0, left, referenced ? reference : NULL,
+                            referenceRows, numChannels, ch));
+                }
+                else {
+                    // predictChannel() unrolled: the residual of every predictor, measured for the next line
+                    uint32_t residual[numLinePredictors];
+                    residual[PREDICT_LEFT] = value - (uint32_t) left[ch];
+                    sums[ch][PREDICT_LEFT] += zigzag(residual[PREDICT_LEFT]);
+                    if (statGradient) {
+                        int up = pixel * numChannels + ch;
+                        int mirrored = (numPixels - 1 - pixel) * numChannels + ch;
+                        residual[PREDICT_GRADIENT] = residual[PREDICT_LEFT]
+                                - ((uint32_t) reference[up] - (uint32_t) reference[up - numChannels]);
+                        residual[PREDICT_GRADIENT_REVERSED] = residual[PREDICT_LEFT]
+                                - ((uint32_t) reference[mirrored] - (uint32_t) reference[mirrored + numChannels]);
+                        sums[ch][PREDICT_GRADIENT] += zigzag(residual[PREDICT_GRADIENT]);
+                        sums[ch][PREDICT_GRADIENT_REVERSED] += zigzag(residual[PREDICT_GRADIENT_REVERSED]);
+                    }
+                    coded = zigzag(residual[predictor[ch]]);
+                }
+
+                // Rice code: quotient ones and a zero, then the low k bits, or the escape and all 32 bits
+                int k = riceK[ch];
+                uint32_t quotient = coded >> k;
+                if (quotient < (uint32_t) lineCodeMaxUnary) {
+                    int length = quotient + 1 + k;
+                    pending = (pending << length) | ((((uint64_t) 1 << quotient) - 1) << (k + 1))
+                            | (coded & (((uint64_t) 1 << k) - 1));
+                    count += length;
+                }
+                else {
+                    pending = (pending << (lineCodeMaxUnary + 32)) | ((((uint64_t) 1 << lineCodeMaxUnary) - 1) << 32)
+                            | coded;
+                    count += lineCodeMaxUnary + 32;
+                }
+                while (count >= 6) {
+                    count -= 6;
+                    out[written++] = lineCodeDigits[(pending >> count) & 63];
+                }
+
+                left[ch] = value;
+                if (line != NULL) line[ch] = value;
+            }
+
+            if (pixel > 0) statRows += 1;
+            pixel += 1;
+            bits = pending;
+            bitCount = count;
+            return written;
+        }
+
+        /*!
+         * \brief pads out the last digit, and keeps the line as the next one's reference
+         * @param *out the last digit, if any, is written here
+         * @return digits written
+         */
+        int endLine(char *out) {
+            int written = 0;
+            if (bitCount > 0) {
+                out[written++] = lineCodeDigits[(bits << (6 - bitCount)) & 63];
+                bitCount = 0;
+            }
+
+            if (stored) {
+                referenceBuffer = 1 - referenceBuffer;
+                referenceRows = numPixels;
+            }
+            else {
+                referenceRows = 0;
+                statGradient = false;
+            }
+            return written;
+        }
+
+    private:
+        int numChannels = 0;
+        int numPixels = 0;
+        int pixel = 0;
+        int left[numScanChannels];
+
+        // the reference and the line being coded, swapped at the end of every line that fits
+        int buffers[2][maxReferenceValues];
+        int referenceBuffer = 0;
+        int referenceRows = 0;
+        bool stored = false;
+
+        // sums of the coded values of this line by predictor, the gradients only where there is a reference
+        uint64_t sums[numScanChannels][numLinePredictors];
+        long statRows = 0;
+        bool statGradient = false;
+
+        uint64_t bits = 0; // pending output, the low bitCount bits, at most 5 between values
+        int bitCount = 0;
+};
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * lockin.cpp
+ * Software lock-in: sine bias modulation from a phase accumulator and I/Q demodulation of the TIA samples
+ */
+
+#ifndef lockin_h
+#define lockin_h
+
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * Runs in the current sampling interrupt. Each sample, modulation() gives the DAC offset for the phase of that
+ * sample, and demodulate() takes the TIA reading that followed the write and advances the phase.
+ *
+ * The reading is AC coupled by a one pole tracker of its mean, about dcPeriods modulation periods long, so the DC
+ * current does not leak through the low pass as ripple at the modulation frequency. The products with the
+ * reference sine and cosine then go through two one pole low pass stages of timeConstantUs each. For a small
+ * modulation a, the in-phase output is dI/dV * a / 2.
+ */
+
+class LockIn
+{
+    private:
+        uint32_t phase;
+        uint32_t phaseStep;
+        uint32_t referenceOffset; // phaseDeg as a phase accumulator value
+        float dacAmplitude;       // modulation amplitude, DAC LSB
+        float sinPhase;           // reference at the phase of the last modulation() call
+        float cosPhase;
+        float dcAlpha;
+        float lowPassAlpha;
+
+        float dc;
+        float x1, x2;             // in-phase low pass stages
+        float y1, y2;             // quadrature low pass stages
+        bool primed;
+
+    public:
+        LockIn() {
+            configure(50, 1);
+        }
+
+        bool enabled = false;
+        float frequencyHz = 2000;     // multiples of 1kHz fit whole periods in a 1ms control cycle
+        float amplitudeMV = 20;       // modulation amplitude, mV
+        float timeConstantUs = 3000;  // of each low pass stage
+        float phaseDeg = 0;           // reference phase behind the modulation, for the TIA's lag
+        float dcPeriods = 5;          // AC coupling time constant, modulation periods
+
+        /*!
+         * \brief applies the parameters and restarts the demodulation
+         * @param samplePeriodUs sampling interrupt period
+         * @param dacPerMV pad DAC LSB per mV of sample bias
+         */
+        void configure(float samplePeriodUs, float dacPerMV) {
+            float sampleHz = 1e6 / samplePeriodUs;
+            phaseStep = (uint32_t) (frequencyHz / sampleHz * 4294967296.0);
+
+            // the AC coupling leads the signal by atan(1 / (2 pi dcPeriods)), taken out of the reference
+            float leadDeg = atanf(1 / (2 * M_PI * dcPeriods)) * 180 / M_PI;
+            referenceOffset = (uint32_t) (int32_t) ((phaseDeg - leadDeg) / 360 * 4294967296.0);
+            dacAmplitude = amplitudeMV * dacPerMV;
+
+            float periodUs = frequencyHz > 0 ? 1e6 / frequencyHz : samplePeriodUs;
+            dcAlpha = samplePeriodUs / (dcPeriods * periodUs + samplePeriodUs);
+            lowPassAlpha = samplePeriodUs / (timeConstantUs + samplePeriodUs);
+
+            phase = 0;
+            sinPhase = 0;
+            cosPhase = 1;
+            x1 = x2 = y1 = y2 = 0;
+            dc = 0;
+            primed = false;
+        }
+
+        /*!
+         * @return modulation offset for this sample, DAC LSB
+         */
+        int modulation() {
+            float angle = phase * (2 * M_PI / 4294967296.0);
+            float out = sinf(angle);
+            float reference = (uint32_t) (phase - referenceOffset) * (2 * M_PI / 4294967296.0);
+            sinPhase = sinf(reference);
+            cosPhase = cosf(reference);
+            return (int) lroundf(dacAmplitude * out);
+        }
+
+        /*!
+         * \brief demodulates one TIA reading taken after the modulation() write and advances the phase
+         * @param value TIA reading, any linear unit
+         */
+        void demodulate(float value) {
+            if (!primed) {
+                dc = value;
+                primed = true;
+            }
+            dc += dcAlpha * (value - dc);
+            float ac = value - dc;
+
+            x1 += lowPassAlpha * (ac * sinPhase - x1);
+            x2 += lowPassAlpha * (x1 - x2);
+            y1 += lowPassAlpha * (ac * cosPhase - y1);
+            y2 += lowPassAlpha * (y1 - y2);
+
+            phase += phaseStep;
+        }
+
+        float inPhase() { return x2; }
+        float quadrature() { return y2; }
+};
+
+#endif
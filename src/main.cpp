@@ -1,180 +1,133 @@
 #include <Arduino.h>
-#include <CircularBuffer.h>
 #include "scanhead.h"
+#include "jobqueue.h"
+#include "commands.h"
+#include "scheduler.h"
+#include "noisespectrum.h"
 #include "ui.h"
 
 ScanHead *scanhead;
 UI *ui;
+JobQueue *jobQueue;
+Commands *commands;
+Scheduler scheduler;
+NoiseSpectrum spectrum; // capture blocks in RAM1, frameBuf fills RAM2
+Bench bench;            // kernel benchmarks, in RAM1 for the same reason
 
-int setpoint = 500; // 500pA
+// packed pixel storage for queued scans, in RAM2
+const int frameBufSize = 100000;
+DMAMEM int frameBuf[frameBufSize];
 
-IntervalTimer currentSampleTimer;
-
-void approachLoop(CircularBuffer<int,1000> &current, CircularBuffer<int,1000> &zpos, bool userStart) {
-    /*!
-     * brief: provides manual and automatic control over scan head during stepper aproach
-     * @param *zpos: a circular buffer which will hold z positions during approach
-     * @param *current: a circular buffer which will hold currents during approach
-     */
+// control loop trace, in RAM1. About 45 halfwords a control cycle, so 0.7s of scanning
+const int traceBufSize = 32768;
+uint16_t traceBuf[traceBufSize];
 
+IntervalTimer currentSampleTimer;
 
-    if (userStart) {
-        while (ui->encoderVals.next == 1) {
-            ui->updateInputs();
-        }
-
-
-        // move encoder until user selection
-        while (ui->encoderVals.next == 0) {
-            ui->updateInputs();
-            scanhead->fetchCurrent();
-            scanhead->moveStepper(1, ui->encoderVals.encoderPos);
-            current.push(scanhead->current);
-            zpos.push(scanhead->zpos);
-            ui->drawDisplay(scanhead);
-            Serial.println(scanhead->fetchCurrent());
-        }
-    }
-
-    // auto approach
-    int autoApproachStatus = 0;
-    int autoApproachSteps = 0;
-
-    while (autoApproachStatus == 0) {
-        Serial.print("approach step, currentRaw=");
-        Serial.print(scanhead->currentRaw);
-        Serial.print(" current=");
-        Serial.println(scanhead->current);
-        autoApproachStatus = scanhead->autoApproachStep(setpoint, current, zpos);
-        autoApproachSteps += 1;
-        if (autoApproachSteps % 1 == 0) {
-            ui->updateInputs();
-            ui->drawDisplay(scanhead);
-        }
-    }
+const int streamPixelsPerRun = 8; // pixel rows written per streaming task run
+const int approachLinesPerRun = 50; // manual approach data printed per UI task run
 
-    for (int i = 0; i < 1000; i++) scanhead -> setPositionStep(0,0,setpoint);
+void sampleScanHeadCurrent() {
+    scanhead->sampleCurrent();
 }
 
-void scan1D() {
-    //// 1-D Scan, without height control
-
-    Serial.println("Scanning in 1D");
-
-
-    int numpoints = 500;
-    int step = 1;
-
-    int currents1Df[numpoints/step];
-    int zPos1Df[numpoints/step];
-    int currents1Db[numpoints/step];
-    int zPos1Db[numpoints/step];
-
-    int scanStatus;
-
-
-    Serial.println("Scanning +x");
-
-    for (int i = 0; i < 1; i++) {
-
-        scanStatus = scanhead->scanOneAxis(currents1Df, zPos1Df, numpoints, step, true, true); // scanning on +x
-
-
-        ui -> drawDisplay(scanhead);
-
-        if (scanStatus != 0) {
-            Serial.print("Encountered scan error ");
-            Serial.println(scanStatus);
-        }
-
-        //approachLoop(currentBuffer, zPosBuffer, false); // returning to setpoint
-
-        Serial.println("Scanning -x");
-
-        scanStatus = scanhead->scanOneAxis(currents1Db, zPos1Db, numpoints, step, false, true); // scanning on -x
-
-        ui -> drawDisplay(scanhead);
-
-        if (scanStatus != 0) {
-            Serial.print("Encountered scan error ");
-            Serial.println(scanStatus);
-        }
-
-
-        Serial.println("Dumping forward x-axis scan");
-
-        //delay(5000);
-
-        for (int j = 0; j < numpoints/step; j++) {
-                Serial.print(j);
-                Serial.print(",");
-                Serial.print(currents1Df[j]);
-                Serial.print(",");
-                Serial.println(zPos1Df[j]);
-        }
+void superviseTask() {
+    /*!
+     * \brief overcurrent watchdog: stops all jobs, the trajectory task then fully retracts the Z piezo
+     */
 
-        Serial.println("Dumping backward x-axis scan");
+    if (!scanhead->isOvercurrent() || jobQueue->state == JobQueue::QUEUE_WITHDRAWING) return;
 
-        for (int j = 0; j < numpoints/step; j++) {
-                Serial.print(j);
-                Serial.print(",");
-                Serial.print(currents1Db[j]);
-                Serial.print(",");
-                Serial.println(zPos1Db[j]);
-        }
+    Serial.print("overcurrent ");
+    Serial.print(scanhead->current);
+    Serial.println("pA, retracting");
 
-        Serial.println("Returning");
-    }
+    jobQueue->withdraw();
 }
 
-void scan2D() {
-    Serial.println("scanning in 2D");
+void trajectoryTask() {
+    jobQueue->update();
+}
 
-    // reference sample - 200nm spacing. So we want to cover 200nm -> 2000 points
+void streamTask() {
+    scanhead->stream.update(streamPixelsPerRun);
+}
 
-    int sizeX = 1000;
-    int sizeY = 1000;
-    int step =  10;
+void spectrumTask() {
+    // one FFT pass per run, sharing the idle time with the stream
+    if (!spectrum.finished()) spectrum.update();
+}
 
-    int numSteps = (sizeX * sizeY) / (step * step);
+void commandTask() {
+    commands->poll();
+}
 
-    int currentArr[numSteps];
-    int xposArr[numSteps];
-    int yposArr[numSteps];
-    int zposArr[numSteps];
+void uiTask() {
+    // dpad center pauses, dpad up resumes, encoder select aborts the active scan.
+    // Encoder next starts the manual approach when no jobs are queued, and ends its coarse stepping
+    ui->updateInputs();
+    if (ui->encoderVals.sel == 1) jobQueue->abort();
+    else if (ui->dpadVals.c == 1) jobQueue->pause();
+    else if (ui->dpadVals.u == 1) jobQueue->resume();
+    else if (ui->encoderVals.nextPressed == 1 && !jobQueue->busy()) {
+        Job job;
+        job.type = JOB_MANUAL_APPROACH;
+        jobQueue->enqueue(job);
+    }
+    else if (ui->encoderVals.nextPressed == 1) jobQueue->confirmApproach();
 
-    int scanStatus = scanhead->scanTwoAxes(currentArr, zposArr, xposArr, yposArr, sizeX, sizeY, step, true);
+    // redrawing blocks for an I2C transfer, so only while the head is idle or steps in without feedback
+    bool coarse = jobQueue->state == JobQueue::QUEUE_COARSE_APPROACHING;
+    if (!jobQueue->busy() || coarse) ui->drawDisplay(scanhead);
 
-    for (int step = 0; step < 50; step++) scanhead->moveStepper(1, -10);
+    if (!jobQueue->busy() && jobQueue->approachLogged) jobQueue->printApproach(approachLinesPerRun);
+}
 
-    Serial.print("Finished scan, returned with code ");
-    Serial.println(scanStatus);
+void approachTask() {
+    // the encoder position sets a manual approach's coarse stepper rate, encoder next starts its auto approach
+    if (jobQueue->state != JobQueue::QUEUE_COARSE_APPROACHING) return;
 
-    if (scanStatus != 0) return;
+    ui->updateInputs();
+    jobQueue->coarseRate = ui->encoderVals.encoderPos;
+    if (ui->encoderVals.nextPressed == 1) jobQueue->confirmApproach();
+}
 
-    Serial.println("Dumping scan output:");
-    Serial.println("step,x,y,z,current");
+void previewTask() {
+    // one page window or chunk of the scan preview per run, so no run blocks on the whole display
+    // the jog draws its own screen, and the UI task the coarse approach's
+    if (jobQueue->busy() && jobQueue->state != JobQueue::QUEUE_JOGGING &&
+            jobQueue->state != JobQueue::QUEUE_COARSE_APPROACHING) ui->drawPreview(scanhead);
+}
 
-    for (int step = 0; step < numSteps; step++) {
-        Serial.print(step);
-        Serial.print(",");
-        Serial.print(xposArr[step]);
-        Serial.print(",");
-        Serial.print(yposArr[step]);
-        Serial.print(",");
-        Serial.print(zposArr[step]);
-        Serial.print(",");
-        Serial.println(currentArr[step]);
-        delay(1);
+void jogTask() {
+    // stick deflection to jog velocity, a detent of the encoder per speed step, encoder next keeps the position
+    static bool jogging = false;
+    static int lastDetent = 0;
+    if (jobQueue->state != JobQueue::QUEUE_JOGGING) {
+        jogging = false;
+        return;
     }
 
-    Serial.println("Returning");
+    Jog &jog = jobQueue->jog;
+    ui->updateInputs();
+    int detent = ui->encoderVals.encoderPos / 4;
+    if (jogging && detent != lastDetent) jog.selectSpeed(jog.speedIndex + detent - lastDetent);
+    lastDetent = detent;
+    jogging = true;
+
+    jog.setDeflection(ui->joystickDeflection(ui->joystickVals.xax), ui->joystickDeflection(ui->joystickVals.yax));
+    if (ui->encoderVals.nextPressed == 1) jog.stop();
 
+    ui->drawJog(scanhead, &jog);
 }
 
+void addTask(const char *name, void (*run)(), int priority, uint32_t periodUs, uint32_t budgetUs) {
+    // a task left out of a full table would silently never run
+    if (scheduler.addTask(name, run, priority, periodUs, budgetUs) >= 0) return;
 
-void sampleScanHeadCurrent() {
-    scanhead->sampleCurrent();
+    Serial.print("task table full, ");
+    Serial.print(name);
+    Serial.println(" not scheduled");
 }
 
 void setup() {
@@ -187,7 +140,7 @@ void setup() {
 
     scanhead = new ScanHead();
     // setting up interrupt for current integration
-    currentSampleTimer.begin(sampleScanHeadCurrent, 50); // sampling every 50us -> 20kHz
+    currentSampleTimer.begin(sampleScanHeadCurrent, ScanHead::samplePeriodUs); // sampling every 50us -> 20kHz
 
     Serial.println("Initializing UI");
 
@@ -196,37 +149,33 @@ void setup() {
     Serial.println("Calibrating Zero Current");
     scanhead->calibrateZeroCurrent();
 
-    Serial.println("Startup Complete");
+    Serial.println("Initializing Job Queue");
 
-    ui->drawDisplay(scanhead);
-    ui->updateInputs();
+    jobQueue = new JobQueue(scanhead, &bench, frameBuf, frameBufSize);
+    commands = new Commands(scanhead, jobQueue, &scheduler, &spectrum, traceBuf, traceBufSize);
 
-    // Initial Approach
+    Serial.println("Starting Scheduler");
 
-    CircularBuffer<int,1000> currentBuffer;
-    CircularBuffer<int,1000> zPosBuffer;
+    // scan lines are written by the streaming task instead of inline with the scan
+    scanhead->stream.buffered = true;
 
-    Serial.println("Starting Approach");
-    approachLoop(currentBuffer, zPosBuffer, true);
-    Serial.print("found current ");
-    Serial.println(scanhead->current);
-    Serial.println("Approach complete");
+    // name, task, priority, period (us), budget (us)
+    addTask("supervisor", superviseTask, 0, 1000, 50);
+    addTask("trajectory", trajectoryTask, 1, scanhead->controlPeriodUs, 400);
+    addTask("stream", streamTask, 2, 0, 300);
+    addTask("spectrum", spectrumTask, 2, 0, 100);
+    addTask("command", commandTask, 3, 10000, 200);
+    addTask("ui", uiTask, 4, 200000, 30000);
+    addTask("preview", previewTask, 4, 4000, 600);
+    addTask("jog", jogTask, 3, 5000, 800);
+    addTask("approach", approachTask, 3, 5000, 200);
 
-    Serial.println("Dumping approach data...");
-
-
-    for (int j = 0; j < 1000; j++) {
-        Serial.print(currentBuffer.shift());
-        Serial.print(",");
-        Serial.println(zPosBuffer.shift());
-    }
+    Serial.println("Startup Complete");
 
-    //scan1D();
-    scan2D();
-    for (int step = 0; step < 50; step++) scanhead->moveStepper(1, -10);
+    ui->drawDisplay(scanhead);
+    ui->updateInputs();
 }
 
-
 void loop() {
-    //scanhead->testScanHeadPosition(30000,10);
+    scheduler.runOnce();
 }
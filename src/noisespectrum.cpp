@@ -0,0 +1,326 @@
+/*
+ * noisespectrum.cpp
+ * TIA noise spectrum analyzer: averaged power spectra of the raw and notch filtered current, peaks, noise floor
+ * and the mains frequency
+ */
+
+#include "Arduino.h"
+#include "noisespectrum.h"
+
+NoiseSpectrum::NoiseSpectrum() {
+    scanhead = NULL;
+    state = SPECTRUM_IDLE;
+    numBlocks = 0;
+    blocksDone = 0;
+}
+
+void NoiseSpectrum::begin(ScanHead *scanhead, int blocks) {
+    /*!
+     * \brief starts averaging a new spectrum
+     * @param *scanhead ScanHead to capture from
+     * @param blocks blocks to average, at least 1
+     */
+
+    this->scanhead = scanhead;
+    numBlocks = blocks < 1 ? 1 : blocks;
+    blocksDone = 0;
+
+    for (int i = 0; i < numBins; i++) {
+        sumPsd[SPECTRUM_RAW][i] = 0;
+        sumPsd[SPECTRUM_FILTERED][i] = 0;
+    }
+
+    scanhead->beginCapture(raw, filtered, blockSize);
+    state = SPECTRUM_CAPTURE;
+}
+
+int NoiseSpectrum::update() {
+    /*!
+     * \brief checks on the capture, or runs one pass of the block's transform. Call until finished()
+     * @return the new state
+     */
+
+    switch (state) {
+
+    case SPECTRUM_CAPTURE:
+        if (!scanhead->captureDone()) break;
+        channel = SPECTRUM_RAW;
+        startTransform(raw);
+        state = SPECTRUM_PROCESS;
+        break;
+
+    case SPECTRUM_PROCESS:
+        if (!fft.step()) break;
+
+        if (channel == SPECTRUM_RAW) {
+            accumulate(raw, sumPsd[SPECTRUM_RAW]);
+            channel = SPECTRUM_FILTERED;
+            startTransform(filtered);
+            break;
+        }
+
+        accumulate(filtered, sumPsd[SPECTRUM_FILTERED]);
+        blocksDone += 1;
+        if (blocksDone >= numBlocks) {
+            state = SPECTRUM_DONE;
+            break;
+        }
+        scanhead->beginCapture(raw, filtered, blockSize);
+        state = SPECTRUM_CAPTURE;
+        break;
+
+    default:
+        break;
+    }
+
+    return state;
+}
+
+void NoiseSpectrum::abort() {
+    /*!
+     * \brief stops averaging, keeping the blocks done so far
+     */
+
+    if (state != SPECTRUM_CAPTURE && state != SPECTRUM_PROCESS) return;
+    scanhead->beginCapture(raw, filtered, 0);
+    state = SPECTRUM_ABORTED;
+}
+
+bool NoiseSpectrum::finished() {
+    return state != SPECTRUM_CAPTURE && state != SPECTRUM_PROCESS;
+}
+
+float NoiseSpectrum::binHz() {
+    return 1e6 / ScanHead::samplePeriodUs / blockSize;
+}
+
+float NoiseSpectrum::psd(int channel, int bin) {
+    /*!
+     * @return averaged PSD of channel at bin, pA^2/Hz, 0 before the first block
+     */
+
+    if (blocksDone == 0) return 0;
+    return sumPsd[channel][bin] / blocksDone * pAPerTiaLSB * pAPerTiaLSB;
+}
+
+float NoiseSpectrum::noiseFloor(int channel) {
+    /*!
+     * @return noise floor of channel, pA/rtHz
+     */
+
+    return sqrtf(floorPsd(channel));
+}
+
+int NoiseSpectrum::findPeaks(peak_struct *peaks, int maxPeaks) {
+    /*!
+     * \brief finds the strongest lines in the raw spectrum
+     * @param *peaks array for the peaks, strongest first
+     * @param maxPeaks length of peaks
+     * @return peaks found
+     */
+
+    float rawFloor = floorPsd(SPECTRUM_RAW);
+    float filteredFloor = floorPsd(SPECTRUM_FILTERED);
+    float strength[NoiseSpectrum::maxPeaks];
+    int bins[NoiseSpectrum::maxPeaks];
+    int numPeaks = 0;
+    if (maxPeaks > NoiseSpectrum::maxPeaks) maxPeaks = NoiseSpectrum::maxPeaks;
+
+    // bins 0 and 1 hold the window's leakage from DC
+    for (int k = 2; k < numBins - 2; k++) {
+        float value = psd(SPECTRUM_RAW, k);
+        if (value < peakThreshold * rawFloor) continue;
+        if (value < psd(SPECTRUM_RAW, k - 1) || value <= psd(SPECTRUM_RAW, k + 1)) continue;
+
+        // insertion into the strongest so far
+        if (numPeaks < maxPeaks) numPeaks += 1;
+        else if (value <= strength[maxPeaks - 1]) continue;
+        int slot = numPeaks - 1;
+        for (; slot > 0 && strength[slot - 1] < value; slot--) {
+            strength[slot] = strength[slot - 1];
+            bins[slot] = bins[slot - 1];
+        }
+        strength[slot] = value;
+        bins[slot] = k;
+    }
+
+    for (int i = 0; i < numPeaks; i++) {
+        peaks[i].hz = interpolatePeak(SPECTRUM_RAW, bins[i], rawFloor);
+        peaks[i].rawPA = sqrtf(linePower(SPECTRUM_RAW, bins[i], rawFloor));
+        peaks[i].filteredPA = sqrtf(linePower(SPECTRUM_FILTERED, bins[i], filteredFloor));
+    }
+    return numPeaks;
+}
+
+float NoiseSpectrum::estimateMains() {
+    /*!
+     * \brief finds the mains line and refines it with its harmonics, weighting each by its order and strength
+     * @return mains frequency in Hz, 0 if there is no line in range
+     */
+
+    float floor = floorPsd(SPECTRUM_RAW);
+    if (floor <= 0) return 0;
+
+    int best = -1;
+    for (int k = (int) (mainsMinHz / binHz()); k <= (int) (mainsMaxHz / binHz()) + 1; k++) {
+        if (best < 0 || psd(SPECTRUM_RAW, k) > psd(SPECTRUM_RAW, best)) best = k;
+    }
+    if (best < 2 || psd(SPECTRUM_RAW, best) < peakThreshold * floor) return 0;
+    float fundamental = interpolatePeak(SPECTRUM_RAW, best, floor);
+
+    double sum = 0;
+    double weights = 0;
+    for (int h = 1; h <= mainsHarmonics; h++) {
+        int center = (int) (h * fundamental / binHz() + 0.5);
+        if (center + 2 >= numBins) break;
+
+        int k = center;
+        if (psd(SPECTRUM_RAW, center - 1) > psd(SPECTRUM_RAW, k)) k = center - 1;
+        if (psd(SPECTRUM_RAW, center + 1) > psd(SPECTRUM_RAW, k)) k = center + 1;
+        float snr = psd(SPECTRUM_RAW, k) / floor;
+        if (snr < peakThreshold) continue;
+
+        // the interpolation error shrinks with the order, the noise error with the line's strength
+        float weight = h * h * (snr < 1000 ? snr : 1000);
+        sum += weight * interpolatePeak(SPECTRUM_RAW, k, floor) / h;
+        weights += weight;
+    }
+    return weights > 0 ? sum / weights : 0;
+}
+
+void NoiseSpectrum::printReport() {
+    /*!
+     * \brief prints the progress, noise floors, mains frequency and the strongest lines with their amplitude
+     *        before and after the notch
+     */
+
+    peak_struct peaks[maxPeaks];
+    int numPeaks = blocksDone > 0 ? findPeaks(peaks, maxPeaks) : 0;
+
+    Serial.print("ok blocks=");
+    Serial.print(blocksDone);
+    Serial.print("/");
+    Serial.print(numBlocks);
+    Serial.print(" bin=");
+    Serial.print(binHz(), 3);
+    Serial.print(" notch=");
+    Serial.print(scanhead != NULL ? scanhead->notchHz() : 0, 2);
+    Serial.print(" mains=");
+    Serial.println(blocksDone > 0 ? estimateMains() : 0, 2);
+
+    Serial.print("floor pA/rtHz raw=");
+    Serial.print(noiseFloor(SPECTRUM_RAW), 3);
+    Serial.print(" filtered=");
+    Serial.println(noiseFloor(SPECTRUM_FILTERED), 3);
+
+    Serial.println("peak,hz,raw_pa,filtered_pa");
+    for (int i = 0; i < numPeaks; i++) {
+        Serial.print("peak,");
+        Serial.print(peaks[i].hz, 2);
+        Serial.print(",");
+        Serial.print(peaks[i].rawPA, 2);
+        Serial.print(",");
+        Serial.println(peaks[i].filteredPA, 2);
+    }
+}
+
+void NoiseSpectrum::printPsd() {
+    /*!
+     * \brief prints the averaged spectra, one bin per line, pA/rtHz
+     */
+
+    Serial.println("hz,raw,filtered");
+    for (int k = 0; k < numBins; k++) {
+        Serial.print(k * binHz(), 2);
+        Serial.print(",");
+        Serial.print(sqrtf(psd(SPECTRUM_RAW, k)), 4);
+        Serial.print(",");
+        Serial.println(sqrtf(psd(SPECTRUM_FILTERED, k)), 4);
+    }
+}
+
+void NoiseSpectrum::startTransform(float *block) {
+    // the mean is removed first, so the window leaks no DC offset into the low bins
+    double mean = 0;
+    for (int i = 0; i < blockSize; i++) mean += block[i];
+    mean /= blockSize;
+
+    // periodic Hann window from a rotating phasor
+    double stepRe = cos(2 * M_PI / blockSize);
+    double stepIm = sin(2 * M_PI / blockSize);
+    double re = 1;
+    double im = 0;
+    for (int i = 0; i < blockSize; i++) {
+        block[i] = (block[i] - mean) * (float) (0.5 - 0.5 * re);
+        double nextRe = re * stepRe - im * stepIm;
+        im = re * stepIm + im * stepRe;
+        re = nextRe;
+    }
+
+    fft.begin(block, blockSize);
+}
+
+void NoiseSpectrum::accumulate(const float *spectrum, float *sum) {
+    // one sided PSD, 2 |X|^2 / (fs sum(w^2)), sum(w^2) = 3N/8 for the Hann window
+    float scale = 2.0 / (1e6 / ScanHead::samplePeriodUs * 0.375 * blockSize);
+
+    sum[0] += spectrum[0] * spectrum[0] * scale / 2;
+    sum[numBins - 1] += spectrum[1] * spectrum[1] * scale / 2;
+    for (int k = 1; k < numBins - 1; k++) {
+        sum[k] += (spectrum[2 * k] * spectrum[2 * k] + spectrum[2 * k + 1] * spectrum[2 * k + 1]) * scale;
+    }
+}
+
+float NoiseSpectrum::floorPsd(int channel) {
+    // median by bisection, so no scratch copy of the spectrum is needed
+    int first = (int) (floorMinHz / binHz()) + 1;
+    int count = numBins - first;
+    if (blocksDone == 0 || count <= 0) return 0;
+
+    float low = psd(channel, first);
+    float high = low;
+    for (int k = first; k < numBins; k++) {
+        float value = psd(channel, k);
+        if (value < low) low = value;
+        if (value > high) high = value;
+    }
+
+    for (int iteration = 0; iteration < 40 && high > low * 1.0001; iteration++) {
+        float mid = 0.5 * (low + high);
+        int below = 0;
+        for (int k = first; k < numBins; k++) {
+            if (psd(channel, k) < mid) below += 1;
+        }
+        if (below * 2 < count) low = mid;
+        else high = mid;
+    }
+
+    // the median of an average of n chi-squared blocks of 2 degrees of freedom sits (1 - 1/9n)^3 below the mean
+    float bias = 1 - 1 / (9.0 * blocksDone);
+    return 0.5 * (low + high) / (bias * bias * bias);
+}
+
+float NoiseSpectrum::interpolatePeak(int channel, int bin, float floor) {
+    // Hann window line shape: a neighbour to peak amplitude ratio a puts the line (2a - 1) / (a + 1) bins over
+    float center = psd(channel, bin) - floor;
+    float left = psd(channel, bin - 1) - floor;
+    float right = psd(channel, bin + 1) - floor;
+    if (center <= 0) return bin * binHz();
+
+    float side = right > left ? right : left;
+    float ratio = sqrtf(side > 0 ? side / center : 0);
+    float offset = (2 * ratio - 1) / (ratio + 1);
+    if (offset < 0) offset = 0;
+    if (right <= left) offset = -offset;
+    return (bin + offset) * binHz();
+}
+
+float NoiseSpectrum::linePower(int channel, int bin, float floor) {
+    // the Hann main lobe spans two bins either side of the line, pA^2
+    float power = 0;
+    for (int k = bin - 2; k <= bin + 2; k++) {
+        if (k >= 0 && k < numBins) power += psd(channel, k) - floor;
+    }
+    power *= binHz();
+    return power > 0 ? power : 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * noisespectrum.h
+ * TIA noise spectrum analyzer: averaged power spectra of the raw and notch filtered current, peaks, noise floor
+ * and the mains frequency
+ */
+
+#ifndef noisespectrum_h
+#define noisespectrum_h
+
+#include "Arduino.h"
+#include "scanhead.h"
+#include "rfft.cpp"
+
+/*
+ * Captures blocks of blockSize consecutive TIA readings through ScanHead, both raw and after the mains notch,
+ * and averages their Hann windowed power spectral densities. Blocks are transformed in place one FFT pass per
+ * update(), so the analyzer runs alongside scans and the control loop sees no more than one pass at a time.
+ * The next block is captured once the last is transformed.
+ *
+ * PSDs are one sided, in pA^2/Hz. The noise floor is the median PSD above floorMinHz, which ignores the lines.
+ * Peaks are local maxima of the raw PSD peakThreshold times above the floor, with their frequency interpolated
+ * from the neighbouring bins and their rms amplitude summed over the window's main lobe. The mains frequency
+ * is the strongest line between mainsMinHz and mainsMaxHz, refined with its harmonics.
+ */
+
+class NoiseSpectrum
+{
+    public:
+        NoiseSpectrum();
+
+        enum State {
+            SPECTRUM_IDLE,
+            SPECTRUM_CAPTURE,  // ScanHead filling the blocks
+            SPECTRUM_PROCESS,  // transforming the blocks
+            SPECTRUM_DONE,
+            SPECTRUM_ABORTED
+        };
+
+        enum Channel {
+            SPECTRUM_RAW,
+            SPECTRUM_FILTERED
+        };
+
+        static const int blockSize = 4096; // 205ms and 4.9Hz bins at 20kHz
+        static const int numBins = blockSize / 2 + 1;
+        static const int maxPeaks = 8;
+
+        struct peak_struct {
+            float hz;
+            float rawPA;      // rms amplitude in the raw current
+            float filteredPA; // rms amplitude after the notch
+        };
+
+        float peakThreshold = 10;  // peak PSD over the noise floor
+        float floorMinHz = 20;
+        float mainsMinHz = 45;
+        float mainsMaxHz = 65;
+        int mainsHarmonics = 5;    // harmonics used to refine the mains frequency
+
+        void begin(ScanHead *scanhead, int blocks);
+        int update();
+        void abort();
+        bool finished();
+
+        float binHz();
+        float psd(int channel, int bin);
+        float noiseFloor(int channel);
+        int findPeaks(peak_struct *peaks, int maxPeaks);
+        float estimateMains();
+
+        void printReport();
+        void printPsd();
+
+        int state;
+        int numBlocks;
+        int blocksDone;
+
+    private:
+        ScanHead *scanhead;
+        RealFFT fft;
+
+        float raw[blockSize];      // TIA LSB, then the transform
+        float filtered[blockSize];
+        float sumPsd[2][numBins];  // summed over the blocks, TIA LSB^2/Hz
+
+        int channel;               // block being transformed
+
+        const float pAPerTiaLSB = 3.3 / 65536.0 * 10000.0; // as tiaToCurrent
+
+        void startTransform(float *block);
+        void accumulate(const float *spectrum, float *sum);
+        float floorPsd(int channel);
+        float interpolatePeak(int channel, int bin, float floor);
+        float linePower(int channel, int bin, float floor);
+};
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * regions.cpp
+ * Picks regions of interest in a coarse survey frame for automatic zoom scans
+ */
+
+#ifndef regions_h
+#define regions_h
+
+#include <math.h>
+#include <stdlib.h>
+#include "scanchannels.h"
+
+#define max_regions 8
+
+struct Region {
+    int col;     // block origin in frame pixels
+    int row;
+    float score;
+};
+
+class RegionFinder
+{
+    private:
+        const int *frame;
+        int numChannels;
+        int channelOffset;
+        int width;
+
+        float planeZ;
+        float slopeCol;
+        float slopeRow;
+        float meanCol;
+        float meanRow;
+
+        int value(int col, int row) {
+            return framePixel(frame, numChannels, channelOffset, width, col, row);
+        }
+
+        /*!
+         * \brief scores one block against the frame plane
+         */
+        float blockScore(int col0, int row0, int blockPixels, int criterion) {
+            double sum = 0, sumSq = 0;
+            float lo = 0, hi = 0;
+            for (int row = row0; row < row0 + blockPixels; row++) {
+                for (int col = col0; col < col0 + blockPixels; col++) {
+                    float d = value(col, row) - planeZ - slopeCol * (col - meanCol) - slopeRow * (row - meanRow);
+                    sum += d;
+                    sumSq += d * d;
+                    if ((row == row0 && col == col0) || d < lo) lo = d;
+                    if ((row == row0 && col == col0) || d > hi) hi = d;
+                }
+            }
+
+            int n = blockPixels * blockPixels;
+            if (criterion == ROI_CONTRAST) return hi - lo;
+            return sqrt(fmax(sumSq / n - (sum / n) * (sum / n), 0.0));
+        }
+
+    public:
+        enum Criterion {
+            ROI_ROUGHNESS, // rms deviation from the frame plane within the block
+            ROI_CONTRAST   // peak to peak deviation from the frame plane within the block
+        };
+
+        /*!
+         * \brief scores square blocks of a frame and returns the highest scoring non-overlapping ones
+         * @param *frame packed frame as recorded by ScanJob, serpentine line order
+         * @param numChannels ints per packed pixel
+         * @param channelOffset position of the scored channel within a packed pixel
+         * @param width pixels per line
+         * @param height number of lines
+         * @param blockPixels block side in pixels, clipped to the frame
+         * @param criterion Criterion
+         * @param *regions array to store up to maxRegions regions, highest score first
+         * @param maxRegions at most max_regions
+         * @return number of regions stored
+         */
+        int find(const int *frame, int numChannels, int channelOffset, int width, int height,
+                int blockPixels, int criterion, Region *regions, int maxRegions) {
+            this->frame = frame;
+            this->numChannels = numChannels;
+            this->channelOffset = channelOffset;
+            this->width = width;
+
+            if (width < 2 || height < 2) return 0;
+            if (blockPixels > width) blockPixels = width;
+            if (blockPixels > height) blockPixels = height;
+            if (blockPixels < 2) blockPixels = 2;
+            if (maxRegions > max_regions) maxRegions = max_regions;
+
+            // frame plane by least squares, so tilt does not count as roughness
+            meanCol = (width - 1) / 2.0;
+            meanRow = (height - 1) / 2.0;
+            double sumZ = 0, sumColZ = 0, sumRowZ = 0, sumColCol = 0, sumRowRow = 0;
+            for (int row = 0; row < height; row++) {
+                for (int col = 0; col < width; col++) {
+                    float z = value(col, row);
+                    sumZ += z;
+                    sumColZ += (col - meanCol) * z;
+                    sumRowZ += (row - meanRow) * z;
+                    sumColCol += (col - meanCol) * (col - meanCol);
+                    sumRowRow += (row - meanRow) * (row - meanRow);
+                }
+            }
+            planeZ = sumZ / (width * height);
+            slopeCol = sumColZ / sumColCol;
+            slopeRow = sumRowZ / sumRowRow;
+
+            // windows on a half block stride, so a feature straddling a tile edge still gets a window around it.
+            // Greedy: each pass takes the best window not overlapping one already taken
+            int stride = blockPixels / 2;
+            int numRegions = 0;
+            while (numRegions < maxRegions) {
+                Region best = {0, 0, -1};
+                for (int row0 = 0; row0 + blockPixels <= height; row0 += stride) {
+                    for (int col0 = 0; col0 + blockPixels <= width; col0 += stride) {
+                        bool overlaps = false;
+                        for (int i = 0; i < numRegions; i++) {
+                            if (abs(col0 - regions[i].col) < blockPixels && abs(row0 - regions[i].row) < blockPixels) overlaps = true;
+                        }
+                        if (overlaps) continue;
+
+                        float score = blockScore(col0, row0, blockPixels, criterion);
+                        if (score > best.score) {
+                            best.col = col0;
+                            best.row = row0;
+                            best.score = score;
+                        }
+                    }
+                }
+                if (best.score < 0) break;
+                regions[numRegions++] = best;
+            }
+
+            return numRegions;
+        }
+};
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * rfft.cpp
+ * In-place real FFT, run one pass at a time so it can share the loop with the control tasks
+ */
+
+#ifndef rfft_h
+#define rfft_h
+
+#include <math.h>
+
+/*
+ * A size point real FFT computed as a size/2 point complex FFT of the even and odd samples, followed by a split
+ * pass, as CMSIS-DSP's arm_rfft_fast_f32 does. The output packing is the same too: data[0] is the DC term,
+ * data[1] the Nyquist term, then the real and imaginary parts of bins 1 to size/2 - 1.
+ *
+ * step() does one pass over the data: the bit reversal, one radix-2 stage, or the split. Twiddles come from a
+ * double precision recurrence at every stage instead of a table, which keeps a 4096 point transform in the
+ * data buffer alone.
+ */
+
+class RealFFT
+{
+    private:
+        float *data;
+        int size;
+        int halfSize;   // complex points
+        int span;       // butterfly span of the next stage, halfSize once the stages are done
+        int pass;       // 0: bit reversal, 1: stages, 2: split, 3: done
+
+        void bitReverse() {
+            for (int i = 1, j = 0; i < halfSize; i++) {
+                int bit = halfSize >> 1;
+                for (; j & bit; bit >>= 1) j ^= bit;
+                j ^= bit;
+                if (i < j) {
+                    float re = data[2 * i];
+                    float im = data[2 * i + 1];
+                    data[2 * i] = data[2 * j];
+                    data[2 * i + 1] = data[2 * j + 1];
+                    data[2 * j] = re;
+                    data[2 * j + 1] = im;
+                }
+            }
+        }
+
+        void stage() {
+            // butterflies of span span, twiddle exp(-i pi k / span)
+            double stepRe = cos(M_PI / span);
+            double stepIm = -sin(M_PI / span);
+            double wRe = 1;
+            double wIm = 0;
+
+            for (int k = 0; k < span; k++) {
+                float fwRe = wRe;
+                float fwIm = wIm;
+                for (int i = k; i < halfSize; i += 2 * span) {
+                    float *a = data + 2 * i;
+                    float *b = data + 2 * (i + span);
+                    float tRe = b[0] * fwRe - b[1] * fwIm;
+                    float tIm = b[0] * fwIm + b[1] * fwRe;
+                    b[0] = a[0] - tRe;
+                    b[1] = a[1] - tIm;
+                    a[0] += tRe;
+                    a[1] += tIm;
+                }
+                double nextRe = wRe * stepRe - wIm * stepIm;
+                wIm = wRe * stepIm + wIm * stepRe;
+                wRe = nextRe;
+            }
+            span *= 2;
+        }
+
+        void split() {
+            // X[k] = E[k] + W^k O[k] and X[N/2 - k] = conj(E[k] - W^k O[k]), W = exp(-2 pi i / N)
+            float re0 = data[0];
+            float im0 = data[1];
+            data[0] = re0 + im0;
+            data[1] = re0 - im0;
+
+            double stepRe = cos(2 * M_PI / size);
+            double stepIm = -sin(2 * M_PI / size);
+            double wRe = stepRe;
+            double wIm = stepIm;
+
+            for (int k = 1; k < halfSize / 2; k++) {
+                float *a = data + 2 * k;
+                float *b = data + 2 * (halfSize - k);
+                float eRe = 0.5f * (a[0] + b[0]);
+                float eIm = 0.5f * (a[1] - b[1]);
+                float oRe = 0.5f * (a[1] + b[1]);
+                float oIm = -0.5f * (a[0] - b[0]);
+                float tRe = oRe * (float) wRe - oIm * (float) wIm;
+                float tIm = oRe * (float) wIm + oIm * (float) wRe;
+                a[0] = eRe + tRe;
+                a[1] = eIm + tIm;
+                b[0] = eRe - tRe;
+                b[1] = -(eIm - tIm);
+
+                double nextRe = wRe * stepRe - wIm * stepIm;
+                wIm = wRe * stepIm + wIm * stepRe;
+                wRe = nextRe;
+            }
+
+            // the middle bin pairs with itself
+            data[halfSize + 1] = -data[halfSize + 1];
+        }
+
+    public:
+        /*!
+         * \brief starts a transform
+         * @param *data size real samples, replaced by the packed spectrum
+         * @param size transform length, a power of two of at least 4
+         */
+        void begin(float *data, int size) {
+            this->data = data;
+            this->size = size;
+            halfSize = size / 2;
+            span = 1;
+            pass = 0;
+        }
+
+        /*!
+         * \brief runs the next pass of the transform
+         * @return true once the transform is complete
+         */
+        bool step() {
+            if (pass == 0) {
+                bitReverse();
+                pass = 1;
+            }
+            else if (pass == 1) {
+                stage();
+                if (span >= halfSize) pass = 2;
+            }
+            else if (pass == 2) {
+                split();
+                pass = 3;
+            }
+            return pass == 3;
+        }
+
+        bool done() { return pass == 3; }
+
+        /*!
+         * \brief runs a whole transform at once
+         */
+        void transform(float *data, int size) {
+            begin(data, size);
+            while (!step()) ;
+        }
+};
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * scanchannels.h
+ * Per-pixel acquisition channel definitions shared by the scan head and scan stream
+ */
+
+#ifndef scanchannels_h
+#define scanchannels_h
+
+// Channels recorded at each scan pixel. OR together to select a channel set.
+// Packed pixel data holds only the selected channels, in bit order.
+enum ScanChannel {
+    CH_XPOS        = 1 << 0, // actual x piezo position, LSB
+    CH_YPOS        = 1 << 1, // actual y piezo position, LSB
+    CH_ZPOS        = 1 << 2, // z piezo position, LSB
+    CH_ZERR        = 1 << 3, // mean Z feedback error over the pixel, pA
+    CH_CURRENT     = 1 << 4, // mean filtered current over the pixel, pA
+    CH_CURRENT_RAW = 1 << 5, // mean unfiltered current over the pixel, pA
+    CH_CURRENT_STD = 1 << 6, // standard deviation of filtered current over the pixel, pA
+    CH_NUM_SAMPLES = 1 << 7, // number of TIA samples integrated into the pixel
+    CH_BIAS        = 1 << 8, // sample bias, mV
+    CH_DIDV        = 1 << 9, // lock-in dI/dV in phase with the bias modulation, pS
+    CH_DIDV_Q      = 1 << 10 // lock-in quadrature output, pS
+};
+
+const int numScanChannels = 11;
+
+// matches the original step,x,y,z,current scan output
+const int defaultScanChannels = CH_XPOS | CH_YPOS | CH_ZPOS | CH_CURRENT;
+
+const char * const scanChannelNames[numScanChannels] = {
+    "x", "y", "z", "zerr", "current", "currentraw", "currentstd", "samples", "bias",
+    "didv", "didvq"
+};
+
+/*!
+ * \brief counts the channels selected in a channel set
+ * @param channels OR of ScanChannel values
+ * @return number of ints per packed pixel
+ */
+inline int channelCount(int channels) {
+    int count = 0;
+    for (int ch = 0; ch < numScanChannels; ch++) {
+        if (channels & (1 << ch)) count += 1;
+    }
+    return count;
+}
+
+/*!
+ * \brief picks the channel frames are analysed and previewed on: Z if recorded, else the current, else the first
+ * @param channels OR of ScanChannel values
+ * @return position of the channel within a packed pixel
+ */
+inline int imageChannelOffset(int channels) {
+    int channel = (channels & CH_ZPOS) ? CH_ZPOS : CH_CURRENT;
+    if (!(channels & channel)) return 0;
+    return channelCount(channels & (channel - 1));
+}
+
+/*!
+ * \brief reads one channel of a pixel from a frame recorded by ScanJob, undoing the serpentine line order
+ * @param *frame packed frame
+ * @param numChannels ints per packed pixel
+ * @param channelOffset position of the channel within a packed pixel
+ * @param width pixels per line
+ * @param col pixel along the line, from the frame origin
+ * @param row line
+ * @return channel value
+ */
+inline int framePixel(const int *frame, int numChannels, int channelOffset, int width, int col, int row) {
+    int index = row * width + (row % 2 == 0 ? col : width - 1 - col);
+    return frame[index * numChannels + channelOffset];
+}
+
+#endif
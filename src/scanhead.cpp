@@ -7,48 +7,41 @@
 
 #include "Arduino.h"
 #include "scanhead.h"
+#include "scanjob.h"
 #include <CircularBuffer.h>
 
-#include "SPI.h"
 
 
-
-ScanHead::ScanHead():
+template<class Board>
+BasicScanHead<Board>::BasicScanHead():
+    tiafilter(),
     stepper0(60, stepper0_pins.A, stepper0_pins.C, stepper0_pins.B, stepper0_pins.D),
     stepper1(60, stepper1_pins.A, stepper1_pins.C, stepper1_pins.B, stepper1_pins.D),
-    stepper2(60, stepper2_pins.A, stepper2_pins.C, stepper2_pins.B, stepper2_pins.D),
-    tiafilter()
+    stepper2(60, stepper2_pins.A, stepper2_pins.C, stepper2_pins.B, stepper2_pins.D)
 
 {
     // Setting up relevant pins
 
     // TIA
-    pinMode(tia.cs, OUTPUT);
-    pinMode(tia.din, OUTPUT);
-    digitalWrite(tia.din, HIGH);
-    SPI1.setMISO(tia.miso);
-    SPI1.begin();
-    SPI1.beginTransaction(SPISettings(300000, MSBFIRST, SPI_MODE3));
+    Board::TiaBus::begin();
     delay(10);
 
     // Piezo
-    pinMode(piezo.cs, OUTPUT);
-    SPI.begin();
-    SPI.beginTransaction(SPISettings(1000000, MSBFIRST, SPI_MODE1));
+    Board::PiezoBus::begin();
     // enabling all outputs
-    digitalWrite(piezo.cs, LOW);
-    SPI.transfer(0b00000100);
-    SPI.transfer(0b00000000);
-    SPI.transfer(0b00000000);
-    SPI.transfer(0b11111111);
-    digitalWrite(piezo.cs, HIGH);
+    Board::PiezoBus::select();
+    Board::PiezoBus::transfer(0b00000100);
+    Board::PiezoBus::transfer(0b00000000);
+    Board::PiezoBus::transfer(0b00000000);
+    Board::PiezoBus::transfer(0b11111111);
+    Board::PiezoBus::deselect();
     // setting int reference
-    digitalWrite(piezo.cs, LOW);
-    SPI.transfer(0b00001000);
-    SPI.transfer(0b00000000);
-    SPI.transfer(0b00000000);
-    SPI.transfer(0b00000001);
-    digitalWrite(piezo.cs, HIGH);
+    Board::PiezoBus::select();
+    Board::PiezoBus::transfer(0b00001000);
+    Board::PiezoBus::transfer(0b00000000);
+    Board::PiezoBus::transfer(0b00000000);
+    Board::PiezoBus::transfer(0b00000001);
+    Board::PiezoBus::deselect();
     delay(1);
 
     // Setting local variables
@@ -56,9 +49,25 @@ ScanHead::ScanHead():
     ypos = 0;
     zpos = 0;
     zposStepper = 0;
+    zStitchOffset = 0;
+    recentering.stepperSteps = 0;
+    recentering.settleCycles = 0;
+    approach.phase = APPROACH_RETRACT;
+    approach.stepperSteps = 0;
+    setpoint = 500; // 500pA, until approached or set over serial
     current = 0;
     currentSum = 0;
     numCurrentSamples = 0;
+    currentLogSum = 0;
+    currentLogSumRaw = 0;
+    currentLogSumSq = 0;
+    numCurrentLogSamples = 0;
+    zErrLogSum = 0;
+    numZErrLogSamples = 0;
+    sweep.active = false;
+    sweep.point = 0;
+    capture.active = false;
+    for (int ch = 0; ch < 8; ch++) piezoOut[ch] = 0;
 
     // Setting piezo to zero
     if (enableSerial) {
@@ -69,13 +78,14 @@ ScanHead::ScanHead():
     }
 
     // Setting sample piezo
-    setPiezo(piezo.samplePad, 37500); // pad to about -0.5V (empirical)
+    setBias(-500);
 
 
     delay(1);
 }
 
-void ScanHead::calibrateZeroCurrent() {
+template<class Board>
+void BasicScanHead<Board>::calibrateZeroCurrent() {
     // clearing initial current readout
     current = fetchCurrent();
 
@@ -90,7 +100,19 @@ void ScanHead::calibrateZeroCurrent() {
 
 
 
-int ScanHead::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
+template<class Board>
+void BasicScanHead<Board>::waitControlPeriod() {
+    /*!
+     * \brief waits until controlPeriodUs has passed since the last setPositionStep cycle began, so every cycle of a
+     *        blocking caller integrates a full window of current samples. This is blocking! Scheduled callers are
+     *        paced by the trajectory task's period instead
+     */
+
+    while (sinceControlStep < (unsigned long) controlPeriodUs) ;
+}
+
+template<class Board>
+int BasicScanHead<Board>::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
     /*!
      * \brief Provides PID control over scan head position via piezos. Call until expected return code. Will retract steppers on overcurrent
      * @param xpos_set Desired X position: integer from -32768 to 32768
@@ -110,11 +132,27 @@ int ScanHead::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
 
     status = 0;
 
+    // a trace records the call as it is made, and the fetch of the currents it acts on after the wait
+    if (trace.active) {
+        noInterrupts();
+        trace.control(micros(), xpos_set, ypos_set, zcurr_set);
+        interrupts();
+    }
+
+    // the cycle's integration window ends here. Blocking callers pace themselves with waitControlPeriod()
+    sinceControlStep = 0;
+
     current = fetchCurrent();
 
     float  xerr = (float) xpos_set-xpos;
     float  yerr = (float) ypos_set-ypos;
-    float  zerr = (float) zcurr_set-current;
+    // Z feedback acts on the estimated current when enabled, logging and overcurrent checks on the measurement.
+    // The estimator takes the unfiltered current: the narrow mains notch rings for hundreds of milliseconds after
+    // every current step, which is correlated noise a white noise model cannot account for
+    float zCurrent = current;
+    if (zEstimation) zCurrent = zEstimator.update(currentRaw, zLastStep);
+
+    float  zerr = (float) zcurr_set-zCurrent;
 
     float xDerErr = xerr-xPrevErr;
     float yDerErr = yerr-yPrevErr;
@@ -128,6 +166,12 @@ int ScanHead::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
     yPrevErr = yerr;
     zPrevErr = zerr;
 
+    // logging Z error for per-pixel acquisition, only meaningful under height control
+    if (zcurr_set >= 0) {
+        zErrLogSum += zerr;
+        numZErrLogSamples += 1;
+    }
+
     int xStepIncrement = (int) (xerr*pidTransverseP + xIntErr*pidTransverseI + xDerErr*pidTransverseD);
     int yStepIncrement = (int) (yerr*pidTransverseP + yIntErr*pidTransverseI + yDerErr*pidTransverseD);
     int zStepIncrement = (int) (zerr*pidZP + zIntErr*pidZI + zDerErr*pidZD);
@@ -170,6 +214,17 @@ int ScanHead::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
 
     if (abs(xStepIncrement) > maxTransverseStep) xStepIncrement = maxTransverseStep * (xStepIncrement/abs(xStepIncrement));
     if (abs(yStepIncrement) > maxTransverseStep) yStepIncrement = maxTransverseStep * (yStepIncrement/abs(yStepIncrement));
+
+    // feed-forward of the predicted height change over this cycle's lateral move
+    if (zFeedForward != 0 && zcurr_set >= 0) {
+        bool useLine = zFeedForward == 2;
+        float zPredicted = zPredictor.predict(xpos + xStepIncrement, ypos + yStepIncrement, useLine)
+                         - zPredictor.predict(xpos, ypos, useLine) + zFeedForwardRemainder;
+        int zFeedForwardStep = (int) zPredicted;
+        zFeedForwardRemainder = zPredicted - zFeedForwardStep;
+        zStepIncrement += zFeedForwardStep;
+    }
+
     if (abs(zStepIncrement) > maxZStep) zStepIncrement = maxZStep * (zStepIncrement/abs(zStepIncrement));
 
     //Serial.print("xStepIncrement ");
@@ -189,6 +244,7 @@ int ScanHead::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
     xpos += xStepIncrement;
     ypos += yStepIncrement;
     zpos += zStepIncrement;
+    zLastStep = zStepIncrement;
 
     //Serial.println(zpos);
 
@@ -202,10 +258,24 @@ int ScanHead::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
     //Serial.println(zpos);
 
 
-    int chX_P = maxPiezo/2 - zpos + xpos;
-    int chX_N = maxPiezo/2 - zpos - xpos;
-    int chY_P = maxPiezo/2 - zpos + ypos;
-    int chY_N = maxPiezo/2 - zpos - ypos;
+    int xcmd = xpos;
+    int ycmd = ypos;
+    int zcmd = zpos;
+    if (driftCorrection) {
+        unsigned long now = millis();
+        xcmd += (int) drift.offsetX(now);
+        ycmd += (int) drift.offsetY(now);
+        zcmd += (int) drift.offsetZ(now);
+    }
+    if (lateralCompensation) {
+        xcmd = (int) xComp.compensate(xcmd);
+        ycmd = (int) yComp.compensate(ycmd);
+    }
+
+    int chX_P = maxPiezo/2 - zcmd + xcmd;
+    int chX_N = maxPiezo/2 - zcmd - xcmd;
+    int chY_P = maxPiezo/2 - zcmd + ycmd;
+    int chY_N = maxPiezo/2 - zcmd - ycmd;
 
     //Serial.print("chX_P ");
     //Serial.println(chX_P);
@@ -258,12 +328,10 @@ int ScanHead::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
 
     // writing piezos
 
-    setPiezo(piezo.chX_P, chX_P);
-    setPiezo(piezo.chX_N, chX_N);
-    setPiezo(piezo.chY_P, chY_P);
-    setPiezo(piezo.chY_N, chY_N);
-
-    delay(1);
+    setPiezoShared(piezo.chX_P, chX_P);
+    setPiezoShared(piezo.chX_N, chX_N);
+    setPiezoShared(piezo.chY_P, chY_P);
+    setPiezoShared(piezo.chY_N, chY_N);
 
     if (exceeded_bounds == true) {
         Serial.println("exceeded bounds!");
@@ -280,7 +348,666 @@ int ScanHead::setPositionStep(int xpos_set, int ypos_set, int zcurr_set) {
 
 }
 
-void ScanHead::testScanHeadPosition(int numsteps, int stepsize) {
+template<class Board>
+bool BasicScanHead<Board>::zNearLimit(int lateralExtent) {
+    /*!
+     * \brief checks whether the current Z position leaves less than zRangeMargin of piezo headroom
+     * @param lateralExtent largest |x| or |y| the upcoming motion will reach, in piezo LSBs
+     * @return true if Z should be recentered before continuing
+     */
+
+    return abs(zpos) + lateralExtent > maxPiezo/2 - zRangeMargin;
+}
+
+template<class Board>
+int BasicScanHead<Board>::recenterZ(int zcurr_set) {
+    /*!
+     * \brief moves the steppers under Z feedback until the piezo returns near the center of its range. This is
+     *        blocking! Scheduled callers run recenterZStep() once per control cycle instead
+     * @param zcurr_set Z current setpoint in pA to hold while the steppers move
+     * @return number of stepper steps taken, negative if zRecenterTarget could not be reached
+     */
+
+    beginRecenterZ();
+    int recenterStatus = 0;
+    while (recenterStatus == 0) {
+        waitControlPeriod();
+        recenterStatus = recenterZStep(zcurr_set);
+    }
+
+    if (recenterStatus < 0) return -recentering.stepperSteps;
+    return recentering.stepperSteps;
+}
+
+template<class Board>
+void BasicScanHead<Board>::beginRecenterZ() {
+    /*!
+     * \brief starts recentering Z, see recenterZStep()
+     */
+
+    recentering.stepperSteps = 0;
+    recentering.settleCycles = 0;
+
+    Serial.print("recentering Z from ");
+    Serial.println(zpos);
+}
+
+template<class Board>
+int BasicScanHead<Board>::recenterZStep(int zcurr_set) {
+    /*!
+     * \brief one control cycle of recentering Z: a stepper step when one is due and the piezo is still off center,
+     *        otherwise a feedback cycle holding the position
+     * \detail every change in zpos is accumulated into zStitchOffset as it happens, so recorded Z stays
+     *         continuous however the recentering ends
+     * @param zcurr_set Z current setpoint in pA to hold while the steppers move
+     * @return 0 while recentering, 1 once |zpos| is within zRecenterTarget, -1 if maxRecenterSteps did not get it
+     *         there or feedback failed
+     */
+
+    if (recentering.settleCycles == 0 &&
+            (abs(zpos) <= zRecenterTarget || recentering.stepperSteps >= maxRecenterSteps)) {
+        Serial.print("recentered Z to ");
+        Serial.print(zpos);
+        Serial.print(", stitch offset ");
+        Serial.println(zStitchOffset);
+
+        if (abs(zpos) > zRecenterTarget) return -1;
+        return 1;
+    }
+
+    // piezo extended toward the sample: advance the steppers and let feedback retract, and vice versa
+    if (recentering.settleCycles == 0 && stepStepper((zpos < 0 ? -1 : 1) * recenterStepRate)) {
+        recentering.stepperSteps += 1;
+        recentering.settleCycles = recenterSettleCycles;
+        return 0;
+    }
+
+    int zposBefore = zpos;
+    int moveStatus = setPositionStep(xpos, ypos, zcurr_set);
+    zStitchOffset += zposBefore - zpos;
+    if (recentering.settleCycles > 0) recentering.settleCycles -= 1;
+
+    if (moveStatus == -2) return -1;
+    return 0;
+}
+
+template<class Board>
+void BasicScanHead<Board>::enableLateralCompensation(bool enable) {
+    /*!
+     * \brief turns lateral hysteresis and creep compensation on or off, assuming the piezos have settled
+     * @param enable true to compensate lateral commands
+     */
+
+    xComp.reset(xpos);
+    yComp.reset(ypos);
+    lateralCompensation = enable;
+}
+
+template<class Board>
+int BasicScanHead<Board>::driveStep(int axis, int target, int zcurr_set) {
+    /*!
+     * \brief one control cycle along one lateral axis under Z feedback
+     * @param axis 0 for X, 1 for Y
+     * @param target position in piezo LSBs
+     * @param zcurr_set Z current setpoint, as for setPositionStep
+     * @return as setPositionStep
+     */
+
+    if (axis == 0) return setPositionStep(target, ypos, zcurr_set);
+    return setPositionStep(xpos, target, zcurr_set);
+}
+
+template<class Board>
+int BasicScanHead<Board>::calibrateHysteresis(int axis, int maxAmplitude) {
+    /*!
+     * \brief identifies the lateral hysteresis model of one axis from trace/retrace height profiles. This is blocking!
+     *        Scheduled callers run CAL_HYSTERESIS with calibrationStep() instead
+     * \detail triangle scans of increasing amplitude are run around the current position under Z feedback. The shift
+     *         between trace and retrace profiles at the scan center is the hysteresis loop width at that amplitude.
+     *         Needs an approached tip over a sample with lateral features.
+     * @param axis 0 for X, 1 for Y
+     * @param maxAmplitude largest triangle scan amplitude in piezo LSBs
+     * @return 0 on success, -4 if axis is neither, the scans would leave the lateral range or the smallest is under
+     *         8 pixels, otherwise the failing setPositionStep status
+     */
+
+    return runCalibration(CAL_HYSTERESIS, axis, maxAmplitude, 0);
+}
+
+template<class Board>
+int BasicScanHead<Board>::calibrateCreep(int axis, int stepSize, int holdMs) {
+    /*!
+     * \brief identifies a single creep term of one axis from the drift of a height profile after a step. This is blocking!
+     *        Scheduled callers run CAL_CREEP with calibrationStep() instead
+     * \detail after settling, the axis steps by stepSize and a short profile is traced repeatedly for holdMs. The shift
+     *         of each profile against the last one decays as exp(-t/tau), scaled by gain*stepSize.
+     *         Needs an approached tip over a sample with lateral features.
+     * @param axis 0 for X, 1 for Y
+     * @param stepSize lateral step in piezo LSBs
+     * @param holdMs time to track creep after the step, several creep time constants, at most maxCreepHoldMs
+     * @return 0 on success, -3 if no creep could be fitted, -4 if axis is neither, stepSize is 0, holdMs is out of
+     *         range or the profiles would leave the lateral range, otherwise the failing setPositionStep status
+     */
+
+    return runCalibration(CAL_CREEP, axis, stepSize, holdMs);
+}
+
+template<class Board>
+int BasicScanHead<Board>::calibrateEstimator(int probeLSB) {
+    /*!
+     * \brief measures the current decay length and per-cycle unfiltered current noise used by zEstimator. This is
+     *        blocking! Scheduled callers run CAL_ESTIMATOR with calibrationStep() instead
+     * \detail holds the tip laterally without feedback, steps Z probeLSB below and above the
+     *         current height and fits log current against Z. Tip must be approached and stable
+     * @param probeLSB Z excursion either side of the current height
+     * @return 0 on success, -1 if the current left the usable range, -2 if no decay was measured, -4 if probeLSB is
+     *         not positive
+     */
+
+    return runCalibration(CAL_ESTIMATOR, 0, probeLSB, 0);
+}
+
+template<class Board>
+int BasicScanHead<Board>::runCalibration(int mode, int axis, int size, int holdMs) {
+    int calStatus = beginCalibration(mode, axis, size, holdMs);
+    if (calStatus != 0) return calStatus;
+
+    while (calStatus == 0) {
+        waitControlPeriod();
+        calStatus = calibrationStep();
+    }
+    return calStatus == 1 ? 0 : calStatus;
+}
+
+template<class Board>
+int BasicScanHead<Board>::beginCalibration(int mode, int axis, int size, int holdMs) {
+    /*!
+     * \brief starts a calibration from the current position. See calibrateHysteresis(), calibrateCreep() and
+     *        calibrateEstimator() for what each measures and needs
+     * @param mode CalibrationMode
+     * @param axis 0 for X, 1 for Y, unused by CAL_ESTIMATOR
+     * @param size CAL_HYSTERESIS largest amplitude, CAL_CREEP step or CAL_ESTIMATOR probe excursion, in LSB
+     * @param holdMs CAL_CREEP hold time
+     * @return 0 if begun, -4 if the arguments are out of range, as the blocking calibration returns it
+     */
+
+    calibration.phase = CAL_IDLE;
+    if (mode == CAL_ESTIMATOR) {
+        if (size <= 0) return -4;
+    }
+    else {
+        // the scans span size about the current position, the creep profiles creepProfilePixels about the
+        // position size away, both within the range zpos leaves the lateral channels
+        if (axis != 0 && axis != 1) return -4;
+        int lateralRange = maxPiezo / 2 - abs(zpos);
+        int position = axis == 0 ? xpos : ypos;
+
+        if (mode == CAL_HYSTERESIS) {
+            calibration.pixelStep = size / maxCalibrationPixels + 1;
+            if (size <= 0 || abs(position) + size / 2 > lateralRange) return -4;
+            if (size * 2 / num_play_operators / calibration.pixelStep < 8) return -4;
+        }
+        else {
+            if (size == 0 || abs(size) > maxPiezo || holdMs <= 0 || holdMs > maxCreepHoldMs) return -4;
+            if (abs(position + size) + creepProfilePixels * creepProfileStep / 2 > lateralRange) return -4;
+        }
+    }
+
+    calibration.mode = mode;
+    calibration.axis = axis;
+    calibration.size = size;
+    calibration.holdMs = holdMs;
+    calibration.status = 1;
+    calibration.origin = axis == 0 ? xpos : ypos;
+
+    if (mode == CAL_HYSTERESIS) {
+        Serial.println("Calibrating hysteresis");
+        Serial.println("amplitude,loopwidth");
+
+        calibration.level = 2;
+        beginAmplitude();
+        calibration.phase = CAL_MEASURE;
+    }
+    else if (mode == CAL_CREEP) {
+        Serial.println("Calibrating creep");
+
+        calibration.start = calibration.origin + size - creepProfilePixels * creepProfileStep / 2;
+        calibration.numSamples = 0;
+        calibration.pass = 0;
+        calibration.phaseStartUs = micros();
+        calibration.phase = CAL_SETTLE;
+    }
+    else {
+        calibration.zStart = zpos;
+        calibration.level = 0;
+        beginHeight();
+        calibration.phase = CAL_MEASURE;
+    }
+
+    if (mode != CAL_ESTIMATOR) {
+        calibration.compensationWas = lateralCompensation;
+        lateralCompensation = false;
+    }
+    return 0;
+}
+
+template<class Board>
+int BasicScanHead<Board>::calibrationStep() {
+    /*!
+     * \brief one control cycle of the calibration begun. The fit runs in the cycle that ends it
+     * @return 0 while calibrating, 1 once the model is updated, otherwise the failure as the blocking calibration
+     *         returns it
+     */
+
+    if (calibration.phase == CAL_IDLE) return -4;
+
+    if (calibration.phase != CAL_RETURN) {
+        if (calibration.mode == CAL_HYSTERESIS) hysteresisStep();
+        else if (calibration.mode == CAL_CREEP) creepStep();
+        else estimatorStep();
+        return 0;
+    }
+
+    if (calibration.mode == CAL_ESTIMATOR) {
+        zpos = calibration.zStart;
+        setPositionStep(xpos, ypos, -1);
+    }
+    // a failing return still ends the calibration
+    else if (driveStep(calibration.axis, calibration.origin, setpoint) == 0) return 0;
+
+    calibration.phase = CAL_IDLE;
+    if (calibration.mode == CAL_HYSTERESIS) return finishHysteresis();
+    if (calibration.mode == CAL_CREEP) return finishCreep();
+    return finishEstimator();
+}
+
+template<class Board>
+void BasicScanHead<Board>::abortCalibration() {
+    /*!
+     * \brief stops the calibration begun where it is, restoring lateral compensation or the starting Z
+     */
+
+    if (calibration.phase == CAL_IDLE) return;
+
+    if (calibration.mode == CAL_ESTIMATOR) zpos = calibration.zStart;
+    else lateralCompensation = calibration.compensationWas;
+    calibration.phase = CAL_IDLE;
+}
+
+template<class Board>
+void BasicScanHead<Board>::failCalibration(int calStatus) {
+    calibration.status = calStatus;
+    calibration.phase = CAL_RETURN;
+}
+
+template<class Board>
+void BasicScanHead<Board>::beginAmplitude() {
+    // a triangle scan of the next amplitude about the origin, from its lower end
+    int amplitude = calibration.size * calibration.level / num_play_operators;
+    calibration.numPixels = amplitude / calibration.pixelStep;
+    calibration.start = calibration.origin - amplitude / 2;
+    calibration.pixel = 0;
+    calibration.forward = true;
+    calibration.pass = 0;
+}
+
+template<class Board>
+void BasicScanHead<Board>::hysteresisStep() {
+    /*!
+     * \brief one cycle toward the next pixel of the triangle scans. The second pass of each amplitude traces the
+     *        periodic loop, the first only sets up the operator memory
+     */
+
+    calibration_struct &c = calibration;
+    int moveStatus = driveStep(c.axis, c.start + c.pixel * c.pixelStep, setpoint);
+    if (moveStatus == 0) return;
+    if (moveStatus != 1) {
+        failCalibration(moveStatus);
+        return;
+    }
+
+    if (c.forward) c.profileFwd[c.pixel] = zpos;
+    else c.profileBwd[c.pixel] = zpos;
+
+    // the retrace starts from the last pixel of the trace
+    if (c.forward && c.pixel < c.numPixels - 1) c.pixel += 1;
+    else if (c.forward) c.forward = false;
+    else if (c.pixel > 0) c.pixel -= 1;
+    else if (++c.pass < 2) c.forward = true;
+    else {
+        int window = c.numPixels / 2;
+        float shift = PiezoCompensator::profileShift(c.profileFwd + c.numPixels / 4, c.profileBwd + c.numPixels / 4,
+                window, window / 3);
+        c.loopWidths[c.level - 2] = fabsf(shift) * c.pixelStep;
+
+        Serial.print(c.size * c.level / num_play_operators);
+        Serial.print(",");
+        Serial.println(c.loopWidths[c.level - 2]);
+
+        if (++c.level > num_play_operators) c.phase = CAL_RETURN;
+        else beginAmplitude();
+    }
+}
+
+template<class Board>
+int BasicScanHead<Board>::finishHysteresis() {
+    if (calibration.status != 1) {
+        Serial.println("Hysteresis calibration failed");
+        lateralCompensation = calibration.compensationWas;
+        return calibration.status;
+    }
+
+    float thresholds[num_play_operators];
+    float weights[num_play_operators];
+    PiezoCompensator::fitHysteresis(calibration.loopWidths, calibration.size, thresholds, weights);
+
+    if (calibration.axis == 0) xComp.setHysteresis(thresholds, weights);
+    else yComp.setHysteresis(thresholds, weights);
+
+    enableLateralCompensation(calibration.compensationWas);
+    printCompensation();
+
+    return 1;
+}
+
+template<class Board>
+void BasicScanHead<Board>::creepStep() {
+    /*!
+     * \brief one cycle of the creep calibration: holding the origin for holdMs, stepping to the profile start, then
+     *        tracing the profile from there until holdMs after the step, keeping geometrically spaced passes
+     */
+
+    calibration_struct &c = calibration;
+
+    if (c.phase == CAL_SETTLE) {
+        setPositionStep(xpos, ypos, setpoint);
+        if (micros() - c.phaseStartUs < (unsigned long) c.holdMs * 1000) return;
+        c.pixel = -1;
+        c.phase = CAL_MEASURE;
+        return;
+    }
+
+    int moveStatus = driveStep(c.axis, c.start + max(c.pixel, 0) * creepProfileStep, setpoint);
+    if (moveStatus == 0) return;
+    if (moveStatus != 1) {
+        failCalibration(moveStatus);
+        return;
+    }
+
+    if (c.pixel >= 0) {
+        c.finalProfile[c.pixel] = zpos;
+        if (++c.pixel == creepProfilePixels) c.pixel = -1;
+        return;
+    }
+
+    // back at the start: the step is made, or a pass is finished
+    if (c.pass == 0) {
+        c.phaseStartUs = micros();
+        c.nextSampleMs = 0;
+    }
+    else {
+        if (c.passStartMs >= c.nextSampleMs && c.numSamples < maxCreepSamples) {
+            for (int p = 0; p < creepProfilePixels; p++) c.profiles[c.numSamples][p] = c.finalProfile[p];
+            c.sampleTimes[c.numSamples] = c.passStartMs;
+            c.numSamples += 1;
+            c.nextSampleMs = (c.passStartMs + 1) * 1.4;
+        }
+        if (micros() - c.phaseStartUs >= (unsigned long) c.holdMs * 1000) {
+            c.phase = CAL_RETURN;
+            return;
+        }
+    }
+
+    c.pass += 1;
+    c.passStartMs = (micros() - c.phaseStartUs) / 1000.0;
+    c.pixel = 0;
+}
+
+template<class Board>
+int BasicScanHead<Board>::finishCreep() {
+    calibration_struct &c = calibration;
+
+    if (c.status != 1) {
+        Serial.println("Creep calibration failed");
+        lateralCompensation = c.compensationWas;
+        return c.status;
+    }
+
+    // log-linear fit of the remaining creep, ignoring the second half where the final profile dominates, and
+    // shifts at the search limit, which are no measurement
+    const int maxShift = creepProfilePixels / 3;
+    float sumT = 0, sumL = 0, sumTT = 0, sumTL = 0;
+    int numFit = 0;
+
+    Serial.println("ms,shift");
+    for (int i = 0; i < c.numSamples; i++) {
+        float shift = fabsf(PiezoCompensator::profileShift(c.profiles[i], c.finalProfile, creepProfilePixels, maxShift)) * creepProfileStep;
+
+        Serial.print(c.sampleTimes[i]);
+        Serial.print(",");
+        Serial.println(shift);
+
+        if (shift < creepProfileStep / 4.0 || shift >= maxShift * creepProfileStep || c.sampleTimes[i] > c.holdMs / 2) continue;
+        float l = logf(shift);
+        sumT += c.sampleTimes[i];
+        sumL += l;
+        sumTT += c.sampleTimes[i] * c.sampleTimes[i];
+        sumTL += c.sampleTimes[i] * l;
+        numFit += 1;
+    }
+
+    float denom = numFit * sumTT - sumT * sumT;
+    if (numFit < 3 || denom <= 0) {
+        Serial.println("Creep calibration found no creep");
+        lateralCompensation = c.compensationWas;
+        return -3;
+    }
+
+    float slope = (numFit * sumTL - sumT * sumL) / denom;
+    float intercept = (sumL - slope * sumT) / numFit;
+
+    if (slope >= 0) {
+        Serial.println("Creep calibration found no decay");
+        lateralCompensation = c.compensationWas;
+        return -3;
+    }
+
+    float tauMs = -1.0 / slope;
+    float gain = expf(intercept) / abs(c.size);
+    float tauCycles = tauMs * 1000.0 / controlPeriodUs;
+
+    if (c.axis == 0) xComp.setCreep(0, gain, tauCycles);
+    else yComp.setCreep(0, gain, tauCycles);
+
+    enableLateralCompensation(c.compensationWas);
+    printCompensation();
+
+    return 1;
+}
+
+template<class Board>
+void BasicScanHead<Board>::printCompensation() {
+    /*!
+     * \brief prints the lateral compensation models
+     */
+
+    PiezoCompensator *comps[2] = {&xComp, &yComp};
+    const char *names[2] = {"x", "y"};
+
+    for (int axis = 0; axis < 2; axis++) {
+        Serial.print(names[axis]);
+        Serial.print(" thresholds");
+        for (int i = 0; i < num_play_operators; i++) {
+            Serial.print(" ");
+            Serial.print(comps[axis]->getThresholds()[i]);
+        }
+        Serial.println();
+
+        Serial.print(names[axis]);
+        Serial.print(" weights");
+        for (int i = 0; i < num_play_operators; i++) {
+            Serial.print(" ");
+            Serial.print(comps[axis]->getWeights()[i], 4);
+        }
+        Serial.println();
+
+        for (int k = 0; k < num_creep_terms; k++) {
+            Serial.print(names[axis]);
+            Serial.print(" creep");
+            Serial.print(k);
+            Serial.print(" gain ");
+            Serial.print(comps[axis]->getCreepGain(k), 4);
+            Serial.print(" tau ");
+            Serial.print(comps[axis]->getCreepTau(k));
+            Serial.println(" cycles");
+        }
+    }
+
+    Serial.print("compensation ");
+    Serial.println(lateralCompensation ? "on" : "off");
+}
+
+static void printParam(const char *key, long value) {
+    Serial.print(",");
+    Serial.print(key);
+    Serial.print("=");
+    Serial.print(value);
+}
+
+static void printParam(const char *key, float value, int digits) {
+    Serial.print(",");
+    Serial.print(key);
+    Serial.print("=");
+    Serial.print(value, digits);
+}
+
+template<class Board>
+void BasicScanHead<Board>::writeFrameParams() {
+    /*!
+     * \brief writes the acquisition parameters as a #params record of the scan stream. Call right after
+     *        stream.beginFrame(), before any line or event is queued
+     */
+
+    if (!stream.enabled) return;
+
+    Serial.print("#params");
+    printParam("time", (long) millis());
+    printParam("setpoint", setpoint);
+    printParam("bias", sampleBias);
+    printParam("pidzp", pidZP, 4);
+    printParam("pidzi", pidZI, 4);
+    printParam("pidzd", pidZD, 4);
+    printParam("pidxyp", pidTransverseP, 4);
+    printParam("controlus", controlPeriodUs);
+    printParam("sampleus", samplePeriodUs);
+    printParam("maxzstep", maxZStep);
+    printParam("maxxystep", maxTransverseStep);
+    printParam("zstitch", zStitchOffset);
+    printParam("zstepper", zposStepper);
+    printParam("zmargin", zRangeMargin);
+    printParam("zff", zFeedForward);
+    printParam("zest", zEstimation ? 1 : 0);
+    printParam("decaylsb", zEstimator.decayLSB, 1);
+    printParam("drift", driftCorrection ? 1 : 0);
+    printParam("notchhz", notchHz(), 2);
+    printParam("lockin", lockIn.enabled ? 1 : 0);
+    printParam("lockinhz", lockIn.frequencyHz, 1);
+    printParam("lockinmv", lockIn.amplitudeMV, 1);
+    printParam("lockinus", lockIn.timeConstantUs, 0);
+    printParam("lockindeg", lockIn.phaseDeg, 1);
+    printParam("lateralcomp", lateralCompensation ? 1 : 0);
+
+    // the compensation models, values separated by '/'
+    PiezoCompensator *comps[2] = {&xComp, &yComp};
+    const char *names[2][4] = {{"xthresholds", "xweights", "xcreepgain", "xcreeptau"},
+                               {"ythresholds", "yweights", "ycreepgain", "ycreeptau"}};
+    for (int axis = 0; axis < 2; axis++) {
+        for (int model = 0; model < 4; model++) {
+            int count = model < 2 ? num_play_operators : num_creep_terms;
+            Serial.print(",");
+            Serial.print(names[axis][model]);
+            Serial.print("=");
+            for (int i = 0; i < count; i++) {
+                if (i > 0) Serial.print("/");
+                if (model == 0) Serial.print(comps[axis]->getThresholds()[i]);
+                else if (model == 1) Serial.print(comps[axis]->getWeights()[i], 4);
+                else if (model == 2) Serial.print(comps[axis]->getCreepGain(i), 4);
+                else Serial.print(comps[axis]->getCreepTau(i));
+            }
+        }
+    }
+    Serial.println();
+}
+
+template<class Board>
+void BasicScanHead<Board>::beginHeight() {
+    // the current height, then probe below and above it
+    const int offsets[3] = {0, -calibration.size, calibration.size};
+
+    zpos = calibration.zStart + offsets[calibration.level];
+    zLastStep = 0;
+    calibration.diffSumSq = 0;
+    calibration.prevCurrent = currentRaw;
+    calibration.logSum = 0;
+    calibration.cycle = 0;
+}
+
+template<class Board>
+void BasicScanHead<Board>::estimatorStep() {
+    /*!
+     * \brief one cycle at an estimator calibration height without feedback, settling, then sampling the current
+     */
+
+    calibration_struct &c = calibration;
+    setPositionStep(xpos, ypos, -1);
+
+    if (currentRaw < zEstimator.minCurrentPA || currentRaw > overCurrent) {
+        Serial.println("Estimator calibration left the current range");
+        failCalibration(-1);
+        return;
+    }
+
+    // noise from successive differences, so slow drift without feedback does not count
+    if (c.cycle >= estimatorSettleCycles) {
+        c.diffSumSq += (double) (currentRaw - c.prevCurrent) * (currentRaw - c.prevCurrent);
+        c.logSum += log(currentRaw);
+    }
+    c.prevCurrent = currentRaw;
+    if (++c.cycle < estimatorSettleCycles + estimatorSampleCycles) return;
+
+    c.logCurrent[c.level] = c.logSum / estimatorSampleCycles;
+    if (c.level == 0) c.noisePA = sqrt(c.diffSumSq / (2 * estimatorSampleCycles));
+
+    if (++c.level < 3) beginHeight();
+    else c.phase = CAL_RETURN;
+}
+
+template<class Board>
+int BasicScanHead<Board>::finishEstimator() {
+    calibration_struct &c = calibration;
+    if (c.status != 1) return c.status;
+
+    zEstimator.reset();
+
+    float slope = (c.logCurrent[2] - c.logCurrent[1]) / (2 * c.size);
+    if (slope <= 0) {
+        Serial.println("Estimator calibration found no decay");
+        return -2;
+    }
+
+    zEstimator.decayLSB = 1.0 / slope;
+    zEstimator.measurementNoisePA = c.noisePA;
+
+    Serial.print("Decay length ");
+    Serial.print(zEstimator.decayLSB);
+    Serial.print(" LSB, cycle noise ");
+    Serial.print(c.noisePA);
+    Serial.println("pA");
+    return 1;
+}
+
+template<class Board>
+void BasicScanHead<Board>::testScanHeadPosition(int numsteps, int stepsize) {
     int x_start = -1*numsteps/2;
     int x_end   = numsteps/2;
 
@@ -291,6 +1018,7 @@ void ScanHead::testScanHeadPosition(int numsteps, int stepsize) {
         for (int ypos_set = y_start; ypos_set < y_end; ypos_set += stepsize) {
             int status = 0;
             while (status != 1) {
+                waitControlPeriod();
                 status = setPositionStep(ypos_set, ypos_set, -1); // just both for now, rather than doing a raster
                 //Serial.print("xpos: ");
                 //Serial.print(xpos_set);
@@ -303,7 +1031,8 @@ void ScanHead::testScanHeadPosition(int numsteps, int stepsize) {
     }
 }
 
-void ScanHead::moveStepper(int steps, int stepRate) {
+template<class Board>
+void BasicScanHead<Board>::moveStepper(int steps, int stepRate) {
     /*!
      * \brief Moves steppers steps at stepRate steps per second. This is blocking!
      * @param steps Number of steps to move
@@ -326,86 +1055,566 @@ void ScanHead::moveStepper(int steps, int stepRate) {
 
     if (stepRate < 0) steps *= -1;
 
+    // the estimator does not model the steppers
+    zEstimator.reset();
+
     stepper0.step(steps);
     stepper1.step(steps);
     stepper2.step(steps);
+    sinceStepperStep = 0;
 
     zposStepper += steps;
 
 }
 
-int ScanHead::autoApproachStep(int zcurr_set, CircularBuffer<int,1000> &currentBuf, CircularBuffer<int,1000> &zposBuf) {
+template<class Board>
+bool BasicScanHead<Board>::stepStepper(int stepRate) {
     /*!
-     * \brief Automatically advances Z until surface is detected. Performs one 'step' iteration. Ensure z-position is zeroed before approach
-     * @return 0 if surface not yet detected, 1 otherwise
+     * \brief moves the steppers one step if one is due at stepRate steps per second since the last, so the
+     *        Stepper library never has to wait for it
+     * @param stepRate steps per second, negative to retract
+     * @return true if the steppers stepped
      */
 
-    setpoint = zcurr_set;
+    if (stepRate == 0 || sinceStepperStep < 1000000UL / abs(stepRate)) return false;
 
-    int approachStatus = 0;
+    moveStepper(1, stepRate);
+    return true;
+}
 
-    // first, fully retract the scan head
+template<class Board>
+int BasicScanHead<Board>::autoApproachStep(int zcurr_set, CircularBuffer<int,1000> &currentBuf, CircularBuffer<int,1000> &zposBuf) {
+    /*!
+     * \brief Automatically advances Z until surface is detected. Performs one 'step' iteration. Ensure z-position is
+     *        zeroed before approach. This is blocking! Scheduled callers run approachCycle() once per control cycle
+     * @return 0 if surface not yet detected, 1 otherwise
+     */
 
-    while (approachStatus == 0 or approachStatus == 1) {
-        approachStatus = setPositionStep(0,0,-2);
+    beginApproach(0, 0);
+    int approachStatus = 0;
+    while (approachStatus == 0) {
+        waitControlPeriod();
+        approachStatus = approachCycle(zcurr_set, currentBuf, zposBuf);
     }
 
-    // next, move the stepper a few steps forward but less than the maximum scan range
+    return approachStatus == 1 ? 1 : 0;
+}
+
+template<class Board>
+void BasicScanHead<Board>::beginApproach(int xpos_set, int ypos_set) {
+    /*!
+     * \brief starts an approach iteration from a full retract, see approachCycle()
+     * @param xpos_set X position to approach at
+     * @param ypos_set Y position to approach at
+     */
+
+    approach.phase = APPROACH_RETRACT;
+    approach.stepperSteps = 0;
+    approach.xpos = xpos_set;
+    approach.ypos = ypos_set;
+}
+
+template<class Board>
+int BasicScanHead<Board>::approachCycle(int zcurr_set, CircularBuffer<int,1000> &currentBuf, CircularBuffer<int,1000> &zposBuf) {
+    /*!
+     * \brief one control cycle of the auto approach, whose iterations fully retract the Z piezo, step the steppers
+     *        in by less than its range, then extend it under feedback until current is found
+     * @param zcurr_set Z current setpoint in pA, also made the setpoint
+     * @param currentBuf current at each extending cycle
+     * @param zposBuf zpos at each extending cycle
+     * @return 0 while approaching, 1 once the surface is found, 2 at the end of an iteration that did not find it.
+     *         The next call starts the next iteration
+     */
+
+    setpoint = zcurr_set;
 
-    moveStepper(3, 100);
-    approachStatus = 0;
+    int approachStatus;
 
-    // then, approach with piezos
+    switch (approach.phase) {
 
-    while (approachStatus == 0 or approachStatus == 1) {
-        //Serial.println("loop step");
-        approachStatus = setPositionStep(0,0,zcurr_set);
+    case APPROACH_RETRACT:
+        approachStatus = setPositionStep(approach.xpos, approach.ypos, -2);
+        if (approachStatus != 0 && approachStatus != 1) {
+            approach.stepperSteps = 0;
+            approach.phase = APPROACH_STEPPER;
+        }
+        return 0;
+
+    case APPROACH_STEPPER:
+        if (stepStepper(approachStepRate) && ++approach.stepperSteps >= approachStepperSteps) {
+            approach.phase = APPROACH_EXTEND;
+        }
+        return 0;
+
+    default:
+        approachStatus = setPositionStep(approach.xpos, approach.ypos, zcurr_set);
         currentBuf.push(current); //TODO: exchange with not-raw
         zposBuf.push(zpos);
-        //if (approachStatus != 0 and approachStatus != 1) {
-        //    Serial.print("could not approach, returned status ");
-        //    Serial.println(approachStatus);
-        //    break;
-        //}
         if (current > zcurr_set) {
-           return 1;
+            approach.phase = APPROACH_RETRACT;
+            return 1;
         }
+        if (approachStatus != 0 && approachStatus != 1) {
+            approach.phase = APPROACH_RETRACT;
+            return 2;
+        }
+        return 0;
     }
-
-    return 0;
 }
 
-void ScanHead::sampleCurrent() {
+template<class Board>
+void BasicScanHead<Board>::sampleCurrent() {
     /*!
-     * \brief takes a single current sample for integration
+     * \brief takes a single current sample for integration, or the next step of a spectroscopy sweep
      */
 
+    if (sweep.active) {
+        sweepStep();
+        capture.index = 0;
+        return;
+    }
+
     if (enableSerial) {
-        digitalWrite(tia.cs, LOW);
-        delayMicroseconds(1);
-        digitalWrite(tia.cs, HIGH);
-        delayMicroseconds(1);
-        digitalWrite(tia.cs, LOW);
-        int16_t receivedVal_high = (int16_t) SPI1.transfer(0xff);
-        int16_t receivedVal_low  = (int16_t) SPI1.transfer(0xff);
-        delayMicroseconds(1);
-        digitalWrite(tia.cs, HIGH);
-        delayMicroseconds(1);
-        digitalWrite(tia.cs, LOW);
-        int receivedVal = receivedVal_high << 8 | receivedVal_low;
+        // the modulated bias is written ahead of the reading it is demodulated from
+        if (lockIn.enabled) {
+            int value = biasCode + lockIn.modulation();
+            if (value > maxPiezo) value = maxPiezo;
+            if (value < minPiezo) value = minPiezo;
+            writeDac(piezo.samplePad, value);
+        }
+
+        int receivedVal = readTia();
+        if (lockIn.enabled) lockIn.demodulate(receivedVal);
 
         int filteredVal = (int) tiafilter.filter( (float) receivedVal);
 
         currentSum += filteredVal;
         currentSumRaw += receivedVal;
         currentLogSum += filteredVal;
+        currentLogSumRaw += receivedVal;
+        currentLogSumSq += (int64_t) filteredVal * filteredVal;
+
+        if (capture.active) {
+            capture.raw[capture.index] = receivedVal;
+            capture.filtered[capture.index] = filteredVal;
+            if (++capture.index >= capture.samples) capture.active = false;
+        }
     }
 
     numCurrentSamples += 1;
     numCurrentLogSamples += 1;
 }
 
-int ScanHead::fetchCurrent() {
+template<class Board>
+int BasicScanHead<Board>::readTia() {
+    /*!
+     * \brief reads one raw TIA ADC conversion
+     * @return raw TIA value
+     */
+
+    Board::TiaBus::select();
+    delayMicroseconds(1);
+    Board::TiaBus::deselect();
+    delayMicroseconds(1);
+    Board::TiaBus::select();
+    int16_t receivedVal_high = (int16_t) Board::TiaBus::transfer(0xff);
+    int16_t receivedVal_low  = (int16_t) Board::TiaBus::transfer(0xff);
+    delayMicroseconds(1);
+    Board::TiaBus::deselect();
+    delayMicroseconds(1);
+    Board::TiaBus::select();
+
+    int receivedVal = receivedVal_high << 8 | receivedVal_low;
+    trace.sample(receivedVal);
+    return receivedVal;
+}
+
+template<class Board>
+void BasicScanHead<Board>::setBias(int biasMV) {
+    /*!
+     * \brief sets the sample bias
+     * @param biasMV bias in mV
+     */
+
+    sampleBias = biasMV;
+    biasCode = biasToDac(biasMV);
+    setPiezoShared(piezo.samplePad, biasCode);
+}
+
+template<class Board>
+void BasicScanHead<Board>::enableLockIn(bool enable) {
+    /*!
+     * \brief starts or stops the bias modulation, restarting the demodulation with the current lockIn parameters
+     * @param enable true to modulate and demodulate
+     */
+
+    noInterrupts();
+    lockIn.configure(samplePeriodUs, biasDacPerMV);
+    lockIn.enabled = enable;
+    if (!enable && !sweep.active) writeDac(piezo.samplePad, biasCode);
+    interrupts();
+}
+
+template<class Board>
+float BasicScanHead<Board>::didvPS() {
+    // in-phase output is dI/dV * amplitude / 2, in TIA LSB. pA per mV is 1000 pS
+    return 2 * lockIn.inPhase() * 3.3 / 65536.0 * 10000.0 / lockIn.amplitudeMV * 1000;
+}
+
+template<class Board>
+float BasicScanHead<Board>::didvQuadraturePS() {
+    return 2 * lockIn.quadrature() * 3.3 / 65536.0 * 10000.0 / lockIn.amplitudeMV * 1000;
+}
+
+template<class Board>
+void BasicScanHead<Board>::beginCapture(float *raw, float *filtered, int samples) {
+    /*!
+     * \brief starts capturing a block of TIA readings. Returns at once, the block fills in sampleCurrent
+     * @param *raw samples long array for the raw readings, TIA LSB
+     * @param *filtered samples long array for the notch filtered readings, TIA LSB
+     * @param samples block length
+     */
+
+    noInterrupts();
+    capture.raw = raw;
+    capture.filtered = filtered;
+    capture.samples = samples;
+    capture.index = 0;
+    capture.active = samples > 0;
+    interrupts();
+}
+
+template<class Board>
+bool BasicScanHead<Board>::captureDone() {
+    return !capture.active;
+}
+
+template<class Board>
+void BasicScanHead<Board>::tuneNotch(float mainsHz) {
+    /*!
+     * \brief moves the TIA filter's mains notches, without a step in the filtered current
+     * @param mainsHz mains frequency, Hz
+     */
+
+    noInterrupts();
+    tiafilter.tune(mainsHz);
+    interrupts();
+}
+
+template<class Board>
+void BasicScanHead<Board>::beginTrace(uint16_t *buffer, int capacity) {
+    /*!
+     * \brief snapshots the control state and starts recording a trace. Returns at once, the trace fills as the
+     *        sampling interrupt and the control loop run, until the buffer is full or trace.stop()
+     * @param *buffer capacity halfwords
+     */
+
+    noInterrupts();
+    trace_state_struct &t = traceState;
+    t.startUs = micros();
+    t.xpos = xpos;
+    t.ypos = ypos;
+    t.zpos = zpos;
+    t.zStitchOffset = zStitchOffset;
+    t.current = current;
+    t.currentRaw = currentRaw;
+    t.currentSum = currentSum;
+    t.currentSumRaw = currentSumRaw;
+    t.numCurrentSamples = numCurrentSamples;
+    t.zLastStep = zLastStep;
+    t.xIntErr = xIntErr;
+    t.yIntErr = yIntErr;
+    t.zIntErr = zIntErr;
+    t.xPrevErr = xPrevErr;
+    t.yPrevErr = yPrevErr;
+    t.zPrevErr = zPrevErr;
+    t.zFeedForwardRemainder = zFeedForwardRemainder;
+    t.calibratedNoCurrent = calibratedNoCurrent;
+    t.pidZP = pidZP;
+    t.maxZStep = maxZStep;
+    t.maxTransverseStep = maxTransverseStep;
+    t.controlPeriodUs = controlPeriodUs;
+    t.sampleBias = sampleBias;
+    t.notchHz = notchHz();
+    t.zFeedForward = zFeedForward;
+    t.zEstimation = zEstimation;
+    t.driftCorrection = driftCorrection;
+    t.lateralCompensation = lateralCompensation;
+    t.lockIn = lockIn.enabled;
+    tiafilter.getState(t.filter);
+    trace.begin(buffer, capacity);
+    interrupts();
+}
+
+static void printBits(const char *key, float value) {
+    // floats as their bit pattern in hex, so the replay starts from exactly the recorded state
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    Serial.print(",");
+    Serial.print(key);
+    Serial.print("=");
+    Serial.print((unsigned long) bits, HEX);
+}
+
+template<class Board>
+void BasicScanHead<Board>::printTrace() {
+    /*!
+     * \brief prints the last trace: a #trace header, the #tstate snapshot, the halfwords as #tdata records of
+     *        four hex digits each, then #tend. Stop the trace first
+     */
+
+    static const int wordsPerRecord = 32;
+    static const char hexDigits[] = "0123456789abcdef";
+    const trace_state_struct &t = traceState;
+
+    Serial.print("#trace,");
+    Serial.print(trace.length);
+    Serial.print(",");
+    Serial.print(trace.full ? 1 : 0);
+    Serial.print(",");
+    Serial.println(samplePeriodUs);
+
+    Serial.print("#tstate");
+    printParam("startus", (long) t.startUs);
+    printParam("xpos", t.xpos);
+    printParam("ypos", t.ypos);
+    printParam("zpos", t.zpos);
+    printParam("zstitch", t.zStitchOffset);
+    printParam("current", t.current);
+    printParam("currentraw", t.currentRaw);
+    printParam("sum", t.currentSum);
+    printParam("sumraw", t.currentSumRaw);
+    printParam("samples", t.numCurrentSamples);
+    printParam("zlaststep", t.zLastStep);
+    printBits("xint", t.xIntErr);
+    printBits("yint", t.yIntErr);
+    printBits("zint", t.zIntErr);
+    printBits("xprev", t.xPrevErr);
+    printBits("yprev", t.yPrevErr);
+    printBits("zprev", t.zPrevErr);
+    printBits("zffrem", t.zFeedForwardRemainder);
+    printBits("zerocurrent", t.calibratedNoCurrent);
+    printBits("pidzp", t.pidZP);
+    printParam("maxzstep", t.maxZStep);
+    printParam("maxxystep", t.maxTransverseStep);
+    printParam("controlus", t.controlPeriodUs);
+    printParam("bias", t.sampleBias);
+    printBits("notchhz", t.notchHz);
+    printParam("zff", t.zFeedForward);
+    printParam("zest", t.zEstimation ? 1 : 0);
+    printParam("drift", t.driftCorrection ? 1 : 0);
+    printParam("lateralcomp", t.lateralCompensation ? 1 : 0);
+    printParam("lockin", t.lockIn ? 1 : 0);
+    Serial.print(",filter=");
+    for (int i = 0; i < SOS::stateSize; i++) {
+        uint32_t bits;
+        memcpy(&bits, &t.filter[i], sizeof(bits));
+        if (i > 0) Serial.print("/");
+        Serial.print((unsigned long) bits, HEX);
+    }
+    Serial.println();
+
+    char digits[4 * wordsPerRecord + 1];
+    for (int offset = 0; offset < trace.length; offset += wordsPerRecord) {
+        int n = min(wordsPerRecord, trace.length - offset);
+        for (int i = 0; i < n; i++) {
+            uint16_t word = trace.words[offset + i];
+            for (int d = 0; d < 4; d++) digits[4 * i + d] = hexDigits[(word >> (12 - 4 * d)) & 15];
+        }
+        digits[4 * n] = '\0';
+        Serial.print("#tdata,");
+        Serial.print(offset);
+        Serial.print(",");
+        Serial.println(digits);
+    }
+
+    Serial.print("#tend,");
+    Serial.println(trace.length);
+}
+
+template<class Board>
+void BasicScanHead<Board>::restoreTrace(const trace_state_struct &state) {
+    /*!
+     * \brief puts the control state back as a trace recorded it. Modes whose state is not recorded start afresh
+     * @param state the trace's snapshot
+     */
+
+    noInterrupts();
+    xpos = state.xpos;
+    ypos = state.ypos;
+    zpos = state.zpos;
+    zStitchOffset = state.zStitchOffset;
+    current = state.current;
+    currentRaw = state.currentRaw;
+    currentSum = state.currentSum;
+    currentSumRaw = state.currentSumRaw;
+    numCurrentSamples = state.numCurrentSamples;
+    zLastStep = state.zLastStep;
+    xIntErr = state.xIntErr;
+    yIntErr = state.yIntErr;
+    zIntErr = state.zIntErr;
+    xPrevErr = state.xPrevErr;
+    yPrevErr = state.yPrevErr;
+    zPrevErr = state.zPrevErr;
+    zFeedForwardRemainder = state.zFeedForwardRemainder;
+    calibratedNoCurrent = state.calibratedNoCurrent;
+    pidZP = state.pidZP;
+    maxZStep = state.maxZStep;
+    maxTransverseStep = state.maxTransverseStep;
+    controlPeriodUs = state.controlPeriodUs;
+    zFeedForward = state.zFeedForward;
+    zEstimation = state.zEstimation;
+    driftCorrection = state.driftCorrection;
+    tiafilter.tune(state.notchHz);
+    tiafilter.setState(state.filter);
+    interrupts();
+
+    setBias(state.sampleBias);
+    enableLateralCompensation(state.lateralCompensation);
+    enableLockIn(state.lockIn);
+}
+
+template<class Board>
+int BasicScanHead<Board>::biasToDac(int biasMV) {
+    int value = (int) ((maxPiezo + 1)/2 + biasMV * biasDacPerMV + 0.5);
+    if (value > maxPiezo) value = maxPiezo;
+    if (value < minPiezo) value = minPiezo;
+    return value;
+}
+
+template<class Board>
+int BasicScanHead<Board>::beginSweep(int mode, const int *table, int numPoints, int settleSamples, int averageSamples, int *currents) {
+    /*!
+     * \brief starts a spectroscopy sweep from the position of the last control cycle. Returns at once, the sweep
+     *        runs in sampleCurrent. Z and bias are restored when it ends
+     * @param mode SWEEP_BIAS to step the sample bias through table in mV, SWEEP_Z to step Z offsets in LSB
+     * @param *table sweep values, copied
+     * @param numPoints entries in table, at most maxSweepPoints
+     * @param settleSamples sample periods from each write to the first averaged sample, at least 1
+     * @param averageSamples raw currents averaged at each point
+     * @param *currents numPoints long array for the mean current at every point, pA
+     * @return 0 if started, -1 on invalid arguments or if a sweep is running
+     */
+
+    if (sweep.active || numPoints <= 0 || numPoints > maxSweepPoints || averageSamples <= 0) return -1;
+    if (mode != SWEEP_BIAS && mode != SWEEP_Z) return -1;
+
+    for (int i = 0; i < numPoints; i++) {
+        sweep.values[i] = mode == SWEEP_BIAS ? biasToDac(table[i]) : table[i];
+    }
+    sweep.mode = mode;
+    sweep.numPoints = numPoints;
+    sweep.settleSamples = settleSamples < 1 ? 1 : settleSamples;
+    sweep.averageSamples = averageSamples;
+    sweep.currents = currents;
+    sweep.point = 0;
+    sweep.tick = 0;
+    sweep.sum = 0;
+    for (int i = 0; i < 4; i++) sweep.held[i] = piezoOut[sweepChannels[i]];
+
+    // the control cycle's integration window is cut short by the sweep, so it starts afresh afterwards
+    noInterrupts();
+    currentSum = 0;
+    currentSumRaw = 0;
+    numCurrentSamples = 0;
+    sweep.active = true;
+    interrupts();
+
+    return 0;
+}
+
+template<class Board>
+bool BasicScanHead<Board>::sweepDone() {
+    return !sweep.active;
+}
+
+template<class Board>
+int BasicScanHead<Board>::sweepPoints() {
+    return sweep.point;
+}
+
+template<class Board>
+void BasicScanHead<Board>::abortSweep() {
+    /*!
+     * \brief stops a running sweep and restores Z and bias at once
+     */
+
+    noInterrupts();
+    if (sweep.active) {
+        restoreSweep();
+        sweep.active = false;
+    }
+    interrupts();
+}
+
+template<class Board>
+void BasicScanHead<Board>::sweepStep() {
+    // one sample period of a sweep: write the point, wait out the settling, then average
+    if (sweep.tick == 0) {
+        if (sweep.point >= sweep.numPoints) {
+            restoreSweep();
+            sweep.active = false;
+            return;
+        }
+        writeSweepPoint(sweep.point);
+    }
+    else if (sweep.tick >= sweep.settleSamples) {
+        sweep.sum += readTia();
+    }
+
+    sweep.tick += 1;
+    if (sweep.tick < sweep.settleSamples + sweep.averageSamples) return;
+
+    int pointCurrent = tiaToCurrent(sweep.sum / sweep.averageSamples);
+    sweep.currents[sweep.point] = pointCurrent;
+    sweep.point += 1;
+    sweep.tick = 0;
+    sweep.sum = 0;
+
+    // the supervisor cannot see the current during a sweep, so an overcurrent point ends it here
+    if (pointCurrent > overCurrent) {
+        restoreSweep();
+        sweep.active = false;
+    }
+}
+
+template<class Board>
+void BasicScanHead<Board>::writeSweepPoint(int point) {
+    if (sweep.mode == SWEEP_BIAS) {
+        writeDac(piezo.samplePad, sweep.values[point]);
+        return;
+    }
+
+    // Z moves all four channels together, down toward the sample
+    for (int i = 0; i < 4; i++) {
+        int value = sweep.held[i] - sweep.values[point];
+        if (value > maxPiezo) value = maxPiezo;
+        if (value < minPiezo) value = minPiezo;
+        writeDac(sweepChannels[i], value);
+    }
+}
+
+template<class Board>
+void BasicScanHead<Board>::restoreSweep() {
+    if (sweep.mode == SWEEP_BIAS) {
+        writeDac(piezo.samplePad, biasCode);
+        return;
+    }
+
+    for (int i = 0; i < 4; i++) writeDac(sweepChannels[i], sweep.held[i]);
+}
+
+template<class Board>
+bool BasicScanHead<Board>::isOvercurrent() {
+    /*!
+     * @return true if the last measured current exceeds the overcurrent limit
+     */
+
+    return current > overCurrent;
+}
+
+template<class Board>
+int BasicScanHead<Board>::fetchCurrent() {
     /*!
      * \brief calculates current from integration, clears current integration
      * \detail to provide maximum integration time, call this as infrequently as possible
@@ -413,41 +1622,119 @@ int ScanHead::fetchCurrent() {
      */
 
 
-    current = tiaToCurrent(currentSum / numCurrentSamples);
-    currentRaw = tiaToCurrent(currentSumRaw / numCurrentSamples);
+    // the sums are taken and cleared with the sampling interrupt held off, so no reading falls between them
+    // and a trace places the fetch exactly among the readings
+    noInterrupts();
+    trace.fetch();
+    int sum = currentSum;
+    int sumRaw = currentSumRaw;
+    int samples = numCurrentSamples;
+    currentSum = 0;
+    currentSumRaw = 0;
+    numCurrentSamples = 0;
+    interrupts();
+
+    if (samples == 0) return current;
+
+    current = tiaToCurrent(sum / samples);
+    currentRaw = tiaToCurrent(sumRaw / samples);
     //Serial.print("raw current ");
-    //Serial.println(tiaToCurrent(currentSumRaw / numCurrentSamples));
+    //Serial.println(tiaToCurrent(sumRaw / samples));
 
     //Serial.print("Num samples ");
-    //Serial.println(numCurrentSamples);
+    //Serial.println(samples);
     //Serial.print("Calc current ");
     //Serial.println(current);
 
-    currentSum = 0;
-    currentSumRaw = 0;
-    numCurrentSamples = 0;
-
     return current; // might bias results to lower val due to rounding err, but we're ok with this
 
 }
 
-int ScanHead::fetchCurrentLog() {
+template<class Board>
+int BasicScanHead<Board>::fetchCurrentLog() {
     /*!
      * \brief calculates current from integration since last fetchCurrentLog call, returns value
      * \detail to provide maximum integration time, call this as infrequently as possible
      * @return current in pA
      */
 
-    int currentLog = tiaToCurrent(currentLogSum / numCurrentLogSamples);
-
+    noInterrupts();
+    int sum = currentLogSum;
+    int samples = numCurrentLogSamples;
     currentLogSum = 0;
+    currentLogSumRaw = 0;
+    currentLogSumSq = 0;
     numCurrentLogSamples = 0;
+    interrupts();
+
+    if (samples == 0) return current;
+    int currentLog = tiaToCurrent(sum / samples);
 
     return currentLog; // might bias results to lower val due to rounding err, but we're ok with this
 
 }
 
-int ScanHead::currentToTia(int currentpA) {
+template<class Board>
+int BasicScanHead<Board>::fetchPixel(int *pixel, int channels) {
+    /*!
+     * \brief packs the selected channels for one scan pixel, clears the log integration
+     * \detail all current channels are computed from the same integration window as fetchCurrentLog
+     * @param *pixel Pointer to channelCount(channels) long array to store the packed pixel
+     * @param channels OR of ScanChannel values to record
+     * @return number of ints written
+     */
+
+    // the sums are taken and cleared with the sampling interrupt held off, as in fetchCurrent, so no reading
+    // falls between them and the 64 bit sum of squares is read whole
+    noInterrupts();
+    int sum = currentLogSum;
+    int sumRaw = currentLogSumRaw;
+    int64_t sumSq = currentLogSumSq;
+    int samples = numCurrentLogSamples;
+    float zErrSum = zErrLogSum;
+    int zErrSamples = numZErrLogSamples;
+    currentLogSum = 0;
+    currentLogSumRaw = 0;
+    currentLogSumSq = 0;
+    numCurrentLogSamples = 0;
+    zErrLogSum = 0;
+    numZErrLogSamples = 0;
+    interrupts();
+
+    int numSamples = samples;
+    if (numSamples == 0) numSamples = 1;
+
+    int meanTia = sum / numSamples;
+    int meanTiaRaw = sumRaw / numSamples;
+
+    // variance in TIA LSB^2, scaled to pA by the same factor as tiaToCurrent. n sumSq - sum^2 is exact in 64 bits,
+    // where the difference of the two large float terms would lose most of it
+    int64_t scaledVariance = (int64_t) numSamples * sumSq - (int64_t) sum * sum;
+    if (scaledVariance < 0) scaledVariance = 0;
+    float variance = (float) ((double) scaledVariance / ((double) numSamples * numSamples));
+
+    int zErr = 0;
+    if (zErrSamples > 0) zErr = (int) (zErrSum / zErrSamples);
+
+    int numWritten = 0;
+
+    if (channels & CH_XPOS)        pixel[numWritten++] = xpos;
+    if (channels & CH_YPOS)        pixel[numWritten++] = ypos;
+    if (channels & CH_ZPOS)        pixel[numWritten++] = zpos + zStitchOffset;
+    if (channels & CH_ZERR)        pixel[numWritten++] = zErr;
+    if (channels & CH_CURRENT)     pixel[numWritten++] = tiaToCurrent(meanTia);
+    if (channels & CH_CURRENT_RAW) pixel[numWritten++] = tiaToCurrent(meanTiaRaw);
+    if (channels & CH_CURRENT_STD) pixel[numWritten++] = (int) (sqrtf(variance) * 3.3 / 65536.0 * 10000.0);
+    if (channels & CH_NUM_SAMPLES) pixel[numWritten++] = samples;
+    if (channels & CH_BIAS)        pixel[numWritten++] = sampleBias;
+    if (channels & CH_DIDV)        pixel[numWritten++] = (int) didvPS();
+    if (channels & CH_DIDV_Q)      pixel[numWritten++] = (int) didvQuadraturePS();
+
+    return numWritten;
+}
+
+template<class Board>
+int BasicScanHead<Board>::currentToTia(int currentpA) {
     /*!
      * \brief converts physical current value (in pA) to equivalent TIA reading, assuming 100M TI gain
      * @param current_pa current in pA
@@ -457,7 +1744,8 @@ int ScanHead::currentToTia(int currentpA) {
     return (int) ( 65536.0 / (3.3*10000) * (float) currentpA + calibratedNoCurrent);
 }
 
-int ScanHead::tiaToCurrent(int currentTIA) {
+template<class Board>
+int BasicScanHead<Board>::tiaToCurrent(int currentTIA) {
     /*!
      * \brief converts raw TIA reading to physical current value (in pA), assuming 100M TI gain
      * @param current_tia raw TIA current value
@@ -467,7 +1755,8 @@ int ScanHead::tiaToCurrent(int currentTIA) {
     return (int) ((float)currentTIA) * 3.3 / 65536.0 * 10000.0 - calibratedNoCurrent;
 }
 
-void ScanHead::setPiezo(int channel, int value) {
+template<class Board>
+void BasicScanHead<Board>::setPiezo(int channel, int value) {
     /*!
      * \brief sets piezo channel to raw value
      * @param channel Raw channel (0-7) to set on TIA
@@ -476,30 +1765,64 @@ void ScanHead::setPiezo(int channel, int value) {
 
 
     status = 2;
+    writeDac(channel, value);
+}
+
+template<class Board>
+void BasicScanHead<Board>::packDacFrame(int channel, int value, byte *frame) {
+    /*!
+     * \brief packs a DAC channel write into the bytes sent over SPI: the write and update command, the channel
+     *        address and the 16 bit value, shifted up a nibble
+     * @param *frame dacFrameBytes bytes
+     */
 
     unsigned int dacMSB = highByte(value);
     unsigned int dacLSB = lowByte(value);
 
-    byte command = 0b00000011;
-    byte addrD1  = lowByte(channel) << 4 | dacMSB >> 4;
-    byte addrD2  = dacMSB << 4 | dacLSB >> 4;
-    byte addrD3  = dacLSB << 4;
+    frame[0] = 0b00000011;
+    frame[1] = lowByte(channel) << 4 | dacMSB >> 4;
+    frame[2] = dacMSB << 4 | dacLSB >> 4;
+    frame[3] = dacLSB << 4;
+}
+
+template<class Board>
+void BasicScanHead<Board>::writeDac(int channel, int value) {
+    // the DAC write alone, for the sampling interrupt, which must not touch the scan head status
+    byte frame[dacFrameBytes];
+    packDacFrame(channel, value, frame);
+
+    piezoOut[channel] = value;
+    trace.dac(channel, value);
+
+    Board::PiezoBus::select();
+    for (int i = 0; i < dacFrameBytes; i++) Board::PiezoBus::transfer(frame[i]);
+    Board::PiezoBus::deselect();
 
+}
+
+template<class Board>
+void BasicScanHead<Board>::setPiezoShared(int channel, int value) {
+    /*!
+     * \brief sets a piezo channel from outside the sampling interrupt, which writes the pad DAC while the
+     *        lock-in runs and must not split this write's SPI frame, and records readings while a trace runs
+     */
 
-    digitalWrite(piezo.cs, LOW);
-    SPI.transfer(command);
-    SPI.transfer(addrD1);
-    SPI.transfer(addrD2);
-    SPI.transfer(addrD3);
-    digitalWrite(piezo.cs, HIGH);
+    if (!lockIn.enabled && !trace.active) {
+        setPiezo(channel, value);
+        return;
+    }
 
+    noInterrupts();
+    setPiezo(channel, value);
+    interrupts();
 }
 
-int ScanHead::scanOneAxis(int *currentArr, int *zposArr, int size, int step, bool direction, bool heightControl) {
+template<class Board>
+int BasicScanHead<Board>::scanOneAxis(int *dataArr, int channels, int size, int step, bool direction, bool heightControl) {
     /*!
-     * \brief scans size piezo LSBs across X axis with optional height control. Writes z positions and currents to arrays
-     * @param *currents Pointer to size long array to store currents
-     * @param *zpos Pointer to size long array to store z positions
+     * \brief scans size piezo LSBs across X axis with optional height control. Writes packed pixels to dataArr
+     * @param *dataArr Pointer to (size/step)*channelCount(channels) long array to store packed pixels
+     * @param channels OR of ScanChannel values to record at each pixel
      * @param size number of piezo LSBs to scan over
      * @param direction true to scan in +x, false to scan in -x
      * @param heightControl true if height control enabled, false otherwise
@@ -515,6 +1838,7 @@ int ScanHead::scanOneAxis(int *currentArr, int *zposArr, int size, int step, boo
     if (!heightControl) setCurrent = -1; // no height control if -1 passed to setPositionStep
 
     int numSteps = 0;
+    int numChannels = channelCount(channels);
 
     Serial.println("scanning x-axis");
     Serial.print("Start:");
@@ -524,8 +1848,6 @@ int ScanHead::scanOneAxis(int *currentArr, int *zposArr, int size, int step, boo
     Serial.print("Step:");
     Serial.println(step);
 
-    int currentBuf[size];
-
     elapsedMicros testStart;
 
     //while (xpos != xEnding) {
@@ -536,6 +1858,7 @@ int ScanHead::scanOneAxis(int *currentArr, int *zposArr, int size, int step, boo
         while (setPositionStatus == 0) {
             //Serial.print("Setting position to:");
             //Serial.println(xTarget);
+            waitControlPeriod();
             setPositionStatus = setPositionStep(xTarget, ypos, setCurrent);
             //Serial.println(setPositionStatus);
         }
@@ -551,8 +1874,7 @@ int ScanHead::scanOneAxis(int *currentArr, int *zposArr, int size, int step, boo
         if (numSteps % step == 0) {
             Serial.print("@");
             Serial.println(xTarget);
-            currentArr[numSteps/step] = fetchCurrentLog();
-            zposArr[numSteps/step] = zpos;
+            fetchPixel(dataArr + (numSteps/step) * numChannels, channels);
         }
 
        if (setPositionStatus != 1) {
@@ -580,112 +1902,30 @@ int ScanHead::scanOneAxis(int *currentArr, int *zposArr, int size, int step, boo
 
 }
 
-int ScanHead::scanTwoAxes(int *currentArr, int *zposArr, int *xposArr, int *yposArr, int sizeX, int sizeY, int step, bool heightControl) {
+template<class Board>
+int BasicScanHead<Board>::scanTwoAxes(int *dataArr, int channels, int sizeX, int sizeY, int step, bool heightControl) {
     /*!
-     * \brief two dimensional scan across sizeX and sizeY. Scans over X preferentially. Writes z positions and currents to arrays
-     * @param *currentArr: Pointer to sizeX*sizeY long array to store currents
-     * @param *zposArr: Pointer to sizeX*sizeY long array to store z positions
+     * \brief two dimensional scan across sizeX and sizeY. Scans over X preferentially. Writes packed pixels to dataArr, streaming each completed line
+     * \detail blocking wrapper around ScanJob, failed lines are retried per the default ScanJob policy
+     * @param *dataArr: Pointer to (sizeX/step)*(sizeY/step)*channelCount(channels) long array to store packed pixels
+     * @param channels OR of ScanChannel values to record at each pixel
      * @param sizeX number of piezo LSBs to scan over in X
      * @param sizeY number of piezo LSBs to scan over in y
      * @param heightControl true if height control enabled, false otherwise
+     * @return 0 on success, otherwise the status of the failing line
      */
 
-    int xStart = xpos;
-    int yStart = ypos;
-
-    int xEnd = xStart + sizeX;
-    int yEnd = yStart + sizeY;
-
-    int numStepsExpected = (sizeX * sizeY)/(step*step);
-
-    int setCurrent = setpoint;
-    if (!heightControl) setCurrent = -1; // no height control if -1 passed to setPositionStep
-
-    int numSteps = 0;
-
-    Serial.println("scanning x-axis,y-axis");
-    Serial.print("Start:");
-    Serial.print(xStart);
-    Serial.print(",");
-    Serial.println(yStart);
-    Serial.print("End:");
-    Serial.print(xEnd);
-    Serial.print(",");
-    Serial.println(yEnd);
-
-    bool direction = true;
-
-    for (int yTarget = yStart; yTarget < yEnd; yTarget += step) {
-
-        if (direction) {
-
-            for (int xTarget = xStart; xTarget < xEnd; xTarget += step) {
-                Serial.print(xTarget);
-                Serial.print("|");
-                Serial.println(yTarget);
-                int setPositionStatus = 0;
-                while (setPositionStatus == 0) setPositionStatus = setPositionStep(xTarget, yTarget, setCurrent);
-
-                if (setPositionStatus != 1) {
-                    Serial.println("Scan failed with error");
-                    Serial.println(setPositionStatus);
-                    return setPositionStatus;
-                }
-
-                currentArr[numSteps] = fetchCurrentLog();
-                zposArr[numSteps] = zpos;
-                xposArr[numSteps] = xpos;
-                yposArr[numSteps] = ypos;
-
-                numSteps += 1;
-            }
-        }
-
-        else {
-
-            for (int xTarget = xEnd; xTarget > xStart; xTarget -= step) {
-                Serial.print(xTarget);
-                Serial.print("|");
-                Serial.println(yTarget);
-                int setPositionStatus = 0;
-                while (setPositionStatus == 0) setPositionStatus = setPositionStep(xTarget, yTarget, setCurrent);
-
-                if (setPositionStatus != 1) {
-                    Serial.println("Scan failed with error");
-                    Serial.println(setPositionStatus);
-                    return setPositionStatus;
-                }
-
-                currentArr[numSteps] = fetchCurrentLog();
-                zposArr[numSteps] = zpos;
-                xposArr[numSteps] = xpos;
-                yposArr[numSteps] = ypos;
-
-                numSteps += 1;
-            }
-        }
-
-        direction = !direction;
-
-
-        //while (setPositionStatus == 0) setPositionStatus = setPositionStep(xStarting, ypos, setCurrent); TODO: ???
-        //currentBuf[numSteps] = current;
-
-        //Serial.print("status:");
-        //Serial.println(setPositionStatus);
-
-        //Serial.print("zpos:");
-        //Serial.println(zpos);
+    ScanJob job;
+    job.begin(this, dataArr, channels, sizeX, sizeY, step, heightControl);
 
+    while (!job.finished()) {
+        waitControlPeriod();
+        job.update();
     }
 
-    //Serial.print("time");
-    //Serial.println(testStart);
-
-    //for (int i = 0; i < numSteps; i++) {
-    //    Serial.println(currentBuf[i]);
-    //}
-
-    return 0;
+    return job.result();
 
 }
+
+// the head on the board the firmware is built for, see board.h
+template class BasicScanHead<Board>;
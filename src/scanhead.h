@@ -9,14 +9,29 @@
 
 #include "Arduino.h"
 #include "Stepper.h"
-#include "SPI.h"
+#include <board.h>
 #include <CircularBuffer.h>
 #include "sos.cpp"
+#include "hysteresis.cpp"
+#include "zpredict.cpp"
+#include "kalman.cpp"
+#include "drift.cpp"
+#include "lockin.cpp"
+#include "trace.cpp"
+#include "scanchannels.h"
+#include "scanstream.h"
+#include "scanpreview.cpp"
 
-class ScanHead
+/*
+ * Built on a board traits type (see controlboard.h) for its pins, DAC channel map and SPI buses. The firmware uses
+ * ScanHead, the head on the board selected by board.h, whose members scanhead.cpp instantiates
+ */
+
+template<class Board>
+class BasicScanHead
 {
     public:
-        ScanHead();
+        BasicScanHead();
 
         int current;
         int currentRaw;
@@ -32,89 +47,315 @@ class ScanHead
         int ypos;
         int zpos;
         int zposStepper;
-        int setPositionStep(int xpos_set, int ypos_set, int zcurr_set);
+        int setpoint; // current setpoint in pA, set on approach
+        int zStitchOffset; // accumulated Z offset from stepper recentering, keeps scan Z continuous
+
+        // Z range management: recentre with the steppers at a line boundary once any piezo channel
+        // comes within zRangeMargin LSBs of its limit. Each stepper step must be well inside the margin.
+        int zRangeMargin = 16384;
+        int zRecenterTarget = 4096; // recentering stops once |zpos| is below this
+        bool zNearLimit(int lateralExtent);
+        int recenterZ(int zcurr_set); // blocking
+        void beginRecenterZ();
+        int recenterZStep(int zcurr_set); // one control cycle of recenterZ()
+        int maxTransverseStep = 5; // largest one-cycle piezo step on the x-axis
+        int maxZStep = 100;
+        float pidZP = 0.5; // gain term in PID control for Z axis
+
+        // lateral hysteresis and creep compensation, applied to xpos/ypos before the DAC write
+        PiezoCompensator xComp;
+        PiezoCompensator yComp;
+        bool lateralCompensation = false;
+        void enableLateralCompensation(bool enable);
+        int calibrateHysteresis(int axis, int maxAmplitude); // blocking
+        int calibrateCreep(int axis, int stepSize, int holdMs); // blocking
+        void printCompensation();
+
+        // Z feed-forward: lateral moves also move Z by the predicted change in height, so the
+        // feedback only corrects the residual. ScanJob feeds zPredictor with every pixel.
+        // 0: off, 1: fitted sample plane, 2: plane and previous line profile
+        int zFeedForward = 0;
+        ZPredictor zPredictor;
+
+        // Z feedback on a Kalman estimate of the current instead of the per-cycle mean. The estimate
+        // needs the current decay length, measured by calibrateEstimator with the tip approached
+        bool zEstimation = false;
+        HeightEstimator zEstimator;
+        int calibrateEstimator(int probeLSB); // blocking
+
+        // the calibrations above one control cycle at a time, for the job queue
+        enum CalibrationMode {
+            CAL_HYSTERESIS,
+            CAL_CREEP,
+            CAL_ESTIMATOR
+        };
+        static const int maxCreepHoldMs = 60000; // longest creep calibration hold
+        int beginCalibration(int mode, int axis, int size, int holdMs);
+        int calibrationStep(); // one control cycle of the calibration begun
+        void abortCalibration();
+
+        // sample drift correction: the drift tracked between repeated frames is added to the piezo command,
+        // so xpos, ypos and zpos stay in sample coordinates. JobQueue registers the frames
+        bool driftCorrection = false;
+        DriftTracker drift;
+
+        // sample bias in mV, on the pad DAC channel
+        int sampleBias;
+        void setBias(int biasMV);
+
+        // dI/dV lock-in: the sampling interrupt adds a sine to the sample bias and demodulates every TIA reading.
+        // Recorded as CH_DIDV and CH_DIDV_Q. Paused while a spectroscopy sweep runs
+        LockIn lockIn;
+        void enableLockIn(bool enable); // also applies changed lockIn parameters
+        float didvPS();                 // in-phase dI/dV, pS
+        float didvQuadraturePS();
+
+        // noise spectrum capture: the sampling interrupt copies raw and notch filtered TIA readings, in TIA LSB,
+        // into the caller's blocks. A sweep restarts the block, so every block is contiguous
+        void beginCapture(float *raw, float *filtered, int samples);
+        bool captureDone();
+        void tuneNotch(float mainsHz); // moves the TIA mains notch to the harmonics of mainsHz
+        float notchHz() { return tiafilter.mainsHz; }
+
+        // control loop trace: every raw TIA reading, DAC write, setPositionStep() call and current fetch, in
+        // order, into the caller's buffer (see trace.cpp), after a snapshot of the state they act on. The host
+        // replays a printed trace through this code. Feed-forward, the estimator, drift correction, lateral
+        // compensation and the lock-in are recorded as on or off, their internal state is not
+        struct trace_state_struct {
+            uint32_t startUs;
+            int xpos, ypos, zpos, zStitchOffset;
+            int current, currentRaw;
+            int currentSum, currentSumRaw, numCurrentSamples;
+            int zLastStep;
+            float xIntErr, yIntErr, zIntErr;
+            float xPrevErr, yPrevErr, zPrevErr;
+            float zFeedForwardRemainder;
+            float calibratedNoCurrent;
+            float pidZP;
+            int maxZStep, maxTransverseStep, controlPeriodUs;
+            int sampleBias;
+            float notchHz;
+            int zFeedForward;
+            bool zEstimation, driftCorrection, lateralCompensation, lockIn;
+            float filter[SOS::stateSize];
+        } traceState;
+        TraceRecorder trace;
+        void beginTrace(uint16_t *buffer, int capacity);
+        void printTrace();
+        void restoreTrace(const trace_state_struct &state); // for the host replay, before its first event
+
+        // Spectroscopy sweeps run in sampleCurrent at the full sampling rate, with the feedback held. Each point
+        // writes the sample bias (SWEEP_BIAS) or a Z offset from the held position (SWEEP_Z, larger toward the
+        // sample) from a table, skips settleSamples sample periods and averages averageSamples raw currents.
+        // No control cycle or other DAC write may run until sweepDone()
+        enum SweepMode {
+            SWEEP_BIAS,
+            SWEEP_Z
+        };
+        static const int maxSweepPoints = 512;
+        int beginSweep(int mode, const int *table, int numPoints, int settleSamples, int averageSamples, int *currents);
+        bool sweepDone();
+        int sweepPoints(); // points measured by the last sweep, short of numPoints if it hit overcurrent
+        void abortSweep();
+
+        static const int samplePeriodUs = 50; // current sampling interrupt period, 20kHz
+        int controlPeriodUs = 1000; // time between setPositionStep cycles, sets the current integration window
+        int setPositionStep(int xpos_set, int ypos_set, int zcurr_set); // one control cycle, never waits
+        void waitControlPeriod(); // blocking callers' pacing of setPositionStep
         void moveStepper(int steps, int stepRate);
+        bool stepStepper(int stepRate); // one step if one is due, never waits
         int autoApproachStep(int zcurr_set, CircularBuffer<int,1000> &currentBuf, CircularBuffer<int,1000> &zposBuf);
+        void beginApproach(int xpos_set, int ypos_set);
+        int approachCycle(int zcurr_set, CircularBuffer<int,1000> &currentBuf, CircularBuffer<int,1000> &zposBuf);
         int fetchCurrent();
         int fetchCurrentLog();
+        int fetchPixel(int *pixel, int channels);
         void calibrateZeroCurrent();
+        bool isOvercurrent();
         void sampleCurrent(); // TODO: remove buf
-        int scanTwoAxes(int *currentArr, int *zposArr, int *xposArr, int *yposArr, int sizeX, int sizeY, int step, bool heightcontrol);
-        int scanOneAxis(int *currentArr, int *zposArr, int size, int step, bool direction, bool heightcontrol);
+        int scanTwoAxes(int *dataArr, int channels, int sizeX, int sizeY, int step, bool heightcontrol);
+        int scanOneAxis(int *dataArr, int channels, int size, int step, bool direction, bool heightcontrol);
         void testScanHeadPosition(int numsteps, int stepsize);
 
-    private:
-
-        const bool enableSerial = true; // serial enable for non-setup serial (SPI) ops
+        ScanStream stream;
+        void writeFrameParams(); // the #params record after a frame header, see scanstream.h
+        ScanPreview preview; // fed by ScanJob, drawn by the UI
 
+        // current unit conversions and the DAC's SPI frame, public for the kernel benchmarks (see bench.h)
         int currentToTia(int currentpA);
         int tiaToCurrent(int currentTIA);
+        static const int dacFrameBytes = 4;
+        static void packDacFrame(int channel, int value, byte *frame);
+
+    private:
+
+        const bool enableSerial = true; // serial enable for non-setup serial (SPI) ops
 
         void setPiezo(int channel, int value);
+        void setPiezoShared(int channel, int value);
+        void writeDac(int channel, int value);
+        int readTia();
+        int biasToDac(int biasMV);
+        void sweepStep();
+        void writeSweepPoint(int point);
+        void restoreSweep();
+        int driveStep(int axis, int target, int zcurr_set);
+        int runCalibration(int mode, int axis, int size, int holdMs);
+        void hysteresisStep();
+        void creepStep();
+        void estimatorStep();
+        void beginAmplitude();
+        void beginHeight();
+        void failCalibration(int calStatus);
+        int finishHysteresis();
+        int finishCreep();
+        int finishEstimator();
 
-        int setpoint; // current setpoint
+        static const int maxCalibrationPixels = 128; // longest hysteresis calibration profile
+        static const int creepProfilePixels = 32;    // creep calibration profile length
+        static const int creepProfileStep = 8;       // creep calibration pixel spacing, LSB
+        static const int maxCreepSamples = 16;       // creep calibration profiles kept
+
+        static const int estimatorSettleCycles = 50;    // cycles after each estimator calibration Z move
+        static const int estimatorSampleCycles = 200;   // cycles averaged at each estimator calibration height
 
         int currentSum;
         int currentSumRaw;
         int numCurrentSamples;
 
         int currentLogSum;
+        int currentLogSumRaw;
+        int64_t currentLogSumSq;
         int numCurrentLogSamples;
 
+        // ISR sweep state. The table is converted to DAC values before the sweep, so each point is one write
+        // (four for Z), made in a sample period of its own so DAC and TIA transfers never share an interrupt
+        struct sweep_struct {
+            volatile bool active;
+            int mode;
+            int numPoints;
+            int settleSamples;
+            int averageSamples;
+            int values[maxSweepPoints]; // pad DAC value, or Z offset, of every point
+            int held[4];                // Z channels at the start of the sweep, as sweepChannels
+            int *currents;
+            volatile int point;
+            int tick;                   // sample periods since the point was written
+            int sum;
+        } sweep;
+
+        struct capture_struct {
+            volatile bool active;
+            float *raw;
+            float *filtered;
+            int samples;
+            int index;
+        } capture;
+
+        int piezoOut[8]; // last value written to each DAC channel
+        int biasCode;    // pad DAC value of sampleBias, the lock-in's center
+        const int sweepChannels[4] = {piezo.chX_P, piezo.chX_N, piezo.chY_P, piezo.chY_N};
+        const float biasDacPerMV = -4732 / 500.0; // pad DAC 37500 is about -0.5V (empirical), 32768 is 0V
+
+        float zFeedForwardRemainder = 0; // sub-LSB feed-forward carried to the next cycle
+        int zLastStep = 0; // Z increment of the last cycle, the estimator's known input
+
+        float zErrLogSum;
+        int numZErrLogSamples;
+
         float calibratedNoCurrent = 0; // This is re-measured when the STM boots.
 
+        elapsedMicros sinceControlStep;
+        elapsedMicros sinceStepperStep;
+
+        // stepped recentering and approach, see recenterZStep() and approachCycle()
+        struct recenter_struct {
+            int stepperSteps;
+            int settleCycles; // feedback cycles left after the last stepper step
+        } recentering;
+
+        enum ApproachPhase {
+            APPROACH_RETRACT,  // withdrawing the Z piezo fully
+            APPROACH_STEPPER,  // stepping in by less than the Z range
+            APPROACH_EXTEND    // extending the Z piezo under feedback until current is found
+        };
+        struct approach_struct {
+            int phase;
+            int stepperSteps;
+            int xpos; // lateral position the approach holds
+            int ypos;
+        } approach;
+
+        // stepped calibration, see calibrationStep()
+        enum CalibrationPhase {
+            CAL_IDLE,
+            CAL_SETTLE,   // holding the creep origin before the step
+            CAL_MEASURE,  // tracing profiles, or sampling the current at each estimator height
+            CAL_RETURN    // back to the lateral origin, or Z to where it started, then the fit
+        };
+        struct calibration_struct {
+            int mode;
+            int phase;
+            int axis;
+            int size;      // hysteresis largest amplitude, creep step or estimator Z probe, LSB
+            int holdMs;
+            int status;    // 1 until a move fails or the current leaves its range, then the failure
+            bool compensationWas;
+            int origin;    // lateral position along axis when the calibration began
+            int start;     // first pixel of the profiles
+            int pixelStep;
+            int numPixels;
+            int pixel;     // pixel driven to, creep's -1 for start itself
+            bool forward;
+            int pass;      // hysteresis passes of this amplitude, creep passes since the step
+            int level;     // hysteresis amplitude, estimator height
+            int cycle;     // estimator cycles at this height
+            unsigned long phaseStartUs;
+            float passStartMs;
+            float nextSampleMs;
+            int numSamples;
+            int profileFwd[maxCalibrationPixels];
+            int profileBwd[maxCalibrationPixels];
+            float loopWidths[num_play_operators - 1];
+            int profiles[maxCreepSamples][creepProfilePixels];
+            int finalProfile[creepProfilePixels];
+            float sampleTimes[maxCreepSamples];
+            int zStart;
+            double diffSumSq;
+            int prevCurrent;
+            float logSum;
+            float logCurrent[3];
+            float noisePA;
+        } calibration;
+
         SOS tiafilter;
 
         Stepper stepper0;
         Stepper stepper1;
         Stepper stepper2;
 
-        struct piezo_struct {
-            static const int cs = 10;
-            static const int chX_P = 1;
-            static const int chY_P = 3;
-            static const int chY_N = 5;
-            static const int chX_N = 7;
-            static const int samplePad = 0;
-        } piezo;
-
-        struct tia_struct {
-            static const int cs   = 34;
-            static const int din  = 38;
-            static const int miso = 39;
-        } tia;
-        struct stepper0_struct {
-            static const int A = 5;
-            static const int B = 4;
-            static const int C = 3;
-            static const int D = 2;
-        } stepper0_pins;
-        struct stepper1_struct {
-            static const int A = 9;
-            static const int B = 8;
-            static const int C = 7;
-            static const int D = 6;
-        } stepper1_pins;
-        struct stepper2_struct {
-            static const int A = 32;
-            static const int B = 33;
-            static const int C = 25;
-            static const int D = 24;
-        } stepper2_pins;
+        typename Board::piezo_struct piezo;
+        typename Board::tia_struct tia;
+        typename Board::stepper0_struct stepper0_pins;
+        typename Board::stepper1_struct stepper1_pins;
+        typename Board::stepper2_struct stepper2_pins;
 
         const int   maxPiezo = 65535; // maximum valuable attainable by a single piezo channel
         const int   minPiezo = 0; // minimum valuable attainable by a single piezo channel
 
         const float pidTransverseP = 1.0; // gain term in PID control for transverse axes
-        const float pidZP = 0.5; // gain term in PID control for Z axis
         const float pidTransverseI = 0.0; // Integral term in PID control for transverse axes
         const float pidZI = 0.0;  // Integral term in PID control for Z axis
         const float pidTransverseD = 0.0; // Derivative term in PID control for transverse axes
         const float pidZD = 0.0; // Derivative term in PID control for Z axis
 
 
-        const int maxTransverseStep = 5; // largest one-cycle piezo step on the x-axis
-        const int maxZStep = 100;
+        const int maxRecenterSteps = 20; // stepper steps before recentering gives up
+        const int recenterStepRate = 10; // stepper steps per second while recentering
+        const int recenterSettleCycles = 500; // feedback cycles after each recentering stepper step
+        const int approachStepperSteps = 3; // stepper steps between piezo approaches, less than the Z range
+        const int approachStepRate = 100;
+
 
         // PID internal use
 
@@ -145,4 +386,6 @@ class ScanHead
 
 };
 
+typedef BasicScanHead<Board> ScanHead;
+
 #endif
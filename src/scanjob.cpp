@@ -0,0 +1,281 @@
+/*
+ * scanjob.cpp
+ * Resumable two-axis scan state machine with per-line checkpoints and retry
+ */
+
+#include "Arduino.h"
+#include "scanjob.h"
+
+ScanJob::ScanJob() {
+    state = SCAN_IDLE;
+    lineIndex = 0;
+    numLines = 0;
+    numSteps = 0;
+    lineRetries = 0;
+    failStatus = 0;
+    reapproachSteps = 0;
+    afterRecenter = SCAN_LINE_START;
+}
+
+void ScanJob::begin(ScanHead *scanhead, int *dataArr, int channels, int sizeX, int sizeY, int step, bool heightControl) {
+    /*!
+     * \brief starts a serpentine two axis scan from the current position. Scans over X preferentially
+     * @param *scanhead ScanHead to scan with
+     * @param *dataArr Pointer to (sizeX/step)*(sizeY/step)*channelCount(channels) long array to store packed pixels
+     * @param channels OR of ScanChannel values to record at each pixel
+     * @param sizeX number of piezo LSBs to scan over in X
+     * @param sizeY number of piezo LSBs to scan over in Y
+     * @param step piezo LSBs between pixels
+     * @param heightControl true if height control enabled, false otherwise
+     */
+
+    this->scanhead = scanhead;
+    this->dataArr = dataArr;
+    this->channels = channels;
+    this->step = step;
+    this->heightControl = heightControl;
+
+    numChannels = channelCount(channels);
+
+    setCurrent = scanhead->setpoint;
+    if (!heightControl) setCurrent = -1; // no height control if -1 passed to setPositionStep
+
+    xStart = scanhead->xpos;
+    xEnd = xStart + sizeX;
+    yTarget = scanhead->ypos;
+    yEnd = yTarget + sizeY;
+
+    lateralExtent = max(max(abs(xStart), abs(xEnd)), max(abs(yTarget), abs(yEnd)));
+
+    numLines = (sizeY + step - 1)/step;
+    lineIndex = 0;
+    numSteps = 0;
+    lineRetries = 0;
+    direction = true;
+
+    Serial.println("scanning x-axis,y-axis");
+    Serial.print("Start:");
+    Serial.print(xStart);
+    Serial.print(",");
+    Serial.println(yTarget);
+    Serial.print("End:");
+    Serial.print(xEnd);
+    Serial.print(",");
+    Serial.println(yEnd);
+
+    scanhead->stream.beginFrame(channels, (sizeX + step - 1)/step, numLines, step);
+    scanhead->writeFrameParams();
+    scanhead->preview.beginFrame((sizeX + step - 1)/step, numLines);
+
+    // pixel positions of both raster directions, xStart to xEnd
+    scanhead->zPredictor.beginFrame(xStart, step, sizeX/step + 1);
+
+    state = SCAN_LINE_START;
+}
+
+int ScanJob::update() {
+    /*!
+     * \brief advances the scan by one control cycle. Call until finished()
+     * @return the new scan state
+     */
+
+    switch (state) {
+
+    case SCAN_LINE_START:
+        if (yTarget >= yEnd) {
+            finish(SCAN_DONE, 0);
+            break;
+        }
+
+        saveCheckpoint();
+
+        scanhead->zPredictor.beginLine(direction);
+
+        // serpentine raster: +x on even lines, -x on odd lines
+        if (direction) xTarget = xStart;
+        else xTarget = xEnd;
+
+        // recentering at the line boundary, so no line is split across a stepper move
+        if (heightControl && scanhead->zNearLimit(lateralExtent)) startRecenter(SCAN_PIXEL);
+        else startPixels();
+        break;
+
+    case SCAN_RECENTER:
+        if (scanhead->recenterZStep(setCurrent) == 0) break;
+
+        scanhead->stream.writeEvent("recenter", lineIndex, scanhead->zStitchOffset);
+        if (afterRecenter == SCAN_PIXEL) startPixels();
+        else state = afterRecenter;
+        break;
+
+    case SCAN_PIXEL: {
+        int setPositionStatus = scanhead->setPositionStep(xTarget, yTarget, setCurrent);
+
+        if (setPositionStatus == 0) break;
+
+        if (setPositionStatus != 1) {
+            Serial.println("Line failed with error");
+            Serial.println(setPositionStatus);
+            failStatus = setPositionStatus;
+            state = SCAN_RETRY;
+            break;
+        }
+
+        scanhead->fetchPixel(dataArr + numSteps * numChannels, channels);
+        numSteps += 1;
+
+        if (heightControl) {
+            scanhead->zPredictor.addSample((xTarget - xStart)/step, scanhead->xpos, scanhead->ypos,
+                    scanhead->zpos + scanhead->zStitchOffset);
+        }
+
+        if (direction) xTarget += step;
+        else xTarget -= step;
+
+        if (direction ? xTarget < xEnd : xTarget > xStart) break;
+
+        // line complete
+        scanhead->stream.writeLine(lineIndex, dataArr, checkpoint.numSteps, numSteps - checkpoint.numSteps);
+        if (scanhead->preview.enabled) {
+            // Z shown as height, so negated
+            scanhead->preview.addLine(lineIndex, dataArr + checkpoint.numSteps * numChannels, numChannels,
+                    imageChannelOffset(channels), !direction, (channels & CH_ZPOS) ? -1 : 1);
+        }
+        if (heightControl) scanhead->zPredictor.endLine(yTarget);
+
+        direction = !direction;
+        yTarget += step;
+        lineIndex += 1;
+        lineRetries = 0;
+
+        // the finished line is behind the checkpoint from here, so an abort or resume never streams it again
+        saveCheckpoint();
+        state = SCAN_LINE_START;
+        break;
+    }
+
+    case SCAN_RETRY:
+        if (lineRetries >= maxLineRetries) {
+            // keeping whatever part of the line was acquired
+            scanhead->stream.writeLine(lineIndex, dataArr, checkpoint.numSteps, numSteps - checkpoint.numSteps);
+            finish(SCAN_FAILED, failStatus);
+            break;
+        }
+
+        lineRetries += 1;
+        scanhead->stream.writeEvent("retry", lineIndex, failStatus);
+        restoreCheckpoint();
+
+        if (heightControl && (failStatus == -2 ||
+                    (reapproachAfterRetries >= 0 && lineRetries > reapproachAfterRetries))) {
+            reapproachSteps = 0;
+            scanhead->stream.writeEvent("reapproach", lineIndex, lineRetries);
+            // approaching where the line restarts, not at the scan origin
+            scanhead->beginApproach(direction ? xStart : xEnd, yTarget);
+            state = SCAN_REAPPROACH;
+        }
+        else if (heightControl && failStatus == -1) startRecenter(SCAN_LINE_START);
+        else state = SCAN_LINE_START;
+        break;
+
+    case SCAN_REAPPROACH: {
+        int approachStatus = scanhead->approachCycle(setCurrent, approachCurrentBuf, approachZposBuf);
+        if (approachStatus == 1) state = SCAN_LINE_START;
+        else if (approachStatus == 2 && ++reapproachSteps >= maxReapproachSteps) finish(SCAN_FAILED, failStatus);
+        break;
+    }
+
+    case SCAN_PAUSED:
+        // holding the tip in place under feedback
+        scanhead->setPositionStep(scanhead->xpos, scanhead->ypos, setCurrent);
+        break;
+
+    default:
+        break;
+    }
+
+    return state;
+}
+
+void ScanJob::pause() {
+    /*!
+     * \brief holds the tip under feedback until resume(). The interrupted line is rescanned on resume
+     */
+
+    if (finished() || state == SCAN_IDLE || state == SCAN_PAUSED) return;
+
+    scanhead->stream.writeEvent("pause", lineIndex, numSteps - checkpoint.numSteps);
+    state = SCAN_PAUSED;
+}
+
+void ScanJob::resume() {
+    /*!
+     * \brief continues a paused scan from the start of the interrupted line
+     */
+
+    if (state != SCAN_PAUSED) return;
+
+    restoreCheckpoint();
+    scanhead->stream.writeEvent("resume", lineIndex, 0);
+    state = SCAN_LINE_START;
+}
+
+void ScanJob::abort() {
+    /*!
+     * \brief stops the scan, streaming whatever part of the current line was acquired
+     */
+
+    if (finished() || state == SCAN_IDLE) return;
+
+    if (numSteps > checkpoint.numSteps) {
+        scanhead->stream.writeLine(lineIndex, dataArr, checkpoint.numSteps, numSteps - checkpoint.numSteps);
+    }
+    finish(SCAN_ABORTED, abortedStatus);
+}
+
+bool ScanJob::finished() {
+    return state == SCAN_DONE || state == SCAN_FAILED || state == SCAN_ABORTED;
+}
+
+int ScanJob::result() {
+    /*!
+     * @return 0 if the scan completed, the failing setPositionStep status if it failed, abortedStatus if aborted
+     */
+
+    if (state == SCAN_DONE) return 0;
+    if (state == SCAN_ABORTED) return abortedStatus;
+    return failStatus;
+}
+
+void ScanJob::saveCheckpoint() {
+    checkpoint.lineIndex = lineIndex;
+    checkpoint.numSteps = numSteps;
+    checkpoint.yTarget = yTarget;
+    checkpoint.direction = direction;
+}
+
+void ScanJob::restoreCheckpoint() {
+    lineIndex = checkpoint.lineIndex;
+    numSteps = checkpoint.numSteps;
+    yTarget = checkpoint.yTarget;
+    direction = checkpoint.direction;
+}
+
+void ScanJob::startPixels() {
+    // the first pixel integrates from here, not over the idle time, recentering or pause before the line
+    int discard[2];
+    scanhead->fetchPixel(discard, CH_ZPOS | CH_CURRENT);
+    state = SCAN_PIXEL;
+}
+
+void ScanJob::startRecenter(int nextState) {
+    scanhead->beginRecenterZ();
+    afterRecenter = nextState;
+    state = SCAN_RECENTER;
+}
+
+void ScanJob::finish(int newState, int status) {
+    failStatus = status;
+    state = newState;
+    scanhead->stream.endFrame(status);
+}
@@ -0,0 +1,97 @@
+/*
+ * scanjob.h
+ * Resumable two-axis scan state machine with per-line checkpoints and retry
+ */
+
+#ifndef scanjob_h
+#define scanjob_h
+
+#include "Arduino.h"
+#include <CircularBuffer.h>
+#include "scanhead.h"
+
+class ScanJob
+{
+    public:
+        ScanJob();
+
+        // Scan states. update() performs at most one control cycle per call
+        enum State {
+            SCAN_IDLE,
+            SCAN_LINE_START,  // checkpointing, starting a recenter if Z is near its limit
+            SCAN_RECENTER,    // recentering Z with the steppers under feedback
+            SCAN_PIXEL,       // driving to the next pixel
+            SCAN_RETRY,       // line failed, deciding how to recover
+            SCAN_REAPPROACH,  // re-approaching the surface before retrying a line
+            SCAN_PAUSED,      // holding position under feedback
+            SCAN_DONE,
+            SCAN_FAILED,
+            SCAN_ABORTED
+        };
+
+        static const int abortedStatus = -3; // result() of an aborted scan
+
+        // Retry policy: a failed line is restarted from its checkpoint up to maxLineRetries times.
+        // Out-of-range failures recenter Z first. Overcurrent failures, and every retry after
+        // reapproachAfterRetries, re-approach the surface first (-1 disables re-approach).
+        int maxLineRetries = 2;
+        int reapproachAfterRetries = 1;
+        int maxReapproachSteps = 50; // approach iterations before a re-approach gives up
+
+        void begin(ScanHead *scanhead, int *dataArr, int channels, int sizeX, int sizeY, int step, bool heightControl);
+        int update();
+        void pause();
+        void resume();
+        void abort();
+
+        bool finished();
+        int result();
+
+        int state;
+        int lineIndex;
+        int numLines;
+        int numSteps;
+        int lineRetries;
+
+    private:
+        ScanHead *scanhead;
+
+        int *dataArr;
+        int channels;
+        int numChannels;
+        int step;
+        bool heightControl;
+        int setCurrent;
+
+        int xStart;
+        int xEnd;
+        int yEnd;
+        int lateralExtent;
+
+        int xTarget;
+        int yTarget;
+        bool direction; // true to scan in +x
+
+        int failStatus;
+        int reapproachSteps;
+        int afterRecenter; // state to continue in once recentered
+
+        // scan position at the start of the current line, restored on retry or resume
+        struct checkpoint_struct {
+            int lineIndex;
+            int numSteps;
+            int yTarget;
+            bool direction;
+        } checkpoint;
+
+        CircularBuffer<int,1000> approachCurrentBuf;
+        CircularBuffer<int,1000> approachZposBuf;
+
+        void saveCheckpoint();
+        void restoreCheckpoint();
+        void startPixels();
+        void startRecenter(int nextState);
+        void finish(int newState, int status);
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * scanpreview.cpp
+ * Downsampled, line leveled 1-bit preview of a scan in progress, laid out in SSD1306 display pages
+ */
+
+#ifndef scanpreview_h
+#define scanpreview_h
+
+#include <stdint.h>
+
+/*
+ * ScanJob adds every completed line. The line is leveled by its least squares fit, so tilt and line to line Z
+ * offsets drop out, box averaged or repeated onto the preview columns and stored. The frame keeps its aspect
+ * ratio, centered in width x height. Lines falling between preview rows are skipped.
+ *
+ * The grey range grows from the 5th to 95th percentile of every line, with margin so it settles after a few
+ * lines. Nothing is dithered when a line is added: pages whose rows changed, or every page when the range
+ * grows, are marked dirty and dithered to 1 bit with a 4x4 Bayer matrix as the display pulls them, so a
+ * line costs one fit and one sort of at most width values in the control loop.
+ */
+
+class ScanPreview
+{
+    public:
+        static const int width = 128;  // preview area, pixels
+        static const int height = 48;
+        static const int numPages = height / 8;
+        static const int16_t noData = -32768;
+
+        bool enabled = true;
+        bool hasFrame = false;
+        int numLines = 0;     // lines of the frame being previewed
+        int linesAdded = 0;   // completed lines added to the preview, retries included
+        int low = 0;          // grey range, leveled channel units
+        int high = 0;
+
+        /*!
+         * \brief clears the preview for a new frame
+         * @param lineWidth pixels per line
+         * @param numLines lines in the frame
+         */
+        void beginFrame(int lineWidth, int numLines) {
+            this->lineWidth = lineWidth;
+            this->numLines = numLines;
+            linesAdded = 0;
+            hasFrame = lineWidth > 0 && numLines > 0;
+            ranged = false;
+
+            float scaleX = (float) width / (lineWidth > 0 ? lineWidth : 1);
+            float scaleY = (float) height / (numLines > 0 ? numLines : 1);
+            scale = scaleX < scaleY ? scaleX : scaleY;
+            areaWidth = (int) (lineWidth * scale);
+            areaHeight = (int) (numLines * scale);
+            if (areaWidth < 1) areaWidth = 1;
+            if (areaHeight < 1) areaHeight = 1;
+            offsetX = (width - areaWidth) / 2;
+            offsetY = (height - areaHeight) / 2;
+
+            for (int row = 0; row < height; row++) {
+                for (int col = 0; col < width; col++) values[row][col] = noData;
+            }
+            dirty = (1 << numPages) - 1;
+        }
+
+        /*!
+         * \brief adds a completed scan line
+         * @param lineIndex line in the frame
+         * @param *line first packed pixel of the line, in acquisition order
+         * @param numChannels ints per packed pixel
+         * @param channelOffset position of the previewed channel within a packed pixel
+         * @param reversed true if the line was acquired in -x
+         * @param sign -1 to show the negated channel, so Z piezo values show as height
+         */
+        void addLine(int lineIndex, const int *line, int numChannels, int channelOffset, bool reversed, int sign) {
+            if (!hasFrame || lineIndex < 0 || lineIndex >= numLines) return;
+            linesAdded += 1;
+
+            int firstRow = offsetY + ceilIndex(lineIndex * scale);
+            int endRow = offsetY + ceilIndex((lineIndex + 1) * scale);
+            if (endRow > offsetY + areaHeight) endRow = offsetY + areaHeight;
+            if (firstRow >= endRow) return;
+
+            // least squares line through the raw pixels
+            double sumX = 0, sumXX = 0, sumV = 0, sumXV = 0;
+            for (int i = 0; i < lineWidth; i++) {
+                double v = pixel(line, numChannels, channelOffset, reversed, i);
+                sumX += i;
+                sumXX += (double) i * i;
+                sumV += v;
+                sumXV += i * v;
+            }
+            double denom = lineWidth * sumXX - sumX * sumX;
+            float slope = denom != 0 ? (lineWidth * sumXV - sumX * sumV) / denom : 0;
+            float intercept = (sumV - slope * sumX) / lineWidth;
+
+            // leveled and box averaged onto the preview columns
+            int16_t leveled[width];
+            for (int c = 0; c < areaWidth; c++) {
+                int first = (int) (c / scale);
+                int end = (int) ((c + 1) / scale);
+                if (end <= first) end = first + 1;
+                if (end > lineWidth) end = lineWidth;
+
+                float sum = 0;
+                for (int i = first; i < end; i++) {
+                    sum += pixel(line, numChannels, channelOffset, reversed, i) - intercept - slope * i;
+                }
+                float v = sign * sum / (end - first);
+                if (v > 32767) v = 32767;
+                if (v < -32767) v = -32767;
+                leveled[c] = (int16_t) v;
+            }
+
+            for (int row = firstRow; row < endRow; row++) {
+                for (int c = 0; c < areaWidth; c++) values[row][offsetX + c] = leveled[c];
+                dirty |= 1 << (row / 8);
+            }
+
+            updateRange(leveled, areaWidth);
+        }
+
+        /*!
+         * \brief marks every page for a redraw, after the display showed something else
+         */
+        void invalidate() {
+            dirty = (1 << numPages) - 1;
+        }
+
+        /*!
+         * @return the first page needing a redraw, its dirty flag cleared, or -1 if none
+         */
+        int nextDirtyPage() {
+            for (int page = 0; page < numPages; page++) {
+                if (dirty & (1 << page)) {
+                    dirty &= ~(1 << page);
+                    return page;
+                }
+            }
+            return -1;
+        }
+
+        /*!
+         * \brief dithers one page of the preview
+         * @param page preview page, 0 to numPages - 1
+         * @param *out width bytes in SSD1306 page layout, bit n is the page's row n
+         */
+        void renderPage(int page, uint8_t *out) {
+            static const uint8_t bayer[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+            int range = high > low ? high - low : 1;
+
+            for (int col = 0; col < width; col++) {
+                uint8_t bits = 0;
+                for (int bit = 0; bit < 8; bit++) {
+                    int row = page * 8 + bit;
+                    int16_t v = values[row][col];
+                    if (v == noData || !ranged) continue;
+                    // 17 grey levels, 0 all dark and 16 all lit
+                    int level = (int) ((long) (v - low) * 16 / range);
+                    if (level > bayer[row & 3][col & 3]) bits |= 1 << bit;
+                }
+                out[col] = bits;
+            }
+        }
+
+    private:
+        int16_t values[height][width];
+        int lineWidth;
+        float scale;     // preview pixels per frame pixel
+        int areaWidth;
+        int areaHeight;
+        int offsetX;
+        int offsetY;
+        uint8_t dirty;   // bit per page
+        bool ranged;     // low and high set by a line
+
+        static int ceilIndex(float x) {
+            int i = (int) x;
+            return i < x ? i + 1 : i;
+        }
+
+        int pixel(const int *line, int numChannels, int channelOffset, bool reversed, int col) {
+            // col from the frame origin, reversed lines were acquired from the far end
+            int index = reversed ? lineWidth - 1 - col : col;
+            return line[index * numChannels + channelOffset];
+        }
+
+        void updateRange(const int16_t *leveled, int n) {
+            // 5th and 95th percentiles by insertion sort, n is at most width
+            int16_t sorted[width];
+            for (int i = 0; i < n; i++) {
+                int16_t v = leveled[i];
+                int j = i;
+                for (; j > 0 && sorted[j - 1] > v; j--) sorted[j] = sorted[j - 1];
+                sorted[j] = v;
+            }
+            int lo = sorted[n / 20];
+            int hi = sorted[n - 1 - n / 20];
+
+            if (!ranged) {
+                low = lo;
+                high = hi > lo ? hi : lo + 1;
+                ranged = true;
+                dirty = (1 << numPages) - 1;
+                return;
+            }
+
+            // growing with an eighth of the range to spare, so the range settles instead of creeping
+            int margin = (high - low) / 8;
+            bool grown = false;
+            if (lo < low) {
+                low = lo - margin;
+                grown = true;
+            }
+            if (hi > high) {
+                high = hi + margin;
+                grown = true;
+            }
+            if (grown) dirty = (1 << numPages) - 1;
+        }
+};
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * scanstream.cpp
+ * Streams packed scan data over serial as each line completes
+ */
+
+#include "Arduino.h"
+#include "scanstream.h"
+
+ScanStream::ScanStream() {
+    channels = defaultScanChannels;
+    numChannels = channelCount(channels);
+    coding = false;
+    pixelsWritten = 0;
+}
+
+void ScanStream::beginFrame(int channels, int width, int height, int step) {
+    /*!
+     * \brief writes the frame and column headers, flushing anything left from the previous frame
+     * @param channels OR of ScanChannel values recorded per pixel
+     * @param width pixels per line
+     * @param height number of lines
+     * @param step piezo LSBs between pixels
+     */
+
+    flush();
+
+    this->channels = channels;
+    numChannels = channelCount(channels);
+    coding = compressed;
+    encoder.beginFrame(numChannels);
+
+    if (!enabled) return;
+
+    Serial.print("#frame,");
+    Serial.print(channels);
+    Serial.print(",");
+    Serial.print(width);
+    Serial.print(",");
+    Serial.print(height);
+    Serial.print(",");
+    Serial.println(step);
+
+    Serial.print("step");
+    for (int ch = 0; ch < numScanChannels; ch++) {
+        if (channels & (1 << ch)) {
+            Serial.print(",");
+            Serial.print(scanChannelNames[ch]);
+        }
+    }
+    Serial.println();
+}
+
+void ScanStream::writeLine(int lineIndex, const int *data, int firstPixel, int numPixels) {
+    /*!
+     * \brief writes one completed scan line
+     * @param lineIndex index of the line within the frame
+     * @param *data packed frame data, numChannels ints per pixel
+     * @param firstPixel index of the first pixel of the line within data
+     * @param numPixels number of pixels in the line
+     */
+
+    if (!enabled) return;
+
+    record_struct record = {NULL, false, lineIndex, 0, data, firstPixel, numPixels};
+    queue(record);
+}
+
+void ScanStream::writeEvent(const char *event, int lineIndex, int value) {
+    /*!
+     * \brief records a scan event such as a Z recentering or line retry
+     * @param event event name, must outlive the stream record
+     * @param lineIndex index of the line the event applies to
+     * @param value event specific value
+     */
+
+    if (!enabled) return;
+
+    record_struct record = {event, false, lineIndex, value, NULL, 0, 0};
+    queue(record);
+}
+
+void ScanStream::endFrame(int status) {
+    /*!
+     * \brief marks the end of the frame
+     * @param status scan return code, 0 on success
+     */
+
+    if (!enabled) return;
+
+    record_struct record = {NULL, true, 0, status, NULL, 0, 0};
+    queue(record);
+}
+
+void ScanStream::update(int maxPixels) {
+    /*!
+     * \brief writes queued records, stopping after maxPixels pixel rows
+     * @param maxPixels pixel rows to write in this call
+     */
+
+    while (!records.isEmpty()) {
+        record_struct record = records.first();
+
+        if (record.event != NULL) {
+            Serial.print("#");
+            Serial.print(record.event);
+            Serial.print(",");
+            Serial.print(record.lineIndex);
+            Serial.print(",");
+            Serial.println(record.value);
+        }
+        else if (record.end) {
+            Serial.print("#end,");
+            Serial.println(record.value);
+        }
+        else {
+            if (pixelsWritten == 0) {
+                if (coding) beginCodedLine(record);
+                else {
+                    Serial.print("#line,");
+                    Serial.println(record.lineIndex);
+                }
+            }
+
+            while (pixelsWritten < record.numPixels) {
+                if (maxPixels <= 0) return;
+                if (coding) writeCodedPixel(record.data, record.firstPixel + pixelsWritten);
+                else writePixel(record.data, record.firstPixel + pixelsWritten);
+                pixelsWritten += 1;
+                maxPixels -= 1;
+            }
+            if (coding) {
+                char digits[LineEncoder::maxPixelDigits];
+                Serial.write((const uint8_t *) digits, encoder.endLine(digits));
+                Serial.println();
+            }
+            pixelsWritten = 0;
+        }
+
+        records.shift();
+    }
+}
+
+void ScanStream::flush() {
+    /*!
+     * \brief writes every queued record. Blocks until done
+     */
+
+    while (!records.isEmpty()) update(1000);
+}
+
+bool ScanStream::pending() {
+    return !records.isEmpty();
+}
+
+void ScanStream::queue(const record_struct &record) {
+    while (records.isFull()) update(1000); // drain the oldest record rather than dropping data
+
+    records.push(record);
+
+    if (!buffered) flush();
+}
+
+void ScanStream::writePixel(const int *data, int pixel) {
+    Serial.print(pixel);
+    const int *values = data + pixel * numChannels;
+    for (int ch = 0; ch < numChannels; ch++) {
+        Serial.print(",");
+        Serial.print(values[ch]);
+    }
+    Serial.println();
+}
+
+void ScanStream::beginCodedLine(const record_struct &record) {
+    // the #zline header, its digits follow a pixel at a time
+    encoder.beginLine(record.numPixels);
+
+    Serial.print("#zline,");
+    Serial.print(record.lineIndex);
+    Serial.print(",");
+    Serial.print(record.firstPixel);
+    Serial.print(",");
+    Serial.print(record.numPixels);
+    Serial.print(",");
+    Serial.print(encoder.sequence);
+    Serial.print(encoder.referenced ? ",1" : ",0");
+    for (int ch = 0; ch < numChannels; ch++) {
+        Serial.print(",");
+        Serial.print(encoder.predictor[ch] * 32 + encoder.riceK[ch]);
+    }
+    Serial.print(",");
+}
+
+void ScanStream::writeCodedPixel(const int *data, int pixel) {
+    char digits[LineEncoder::maxPixelDigits];
+    int length = encoder.encodePixel(data + pixel * numChannels, digits);
+    Serial.write((const uint8_t *) digits, length);
+}
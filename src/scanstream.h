@@ -0,0 +1,88 @@
+/*
+ * scanstream.h
+ * Streams packed scan data over serial as each line completes
+ */
+
+#ifndef scanstream_h
+#define scanstream_h
+
+#include "Arduino.h"
+#include <CircularBuffer.h>
+#include "scanchannels.h"
+#include "linecodec.cpp"
+
+/*
+ * Stream format (one record per serial line):
+ *   #frame,<channels>,<width>,<height>,<step>   frame header, channels is the ScanChannel mask
+ *   step,<channel names...>                      column header
+ *   #params,<key>=<value>,...                    acquisition parameters: setpoint, bias, gains, control
+ *                                                and sampling periods, Z range state, feed-forward,
+ *                                                estimator, lock-in and compensation settings, written
+ *                                                by ScanHead::writeFrameParams()
+ *   #line,<index>                                start of a completed scan line
+ *   <step>,<values...>                           one row per pixel, selected channels in bit order
+ *   #zline,<index>,<first step>,<rows>,<sequence>,<referenced>,<code per channel...>,<digits>
+ *                                                with compressed set, a whole line in one record in place of
+ *                                                #line and its rows, coded as linecodec.cpp describes. Rows
+ *                                                run on from the first step; code is predictor * 32 + Rice k
+ *   #<event>,<line>,<value>                      scan event before/at line:
+ *                                                  recenter (value: new Z stitch offset)
+ *                                                  retry (value: failing setPositionStep status)
+ *                                                  reapproach (value: retry attempt)
+ *                                                  pause (value: pixels into the line), resume
+ *                                                  spec (line: grid width, value: 0 I(V), 1 I(z)), at the start
+ *                                                  of a spectroscopy grid, whose lines are the pixels' curves
+ *                                                  overcurrent (value: curve points measured)
+ *   #end,<status>                                end of frame, status as returned by the scan
+ *
+ * With buffered set, lines, events and the end record are queued and written a few pixels at a time
+ * by update(), so streaming never holds up the control loop. beginFrame() flushes anything pending,
+ * and the frame data must stay valid until it has been written.
+ */
+
+class ScanStream
+{
+    public:
+        ScanStream();
+
+        bool enabled = true;
+        bool buffered = false;
+        bool compressed = false; // lines as #zline records, from the next frame on
+
+        void beginFrame(int channels, int width, int height, int step);
+        void writeLine(int lineIndex, const int *data, int firstPixel, int numPixels);
+        void writeEvent(const char *event, int lineIndex, int value);
+        void endFrame(int status);
+
+        void update(int maxPixels);
+        void flush();
+        bool pending();
+
+    private:
+        int channels;
+        int numChannels;
+        bool coding;        // compressed, as it was when the frame began
+        LineEncoder encoder;
+
+        // queued stream record. Lines are written from data, events print event, end records print value
+        struct record_struct {
+            const char *event; // NULL for lines and end records
+            bool end;
+            int lineIndex;
+            int value;
+            const int *data;
+            int firstPixel;
+            int numPixels;
+        };
+
+        static const int maxPendingRecords = 32;
+        CircularBuffer<record_struct,maxPendingRecords> records;
+        int pixelsWritten; // pixels of the oldest queued line already written
+
+        void queue(const record_struct &record);
+        void writePixel(const int *data, int pixel);
+        void beginCodedLine(const record_struct &record);
+        void writeCodedPixel(const int *data, int pixel);
+};
+
+#endif
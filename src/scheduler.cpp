@@ -0,0 +1,123 @@
+/*
+ * scheduler.cpp
+ * Cooperative, non-preemptive task scheduler with per-task time budgets
+ */
+
+#include "Arduino.h"
+#include "scheduler.h"
+
+Scheduler::Scheduler() {
+    numTasks = 0;
+    statsTimer = 0;
+}
+
+int Scheduler::addTask(const char *name, void (*run)(), int priority, uint32_t periodUs, uint32_t budgetUs) {
+    /*!
+     * \brief registers a task. Tasks must return within their budget and never block
+     * @param name task name for stats
+     * @param run function performing one slice of the task's work
+     * @param priority lower values run first when several tasks are due
+     * @param periodUs minimum time between run starts, 0 to run in the background whenever no periodic task is due
+     * @param budgetUs expected worst case run time
+     * @return task index, -1 if the task table is full
+     */
+
+    if (numTasks >= maxTasks) return -1;
+
+    task_struct &task = tasks[numTasks];
+    task.name = name;
+    task.run = run;
+    task.priority = priority;
+    task.periodUs = periodUs;
+    task.budgetUs = budgetUs;
+    task.lastStartUs = micros();
+
+    numTasks += 1;
+    resetStats();
+
+    return numTasks - 1;
+}
+
+void Scheduler::runOnce() {
+    /*!
+     * \brief runs the most important due task once. Call continuously from loop()
+     * \detail among due tasks the lowest priority value wins, ties go to the task waiting longest. Background
+     *         tasks (period 0) are always due, so they only run when no periodic task is
+     */
+
+    uint32_t now = micros();
+
+    int next = -1;
+    uint32_t nextWait = 0;
+
+    for (int i = 0; i < numTasks; i++) {
+        uint32_t wait = now - tasks[i].lastStartUs;
+        if (wait < tasks[i].periodUs) continue;
+
+        bool background = tasks[i].periodUs == 0;
+        bool nextBackground = next >= 0 && tasks[next].periodUs == 0;
+
+        if (next < 0 || (nextBackground && !background) || (background == nextBackground &&
+                (tasks[i].priority < tasks[next].priority ||
+                (tasks[i].priority == tasks[next].priority && wait > nextWait)))) {
+            next = i;
+            nextWait = wait;
+        }
+    }
+
+    if (next < 0) return;
+
+    task_struct &task = tasks[next];
+
+    if (task.periodUs > 0 && nextWait > 2 * task.periodUs) task.late += 1;
+
+    task.lastStartUs = now;
+    task.run();
+    uint32_t elapsed = micros() - now;
+
+    task.runs += 1;
+    task.totalUs += elapsed;
+    if (elapsed > task.maxUs) task.maxUs = elapsed;
+    if (elapsed > task.budgetUs) task.overruns += 1;
+}
+
+void Scheduler::printStats() {
+    /*!
+     * \brief prints per-task run counts, CPU share, worst case time and overruns since the last reset
+     */
+
+    uint32_t windowMs = statsTimer;
+    if (windowMs == 0) windowMs = 1;
+
+    Serial.println("task,runs,cpu%,avgus,maxus,budgetus,overruns,late");
+
+    for (int i = 0; i < numTasks; i++) {
+        task_struct &task = tasks[i];
+        Serial.print(task.name);
+        Serial.print(",");
+        Serial.print(task.runs);
+        Serial.print(",");
+        Serial.print(task.totalUs / (10.0 * windowMs));
+        Serial.print(",");
+        Serial.print(task.runs > 0 ? (uint32_t) (task.totalUs / task.runs) : 0);
+        Serial.print(",");
+        Serial.print(task.maxUs);
+        Serial.print(",");
+        Serial.print(task.budgetUs);
+        Serial.print(",");
+        Serial.print(task.overruns);
+        Serial.print(",");
+        Serial.println(task.late);
+    }
+}
+
+void Scheduler::resetStats() {
+    for (int i = 0; i < numTasks; i++) {
+        tasks[i].runs = 0;
+        tasks[i].overruns = 0;
+        tasks[i].late = 0;
+        tasks[i].maxUs = 0;
+        tasks[i].totalUs = 0;
+    }
+    statsTimer = 0;
+}
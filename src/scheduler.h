@@ -0,0 +1,44 @@
+/*
+ * scheduler.h
+ * Cooperative, non-preemptive task scheduler with per-task time budgets
+ */
+
+#ifndef scheduler_h
+#define scheduler_h
+
+#include "Arduino.h"
+
+class Scheduler
+{
+    public:
+        Scheduler();
+
+        static const int maxTasks = 12;
+
+        struct task_struct {
+            const char *name;
+            void (*run)();
+            int priority;        // lower runs first when several tasks are due
+            uint32_t periodUs;   // minimum time between run starts
+            uint32_t budgetUs;   // runs longer than this count as overruns
+            uint32_t lastStartUs;
+            uint32_t runs;
+            uint32_t overruns;
+            uint32_t late;       // runs started more than one period after they were due
+            uint32_t maxUs;
+            uint64_t totalUs;
+        };
+
+        int addTask(const char *name, void (*run)(), int priority, uint32_t periodUs, uint32_t budgetUs);
+        void runOnce();
+        void printStats();
+        void resetStats();
+
+        int numTasks;
+        task_struct tasks[maxTasks];
+
+    private:
+        elapsedMillis statsTimer; // time since stats were reset
+};
+
+#endif
@@ -7,6 +7,7 @@
 #ifndef sos_h
 #define sos_h
 
+#include <math.h>
 #include "biquad.cpp"
 
 #define num_stages 6
@@ -50,6 +51,8 @@ class SOS
             {1.0,-1.9943498874477295,0.9999999999999998,1.0,-1.9942673440170853,0.9999044760024318}
         };
 
+        const float designHz = 60; // mains frequency sosmatrix_60hz was designed for
+
     public:
         SOS() {
             for (int stagenum = 0; stagenum < num_stages; stagenum++) {
@@ -58,6 +61,47 @@ class SOS
             }
         }
 
+        float mainsHz = 60; // mains frequency the notches are tuned to
+
+        /*!
+         * \brief moves the notches to the harmonics of another mains frequency. The filter state is kept and
+         *        every stage keeps its DC gain, so a steady current passes without a transient
+         * @param hz new mains frequency
+         */
+        void tune(float hz) {
+            // each stage's zeros sit on a harmonic of designHz with its poles just inside them. Rotating both by
+            // the harmonic's shift moves the notch and keeps its width in Hz, then the DC gain is restored
+            for (int stagenum = 0; stagenum < num_stages; stagenum++) {
+                const float *design = sosmatrix_60hz[stagenum];
+                double zeroAngle = acos(-design[1] / (2.0 * design[0]));
+                double poleRadius = sqrt(design[5]);
+                double poleAngle = acos(-design[4] / (2.0 * poleRadius));
+                double shift = zeroAngle * (hz / designHz - 1);
+
+                double num[3] = {1, -2 * cos(zeroAngle + shift), design[2] / design[0]};
+                double den[3] = {1, -2 * poleRadius * cos(poleAngle + shift), design[5]};
+                double dcGain = (design[0] + design[1] + design[2]) / (1.0 + design[4] + design[5]);
+                double scale = dcGain * (den[0] + den[1] + den[2]) / (num[0] + num[1] + num[2]);
+
+                float coeffs[6] = {(float) (scale * num[0]), (float) (scale * num[1]), (float) (scale * num[2]),
+                                   (float) den[0], (float) den[1], (float) den[2]};
+                stages[stagenum].retune(coeffs);
+            }
+            mainsHz = hz;
+        }
+
+        static const int stateSize = 4 * num_stages; // floats of filter state
+
+        /*!
+         * \brief copies out the state of every stage, stateSize floats
+         */
+        void getState(float *state) const {
+            for (int stagenum = 0; stagenum < num_stages; stagenum++) stages[stagenum].getState(state + 4 * stagenum);
+        }
+        void setState(const float *state) {
+            for (int stagenum = 0; stagenum < num_stages; stagenum++) stages[stagenum].setState(state + 4 * stagenum);
+        }
+
         float filter(float in) {
             float result = in;
 
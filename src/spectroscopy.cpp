@@ -0,0 +1,246 @@
+/*
+ * spectroscopy.cpp
+ * Grid spectroscopy: I(V) or I(z) curves taken at every pixel of a grid, streamed as they complete
+ */
+
+#include "Arduino.h"
+#include "spectroscopy.h"
+#include "scanjob.h"
+
+Spectroscopy::Spectroscopy() {
+    state = SPEC_IDLE;
+    pixelIndex = 0;
+    numPixels = 0;
+    failStatus = 0;
+    setLinearTable(-1000, 1000, 200);
+}
+
+void Spectroscopy::setLinearTable(int start, int end, int points) {
+    /*!
+     * \brief fills the sweep table with evenly spaced values
+     * @param start first value
+     * @param end last value
+     * @param points number of values, clamped to 2 to ScanHead::maxSweepPoints
+     */
+
+    if (points < 2) points = 2;
+    if (points > ScanHead::maxSweepPoints) points = ScanHead::maxSweepPoints;
+
+    for (int i = 0; i < points; i++) table[i] = start + (int) ((long) (end - start) * i / (points - 1));
+    numPoints = points;
+}
+
+int Spectroscopy::appendTable(int value) {
+    /*!
+     * \brief adds a value to the end of the sweep table
+     * @return 0 if added, -1 if the table is full
+     */
+
+    if (numPoints >= ScanHead::maxSweepPoints) return -1;
+    table[numPoints++] = value;
+    return 0;
+}
+
+long Spectroscopy::bufferSize(int numPoints) {
+    /*!
+     * @return ints of curve buffer a grid of numPoints point curves needs
+     */
+
+    return (long) ringSlots * numPoints * channelCount(curveChannels);
+}
+
+void Spectroscopy::begin(ScanHead *scanhead, int *dataArr, int sizeX, int sizeY, int step) {
+    /*!
+     * \brief starts a spectroscopy grid with its origin at the current position
+     * @param *scanhead ScanHead to measure with
+     * @param *dataArr array of at least bufferSize(numPoints) ints
+     * @param sizeX grid width, LSB
+     * @param sizeY grid height, LSB
+     * @param step pixel spacing, LSB
+     */
+
+    this->scanhead = scanhead;
+    this->dataArr = dataArr;
+    this->step = step;
+
+    gridWidth = (sizeX + step - 1) / step;
+    gridHeight = (sizeY + step - 1) / step;
+    numPixels = gridWidth * gridHeight;
+    xStart = scanhead->xpos;
+    yStart = scanhead->ypos;
+    lateralExtent = max(max(abs(xStart), abs(xStart + sizeX)), max(abs(yStart), abs(yStart + sizeY)));
+
+    col = 0;
+    row = 0;
+    pixelIndex = 0;
+    progress = 0;
+    pausePending = false;
+    failStatus = 0;
+
+    scanhead->zPredictor.beginFrame(0, 1, 0);
+
+    scanhead->stream.beginFrame(curveChannels, numPoints, numPixels, step);
+    scanhead->writeFrameParams();
+    scanhead->stream.writeEvent("spec", gridWidth, mode);
+
+    state = SPEC_MOVE;
+    checkRange();
+}
+
+int Spectroscopy::update() {
+    /*!
+     * \brief advances the grid by one control cycle, or checks on the running sweep. Call until finished()
+     * @return the new spectroscopy state
+     */
+
+    switch (state) {
+
+    case SPEC_RECENTER:
+        if (scanhead->recenterZStep(scanhead->setpoint) == 0) break;
+
+        scanhead->stream.writeEvent("recenter", row * gridWidth, scanhead->zStitchOffset);
+        state = pausePending ? SPEC_PAUSED : SPEC_MOVE;
+        break;
+
+    case SPEC_MOVE: {
+        int moveStatus = scanhead->setPositionStep(xStart + col * step, yStart + row * step, scanhead->setpoint);
+        if (moveStatus == 1) {
+            progress = 0;
+            state = SPEC_SETTLE;
+        }
+        else if (moveStatus < 0) finish(SPEC_FAILED, moveStatus);
+        break;
+    }
+
+    case SPEC_SETTLE: {
+        int moveStatus = scanhead->setPositionStep(xStart + col * step, yStart + row * step, scanhead->setpoint);
+        if (moveStatus < 0) finish(SPEC_FAILED, moveStatus);
+        else if (pausePending) state = SPEC_PAUSED;
+        else if (++progress >= settleCycles) startSweep();
+        break;
+    }
+
+    case SPEC_SWEEP:
+        if (!scanhead->sweepDone()) break;
+
+        writeCurve();
+        nextPixel();
+        if (pixelIndex >= numPixels) {
+            finish(SPEC_DONE, 0);
+            break;
+        }
+        state = pausePending ? SPEC_PAUSED : SPEC_MOVE;
+        if (pixelIndex % gridWidth == 0) checkRange();
+        break;
+
+    case SPEC_PAUSED:
+        scanhead->setPositionStep(scanhead->xpos, scanhead->ypos, scanhead->setpoint);
+        break;
+
+    default:
+        break;
+    }
+
+    return state;
+}
+
+void Spectroscopy::pause() {
+    /*!
+     * \brief holds position under feedback, after the running sweep or recenter if there is one
+     */
+
+    if (state != SPEC_RECENTER && state != SPEC_MOVE && state != SPEC_SETTLE && state != SPEC_SWEEP) return;
+    scanhead->stream.writeEvent("pause", pixelIndex, 0);
+    if (state == SPEC_MOVE) state = SPEC_PAUSED;
+    else pausePending = true;
+}
+
+void Spectroscopy::resume() {
+    /*!
+     * \brief returns to the next pixel, settling again before its sweep
+     */
+
+    if (state != SPEC_PAUSED && !pausePending) return;
+    scanhead->stream.writeEvent("resume", pixelIndex, 0);
+    pausePending = false;
+    if (state == SPEC_PAUSED) {
+        progress = 0;
+        state = SPEC_MOVE;
+    }
+}
+
+void Spectroscopy::abort() {
+    /*!
+     * \brief stops the grid, restoring Z and bias if a sweep is running
+     */
+
+    if (finished() || state == SPEC_IDLE) return;
+
+    scanhead->abortSweep();
+    finish(SPEC_ABORTED, ScanJob::abortedStatus);
+}
+
+bool Spectroscopy::finished() {
+    return state == SPEC_DONE || state == SPEC_FAILED || state == SPEC_ABORTED;
+}
+
+int Spectroscopy::result() {
+    if (state == SPEC_DONE) return 0;
+    return failStatus;
+}
+
+void Spectroscopy::startSweep() {
+    // clearing the settle cycles' integration, the curve's Z is where the feedback left it
+    int discard[2];
+    scanhead->fetchPixel(discard, CH_ZPOS | CH_CURRENT);
+    heldZ = scanhead->zpos + scanhead->zStitchOffset;
+
+    if (scanhead->beginSweep(mode, table, numPoints, settleSamples, averageSamples, currents) != 0) {
+        finish(SPEC_FAILED, -1);
+        return;
+    }
+    state = SPEC_SWEEP;
+}
+
+void Spectroscopy::writeCurve() {
+    // packs the sweep into the next ring slot as z, current, bias rows and streams it
+    int numChannels = channelCount(curveChannels);
+    int *curve = dataArr + (pixelIndex % ringSlots) * numPoints * numChannels;
+    int measured = scanhead->sweepPoints();
+
+    for (int i = 0; i < measured; i++) {
+        int *point = curve + i * numChannels;
+        point[0] = heldZ + (mode == SPEC_IZ ? table[i] : 0);
+        point[1] = currents[i];
+        point[2] = mode == SPEC_IV ? table[i] : scanhead->sampleBias;
+    }
+
+    int rasterIndex = row * gridWidth + col;
+    scanhead->stream.writeLine(rasterIndex, curve, 0, measured);
+    if (measured < numPoints) scanhead->stream.writeEvent("overcurrent", rasterIndex, measured);
+}
+
+void Spectroscopy::checkRange() {
+    // recentering at row starts only, so no row of the map is split by a stepper move
+    if (!scanhead->zNearLimit(lateralExtent)) return;
+
+    scanhead->beginRecenterZ();
+    state = SPEC_RECENTER;
+}
+
+void Spectroscopy::nextPixel() {
+    // serpentine, so consecutive pixels are always one step apart
+    pixelIndex += 1;
+    progress = 0;
+
+    bool forward = row % 2 == 0;
+    if (forward && col < gridWidth - 1) col += 1;
+    else if (!forward && col > 0) col -= 1;
+    else row += 1;
+}
+
+void Spectroscopy::finish(int newState, int status) {
+    failStatus = status;
+    state = newState;
+    scanhead->stream.endFrame(status);
+}
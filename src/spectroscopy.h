@@ -0,0 +1,105 @@
+/*
+ * spectroscopy.h
+ * Grid spectroscopy: I(V) or I(z) curves taken at every pixel of a grid, streamed as they complete
+ */
+
+#ifndef spectroscopy_h
+#define spectroscopy_h
+
+#include "Arduino.h"
+#include "scanhead.h"
+
+/*
+ * The grid is walked in serpentine order. At each pixel the tip settles under feedback for settleCycles, then
+ * ScanHead sweeps the table with the feedback held: sample bias in mV for SPEC_IV, Z offsets from the held
+ * position in LSB for SPEC_IZ (larger toward the sample). The sweep runs in the current sampling interrupt, so a
+ * point costs (settleSamples + averageSamples) sample periods and nothing is written to serial until the curve
+ * is done.
+ *
+ * Each curve is streamed as one line of the frame, indexed by the pixel in raster order from the grid origin,
+ * with one row per point holding z, current and bias. The frame starts with a #spec event giving the grid
+ * width and the mode. A curve cut short by overcurrent has fewer rows. Curves are packed into a ring of
+ * ringSlots buffers, more than the stream can hold pending, so a slot has been written before it is reused.
+ */
+
+class Spectroscopy
+{
+    public:
+        Spectroscopy();
+
+        enum State {
+            SPEC_IDLE,
+            SPEC_RECENTER, // recentering Z with the steppers at a row start
+            SPEC_MOVE,     // driving to the next pixel under feedback
+            SPEC_SETTLE,   // holding the pixel under feedback before the sweep
+            SPEC_SWEEP,    // ScanHead sweeping, feedback held
+            SPEC_PAUSED,   // holding the current pixel under feedback
+            SPEC_DONE,
+            SPEC_FAILED,
+            SPEC_ABORTED
+        };
+
+        enum Mode {
+            SPEC_IV = ScanHead::SWEEP_BIAS,
+            SPEC_IZ = ScanHead::SWEEP_Z
+        };
+
+        static const int curveChannels = CH_ZPOS | CH_CURRENT | CH_BIAS;
+        static const int ringSlots = 64;
+
+        int mode = SPEC_IV;
+        int settleCycles = 20;   // feedback cycles at each pixel before the sweep
+        int settleSamples = 1;   // sample periods from each sweep write to the first averaged sample
+        int averageSamples = 2;  // raw currents averaged at each point
+
+        // sweep table, mV for SPEC_IV or LSB for SPEC_IZ
+        int table[ScanHead::maxSweepPoints];
+        int numPoints;
+        void setLinearTable(int start, int end, int points);
+        int tableStart() { return numPoints > 0 ? table[0] : 0; }
+        int tableEnd() { return numPoints > 0 ? table[numPoints - 1] : 0; }
+        int appendTable(int value);
+
+        static long bufferSize(int numPoints);
+
+        void begin(ScanHead *scanhead, int *dataArr, int sizeX, int sizeY, int step);
+        int update();
+        void pause();
+        void resume();
+        void abort();
+
+        bool finished();
+        int result();
+
+        int state;
+        int pixelIndex;  // pixels completed
+        int numPixels;
+
+    private:
+        ScanHead *scanhead;
+
+        int *dataArr;
+        int step;
+        int gridWidth;
+        int gridHeight;
+        int xStart;
+        int yStart;
+        int lateralExtent;
+
+        int col;         // current pixel, from the grid origin
+        int row;
+        int progress;    // settle cycles at the current pixel
+        bool pausePending;
+        int heldZ;       // Z at the start of the sweep, with the stitch offset
+        int failStatus;
+
+        int currents[ScanHead::maxSweepPoints];
+
+        void checkRange();
+        void startSweep();
+        void writeCurve();
+        void nextPixel();
+        void finish(int newState, int status);
+};
+
+#endif
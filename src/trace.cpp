@@ -0,0 +1,105 @@
+/*
+ * trace.cpp
+ * Records the control loop's inputs and outputs, for replaying a scan against the firmware on the host
+ */
+
+#ifndef trace_h
+#define trace_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A trace is a stream of 16 bit halfwords in the caller's buffer, in the order the events happened:
+ *   raw TIA reading      the reading itself, or traceEscape, TRACE_SAMPLE for a reading of 0xffff
+ *   DAC write            traceEscape, TRACE_DAC | channel << 8, the value
+ *   control cycle        traceEscape, TRACE_CONTROL, micros(), x, y and zcurr_set, each as two halfwords low first
+ *   integrator fetch     traceEscape, TRACE_FETCH
+ * Readings carry no time, as the filter and integrators only see their order. A control cycle is recorded as
+ * setPositionStep() is called, with its arguments, and the fetch of the currents it integrates at the end of its
+ * wait. Recording stops when an event does not fit, which is never split.
+ */
+
+static const uint16_t traceEscape = 0xffff;
+
+enum TraceEvent {
+    TRACE_SAMPLE,
+    TRACE_DAC,
+    TRACE_CONTROL,
+    TRACE_FETCH
+};
+
+class TraceRecorder
+{
+    public:
+        volatile bool active = false;
+        bool full = false;      // stopped when the buffer filled
+        uint16_t *words = NULL;
+        int capacity = 0;
+        volatile int length = 0;
+
+        /*!
+         * \brief starts recording into a buffer, dropping any earlier trace
+         * @param *buffer capacity halfwords
+         */
+        void begin(uint16_t *buffer, int capacity) {
+            words = buffer;
+            this->capacity = capacity;
+            length = 0;
+            full = false;
+            active = buffer != NULL && capacity > 0;
+        }
+
+        void stop() {
+            active = false;
+        }
+
+        void sample(int raw) {
+            if (!active) return;
+            if (raw != traceEscape) {
+                if (reserve(1)) words[length++] = raw;
+            }
+            else if (reserve(2)) {
+                words[length++] = traceEscape;
+                words[length++] = TRACE_SAMPLE;
+            }
+        }
+
+        void dac(int channel, int value) {
+            if (!active || !reserve(3)) return;
+            words[length++] = traceEscape;
+            words[length++] = TRACE_DAC | channel << 8;
+            words[length++] = value;
+        }
+
+        void control(uint32_t us, int x, int y, int zcurr) {
+            if (!active || !reserve(10)) return;
+            words[length++] = traceEscape;
+            words[length++] = TRACE_CONTROL;
+            put32(us);
+            put32(x);
+            put32(y);
+            put32(zcurr);
+        }
+
+        void fetch() {
+            if (!active || !reserve(2)) return;
+            words[length++] = traceEscape;
+            words[length++] = TRACE_FETCH;
+        }
+
+    private:
+        bool reserve(int n) {
+            if (length + n <= capacity) return true;
+            active = false;
+            full = true;
+            return false;
+        }
+
+        void put32(uint32_t value) {
+            words[length++] = value & 0xffff;
+            words[length++] = value >> 16;
+        }
+};
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * trajectory.cpp
+ * Smooth non-raster scan trajectories (constant linear velocity spiral, Lissajous) from a fixed-point sine table
+ */
+
+#ifndef trajectory_h
+#define trajectory_h
+
+#include <stdint.h>
+#include <math.h>
+
+#define sine_table_bits 10
+#define sine_table_size (1 << sine_table_bits)
+
+class Trajectory
+{
+    private:
+        int16_t sineTable[sine_table_size + 1]; // one full turn in Q15, last entry repeats the first
+
+        static const uint32_t quarterTurn = 0x40000000;
+        static const uint32_t maxSpiralPhaseStep = 0x10000000; // 1/16 turn per cycle near the spiral center
+
+        int pattern;
+        int centerX;
+        int centerY;
+        int32_t radius;   // LSB, spiral outer radius or Lissajous amplitude
+        int32_t speed;    // LSB per cycle
+        int32_t pitch;    // LSB per spiral turn
+
+        uint32_t phase;   // spiral angle, or Lissajous base phase, 2^32 per turn
+        uint32_t phaseStep;
+        int64_t r;        // spiral radius, Q16 LSB
+        int lissajousX;   // Lissajous frequency multiples
+        int lissajousY;
+        long cycle;
+        long numCycles;
+        bool done;
+
+        void position() {
+            if (pattern == TRAJ_SPIRAL) {
+                x = centerX + (int) ((r * cosine(phase)) >> 31);
+                y = centerY + (int) ((r * sine(phase)) >> 31);
+            }
+            else {
+                // y runs a quarter turn ahead, otherwise the figure for equal multiples collapses to a line
+                x = centerX + (int) (((int64_t) radius * sine(phase * lissajousX)) >> 15);
+                y = centerY + (int) (((int64_t) radius * sine(phase * lissajousY + quarterTurn)) >> 15);
+            }
+        }
+
+    public:
+        enum Pattern {
+            TRAJ_SPIRAL,    // constant linear velocity Archimedean spiral out from the center
+            TRAJ_LISSAJOUS  // lines/2 : lines/2+1 Lissajous figure, one full period
+        };
+
+        int x;
+        int y;
+
+        Trajectory() {
+            for (int i = 0; i <= sine_table_size; i++) {
+                sineTable[i] = (int16_t) lroundf(32767 * sinf(2 * M_PI * i / sine_table_size));
+            }
+            pattern = TRAJ_SPIRAL;
+            numCycles = 0;
+            cycle = 0;
+            done = true;
+            x = 0;
+            y = 0;
+        }
+
+        /*!
+         * \brief fixed-point sine with linear interpolation between table entries
+         * @param angle 2^32 per turn
+         * @return sine in Q15
+         */
+        int32_t sine(uint32_t angle) {
+            uint32_t index = angle >> (32 - sine_table_bits);
+            int32_t frac = (angle >> (16 - sine_table_bits)) & 0xffff;
+            int32_t a = sineTable[index];
+            int32_t b = sineTable[index + 1];
+            return a + (((b - a) * frac) >> 16);
+        }
+
+        int32_t cosine(uint32_t angle) {
+            return sine(angle + quarterTurn);
+        }
+
+        /*!
+         * \brief sets up a trajectory. x and y then hold the start point, drive the tip there before the first next()
+         * @param newPattern Pattern
+         * @param newCenterX pattern center, LSB
+         * @param newCenterY pattern center, LSB
+         * @param size spiral diameter or Lissajous width, LSB
+         * @param lines spiral turns across the diameter, or Lissajous lines across the width. Sets resolution
+         * @param newSpeed tip speed, LSB per cycle. For Lissajous this is the mean speed of the faster axis
+         */
+        void begin(int newPattern, int newCenterX, int newCenterY, int size, int lines, int newSpeed) {
+            pattern = newPattern;
+            centerX = newCenterX;
+            centerY = newCenterY;
+            radius = size / 2;
+            speed = newSpeed > 0 ? newSpeed : 1;
+            if (lines < 2) lines = 2;
+            cycle = 0;
+            done = false;
+
+            if (pattern == TRAJ_SPIRAL) {
+                pitch = size / lines;
+                if (pitch < 1) pitch = 1;
+                phase = 0;
+                r = 0;
+                // path length of an Archimedean spiral is about pi R^2 / pitch. The spiral ends at the
+                // outer radius, this only sizes buffers
+                numCycles = (long) (M_PI * radius * radius / pitch / speed) + 1;
+            }
+            else {
+                lissajousX = lines / 2;
+                lissajousY = lines / 2 + 1;
+                // the y axis, the faster of the two, sweeps 4 amplitudes per turn
+                numCycles = (long) 4 * radius * lissajousY / speed + 1;
+                phaseStep = (uint32_t) (4294967296.0 / numCycles);
+                phase = 0;
+            }
+
+            position();
+        }
+
+        /*!
+         * \brief advances the trajectory by one control cycle
+         * @return true while the trajectory continues, false once it is complete
+         */
+        bool next() {
+            if (done) return false;
+            cycle += 1;
+
+            if (pattern == TRAJ_SPIRAL) {
+                // constant linear velocity: the angle advances by speed / r radians per cycle
+                uint32_t step = maxSpiralPhaseStep;
+                if (r > 0) {
+                    int64_t s = ((int64_t) speed * 683565276LL << 16) / r; // 2^32 / 2pi
+                    if (s < step) step = (uint32_t) s;
+                }
+                phase += step;
+                r += ((int64_t) pitch * step) >> 16;
+                if (r >= ((int64_t) radius << 16)) {
+                    r = (int64_t) radius << 16;
+                    done = true;
+                }
+            }
+            else {
+                phase += phaseStep;
+                if (cycle >= numCycles) done = true;
+            }
+
+            position();
+            return !done;
+        }
+
+        long length() { return numCycles; } // expected cycles, exact for Lissajous
+        long progress() { return cycle; }
+};
+
+#endif
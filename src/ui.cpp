@@ -8,11 +8,12 @@
 #include "Arduino.h"
 #include <math.h>
 
-UI::UI():
+template<class Board>
+BasicUI<Board>::BasicUI():
     enc(encoder.chA, encoder.chB),
-    display(display_config.width, display_config.height, &Wire1, -1),
+    bar(),
+    display(display_config.width, display_config.height, Board::displayBus(), -1)
     //display(128, 64, &Wire1, -1),
-    bar()
 {
 
     Serial.println("Setting up UI");
@@ -27,9 +28,9 @@ UI::UI():
 
     Serial.println("Setting up Bar");
 
-    bar.begin(0x70);
+    bar.begin(Board::barAddress);
 
-    if(!display.begin(SSD1306_SWITCHCAPVCC, 0x3C)) {
+    if(!display.begin(SSD1306_SWITCHCAPVCC, display_config.address)) {
       Serial.println("SSD1306 init failed");
     }
 
@@ -68,7 +69,8 @@ UI::UI():
     delay(500);
 }
 
-void UI::updateInputs() {
+template<class Board>
+void BasicUI<Board>::updateInputs() {
    /*!
     * \brief Scans all inputs on the control board and updates structs
     */
@@ -86,7 +88,9 @@ void UI::updateInputs() {
 
    // encoder
    encoderVals.encoderPos = enc.read();
+   int nextBefore = encoderVals.next;
    encoderVals.next = 1^digitalRead(encoder.next);
+   encoderVals.nextPressed = encoderVals.next == 1 && nextBefore == 0;
    encoderVals.sel = 1^digitalRead(encoder.sel);
 
    // voltages
@@ -107,7 +111,23 @@ void UI::updateInputs() {
    else voltageVals._33_good = true;
 }
 
-void UI::plotBarsLog(int current) {
+template<class Board>
+float BasicUI<Board>::joystickDeflection(int value) {
+    /*!
+     * \brief converts a joystick axis reading to a deflection, zero within the deadband around center
+     * @param value analogRead of the axis
+     * @return deflection, -1 to 1
+     */
+
+    int offset = value - joystick.center;
+    if (abs(offset) <= joystick.deadband) return 0;
+    float deflection = (float) (offset - (offset > 0 ? joystick.deadband : -joystick.deadband))
+            / (joystick.center - joystick.deadband);
+    return deflection < -1 ? -1 : (deflection > 1 ? 1 : deflection);
+}
+
+template<class Board>
+void BasicUI<Board>::plotBarsLog(int current) {
     /*!
      * \brief Draws new value on the LED bar chart representing the TIA input current
      * @param current TIA current in pA
@@ -130,12 +150,32 @@ void UI::plotBarsLog(int current) {
 }
 
 
-void UI::drawDisplay(ScanHead* scanhead) {
+template<class Board>
+void BasicUI<Board>::drawDisplay(ScanHead* scanhead) {
     /*!
-     * \brief Updates values on display, including position and current information from the scanhead
+     * \brief Updates values on display, including position and current information from the scanhead. Shows the
+     *        scan preview instead once a scan has started
      * @param scanhead ScanHead object to update ScanHead fields
      */
-    
+
+    if (showPreview(scanhead)) {
+        display.clearDisplay();
+        drawPreviewHeader(scanhead);
+        uint8_t *buffer = display.getBuffer();
+        for (int page = 0; page < ScanPreview::numPages; page++) {
+            scanhead->preview.renderPage(page, buffer + (previewFirstPage + page) * display_config.width);
+        }
+        while (scanhead->preview.nextDirtyPage() >= 0) ;
+        display.display();
+
+        push.screen = SCREEN_PREVIEW;
+        push.page = -1;
+        push.dirty = 0;
+        plotBarsLog(scanhead->current);
+        return;
+    }
+    push.screen = SCREEN_STATUS;
+
     // initial setup
     display.clearDisplay();
     display.setTextSize(1);
@@ -197,7 +237,8 @@ void UI::drawDisplay(ScanHead* scanhead) {
     plotBarsLog(scanhead->current);
 }
 
-void UI::drawDisplayErr(int error) {
+template<class Board>
+void BasicUI<Board>::drawDisplayErr(int error) {
 
     // initial setup
     display.clearDisplay();
@@ -212,3 +253,176 @@ void UI::drawDisplayErr(int error) {
 
     display.display();
 }
+
+template<class Board>
+bool BasicUI<Board>::showPreview(ScanHead* scanhead) {
+    // the status screen stays up for approaches and overcurrent
+    return scanhead->preview.enabled && scanhead->preview.hasFrame && scanhead->status == 2;
+}
+
+template<class Board>
+void BasicUI<Board>::drawPreviewHeader(ScanHead* scanhead) {
+    /*!
+     * \brief draws scan progress, current and the preview's grey range into the header pages of the buffer
+     */
+
+    ScanPreview &preview = scanhead->preview;
+
+    display.fillRect(0, 0, display_config.width, previewFirstPage * 8, SSD1306_BLACK);
+    display.setTextSize(1);
+    display.setTextColor(SSD1306_WHITE);
+
+    display.setCursor(0, 0);
+    display.print("SCAN ");
+    display.print(preview.linesAdded < preview.numLines ? preview.linesAdded : preview.numLines);
+    display.print("/");
+    display.print(preview.numLines);
+    display.setCursor(80, 0);
+    display.print(scanhead->current);
+    display.print("pA");
+
+    display.setCursor(0, 8);
+    display.print("RANGE ");
+    display.print(preview.high - preview.low);
+
+    push.headerLines = preview.linesAdded;
+    push.dirty |= (1 << previewFirstPage) - 1;
+}
+
+template<class Board>
+void BasicUI<Board>::drawPreview(ScanHead* scanhead) {
+    /*!
+     * \brief pushes the next chunk of the scan preview to the display. Only pages changed since they were last
+     *        pushed are sent, so a scan line costs about one page
+     * @param scanhead ScanHead whose preview to draw
+     */
+
+    ScanPreview &preview = scanhead->preview;
+    if (!preview.enabled || !preview.hasFrame) return;
+
+    if (push.screen != SCREEN_PREVIEW) {
+        preview.invalidate();
+        push.screen = SCREEN_PREVIEW;
+        push.page = -1;
+        push.dirty = 0;
+        push.headerLines = -1;
+    }
+
+    if (push.page < 0 && push.dirty == 0) {
+        // header first
+        if (preview.linesAdded != push.headerLines) drawPreviewHeader(scanhead);
+        else {
+            int page = preview.nextDirtyPage();
+            if (page < 0) return;
+            preview.renderPage(page, display.getBuffer() + (previewFirstPage + page) * display_config.width);
+            push.dirty = 1 << (previewFirstPage + page);
+        }
+    }
+
+    pushChunk();
+}
+
+template<class Board>
+void BasicUI<Board>::drawJog(ScanHead* scanhead, Jog* jog) {
+    /*!
+     * \brief pushes the next chunk of the jog screen: speed, position and the live current. The screen is
+     *        redrawn into the buffer once the last one is pushed, and only pages that changed are sent
+     * @param scanhead ScanHead for Z and the current
+     * @param jog active jog
+     */
+
+    bool fresh = push.screen != SCREEN_JOG;
+    if (fresh) {
+        push.screen = SCREEN_JOG;
+        push.page = -1;
+        push.dirty = 0;
+    }
+
+    if (push.page < 0 && push.dirty == 0) {
+        display.clearDisplay();
+        display.setTextSize(1);
+        display.setTextColor(SSD1306_WHITE);
+
+        display.setCursor(0, 0);
+        display.print("JOG  SPEED ");
+        display.print(jog->speedIndex);
+        display.setCursor(0, 16);
+        display.print("X ");
+        display.print((int) jog->x);
+        display.setCursor(64, 16);
+        display.print("Y ");
+        display.print((int) jog->y);
+        display.setCursor(0, 32);
+        display.print("Z ");
+        display.print(scanhead->zpos);
+
+        display.setTextSize(2);
+        display.setCursor(0, 48);
+        display.print(scanhead->current);
+        display.print("pA");
+
+        uint8_t *buffer = display.getBuffer();
+        for (int page = 0; page < display_config.height / 8; page++) {
+            uint16_t sum = 0;
+            for (int col = 0; col < display_config.width; col++) sum = sum * 31 + buffer[page * display_config.width + col];
+            if (fresh || sum != push.sums[page]) push.dirty |= 1 << page;
+            push.sums[page] = sum;
+        }
+        plotBarsLog(scanhead->current);
+    }
+
+    pushChunk();
+}
+
+template<class Board>
+bool BasicUI<Board>::pushChunk() {
+    /*!
+     * \brief sends the next piece of the dirty display pages: a page's address window, or up to pushChunkBytes
+     *        of its data
+     * @return false if there was nothing to send
+     */
+
+    uint8_t *buffer = display.getBuffer();
+    const int width = display_config.width;
+    TwoWire *bus = Board::displayBus();
+
+    if (push.page < 0) {
+        if (push.dirty == 0) return false;
+        int page = 0;
+        while (!(push.dirty & (1 << page))) page++;
+        push.dirty &= ~(1 << page);
+        push.page = page;
+        push.column = 0;
+
+        // the controller's address pointer then runs along the page as data arrives
+        bus->setClock(400000);
+        bus->beginTransmission(display_config.address);
+        bus->write((uint8_t) 0x00); // command stream
+        bus->write((uint8_t) SSD1306_PAGEADDR);
+        bus->write((uint8_t) page);
+        bus->write((uint8_t) page);
+        bus->write((uint8_t) SSD1306_COLUMNADDR);
+        bus->write((uint8_t) 0);
+        bus->write((uint8_t) (width - 1));
+        bus->endTransmission();
+        bus->setClock(100000);
+        return true;
+    }
+
+    int count = width - push.column;
+    if (count > pushChunkBytes) count = pushChunkBytes;
+
+    bus->setClock(400000);
+    bus->beginTransmission(display_config.address);
+    bus->write((uint8_t) 0x40); // data stream
+    bus->write(buffer + push.page * width + push.column, count);
+    bus->endTransmission();
+    bus->setClock(100000);
+
+    push.column += count;
+    if (push.column >= width) push.page = -1;
+    return true;
+}
+
+// the front panel of the board the firmware is built for, see board.h
+template class BasicUI<Board>;
@@ -8,6 +8,7 @@
 #define ui_h
 
 #include "scanhead.h"
+#include "jog.h"
 #include "Arduino.h"
 #include "Encoder.h"
 #include "Wire.h"
@@ -15,13 +16,22 @@
 #include "Adafruit_LEDBackpack.h"
 #include "Adafruit_SSD1306.h"
 
-class UI
+/*
+ * Built on a board traits type (see controlboard.h) for its pins, per board calibration and display bus. The
+ * firmware uses UI, the front panel of the board selected by board.h
+ */
+
+template<class Board>
+class BasicUI
 {
     public:
-        UI();
+        BasicUI();
         void drawDisplay(ScanHead* scanhead);
+        void drawPreview(ScanHead* scanhead);
+        void drawJog(ScanHead* scanhead, Jog* jog);
         void drawDisplayErr(int error);
         void updateInputs();
+        float joystickDeflection(int value);
 
         struct barPlot_struct {
             int minBound = 50; // pA. This is the minimum value that will be plotted
@@ -47,6 +57,7 @@ class UI
             int encoderPos = 0;
             int next = 0;
             int sel = 0;
+            int nextPressed = 0; // next went down since the last updateInputs
         } encoderVals;
 
         struct voltageVals_struct {
@@ -65,45 +76,39 @@ class UI
         Adafruit_SSD1306 display;
 
         void plotBarsLog(int current);
-
-        struct dpad_struct {
-            static const int l = 15;
-            static const int r = 14;
-            static const int u = 36;
-            static const int d = 35;
-            static const int c = 40;
-        } dpad;
-
-        struct joystick_struct {
-            static const int xax = A9;
-            static const int yax = A8;
-        } joystick;
-
-        struct encoder_struct {
-            static const int chA  = 30;
-            static const int chB  = 31;
-            static const int next = 37;
-            static const int sel  = 41;
-        } encoder;
-
-        struct voltages_struct {
-            static const int _5 = A7;
-            static const int _10 = A6;
-            static const int _33 = A5;
-            static const int allowedvariance = 20;
-            static const int _5_expected = 488; // calibrated per-board
-            static const int _10_expected = 573; // calibrated per-board
-            static const int _33_expected = 492; // calibrated per-board
-        } voltages;
-
-        struct display_config_struct {
-            static const int width  = 128;
-            static const int height = 64;
-        } display_config;
-
-        struct debug_struct {
-            static const int io3 = 18;
-        } debug;
+        bool showPreview(ScanHead* scanhead);
+        void drawPreviewHeader(ScanHead* scanhead);
+
+        // incremental drawing: one display page at a time is pushed over I2C, a window or a chunk per pushChunk
+        // call, for the scan preview and the jog screen while the head is busy
+        enum Screen {
+            SCREEN_STATUS,
+            SCREEN_PREVIEW,
+            SCREEN_JOG
+        };
+
+        struct pagePush_struct {
+            int screen = SCREEN_STATUS; // what the display shows
+            int page = -1;          // display page being pushed, -1 between pages
+            int column = 0;         // next column of the page to push
+            uint8_t dirty = 0;      // bit per display page still to push
+            int headerLines = -1;   // preview lines the header was drawn for, -1 to redraw
+            uint16_t sums[8];       // jog screen page checksums as last drawn
+        } push;
+
+        static const int previewFirstPage = 2;
+        static const int pushChunkBytes = 16; // display bytes per pushChunk call, about 0.4ms of I2C
+
+        bool pushChunk();
+
+        typename Board::dpad_struct dpad;
+        typename Board::joystick_struct joystick;
+        typename Board::encoder_struct encoder;
+        typename Board::voltages_struct voltages;
+        typename Board::display_config_struct display_config;
+        typename Board::debug_struct debug;
 };
 
+typedef BasicUI<Board> UI;
+
 #endif
@@ -0,0 +1,216 @@
+/*
+ * zpredict.cpp
+ * Sample plane and previous-line topography prediction for Z feed-forward
+ */
+
+#ifndef zpredict_h
+#define zpredict_h
+
+#define max_line_pixels 1024
+
+class ZPredictor
+{
+    private:
+        // exponentially weighted least squares sums, in coordinates relative to the first sample
+        double sumW, sumX, sumY, sumZ, sumXX, sumYY, sumXY, sumXZ, sumYZ;
+        float originX, originY;
+        bool hasOrigin;
+
+        // fitted plane z = planeC + planeA*x + planeB*y
+        float planeA, planeB, planeC;
+
+        // Z profiles indexed by pixel: the line being scanned and the last complete line in each raster
+        // direction. Trace and retrace profiles are offset by lateral hysteresis and Z lag, so a line is
+        // predicted from the last line scanned the same way
+        float lineZ[3][max_line_pixels];
+        int recording;       // index into lineZ of the line being scanned
+        int previous[2];     // index into lineZ of the last complete line, per direction
+        bool prevValid[2];
+        float prevY[2];
+        int direction;       // of the line being scanned, 1 for +x
+        int lineCount;
+        int firstPixel;      // lowest and highest pixel recorded in the line being scanned
+        int lastPixel;
+
+        int xStart;
+        int step;
+        int numPixels;
+
+        void fitPlane() {
+            if (sumW <= 0) return;
+
+            double meanX = sumX / sumW;
+            double meanY = sumY / sumW;
+            double meanZ = sumZ / sumW;
+
+            // centered normal equations for the slopes. The ridge keeps a direction with no spread
+            // (the Y slope after a single line) at zero instead of blowing up
+            double cxx = sumXX / sumW - meanX * meanX + planeRidge;
+            double cyy = sumYY / sumW - meanY * meanY + planeRidge;
+            double cxy = sumXY / sumW - meanX * meanY;
+            double cxz = sumXZ / sumW - meanX * meanZ;
+            double cyz = sumYZ / sumW - meanY * meanZ;
+
+            double det = cxx * cyy - cxy * cxy;
+            if (det <= 0) return;
+
+            planeA = (cxz * cyy - cyz * cxy) / det;
+            planeB = (cyz * cxx - cxz * cxy) / det;
+            planeC = meanZ - planeA * meanX - planeB * meanY;
+        }
+
+        float plane(float x, float y) {
+            return planeC + planeA * (x - originX) + planeB * (y - originY);
+        }
+
+    public:
+        float planeMemory = 0.8; // fraction of the plane fit weight kept at the end of each line
+        float planeRidge = 1.0;  // LSB^2, slope regularization
+        // fraction of the previous line's deviation from the plane that is predicted. The recorded profile
+        // includes the feed-forward of the line before it, so weights near 1 accumulate noise line to line
+        float lineWeight = 0.5;
+
+        ZPredictor() {
+            xStart = 0;
+            step = 1;
+            numPixels = 0;
+            reset();
+        }
+
+        /*!
+         * \brief forgets the plane fit and line profiles
+         */
+        void reset() {
+            sumW = sumX = sumY = sumZ = sumXX = sumYY = sumXY = sumXZ = sumYZ = 0;
+            originX = originY = 0;
+            hasOrigin = false;
+            planeA = planeB = planeC = 0;
+            recording = 2;
+            for (int d = 0; d < 2; d++) {
+                previous[d] = d;
+                prevValid[d] = false;
+                prevY[d] = 0;
+            }
+            beginLine(true);
+        }
+
+        /*!
+         * \brief starts a new frame. The plane fit carries over, line profiles do not
+         * @param newXStart x position of pixel 0
+         * @param newStep LSB between pixels
+         * @param newNumPixels pixel positions per line, at most max_line_pixels are predicted
+         */
+        void beginFrame(int newXStart, int newStep, int newNumPixels) {
+            xStart = newXStart;
+            step = newStep > 0 ? newStep : 1;
+            numPixels = newNumPixels < max_line_pixels ? newNumPixels : max_line_pixels;
+            prevValid[0] = prevValid[1] = false;
+            beginLine(true);
+        }
+
+        /*!
+         * \brief starts (or restarts) a line, discarding samples of an unfinished line
+         * @param forward true if the line is scanned in +x
+         */
+        void beginLine(bool forward) {
+            direction = forward ? 1 : 0;
+            lineCount = 0;
+            firstPixel = numPixels;
+            lastPixel = -1;
+        }
+
+        /*!
+         * \brief records the Z position at a scan pixel
+         * @param pixel pixel index in the line
+         * @param x x position, LSB
+         * @param y y position, LSB
+         * @param z Z position, LSB, continuous across stepper recentering
+         */
+        void addSample(int pixel, int x, int y, int z) {
+            if (!hasOrigin) {
+                originX = x;
+                originY = y;
+                hasOrigin = true;
+            }
+
+            float dx = x - originX;
+            float dy = y - originY;
+            sumW += 1;
+            sumX += dx;
+            sumY += dy;
+            sumZ += z;
+            sumXX += dx * dx;
+            sumYY += dy * dy;
+            sumXY += dx * dy;
+            sumXZ += dx * z;
+            sumYZ += dy * z;
+
+            if (pixel >= 0 && pixel < numPixels) {
+                lineZ[recording][pixel] = z;
+                lineCount += 1;
+                if (pixel < firstPixel) firstPixel = pixel;
+                if (pixel > lastPixel) lastPixel = pixel;
+            }
+        }
+
+        /*!
+         * \brief completes a line: refits the plane and keeps the line profile for the next line in the same direction
+         * @param y y position of the completed line
+         */
+        void endLine(int y) {
+            fitPlane();
+
+            sumW *= planeMemory;
+            sumX *= planeMemory;
+            sumY *= planeMemory;
+            sumZ *= planeMemory;
+            sumXX *= planeMemory;
+            sumYY *= planeMemory;
+            sumXY *= planeMemory;
+            sumXZ *= planeMemory;
+            sumYZ *= planeMemory;
+
+            // serpentine lines are offset by a pixel, so one end of the profile may be missing
+            if (numPixels < 2 || lineCount < numPixels - 1) return;
+
+            float *line = lineZ[recording];
+            for (int i = 0; i < firstPixel; i++) line[i] = line[firstPixel];
+            for (int i = lastPixel + 1; i < numPixels; i++) line[i] = line[lastPixel];
+
+            int done = previous[direction];
+            previous[direction] = recording;
+            recording = done;
+            prevValid[direction] = true;
+            prevY[direction] = y;
+            lineCount = 0;
+        }
+
+        /*!
+         * \brief predicts the Z position at a lateral position
+         * @param x x position, LSB
+         * @param y y position, LSB
+         * @param useLine true to add the deviation from the plane of the last line scanned in the current direction
+         * @return predicted Z in the units passed to addSample. Only differences between predictions are meaningful
+         */
+        float predict(float x, float y, bool useLine) {
+            float z = plane(x, y);
+            if (!useLine || !prevValid[direction]) return z;
+
+            // previous line deviation from the plane, linearly interpolated between pixels
+            float pos = (x - xStart) / step;
+            if (pos < 0) pos = 0;
+            if (pos > numPixels - 1) pos = numPixels - 1;
+            int i = (int) pos;
+            if (i > numPixels - 2) i = numPixels - 2;
+            float frac = pos - i;
+
+            const float *prev = lineZ[previous[direction]];
+            float prevZ = prev[i] + frac * (prev[i + 1] - prev[i]);
+            return z + lineWeight * (prevZ - plane(x, prevY[direction]));
+        }
+
+        float getSlopeX() { return planeA; }
+        float getSlopeY() { return planeB; }
+};
+
+#endif